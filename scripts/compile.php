@@ -10,3 +10,29 @@ for_each_obj(function($file)
 	run_command_async($compiler." -o int/{$file}.o -c src/{$file}.cpp");
 });
 await_commands();
+
+// plutoc compiles the standard library code written in Pluto, which is then embedded as bytecode.
+echo ">>> Compiling standard library code written in Pluto\n";
+$compile_cmd = $compiler;
+prepare_link();
+$plutoc = "int".DIRECTORY_SEPARATOR."plutoc";
+if(defined("PHP_WINDOWS_VERSION_MAJOR"))
+{
+	$plutoc .= ".exe";
+}
+$cmd = $compiler." -o ".$plutoc;
+for_each_obj(function($file)
+{
+	if($file != "lua")
+	{
+		global $cmd;
+		$cmd .= " int/{$file}.o";
+	}
+});
+passthru($cmd);
+passthru($plutoc." --stdlib-header -o src/lstdlibbytecode.h", $exit_code);
+if($exit_code != 0)
+{
+	die("Failed to generate src/lstdlibbytecode.h\n");
+}
+passthru($compile_cmd." -D PLUTO_STDLIB_BYTECODE -o int/lstdlibcode.o -c src/lstdlibcode.cpp");
@@ -1184,14 +1184,14 @@ LUA_API int lua_pcallk (lua_State *L, int nargs, int nresults, int errfunc,
 }
 
 
-LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
-                      const char *chunkname, const char *mode) {
+static int load (lua_State *L, lua_Reader reader, void *data,
+                 const char *chunkname, const char *mode, LoadMapping *mapping) {
   ZIO z;
   int status;
   lua_lock(L);
   if (!chunkname) chunkname = "?";
   luaZ_init(L, &z, reader, data);
-  status = luaD_protectedparser(L, &z, chunkname, mode);
+  status = luaD_protectedparser(L, &z, chunkname, mode, mapping);
   if (status == LUA_OK) {  /* no errors? */
     LClosure *f = clLvalue(s2v(L->top.p - 1));  /* get new function */
     if (f->nupvalues >= 1) {  /* does it have an upvalue? */
@@ -1207,6 +1207,50 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
 }
 
 
+LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
+                      const char *chunkname, const char *mode) {
+  return load(L, reader, data, chunkname, mode, NULL);
+}
+
+
+struct Block {
+  const char *p;
+  size_t size;
+};
+
+
+static const char *getblock (lua_State *L, void *ud, size_t *size) {
+  Block *b = static_cast<Block *>(ud);
+  UNUSED(L);
+  if (b->size == 0) return NULL;
+  *size = b->size;
+  b->size = 0;
+  return b->p;
+}
+
+
+/*
+** [Pluto] Loads a chunk from 'buff', which the state takes over: 'release'
+** is called with 'ud' and the block once nothing needs it anymore. That is
+** right away, unless it is an indexed binary chunk (see 'plutoc -i'), whose
+** functions are then loaded from 'buff' as they are first needed, without
+** copying it. The block must not change until it is released, so a file
+** that is mapped into memory must not be rewritten meanwhile. 'release' may
+** be called after the state is closed, since states cloned from it share
+** the chunk.
+*/
+LUA_API int lua_loadmapped (lua_State *L, const char *buff, size_t sz,
+                            const char *chunkname, const char *mode,
+                            lua_Release release, void *ud) {
+  LoadMapping m{ buff, sz, release, ud, false };
+  Block b{ buff, sz };
+  int status = load(L, getblock, &b, chunkname, mode, &m);
+  if (!m.taken)
+    release(ud, buff, sz);
+  return status;
+}
+
+
 LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data, int strip) {
   int status;
   TValue *o;
@@ -1222,6 +1266,24 @@ LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data, int strip) {
 }
 
 
+#ifdef PLUTO_ETL_ENABLE
+/*
+** Sets the execution time limit of all threads of the state to 'nanos'
+** from now; 0 removes the limit.
+*/
+LUA_API void lua_setexecutionlimit (lua_State *L, lua_Integer nanos) {
+  global_State *g = G(L);
+  lua_lock(L);
+  if (nanos > 0)
+    g->deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() + nanos;
+  else
+    g->deadline = 0;
+  g->etl_fuel = PLUTO_ETL_INTERVAL;
+  lua_unlock(L);
+}
+#endif
+
+
 LUA_API int lua_status (lua_State *L) {
   return L->status;
 }
@@ -1329,6 +1391,49 @@ LUA_API int lua_gc (lua_State *L, int what, ...) {
 }
 
 
+/*
+** [Pluto] Sets the maximum number of bytes the state may have allocated;
+** allocations beyond it fail with a memory error after an emergency
+** collection. 0 removes the limit. This is for the host: it also sets the
+** quota that 'lua_trysetmemorylimit' cannot exceed.
+*/
+LUA_API void lua_setmemorylimit (lua_State *L, size_t limit) {
+  lua_lock(L);
+  G(L)->memlimit = G(L)->memquota = cast(lu_mem, limit);
+  lua_unlock(L);
+}
+
+
+/*
+** [Pluto] Like 'lua_setmemorylimit', but for scripts: fails (returning 0)
+** if 'limit' is above the quota set by the host, so it can only lower the
+** limit or raise it back up to that quota.
+*/
+LUA_API int lua_trysetmemorylimit (lua_State *L, size_t limit) {
+  int res = 1;
+  lua_lock(L);
+  global_State *g = G(L);
+  if (g->memquota != 0 && (limit == 0 || cast(lu_mem, limit) > g->memquota))
+    res = 0;
+  else
+    g->memlimit = cast(lu_mem, limit);
+  lua_unlock(L);
+  return res;
+}
+
+
+LUA_API size_t lua_getmemorylimit (lua_State *L) {
+  return cast_sizet(G(L)->memlimit);
+}
+
+
+LUA_API void lua_getmemstats (lua_State *L, lua_MemStats *stats) {
+  lua_lock(L);
+  luaC_memstats(L, stats);
+  lua_unlock(L);
+}
+
+
 
 /*
 ** miscellaneous functions
@@ -1461,7 +1566,7 @@ LUA_API void *lua_newuserdatauv (lua_State *L, size_t size, int nuvalue) {
 
 
 
-static const char *aux_upvalue (TValue *fi, int n, TValue **val,
+static const char *aux_upvalue (lua_State *L, TValue *fi, int n, TValue **val,
                                 GCObject **owner) {
   switch (ttypetag(fi)) {
     case LUA_VCCL: {  /* C closure */
@@ -1478,6 +1583,7 @@ static const char *aux_upvalue (TValue *fi, int n, TValue **val,
       Proto *p = f->p;
       if (!(cast_uint(n) - 1u  < cast_uint(p->sizeupvalues)))
         return NULL;  /* 'n' not in [1, p->sizeupvalues] */
+      luaU_checkdebug(L, p);  /* may move the stack, so 'fi' is not used after this */
       *val = f->upvals[n-1]->v.p;
       if (owner) *owner = obj2gco(f->upvals[n - 1]);
       name = p->upvalues[n-1].name;
@@ -1492,7 +1598,7 @@ LUA_API const char *lua_getupvalue (lua_State *L, int funcindex, int n) {
   const char *name;
   TValue *val = NULL;  /* to avoid warnings */
   lua_lock(L);
-  name = aux_upvalue(index2value(L, funcindex), n, &val, NULL);
+  name = aux_upvalue(L, index2value(L, funcindex), n, &val, NULL);
   if (name) {
     setobj2s(L, L->top.p, val);
     api_incr_top(L);
@@ -1510,7 +1616,7 @@ LUA_API const char *lua_setupvalue (lua_State *L, int funcindex, int n) {
   lua_lock(L);
   fi = index2value(L, funcindex);
   api_checknelems(L, 1);
-  name = aux_upvalue(fi, n, &val, &owner);
+  name = aux_upvalue(L, fi, n, &val, &owner);
   if (name) {
     L->top.p--;
     setobj(L, val, s2v(L->top.p));
@@ -1,17 +1,13 @@
-#include <cstring>
-
 #define LUA_LIB
 #include "lualib.h"
+#include "lstdlibcode.hpp"
 
 static const luaL_Reg funcs[] = {
   {nullptr, nullptr}
 };
 
-LUAMOD_API int luaopen_assert(lua_State *L) {
-#ifdef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
-  return 0;
-#else
-  const auto code = R"EOC(pluto_use "0.6.0"
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+const Pluto::StdlibChunk Pluto::stdlib_assert{ "pluto:assert", R"EOC(pluto_use "0.6.0"
 
 local module = {}
 
@@ -310,8 +306,14 @@ setmetatable(module, {
 
 module.AssertionError = AssertionError
 
-return module)EOC";
-  luaL_loadbuffer(L, code, strlen(code), "pluto:assert");
+return module)EOC" };
+#endif
+
+LUAMOD_API int luaopen_assert(lua_State *L) {
+#ifdef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+  return 0;
+#else
+  Pluto::loadStdlibChunk(L, Pluto::stdlib_assert);
   lua_call(L, 0, 1);
   return 1;
 #endif
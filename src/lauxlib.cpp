@@ -26,17 +26,12 @@
 #include "lua.h"
 #include "lprefix.h"
 #include "lauxlib.h"
-#if defined(PLUTO_MEMORY_LIMIT) || defined(PLUTO_PARSER_CACHE)
+#ifdef PLUTO_PARSER_CACHE
 #include "lstate.h"
 #endif
+#include "lslaballoc.hpp"
 #ifdef PLUTO_PARSER_CACHE
-#include "lundump.h"
-
-#include <filesystem>
-
-#include "vendor/Soup/soup/filesystem.hpp"
-#include "vendor/Soup/soup/sha256.hpp"
-#include "vendor/Soup/soup/string.hpp"
+#include "lcodecache.hpp"
 #endif
 
 
@@ -855,11 +850,6 @@ extern bool PLUTO_LOADFILE_HOOK(lua_State* L, const char* filename);
 #ifdef PLUTO_PARSER_CACHE
 #define toproto(L,i) getproto(s2v(L->top.p+(i)))
 
-static int writer(lua_State* L, const void* p, size_t size, void* u) {
- UNUSED(L);
- return (fwrite(p,size,1,(FILE*)u)!=1) && (size!=0);
-}
-
 inline thread_local bool parser_emitted_warnings;
 #endif
 
@@ -889,7 +879,7 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
   }
   lf.n = 0;
 #ifdef PLUTO_PARSER_CACHE
-  std::string cache_file_path;
+  Pluto::CodeCache::Lookup cache;
 #endif
   if (skipcomment(lf.f, &c))  /* read initial portion */
     lf.buff[lf.n++] = '\n';  /* add newline to correct line numbers */
@@ -909,24 +899,13 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
   }
 #ifdef PLUTO_PARSER_CACHE
   else {  /* text file? */
-    if (filename) {  /* "real" file? */
-      char hexdigest[soup::sha256::DIGEST_BYTES * 2 + 10] = { 'p', 'l', 'u', 't', 'o', 'c', 'a', 'c', 'h', 'e' };
-      size_t size;
-      if (auto data = soup::filesystem::createFileMapping(std::string_view(filename, filename_len), size)) {
-        soup::sha256::State st;
-        st.append(data, size);
-        st.finalise();
-        uint8_t digest[soup::sha256::DIGEST_BYTES];
-        st.getDigest(digest);
-        soup::string::bin2hexAt(hexdigest + 10, (const char*)digest, sizeof(digest), soup::string::charset_hex_lower);
-        soup::filesystem::destroyFileMapping(data, size);
-        cache_file_path = soup::string::fixType((std::filesystem::temp_directory_path() / std::string_view(hexdigest, sizeof(hexdigest))).u8string());
-        if (auto fh = luaL_fopen(cache_file_path.data(), cache_file_path.size(), "rb", sizeof("rb") - sizeof(""))) {
-          fclose(lf.f);
-          lf.f = fh;
-          skipcomment(lf.f, &c);
-          cache_file_path.clear();  /* no need to write to the cache, it already exists */
-        }
+    if (filename && (mode == NULL || strchr(mode, 't'))) {  /* "real" file & may load it? */
+      if (FILE *fh = Pluto::CodeCache::open(L, filename, filename_len, cache)) {
+        fclose(lf.f);
+        lf.f = fh;
+        lf.n = 0;
+        skipcomment(lf.f, &c);
+        mode = "b";  /* the cached bytecode stands in for the text chunk */
       }
     }
   }
@@ -946,14 +925,8 @@ LUALIB_API int luaL_loadfilex (lua_State *L, const char *filename,
   }
   lua_remove(L, fnameindex);
 #ifdef PLUTO_PARSER_CACHE
-  if (status == LUA_OK && !cache_file_path.empty() && !parser_emitted_warnings) {
-    errno = 0;
-    if (FILE* D = luaL_fopen(cache_file_path.data(), cache_file_path.size(), "wb", sizeof("wb") - sizeof(""))) {
-      lua_lock(L);
-      luaU_dump(L, toproto(L, -1), writer, D, false);
-      lua_unlock(L);
-      fclose(D);
-    }
+  if (status == LUA_OK && !cache.entry.empty() && !parser_emitted_warnings) {
+    Pluto::CodeCache::store(L, toproto(L, -1), cache);
   }
 #endif
   return status;
@@ -1160,24 +1133,13 @@ LUALIB_API const char *luaL_gsub (lua_State *L, const char *s,
 
 
 static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
-#ifndef PLUTO_MEMORY_LIMIT
   (void)ud; (void)osize;  /* not used */
-#endif
   if (nsize == 0) {
     free(ptr);
     return NULL;
   }
-  else {
-#ifdef PLUTO_MEMORY_LIMIT
-    if (ud  /* state has finished opening? */
-      && (!ptr || nsize > osize)  /* new allocation or increasing existing allocation? */
-      && gettotalbytes(reinterpret_cast<global_State*>(ud)) >= PLUTO_MEMORY_LIMIT  /* limit reached? */
-      ) {
-      return NULL;
-    }
-#endif
+  else
     return realloc(ptr, nsize);
-  }
 }
 
 
@@ -1253,10 +1215,27 @@ static void warnfon (void *ud, const char *message, int tocont) {
 
 
 LUALIB_API lua_State *luaL_newstate (void) {
-  lua_State *L = lua_newstate(l_alloc, NULL);
+#ifdef PLUTO_USE_SLAB_ALLOCATOR
+  return luaL_newstatex(LUAL_SLABALLOC);
+#else
+  return luaL_newstatex(0);
+#endif
+}
+
+
+LUALIB_API lua_State *luaL_newstatex (int flags) {
+  lua_State *L;
+  if (flags & LUAL_SLABALLOC) {
+    Pluto::SlabAllocator *slab = Pluto::SlabAllocator::create();
+    if (slab == NULL) return NULL;
+    L = lua_newstate(Pluto::SlabAllocator::alloc, slab);
+    slab->release();  /* from now on, the state owns it */
+  }
+  else
+    L = lua_newstate(l_alloc, NULL);
   if (l_likely(L)) {
 #ifdef PLUTO_MEMORY_LIMIT
-    G(L)->ud = G(L);
+    lua_setmemorylimit(L, PLUTO_MEMORY_LIMIT);
 #endif
     lua_atpanic(L, &panic);
     lua_setwarnf(L, warnfon, L);  /* unlike lua, warnings are enabled by default in pluto */
@@ -1265,6 +1244,26 @@ LUALIB_API lua_State *luaL_newstate (void) {
 }
 
 
+/*
+** Clones 'L' with the same kind of allocator; a slab-allocated template gets
+** clones with their own slab allocator, since those are not shareable.
+*/
+LUALIB_API lua_State *luaL_clonestate (lua_State *L) {
+  void *ud;
+  lua_Alloc f = lua_getallocf(L, &ud);
+  if (f == Pluto::SlabAllocator::alloc) {
+    Pluto::SlabAllocator *slab = Pluto::SlabAllocator::create();
+    if (slab == NULL) return NULL;
+    struct Release {
+      Pluto::SlabAllocator *slab;
+      ~Release() { slab->release(); }  /* from now on, the clone owns it (also if cloning raised an error) */
+    } release{ slab };
+    return lua_clonestate(L, Pluto::SlabAllocator::alloc, slab);
+  }
+  return lua_clonestate(L, f, ud);
+}
+
+
 LUALIB_API void luaL_checkversion_ (lua_State *L, lua_Number ver, size_t sz) {
   lua_Number v = lua_version(L);
   if (sz != LUAL_NUMSIZES)  /* check numeric types */
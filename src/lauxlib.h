@@ -135,6 +135,12 @@ LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s);
 
 LUALIB_API lua_State *(luaL_newstate) (void);
 
+/* flags for 'luaL_newstatex' */
+#define LUAL_SLABALLOC	1  /* use a slab allocator for small objects; see lslaballoc.hpp */
+
+LUALIB_API lua_State *(luaL_newstatex) (int flags);
+LUALIB_API lua_State *(luaL_clonestate) (lua_State *L);
+
 LUALIB_API lua_Integer (luaL_len) (lua_State *L, int idx);
 
 LUALIB_API void (luaL_addgsub) (luaL_Buffer *b, const char *s,
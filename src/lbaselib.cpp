@@ -16,6 +16,7 @@
 
 #include <thread>
 #include <unordered_set>
+#include <utility> // pair
 
 #include "lua.h"
 #include "lprefix.h"
@@ -247,15 +248,49 @@ static int pushmode (lua_State *L, int oldmode) {
 */
 #define checkvalres(res) { if (res == -1) break; }
 
+/* [Pluto] options not handled by 'lua_gc' */
+#define GCLIMIT		(-1)
+#define GCSTATS		(-2)
+
+static void pushmemstats (lua_State *L) {
+  lua_MemStats st;
+  lua_getmemstats(L, &st);
+  lua_createtable(L, 0, 9);
+  const std::pair<const char*, size_t> fields[] = {
+    {"total", st.total}, {"limit", lua_getmemorylimit(L)},
+    {"strings", st.strings}, {"tables", st.tables}, {"functions", st.functions},
+    {"userdata", st.userdata}, {"buffers", st.buffers}, {"threads", st.threads},
+    {"other", st.other},
+  };
+  for (const auto& [name, value] : fields) {
+    lua_pushinteger(L, (lua_Integer)value);
+    lua_setfield(L, -2, name);
+  }
+}
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
     "count", "step", "setpause", "setstepmul",
-    "isrunning", "generational", "incremental", NULL};
+    "isrunning", "generational", "incremental", "limit", "stats", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC};
+    LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC, GCLIMIT, GCSTATS};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   switch (o) {
+    case GCLIMIT: {  /* returns the previous limit in bytes, 0 if there was none */
+      const size_t previous = lua_getmemorylimit(L);
+      if (!lua_isnoneornil(L, 2)) {
+        const lua_Integer limit = luaL_checkinteger(L, 2);
+        luaL_argcheck(L, limit >= 0, 2, "limit must not be negative");
+        luaL_argcheck(L, lua_trysetmemorylimit(L, (size_t)limit), 2, "cannot exceed the limit set by the host");
+      }
+      lua_pushinteger(L, (lua_Integer)previous);
+      return 1;
+    }
+    case GCSTATS: {
+      pushmemstats(L);
+      return 1;
+    }
     case LUA_GCCOUNT: {
       int k = lua_gc(L, o);
       int b = lua_gc(L, LUA_GCCOUNTB);
@@ -766,12 +801,153 @@ static int luaB_compareversions (lua_State *L) {
 }
 
 
-static int luaB_range (lua_State *L) {
+/*
+** A range is only its bounds; elements are computed when they're indexed or
+** iterated over, so it takes the same memory no matter how many it spans.
+** 'range(...):totable()' gives the old table form; methods of tables other
+** than those below are called on it, so they work as before.
+*/
+struct Range {
+  lua_Integer start;
+  lua_Integer step;
+  lua_Unsigned count;
+};
+
+#define RANGEHANDLE "pluto:range"
+
+/* The metatable is an upvalue of its methods, which spares iteration a registry lookup per element. */
+static Range *checkrange (lua_State *L) {
+  const TValue *o = index2value(L, 1);
+  if (l_likely(ttisfulluserdata(o) && uvalue(o)->metatable == hvalue(index2value(L, lua_upvalueindex(1)))))
+    return (Range *)getudatamem(uvalue(o));
+  luaL_typeerror(L, 1, RANGEHANDLE);
+}
+
+/* Element at (0-based) 'i', which must be below 'count'. */
+static lua_Integer range_at (const Range *r, lua_Unsigned i) {
+  return l_castU2S(l_castS2U(r->start) + i * l_castS2U(r->step));
+}
+
+static int range_len (lua_State *L) {
+  const Range *r = checkrange(L);
+  lua_pushinteger(L, r->count > LUA_MAXINTEGER ? LUA_MAXINTEGER : l_castU2S(r->count));
+  return 1;
+}
+
+/* Iterates over (index, value) pairs, as with the table form. */
+static int range_next (lua_State *L) {
+  const Range *r = checkrange(L);
+  const lua_Unsigned i = l_castS2U(luaL_optinteger(L, 2, 0));
+  if (i >= r->count)
+    return 0;
+  lua_pushinteger(L, l_castU2S(i + 1));
+  lua_pushinteger(L, range_at(r, i));
+  return 2;
+}
+
+/* also used by generic for loops over a range */
+static int range_pairs (lua_State *L) {
+  checkrange(L);
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_pushcclosure(L, range_next, 1);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+static int range_totable (lua_State *L) {
+  const Range *r = checkrange(L);
+  luaL_argcheck(L, r->count <= INT_MAX, 1, "range is too large to be a table");
+  lua_createtable(L, static_cast<int>(r->count), 0);
+  for (lua_Unsigned i = 0; i != r->count; ++i) {
+    lua_pushinteger(L, range_at(r, i));
+    lua_rawseti(L, -2, l_castU2S(i + 1));
+    L->checkEtl();
+  }
+  return 1;
+}
+
+static int range_min (lua_State *L) {
+  const Range *r = checkrange(L);
+  if (r->count == 0)
+    return 0;
+  lua_pushinteger(L, r->step > 0 ? r->start : range_at(r, r->count - 1));
+  return 1;
+}
+
+static int range_max (lua_State *L) {
+  const Range *r = checkrange(L);
+  if (r->count == 0)
+    return 0;
+  lua_pushinteger(L, r->step > 0 ? range_at(r, r->count - 1) : r->start);
+  return 1;
+}
+
+/* Calls a method of tables (upvalue 2) with the table form in place of the range. */
+static int range_forward (lua_State *L) {
+  range_totable(L);
+  lua_replace(L, 1);
+  lua_pushvalue(L, lua_upvalueindex(2));
+  lua_insert(L, 1);
+  lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+  return lua_gettop(L);
+}
+
+static int range_index (lua_State *L) {
+  const Range *r = checkrange(L);
+  if (lua_type(L, 2) == LUA_TSTRING) {  /* method */
+    lua_getmetatable(L, 1);
+    lua_pushvalue(L, 2);
+    if (lua_rawget(L, -2) != LUA_TNIL)
+      return 1;
+    /* any other method of the table form, e.g. 'range(10):contains(5)' */
+    lua_newtable(L);
+    if (!lua_getmetatable(L, -1) || lua_getfield(L, -1, "__mindex") != LUA_TTABLE)
+      return 0;
+    lua_pushvalue(L, 2);
+    if (lua_gettable(L, -2) == LUA_TNIL)
+      return 0;
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, -2);
+    lua_pushcclosure(L, range_forward, 2);
+    return 1;
+  }
+  int isnum;
+  const lua_Unsigned i = l_castS2U(lua_tointegerx(L, 2, &isnum)) - 1;
+  if (!isnum || i >= r->count)
+    return 0;
+  lua_pushinteger(L, range_at(r, i));
+  return 1;
+}
+
+static int range_tostring (lua_State *L) {
+  const Range *r = checkrange(L);
+  if (r->count == 0)
+    lua_pushliteral(L, "range()");
+  else
+    lua_pushfstring(L, "range(%I, %I, %I)", (LUAI_UACINT)r->start, (LUAI_UACINT)range_at(r, r->count - 1), (LUAI_UACINT)r->step);
+  return 1;
+}
+
+static const luaL_Reg funcs_range[] = {
+  {"totable", range_totable},
+  {"min", range_min},
+  {"max", range_max},
+  {"__index", range_index},
+  {"__len", range_len},
+  {"__pairs", range_pairs},
+  {"__tostring", range_tostring},
+  {nullptr, nullptr}
+};
+
+LUAI_FUNC int luaB_range (lua_State *L);
+int luaB_range (lua_State *L) {
   lua_Integer start, end, step;
   if (!lua_isnoneornil(L, 2)) {
     start = luaL_checkinteger(L, 1);
     end = luaL_checkinteger(L, 2);
     step = luaL_optinteger(L, 3, 1);
+    luaL_argcheck(L, step != 0, 3, "step must not be zero");
   }
   else {
     start = 1;
@@ -779,13 +955,24 @@ static int luaB_range (lua_State *L) {
     step = 1;
   }
 
-  lua_createtable(L, cast(int, end - start), 0);
-  lua_Integer idx = 1;
-  for (lua_Integer i = start; i <= end; i += step, ++idx) {
-    lua_pushinteger(L, i);
-    lua_rawseti(L, -2, idx);
-    L->checkEtl();
+  auto r = (Range *)lua_newuserdatauv(L, sizeof(Range), 0);
+  r->start = start;
+  r->step = step;
+  /* same as a numeric for's iteration count */
+  if (step > 0 ? start > end : start < end)
+    r->count = 0;
+  else {
+    const lua_Unsigned n = (step > 0
+      ? (l_castS2U(end) - l_castS2U(start)) / l_castS2U(step)
+      : (l_castS2U(start) - l_castS2U(end)) / (l_castS2U(-(step + 1)) + 1u)
+    );
+    r->count = (n == ~(lua_Unsigned)0 ? n : n + 1);  /* a range over every integer is one short */
   }
+  if (luaL_newmetatable(L, RANGEHANDLE)) {
+    lua_pushvalue(L, -1);
+    luaL_setfuncs(L, funcs_range, 1);
+  }
+  lua_setmetatable(L, -2);
   return 1;
 }
 
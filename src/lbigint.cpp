@@ -43,8 +43,15 @@ static int bigint_div_mm (lua_State *L) {
   return 1;
 }
 
+static const soup::Bigint& checkmodulus (lua_State *L, int i) {
+  const soup::Bigint& m = *checkbigint(L, i);
+  luaL_argcheck(L, !m.isZero(), i, "modulus must not be zero");
+  return m;
+}
+
 static int bigint_mod (lua_State *L) {
-  pushbigint(L, *checkbigint(L, 1) % *checkbigint(L, 2));
+  const soup::Bigint& x = *checkbigint(L, 1);
+  pushbigint(L, x % checkmodulus(L, 2));
   return 1;
 }
 
@@ -53,6 +60,181 @@ static int bigint_pow (lua_State *L) {
   return 1;
 }
 
+static int bigint_modpow (lua_State *L) {
+  const soup::Bigint& e = *checkbigint(L, 2);
+  const soup::Bigint& m = *checkbigint(L, 3);
+  luaL_argcheck(L, !e.isNegative(), 2, "exponent must not be negative");
+  luaL_argcheck(L, !m.isNegative() && !m.isZero(), 3, "modulus must be positive");
+  if (m == (soup::Bigint::chunk_t)1u) {
+    pushbigint(L, soup::Bigint());
+    return 1;
+  }
+  const soup::Bigint *base = checkbigint(L, 1);
+  soup::Bigint reduced;
+  if (base->isNegative()) {
+    reduced = *base % m;
+    base = &reduced;
+  }
+  /* uses Montgomery multiplication for odd moduli & large exponents */
+  pushbigint(L, base->modPow(e, m));
+  return 1;
+}
+
+static int bigint_modinv (lua_State *L) {
+  const soup::Bigint& m = *checkbigint(L, 2);
+  luaL_argcheck(L, !m.isNegative() && !m.isZero(), 2, "modulus must be positive");
+  soup::Bigint inv;
+  try {
+    inv = checkbigint(L, 1)->modMulInv(m);
+  }
+  catch (std::exception&) {
+    luaL_error(L, "no modular inverse exists");
+  }
+  pushbigint(L, std::move(inv));
+  return 1;
+}
+
+static int bigint_gcd (lua_State *L) {
+  soup::Bigint a = checkbigint(L, 1)->abs();
+  soup::Bigint b = checkbigint(L, 2)->abs();
+  if (a.isZero())
+    pushbigint(L, std::move(b));
+  else if (b.isZero())
+    pushbigint(L, std::move(a));
+  else
+    pushbigint(L, a.gcd(std::move(b)));
+  return 1;
+}
+
+/* Results of left shifts are limited to 2^26 bits (8 MiB), so a shift count can't request an arbitrarily large allocation. */
+#define MAXSHIFTBITS ((size_t)1 << 26)
+
+/* Shifts the magnitude, keeping the sign. A negative count shifts the other way. */
+static soup::Bigint shifted (lua_State *L, bool left) {
+  soup::Bigint x = *checkbigint(L, 1);
+  const lua_Integer n = luaL_checkinteger(L, 2);
+  if (n < 0)
+    left = !left;
+  const size_t bits = n < 0 ? (size_t)0 - (size_t)n : (size_t)n;
+  if (left) {
+    if (x.isZero())
+      return x;
+    luaL_argcheck(L, bits <= MAXSHIFTBITS && x.getBitLength() <= MAXSHIFTBITS - bits, 2, "shift count too large");
+    /* whole chunks, then less than a chunk; soup's path for other counts goes bit by bit */
+    x <<= bits - bits % soup::Bigint::getBitsPerChunk();
+    x <<= bits % soup::Bigint::getBitsPerChunk();
+  }
+  else {
+    x >>= bits;
+    if (x.isZero())
+      x.reset();  /* no negative zero */
+  }
+  return x;
+}
+
+static int bigint_shl (lua_State *L) {
+  pushbigint(L, shifted(L, true));
+  return 1;
+}
+
+static int bigint_shr (lua_State *L) {
+  pushbigint(L, shifted(L, false));
+  return 1;
+}
+
+/* Bitwise operations work on non-negative values only, as the representation is sign & magnitude. */
+static const soup::Bigint& checkunsigned (lua_State *L, int i) {
+  const soup::Bigint& x = *checkbigint(L, i);
+  luaL_argcheck(L, !x.isNegative(), i, "bitwise operation on negative bigint");
+  return x;
+}
+
+static int bigint_band (lua_State *L) {
+  pushbigint(L, checkunsigned(L, 1) & checkunsigned(L, 2));
+  return 1;
+}
+
+static int bigint_bor (lua_State *L) {
+  pushbigint(L, checkunsigned(L, 1) | checkunsigned(L, 2));
+  return 1;
+}
+
+static int bigint_bxor (lua_State *L) {
+  const soup::Bigint& a = checkunsigned(L, 1);
+  const soup::Bigint& b = checkunsigned(L, 2);
+  const bool a_longer = a.getNumChunks() >= b.getNumChunks();
+  soup::Bigint res = (a_longer ? a : b);
+  const soup::Bigint& other = (a_longer ? b : a);
+  for (size_t i = 0; i != other.getNumChunks(); ++i)
+    res.setChunkInbounds(i, res.getChunkInbounds(i) ^ other.getChunkInbounds(i));
+  res.shrink();
+  pushbigint(L, std::move(res));
+  return 1;
+}
+
+static int bigint_frombinary (lua_State *L) {
+  size_t len;
+  const char *str = luaL_checklstring(L, 1, &len);
+  pushbigint(L, soup::Bigint::fromBinary(str, len));
+  return 1;
+}
+
+/* Big-endian magnitude, optionally left-padded with zeroes to 'bytes'. */
+static int bigint_tobinary (lua_State *L) {
+  const soup::Bigint& x = *checkbigint(L, 1);
+  std::string bin = x.toBinary();
+  if (!lua_isnoneornil(L, 2)) {
+    const lua_Integer bytes = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, bytes >= 0 && (size_t)bytes >= bin.size(), 2, "value does not fit");
+    bin.insert(bin.begin(), (size_t)bytes - bin.size(), '\0');
+  }
+  pluto_pushstring(L, bin);
+  return 1;
+}
+
+/*
+** The *assign methods update the first operand in place and return it, so
+** accumulating loops don't allocate a new bigint per step. Other references
+** to that bigint observe the change.
+*/
+
+static int bigint_addassign (lua_State *L) {
+  soup::Bigint& x = *checkbigint(L, 1);
+  const soup::Bigint& y = *checkbigint(L, 2);
+  if (&x == &y)
+    x <<= 1;
+  else
+    x += y;
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int bigint_subassign (lua_State *L) {
+  soup::Bigint& x = *checkbigint(L, 1);
+  const soup::Bigint& y = *checkbigint(L, 2);
+  if (&x == &y)
+    x.reset();
+  else
+    x -= y;
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int bigint_mulassign (lua_State *L) {
+  soup::Bigint& x = *checkbigint(L, 1);
+  x *= *checkbigint(L, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int bigint_modassign (lua_State *L) {
+  soup::Bigint& x = *checkbigint(L, 1);
+  const soup::Bigint& m = checkmodulus(L, 2);
+  x = x % m;
+  lua_settop(L, 1);
+  return 1;
+}
+
 static int bigint_tostring (lua_State *L) {
   pluto_pushstring(L, checkbigint(L, 1)->toString());
   return 1;
@@ -115,6 +297,21 @@ void pushbigint (lua_State *L, soup::Bigint&& x) {
     lua_pushliteral(L, "__pow");
     lua_pushcfunction(L, bigint_pow);
     lua_settable(L, -3);
+    lua_pushliteral(L, "__shl");
+    lua_pushcfunction(L, bigint_shl);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__shr");
+    lua_pushcfunction(L, bigint_shr);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__band");
+    lua_pushcfunction(L, bigint_band);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__bor");
+    lua_pushcfunction(L, bigint_bor);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__bxor");
+    lua_pushcfunction(L, bigint_bxor);
+    lua_settable(L, -3);
     lua_pushliteral(L, "__tostring");
     lua_pushcfunction(L, bigint_tostring);
     lua_settable(L, -3);
@@ -143,6 +340,18 @@ static const luaL_Reg funcs_bigint[] = {
   {"div", bigint_div},
   {"mod", bigint_mod},
   {"pow", bigint_pow},
+  {"modpow", bigint_modpow},
+  {"modinv", bigint_modinv},
+  {"gcd", bigint_gcd},
+  {"shl", bigint_shl},
+  {"shr", bigint_shr},
+  {"band", bigint_band},
+  {"bor", bigint_bor},
+  {"bxor", bigint_bxor},
+  {"addassign", bigint_addassign},
+  {"subassign", bigint_subassign},
+  {"mulassign", bigint_mulassign},
+  {"modassign", bigint_modassign},
   {"tostring", bigint_tostring},
   {"eq", bigint_eq},
   {"lt", bigint_lt},
@@ -150,6 +359,8 @@ static const luaL_Reg funcs_bigint[] = {
   {"hex", bigint_hex},
   {"binary", bigint_binary},
   {"bitlength", bigint_bitlength},
+  {"frombinary", bigint_frombinary},
+  {"tobinary", bigint_tobinary},
   {nullptr, nullptr}
 };
 
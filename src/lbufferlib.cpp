@@ -1,107 +1,161 @@
 #define LUA_LIB
 #include "lualib.h"
 
-#include <cstdlib> // malloc, realloc, free
+#include <cstring> // memcpy
 #include <memory> // destroy_at
-#include <new> // bad_alloc
+#include <string_view>
 
-#include "vendor/Soup/soup/Buffer.hpp"
+#include "lbufferlib.hpp"
+
+#include "vendor/Soup/soup/filesystem.hpp"
 
 #include "ldo.h"
-#include "lmem.h"
 
-#ifdef PLUTO_MEMORY_LIMIT
-struct PlutoSingleBlockAllocator : public soup::memAllocator
+/*
+** A view is a (offset, length) pair into a pluto:buffer or file mapping,
+** which it keeps alive as its user value. The range is validated on every
+** access since the buffer may have been cleared, or the mapping closed,
+** since the view was created.
+*/
+struct PlutoBufferView
 {
-    lua_State* L;
-    size_t size = 0;
-
-    PlutoSingleBlockAllocator()
-        : memAllocator(&allocateImpl, &reallocateImpl, &deallocateImpl)
-    {
-    }
-
-    static void* allocateImpl(memAllocator* inst, size_t size) /* SOUP_EXCAL */
-    {
-        //printf("allocate %zu\n", size);
-        void* ptr = luaM_realloc_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, nullptr, 0, size);
-        SOUP_IF_LIKELY (ptr)
-        {
-            static_cast<PlutoSingleBlockAllocator*>(inst)->size = size;
-            return ptr;
-        }
-        throw std::bad_alloc{};
-    }
-
-    static void* reallocateImpl(memAllocator* inst, void* addr, size_t new_size) /* SOUP_EXCAL */
-    {
-        //printf("resize %zu to %zu\n", static_cast<PlutoSingleBlockAllocator*>(inst)->size, new_size);
-        addr = luaM_realloc_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, addr, static_cast<PlutoSingleBlockAllocator*>(inst)->size, new_size);
-        SOUP_IF_LIKELY (addr)
-        {
-            static_cast<PlutoSingleBlockAllocator*>(inst)->size = new_size;
-            return addr;
-        }
-        throw std::bad_alloc{};
-    }
-
-    static void deallocateImpl(memAllocator* inst, void* addr) noexcept
-    {
-        luaM_free_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, addr, static_cast<PlutoSingleBlockAllocator*>(inst)->size);
-    }
+  size_t off;
+  size_t len;
 };
-#endif
 
-struct PlutoBuffer
+/* A read-only file mapping from io.mmap. 'addr' is nullptr once it has been closed. */
+struct PlutoMapping
 {
-#ifdef PLUTO_MEMORY_LIMIT
-    PlutoSingleBlockAllocator allocator;
-#endif
-    soup::Buffer buffer;
-
-    PlutoBuffer()
-#ifdef PLUTO_MEMORY_LIMIT
-        : buffer(allocator)
-#endif
-    {
-    }
+  const void *addr;
+  size_t len;
 };
 
-[[nodiscard]] static PlutoBuffer* checkbuffer (lua_State *L, int i) {
-  const auto buf = (PlutoBuffer*)luaL_checkudata(L, i, "pluto:buffer");
-#ifdef PLUTO_MEMORY_LIMIT
-  buf->allocator.L = L;
-#endif
-  return buf;
-}
-
-static int buffer_new (lua_State *L) {
-  new (lua_newuserdata(L, sizeof(PlutoBuffer))) PlutoBuffer{};
-  if (luaL_newmetatable(L, "pluto:buffer")) {
+static void setmetatable (lua_State *L, const char *tname, lua_CFunction gc) {
+  if (luaL_newmetatable(L, tname)) {
     lua_pushliteral(L, "__index");
     luaL_loadbuffer(L, "return require\"pluto:buffer\"", 28, 0);
     lua_call(L, 0, 1);
     lua_settable(L, -3);
-    lua_pushliteral(L, "__gc");
-    lua_pushcfunction(L, [](lua_State *L) {
-      std::destroy_at<>(checkbuffer(L, 1));
-      return 0;
-    });
+    if (gc) {
+      lua_pushliteral(L, "__gc");
+      lua_pushcfunction(L, gc);
+      lua_settable(L, -3);
+    }
+    lua_pushliteral(L, "__tostring");
+    luaL_loadbuffer(L, "return require\"pluto:buffer\".tostring", 37, 0);
+    lua_call(L, 0, 1);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__len");
+    luaL_loadbuffer(L, "return require\"pluto:buffer\".size", 33, 0);
+    lua_call(L, 0, 1);
     lua_settable(L, -3);
-	lua_pushliteral(L, "__tostring");
-	luaL_loadbuffer(L, "return require\"pluto:buffer\".tostring", 37, 0);
-	lua_call(L, 0, 1);
-	lua_settable(L, -3);
   }
   lua_setmetatable(L, -2);
+}
+
+/* resolves the buffer or view at index 'i' into a byte range; returns nullptr if it's neither */
+static const char *tospan (lua_State *L, int i, size_t *len) {
+  if (auto buf = (PlutoBuffer*)luaL_testudata(L, i, "pluto:buffer")) {
+    *len = buf->buffer.size();
+    return (const char*)buf->buffer.data();
+  }
+  if (auto map = (PlutoMapping*)luaL_testudata(L, i, "pluto:mapping")) {
+    if (l_unlikely(map->addr == nullptr))
+      luaL_error(L, "attempt to use a closed file mapping");
+    *len = map->len;
+    return (const char*)map->addr;
+  }
+  if (auto view = (PlutoBufferView*)luaL_testudata(L, i, "pluto:bufferview")) {
+    size_t baselen;
+    lua_getiuservalue(L, i, 1);
+    const char *base = tospan(L, -1, &baselen);
+    lua_pop(L, 1);  /* the view keeps it alive */
+    if (l_unlikely(view->off + view->len > baselen))
+      luaL_error(L, "buffer view is out of range (was the buffer cleared?)");
+    *len = view->len;
+    return base + view->off;
+  }
+  return nullptr;
+}
+
+static const char *checkspan (lua_State *L, int i, size_t *len) {
+  const char *data = tospan(L, i, len);
+  if (l_unlikely(data == nullptr))
+    luaL_typeerror(L, i, "buffer");
+  return data;
+}
+
+const char *pluto_tobytes (lua_State *L, int i, size_t *len) {
+  if (lua_type(L, i) == LUA_TSTRING)
+    return lua_tolstring(L, i, len);
+  if (lua_type(L, i) == LUA_TUSERDATA)
+    return tospan(L, i, len);
+  return nullptr;
+}
+
+const char *pluto_checkbytes (lua_State *L, int i, size_t *len) {
+  if (lua_type(L, i) == LUA_TUSERDATA) {
+    if (const char *data = tospan(L, i, len))
+      return data;
+  }
+  return luaL_checklstring(L, i, len);
+}
+
+static int mapping_close (lua_State *L) {
+  auto map = (PlutoMapping*)luaL_checkudata(L, 1, "pluto:mapping");
+  if (map->addr) {
+    soup::filesystem::destroyFileMapping(map->addr, map->len);
+    map->addr = nullptr;
+    map->len = 0;
+  }
+  return 0;
+}
+
+void pluto_pushmapping (lua_State *L, const void *addr, size_t len) {
+  auto map = (PlutoMapping*)lua_newuserdatauv(L, sizeof(PlutoMapping), 0);
+  map->addr = addr;
+  map->len = len;
+  setmetatable(L, "pluto:mapping", mapping_close);
+  lua_getmetatable(L, -1);
+  if (lua_getfield(L, -1, "__close") == LUA_TNIL) {
+    lua_pushcfunction(L, mapping_close);
+    lua_setfield(L, -3, "__close");
+  }
+  lua_pop(L, 2);
+}
+
+static int buffer_new (lua_State *L) {
+  const lua_Integer capacity = luaL_optinteger(L, 1, 0);
+  luaL_argcheck(L, capacity >= 0, 1, "capacity must not be negative");
+  auto buf = new (lua_newuserdata(L, sizeof(PlutoBuffer))) PlutoBuffer{};
+  setmetatable(L, "pluto:buffer", [](lua_State *L) {
+    std::destroy_at<>(checkbuffer(L, 1));
+    return 0;
+  });
+  if (capacity != 0) {
+    buf->allocator.L = L;
+    try {
+      buf->buffer.reserve(static_cast<size_t>(capacity));
+    }
+    catch (std::bad_alloc&) {
+      luaD_throw(L, LUA_ERRMEM);
+    }
+  }
   return 1;
 }
 
 static int buffer_append (lua_State *L) {
   size_t size;
-  const char* data = luaL_checklstring(L, 2, &size);
+  const char* data = pluto_checkbytes(L, 2, &size);
+  soup::Buffer& buf = checkbuffer(L, 1)->buffer;
   try {
-    checkbuffer(L, 1)->buffer.append(data, size);
+    if (data >= (const char*)buf.data() && data < (const char*)buf.data() + buf.size()) {
+      /* appending (a view of) itself; the data may move when the buffer grows */
+      const size_t off = data - (const char*)buf.data();
+      buf.reserve(buf.size() + size);
+      data = (const char*)buf.data() + off;
+    }
+    buf.append(data, size);
   }
   catch (std::bad_alloc&) {
     luaD_throw(L, LUA_ERRMEM);
@@ -109,10 +163,133 @@ static int buffer_append (lua_State *L) {
   return 0;
 }
 
+static int buffer_reserve (lua_State *L) {
+  soup::Buffer& buf = checkbuffer(L, 1)->buffer;
+  const lua_Integer n = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, n >= 0, 2, "capacity must not be negative");
+  try {
+    buf.reserve(static_cast<size_t>(n));
+  }
+  catch (std::bad_alloc&) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  return 0;
+}
+
+static int buffer_clear (lua_State *L) {
+  checkbuffer(L, 1)->buffer.clear();  /* keeps the capacity, so the buffer can be reused without reallocating */
+  return 0;
+}
+
+static int buffer_size (lua_State *L) {
+  size_t len;
+  checkspan(L, 1, &len);
+  lua_pushinteger(L, static_cast<lua_Integer>(len));
+  return 1;
+}
+
 static int buffer_tostring (lua_State *L) {
+  size_t len;
+  const char *data = checkspan(L, 1, &len);
+  try {
+    lua_pushlstring(L, data, len);
+  }
+  catch (std::bad_alloc&) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  return 1;
+}
+
+/* same semantics as for string.sub */
+static size_t posrelat (lua_Integer pos, size_t len) {
+  if (pos > 0)
+    return (size_t)pos;
+  else if (pos == 0)
+    return 1;
+  else if (pos < -(lua_Integer)len)
+    return 1;
+  else return len + (size_t)pos + 1;
+}
+
+static int buffer_sub (lua_State *L) {
+  size_t len;
+  checkspan(L, 1, &len);
+  size_t start = posrelat(luaL_checkinteger(L, 2), len);
+  lua_Integer j = luaL_optinteger(L, 3, -1);
+  size_t end = (j > (lua_Integer)len ? len : j >= 0 ? (size_t)j : j < -(lua_Integer)len ? 0 : len + (size_t)j + 1);
+  auto view = (PlutoBufferView*)lua_newuserdatauv(L, sizeof(PlutoBufferView), 1);
+  view->len = (start <= end ? end - start + 1 : 0);
+  if (luaL_testudata(L, 1, "pluto:bufferview")) {
+    view->off = static_cast<const PlutoBufferView*>(lua_touserdata(L, 1))->off + start - 1;
+    lua_getiuservalue(L, 1, 1);  /* refer to the underlying buffer, not the view */
+  }
+  else {
+    view->off = start - 1;
+    lua_pushvalue(L, 1);
+  }
+  if (view->len == 0)
+    view->off = 0;
+  lua_setiuservalue(L, -2, 1);
+  setmetatable(L, "pluto:bufferview", nullptr);
+  return 1;
+}
+
+static int buffer_find (lua_State *L) {
+  size_t len, needlelen;
+  const char *data = checkspan(L, 1, &len);
+  const char *needle = pluto_checkbytes(L, 2, &needlelen);
+  const size_t init = posrelat(luaL_optinteger(L, 3, 1), len) - 1;
+  if (init > len) {
+    luaL_pushfail(L);
+    return 1;
+  }
+  const auto pos = std::string_view(data, len).find(std::string_view(needle, needlelen), init);
+  if (pos == std::string_view::npos) {
+    luaL_pushfail(L);
+    return 1;
+  }
+  lua_pushinteger(L, static_cast<lua_Integer>(pos + 1));
+  lua_pushinteger(L, static_cast<lua_Integer>(pos + needlelen));
+  return 2;
+}
+
+/* buffer:pack(fmt, ...) appends the values as string.pack would encode them; if one can't be packed, nothing is appended */
+static int buffer_pack (lua_State *L) {
+  soup::Buffer& buf = checkbuffer(L, 1)->buffer;
+  const size_t size = buf.size();
+  try {
+    pluto_packinto(L, 2, buf, size);
+  }
+  catch (std::bad_alloc&) {
+    buf.resize(size);
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  catch (...) {  /* error raised for a value; drop the ones packed before it */
+    buf.resize(size);
+    throw;
+  }
+  return 0;
+}
+
+/* buffer:packat(pos, fmt, ...) overwrites the data at 'pos', growing the buffer as needed; returns the position after it */
+static int buffer_packat (lua_State *L) {
   soup::Buffer& buf = checkbuffer(L, 1)->buffer;
+  const lua_Integer pos = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, pos >= 1 && static_cast<size_t>(pos) <= buf.size() + 1, 2, "position out of buffer");
+  const size_t off = static_cast<size_t>(pos) - 1;
   try {
-    lua_pushlstring(L, (const char*)buf.data(), buf.size());
+    /* packed on the side first, so the buffer is left as it was if a value can't be packed; through the state, so it counts towards its memory */
+    PlutoBuffer packed;
+    packed.allocator.L = L;
+    pluto_packinto(L, 3, packed.buffer, 0);
+    const size_t n = packed.buffer.size();
+    if (buf.size() < off + n) {
+      buf.reserve(off + n);  /* resize would set the size first, even if growing fails */
+      buf.resize(off + n);
+    }
+    if (n != 0)
+      memcpy(buf.data() + off, packed.buffer.data(), n);
+    lua_pushinteger(L, static_cast<lua_Integer>(off + n + 1));
   }
   catch (std::bad_alloc&) {
     luaD_throw(L, LUA_ERRMEM);
@@ -120,10 +297,27 @@ static int buffer_tostring (lua_State *L) {
   return 1;
 }
 
+/* buffer:unpack(fmt, pos) works like string.unpack(fmt, tostring(buffer), pos) without the copy */
+static int buffer_unpack (lua_State *L) {
+  size_t len;
+  const char *data = checkspan(L, 1, &len);
+  const size_t pos = posrelat(luaL_optinteger(L, 3, 1), len) - 1;
+  luaL_argcheck(L, pos <= len, 3, "initial position out of buffer");
+  return pluto_unpackfrom(L, 2, 1, data, len, pos);
+}
+
 static const luaL_Reg funcs_buffer[] = {
   {"new", buffer_new},
   {"append", buffer_append},
+  {"reserve", buffer_reserve},
+  {"clear", buffer_clear},
+  {"size", buffer_size},
   {"tostring", buffer_tostring},
+  {"sub", buffer_sub},
+  {"find", buffer_find},
+  {"pack", buffer_pack},
+  {"packat", buffer_packat},
+  {"unpack", buffer_unpack},
   {nullptr, nullptr}
 };
 
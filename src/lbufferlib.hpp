@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdlib> // malloc, realloc, free
+#include <new> // bad_alloc
+
+#include "vendor/Soup/soup/Buffer.hpp"
+
+#include "lauxlib.h"
+#include "lmem.h"
+#include "lstate.h"
+
+/* Allocates through the state, so buffer contents count towards its memory limit & stats. */
+struct PlutoSingleBlockAllocator : public soup::memAllocator
+{
+    lua_State* L;
+    size_t size = 0;
+
+    PlutoSingleBlockAllocator()
+        : memAllocator(&allocateImpl, &reallocateImpl, &deallocateImpl)
+    {
+    }
+
+    static void* allocateImpl(memAllocator* inst, size_t size) /* SOUP_EXCAL */
+    {
+        //printf("allocate %zu\n", size);
+        void* ptr = luaM_realloc_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, nullptr, 0, size);
+        SOUP_IF_LIKELY (ptr)
+        {
+            G(static_cast<PlutoSingleBlockAllocator*>(inst)->L)->buffermem += size;
+            static_cast<PlutoSingleBlockAllocator*>(inst)->size = size;
+            return ptr;
+        }
+        throw std::bad_alloc{};
+    }
+
+    static void* reallocateImpl(memAllocator* inst, void* addr, size_t new_size) /* SOUP_EXCAL */
+    {
+        //printf("resize %zu to %zu\n", static_cast<PlutoSingleBlockAllocator*>(inst)->size, new_size);
+        addr = luaM_realloc_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, addr, static_cast<PlutoSingleBlockAllocator*>(inst)->size, new_size);
+        SOUP_IF_LIKELY (addr)
+        {
+            G(static_cast<PlutoSingleBlockAllocator*>(inst)->L)->buffermem += new_size - static_cast<PlutoSingleBlockAllocator*>(inst)->size;
+            static_cast<PlutoSingleBlockAllocator*>(inst)->size = new_size;
+            return addr;
+        }
+        throw std::bad_alloc{};
+    }
+
+    static void deallocateImpl(memAllocator* inst, void* addr) noexcept
+    {
+        luaM_free_(static_cast<PlutoSingleBlockAllocator*>(inst)->L, addr, static_cast<PlutoSingleBlockAllocator*>(inst)->size);
+        G(static_cast<PlutoSingleBlockAllocator*>(inst)->L)->buffermem -= static_cast<PlutoSingleBlockAllocator*>(inst)->size;
+    }
+};
+
+struct PlutoBuffer
+{
+    PlutoSingleBlockAllocator allocator;
+    soup::Buffer buffer;
+
+    PlutoBuffer()
+        : buffer(allocator)
+    {
+    }
+};
+
+[[nodiscard]] inline PlutoBuffer* checkbuffer (lua_State *L, int i) {
+  const auto buf = (PlutoBuffer*)luaL_checkudata(L, i, "pluto:buffer");
+  buf->allocator.L = L;
+  return buf;
+}
+
+/* Pushes a read-only buffer over a file mapping from soup::filesystem::createFileMapping, taking ownership of it. */
+void pluto_pushmapping (lua_State *L, const void *addr, size_t len);
+
+/* Returns the contents of a string, pluto:buffer, file mapping or buffer view, raising an error for anything else. */
+[[nodiscard]] const char *pluto_checkbytes (lua_State *L, int i, size_t *len);
+
+/* Like 'pluto_checkbytes', but returns nullptr instead of raising an error. */
+[[nodiscard]] const char *pluto_tobytes (lua_State *L, int i, size_t *len);
+
+/* string.pack into 'buf' at (0-based) 'pos', which may be at or before its end. Returns the position after the packed data. Implemented in lstrlib. */
+size_t pluto_packinto (lua_State *L, int arg, soup::Buffer& buf, size_t pos);
+
+/* string.unpack from 'data' at (0-based) 'pos'. Implemented in lstrlib. */
+int pluto_unpackfrom (lua_State *L, int fmtarg, int dataarg, const char *data, size_t ld, size_t pos);
@@ -1,6 +1,13 @@
 #define LUA_LIB
 #include "lualib.h"
 
+#include <cctype> // isspace, isdigit
+#include <cstring> // memcpy
+#include <new> // bad_alloc
+
+#include "ldo.h"
+#include "lpng.hpp"
+
 #include "vendor/Soup/soup/Canvas.hpp"
 #include "vendor/Soup/soup/MemoryRefReader.hpp"
 #include "vendor/Soup/soup/QrCode.hpp"
@@ -41,6 +48,98 @@ static int canvas_bmp (lua_State *L) {
   return 1;
 }
 
+static_assert(sizeof(soup::Rgb) == 3);  /* pixels are passed to the PNG codec as RGB triplets */
+
+static int canvas_png (lua_State *L) {
+  size_t size;
+  const char *data = luaL_checklstring(L, 1, &size);
+  Pluto::Png::Info info;
+  const char *err = Pluto::Png::readInfo(data, size, info);
+  if (l_likely(err == nullptr)) {
+    try {
+      soup::Canvas c(info.width, info.height);
+      err = Pluto::Png::decode(L, data, size, info, reinterpret_cast<uint8_t*>(c.pixels.data()));
+      if (l_likely(err == nullptr)) {
+        pushcanvas(L, std::move(c));
+        return 1;
+      }
+    }
+    catch (std::bad_alloc&) {
+      luaD_throw(L, LUA_ERRMEM);
+    }
+  }
+  luaL_error(L, "failed to decode PNG: %s", err);
+  return 0;
+}
+
+/* Skips whitespace & comments, then reads a decimal number from a PNM header. */
+static bool ppm_readnum (const char *&p, const char *end, unsigned int &out) {
+  while (p != end && (isspace((unsigned char)*p) || *p == '#')) {
+    if (*p == '#') {
+      while (p != end && *p != '\n')
+        ++p;
+    }
+    else
+      ++p;
+  }
+  if (p == end || !isdigit((unsigned char)*p))
+    return false;
+  uint64_t v = 0;
+  for (; p != end && isdigit((unsigned char)*p); ++p) {
+    v = v * 10 + (*p - '0');
+    if (v > 0xFFFFFFFF)
+      return false;
+  }
+  out = static_cast<unsigned int>(v);
+  return true;
+}
+
+/* Decodes PPM (P3 & P6) and PGM (P2 & P5) images. */
+static int canvas_ppm (lua_State *L) {
+  size_t size;
+  const char *data = luaL_checklstring(L, 1, &size);
+  const char *p = data + 2;
+  const char *const end = data + size;
+  if (size < 2 || data[0] != 'P' || (data[1] != '2' && data[1] != '3' && data[1] != '5' && data[1] != '6'))
+    luaL_error(L, "failed to decode PPM: not a PPM or PGM image");
+  const bool binary = (data[1] == '5' || data[1] == '6');
+  const unsigned int channels = (data[1] == '3' || data[1] == '6') ? 3 : 1;
+  unsigned int width, height, maxval;
+  if (!ppm_readnum(p, end, width) || !ppm_readnum(p, end, height) || !ppm_readnum(p, end, maxval))
+    luaL_error(L, "failed to decode PPM: malformed header");
+  if (width == 0 || height == 0 || (uint64_t)width * height > Pluto::Png::MAX_PIXELS || maxval == 0 || maxval > 65535)
+    luaL_error(L, "failed to decode PPM: invalid dimensions or maximum value");
+  const uint64_t samples = (uint64_t)width * height * channels;
+  const unsigned int sample_size = (maxval > 255 ? 2 : 1);
+  if (binary) {
+    if (p == end || !isspace((unsigned char)*p))
+      luaL_error(L, "failed to decode PPM: malformed header");
+    ++p;  /* a single whitespace character precedes the raster */
+    if ((uint64_t)(end - p) < samples * sample_size)
+      luaL_error(L, "failed to decode PPM: truncated image");
+  }
+  else if ((uint64_t)(end - p) < samples * 2)  /* each sample is a digit & a separator at least */
+    luaL_error(L, "failed to decode PPM: truncated image");
+  soup::Canvas c(width, height);
+  auto out = reinterpret_cast<uint8_t*>(c.pixels.data());
+  for (uint64_t i = 0; i != samples; ++i) {
+    unsigned int v;
+    if (binary) {
+      v = (sample_size == 2 ? ((uint8_t)p[0] << 8) | (uint8_t)p[1] : (uint8_t)p[0]);
+      p += sample_size;
+    }
+    else if (!ppm_readnum(p, end, v))
+      luaL_error(L, "failed to decode PPM: truncated image");
+    const auto sample = static_cast<uint8_t>(maxval == 255 ? v : (v > maxval ? 255 : v * 255 / maxval));
+    if (channels == 3)
+      out[i] = sample;
+    else
+      out[i * 3] = out[i * 3 + 1] = out[i * 3 + 2] = sample;
+  }
+  pushcanvas(L, std::move(c));
+  return 1;
+}
+
 static int canvas_qrcode (lua_State *L) {
   size_t size;
   const char *data = luaL_checklstring(L, 1, &size);
@@ -132,7 +231,20 @@ static int canvas_tobmp (lua_State* L) {
 }
 
 static int canvas_topng (lua_State* L) {
-  pluto_pushstring(L, checkcanvas(L, 1)->toPng());
+  const auto c = checkcanvas(L, 1);
+  const auto level = luaL_optinteger(L, 2, Pluto::Png::DEFAULT_LEVEL);
+  luaL_argcheck(L, level >= 0 && level <= 9, 2, "level must be between 0 and 9");
+  try {
+    pluto_pushstring(L, Pluto::Png::encode(L, reinterpret_cast<const uint8_t*>(c->pixels.data()), c->width, c->height, static_cast<int>(level)));
+  }
+  catch (std::bad_alloc&) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  return 1;
+}
+
+static int canvas_toppm (lua_State* L) {
+  pluto_pushstring(L, checkcanvas(L, 1)->toPpm());
   return 1;
 }
 
@@ -144,6 +256,8 @@ static int canvas_tobwstring(lua_State* L) {
 static const luaL_Reg funcs_canvas[] = {
   {"new", canvas_new},
   {"bmp", canvas_bmp},
+  {"png", canvas_png},
+  {"ppm", canvas_ppm},
   {"qrcode", canvas_qrcode},
   {"get", canvas_get},
   {"set", canvas_set},
@@ -152,6 +266,7 @@ static const luaL_Reg funcs_canvas[] = {
   {"mulsize", canvas_mulsize},
   {"tobmp", canvas_tobmp},
   {"topng", canvas_topng},
+  {"toppm", canvas_toppm},
   {"tobwstring", canvas_tobwstring},
   {nullptr, nullptr}
 };
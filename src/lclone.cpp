@@ -0,0 +1,495 @@
+/*
+** Cloning of states
+** See Copyright Notice in lua.h
+*/
+
+#define lclone_c
+#define LUA_CORE
+
+#include "lprefix.h"
+
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "lua.h"
+
+#include "ldebug.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lmem.h"
+#include "lobject.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "ltm.h"
+#include "lundump.h"
+
+
+/*
+** 'lua_clonestate' copies everything that is reachable from the registry
+** and the metatables of the basic types into a new state. Every object is
+** first created as an empty "shell" of the right size when it is reached,
+** and queued; its contents are copied when it is dequeued, so the copy
+** needs no recursion, and shared objects & cycles are preserved by 'map'.
+**
+** While copying, the new state's collector is stopped (including emergency
+** collections), since the shells are not anchored anywhere until the
+** registry is set at the end. It stays stopped while the '__clone'
+** metamethods run, as a copy may only be reachable through a weak table.
+*/
+
+namespace {
+  /* maps objects of the template to their copies; open addressing, since nothing is ever removed */
+  class ObjectMap {
+    std::vector<std::pair<const GCObject*, GCObject*>> slots = std::vector<std::pair<const GCObject*, GCObject*>>(64);
+    size_t count = 0;
+
+    [[nodiscard]] size_t index (const GCObject *o) const {
+      return static_cast<size_t>((reinterpret_cast<uintptr_t>(o) >> 4) * UINT64_C(0x9E3779B97F4A7C15) >> 32) & (slots.size() - 1);
+    }
+
+    void place (const GCObject *o, GCObject *copy) {
+      size_t i = index(o);
+      while (slots[i].first)
+        i = (i + 1) & (slots.size() - 1);
+      slots[i] = { o, copy };
+    }
+
+  public:
+    void reserve (size_t n) {
+      size_t size = slots.size();
+      while (size < n * 2)
+        size *= 2;
+      if (size == slots.size())
+        return;
+      std::vector<std::pair<const GCObject*, GCObject*>> old(size);
+      old.swap(slots);
+      for (const auto& [o, copy] : old) {
+        if (o)
+          place(o, copy);
+      }
+    }
+
+    [[nodiscard]] GCObject *find (const GCObject *o) const {
+      for (size_t i = index(o); slots[i].first; i = (i + 1) & (slots.size() - 1)) {
+        if (slots[i].first == o)
+          return slots[i].second;
+      }
+      return NULL;
+    }
+
+    void insert (const GCObject *o, GCObject *copy) {
+      reserve(++count);
+      place(o, copy);
+    }
+  };
+
+  struct Cloner {
+    lua_State *from;
+    lua_State *to;
+    TString *clonekey;  /* "__clone" in 'from' */
+    TString *namekey;  /* "__name" in 'from' */
+    ObjectMap map;
+    std::vector<std::pair<const GCObject*, GCObject*>> pending;  /* shells to fill */
+    std::vector<GCObject*> finalize;  /* copies that need 'luaC_checkfinalizer' */
+    std::vector<GCObject*> fixup;  /* copies whose metatable has a '__clone' field */
+    std::string error;  /* reason the template can't be cloned */
+
+    [[noreturn]] void fail (std::string msg) {
+      error = std::move(msg);
+      luaD_throw(to, LUA_ERRRUN);
+    }
+
+    [[nodiscard]] bool hasfield (Table *mt, TString *key) const {
+      return mt && !ttisnil(luaH_getshortstr(mt, key));
+    }
+
+    /* checks the metatable of a table or userdata in 'from' */
+    void checkmeta (GCObject *copy, Table *mt, bool isudata) {
+      if (mt == NULL)
+        return;
+      const bool hasgc = hasfield(mt, G(from)->tmname[TM_GC]);
+      const bool hasclone = hasfield(mt, clonekey);
+      if (isudata && hasgc && !hasclone) {
+        const TValue *name = luaH_getshortstr(mt, namekey);
+        fail(std::string("cannot clone userdata of type '") + (ttisstring(name) ? getstr(tsvalue(name)) : "?")
+          + "' (it has a __gc but no __clone metamethod)");
+      }
+      if (hasgc)
+        finalize.push_back(copy);
+      if (hasclone)
+        fixup.push_back(copy);
+    }
+
+    GCObject *object (GCObject *o) {
+      if (GCObject *copy = map.find(o))
+        return copy;
+      GCObject *copy;
+      switch (o->tt) {
+        case LUA_VSHRSTR: {
+          TString *ts = gco2ts(o);
+          copy = obj2gco(luaS_newlstr(to, getstr(ts), ts->shrlen));
+          map.insert(o, copy);
+          return copy;  /* nothing more to copy */
+        }
+        case LUA_VLNGSTR: {
+          TString *ts = gco2ts(o);
+          TString *ts2 = luaS_createlngstrobj(to, ts->u.lnglen);
+          memcpy(getlngstr(ts2), getlngstr(ts), ts->u.lnglen);
+          copy = obj2gco(ts2);
+          map.insert(o, copy);
+          return copy;  /* nothing more to copy */
+        }
+        case LUA_VTABLE: {
+          Table *t = gco2t(o);
+          Table *t2 = luaH_new(to);
+          copy = obj2gco(t2);
+          map.insert(o, copy);  /* before resizing, so 'copy' is not lost on errors */
+          luaH_resize(to, t2, luaH_realasize(t), allocsizenode(t));
+          checkmeta(copy, t->metatable, false);
+          break;
+        }
+        case LUA_VUSERDATA: {
+          Udata *u = gco2u(o);
+          Udata *u2 = luaS_newudata(to, u->len, u->nuvalue);
+          memcpy(getudatamem(u2), getudatamem(u), u->len);
+          copy = obj2gco(u2);
+          map.insert(o, copy);
+          checkmeta(copy, u->metatable, true);
+          break;
+        }
+        case LUA_VLCL:
+          copy = obj2gco(luaF_newLclosure(to, gco2lcl(o)->nupvalues));
+          map.insert(o, copy);
+          break;
+        case LUA_VCCL: {
+          CClosure *cl = gco2ccl(o);
+          CClosure *cl2 = luaF_newCclosure(to, cl->nupvalues);
+          cl2->f = cl->f;
+          for (int i = 0; i != cl->nupvalues; ++i)
+            setnilvalue(&cl2->upvalue[i]);
+          copy = obj2gco(cl2);
+          map.insert(o, copy);
+          break;
+        }
+        case LUA_VUPVAL: {
+          /* open upvalues are copied as closed ones holding their current value */
+          UpVal *uv = gco2upv(luaC_newobj(to, LUA_VUPVAL, sizeof(UpVal)));
+          uv->v.p = &uv->u.value;
+          setnilvalue(uv->v.p);
+          copy = obj2gco(uv);
+          map.insert(o, copy);
+          break;
+        }
+        case LUA_VPROTO:
+          copy = obj2gco(luaF_newproto(to));
+          map.insert(o, copy);
+          break;
+        case LUA_VTHREAD:  /* the main thread was mapped up-front */
+          fail("cannot clone a coroutine");
+        default:
+          lua_assert(0);
+          fail("cannot clone an object of unknown type");
+      }
+      pending.emplace_back(o, copy);
+      return copy;
+    }
+
+    TString *string (TString *ts) {
+      return ts ? gco2ts(object(obj2gco(ts))) : NULL;
+    }
+
+    Table *table (Table *t) {
+      return t ? gco2t(object(obj2gco(t))) : NULL;
+    }
+
+    void value (TValue *dst, const TValue *src) {
+      if (iscollectable(src)) {
+        val_(dst).gc = object(gcvalue(src));
+        settt_(dst, rawtt(src));
+      }
+      else
+        setobj(to, dst, src);
+    }
+
+    void filltable (const Table *t, Table *t2) {
+      const unsigned int asize = luaH_realasize(t);
+      for (unsigned int i = 0; i != asize; ++i)
+        value(&t2->array[i], &t->array[i]);
+      if (!isdummy(t)) {
+        for (Node *n = gnode(t, 0), *limit = gnode(t, sizenode(t)); n != limit; ++n) {
+          if (isempty(gval(n)))
+            continue;
+          TValue k, v, k2, v2;
+          getnodekey(from, &k, n);
+          setobj(from, &v, gval(n));
+          value(&k2, &k);
+          value(&v2, &v);
+          luaH_set(to, t2, &k2, &v2);
+        }
+      }
+      t2->metatable = table(t->metatable);
+      t2->flags = cast_byte((t2->flags & ~maskflags) | (t->flags & maskflags));  /* the metatable has the same fields */
+#ifdef PLUTO_ENABLE_TABLE_FREEZING
+      t2->isfrozen = t->isfrozen;
+#endif
+    }
+
+    void fillproto (const Proto *f, Proto *f2) {
+      f2->numparams = f->numparams;
+      f2->is_vararg = f->is_vararg;
+      f2->maxstacksize = f->maxstacksize;
+      f2->linedefined = f->linedefined;
+      f2->lastlinedefined = f->lastlinedefined;
+      f2->lua_vm_compatible = f->lua_vm_compatible;
+      f2->min_required_version = f->min_required_version;
+      if (f->lazy) {  /* what is not loaded yet from an indexed chunk is loaded from the same one */
+        f2->lazy = f->lazy;
+        luaU_chunkref(f->lazy);
+        f2->lazybody = f->lazybody;
+        f2->lazydebug = f->lazydebug;
+      }
+      /* each size is set as soon as its vector exists, so that a partial copy is freed correctly */
+      f2->code = luaM_newvectorchecked(to, f->sizecode, Instruction);
+      f2->sizecode = f->sizecode;
+      memcpy(f2->code, f->code, f->sizecode * sizeof(Instruction));
+      if (f->sizelineinfo) {
+        f2->lineinfo = luaM_newvectorchecked(to, f->sizelineinfo, ls_byte);
+        f2->sizelineinfo = f->sizelineinfo;
+        memcpy(f2->lineinfo, f->lineinfo, f->sizelineinfo * sizeof(ls_byte));
+      }
+      if (f->sizeabslineinfo) {
+        f2->abslineinfo = luaM_newvectorchecked(to, f->sizeabslineinfo, AbsLineInfo);
+        f2->sizeabslineinfo = f->sizeabslineinfo;
+        memcpy(f2->abslineinfo, f->abslineinfo, f->sizeabslineinfo * sizeof(AbsLineInfo));
+      }
+      f2->k = luaM_newvectorchecked(to, f->sizek, TValue);
+      f2->sizek = f->sizek;
+      for (int i = 0; i != f->sizek; ++i)
+        setnilvalue(&f2->k[i]);
+      f2->p = luaM_newvectorchecked(to, f->sizep, Proto *);
+      f2->sizep = f->sizep;
+      for (int i = 0; i != f->sizep; ++i)
+        f2->p[i] = NULL;
+      f2->upvalues = luaM_newvectorchecked(to, f->sizeupvalues, Upvaldesc);
+      f2->sizeupvalues = f->sizeupvalues;
+      for (int i = 0; i != f->sizeupvalues; ++i)
+        f2->upvalues[i].name = NULL;
+      f2->locvars = luaM_newvectorchecked(to, f->sizelocvars, LocVar);
+      f2->sizelocvars = f->sizelocvars;
+      for (int i = 0; i != f->sizelocvars; ++i)
+        f2->locvars[i].varname = NULL;
+      for (int i = 0; i != f->sizek; ++i)
+        value(&f2->k[i], &f->k[i]);
+      for (int i = 0; i != f->sizep; ++i)
+        f2->p[i] = gco2p(object(obj2gco(f->p[i])));
+      for (int i = 0; i != f->sizeupvalues; ++i) {
+        f2->upvalues[i] = f->upvalues[i];
+        f2->upvalues[i].name = string(f->upvalues[i].name);
+      }
+      for (int i = 0; i != f->sizelocvars; ++i) {
+        f2->locvars[i] = f->locvars[i];
+        f2->locvars[i].varname = string(f->locvars[i].varname);
+      }
+      f2->source = string(f->source);
+    }
+
+    void fill (const GCObject *o, GCObject *copy) {
+      switch (o->tt) {
+        case LUA_VTABLE:
+          filltable(gco2t(o), gco2t(copy));
+          break;
+        case LUA_VUSERDATA: {
+          const Udata *u = gco2u(o);
+          Udata *u2 = gco2u(copy);
+          for (int i = 0; i != u->nuvalue; ++i)
+            value(&u2->uv[i].uv, &u->uv[i].uv);
+          u2->metatable = table(u->metatable);
+          break;
+        }
+        case LUA_VLCL: {
+          const LClosure *cl = gco2lcl(o);
+          LClosure *cl2 = gco2lcl(copy);
+          cl2->p = gco2p(object(obj2gco(cl->p)));
+          for (int i = 0; i != cl->nupvalues; ++i)
+            cl2->upvals[i] = cl->upvals[i] ? gco2upv(object(obj2gco(cl->upvals[i]))) : NULL;
+          break;
+        }
+        case LUA_VCCL: {
+          const CClosure *cl = gco2ccl(o);
+          CClosure *cl2 = gco2ccl(copy);
+          for (int i = 0; i != cl->nupvalues; ++i)
+            value(&cl2->upvalue[i], &cl->upvalue[i]);
+          break;
+        }
+        case LUA_VUPVAL: {
+          const UpVal *uv = gco2upv(o);
+          value(gco2upv(copy)->v.p, uv->v.p);
+          break;
+        }
+        case LUA_VPROTO:
+          fillproto(gco2p(o), gco2p(copy));
+          break;
+      }
+    }
+
+    void run () {
+      global_State *g = G(from);
+      global_State *g2 = G(to);
+      /* size the structures for the template up-front instead of growing them while copying */
+      if (g2->strt.size < g->strt.size)
+        luaS_resize(to, g->strt.size);
+      map.reserve(2 * static_cast<size_t>(g->strt.nuse));
+      map.insert(obj2gco(g->mainthread), obj2gco(g2->mainthread));
+      TValue registry;
+      value(&registry, &g->l_registry);
+      Table *mt[LUA_NUMTYPES];
+      for (int i = 0; i != LUA_NUMTYPES; ++i)
+        mt[i] = table(g->mt[i]);
+#ifndef PLUTO_NO_DEFAULT_TABLE_METATABLE
+      TValue table_mt;
+      value(&table_mt, &g->table_mt);
+#endif
+      while (!pending.empty()) {
+        auto [o, copy] = pending.back();
+        pending.pop_back();
+        fill(o, copy);
+      }
+      /* everything is copied; anchor it */
+      setobj(to, &g2->l_registry, &registry);
+      for (int i = 0; i != LUA_NUMTYPES; ++i)
+        g2->mt[i] = mt[i];
+#ifndef PLUTO_NO_DEFAULT_TABLE_METATABLE
+      setobj(to, &g2->table_mt, &table_mt);
+#endif
+      /* let libraries adjust their objects, e.g. to not release what the template owns */
+      TString *key = luaS_newliteral(to, "__clone");
+      for (GCObject *o : fixup) {
+        setobj2s(to, to->top.p, luaH_getshortstr(metatable(o), key));
+        if (o->tt == LUA_VTABLE) {
+          sethvalue2s(to, to->top.p + 1, gco2t(o));
+        }
+        else {
+          setuvalue(to, s2v(to->top.p + 1), gco2u(o));
+        }
+        to->top.p += 2;
+        luaD_callnoyield(to, to->top.p - 2, 0);
+      }
+      /* only now, so a failed clone never finalizes an object that '__clone' did not adjust */
+      separatefinalizers();
+      /* last, as entering generational mode collects, and copies may only be reachable through weak tables */
+      g2->gcstp = 0;
+      g2->gcstopem = 0;
+      if (g->gckind != g2->gckind)
+        luaC_changemode(to, g->gckind);
+    }
+
+    /*
+    ** Moves the copies with a '__gc' metamethod from 'allgc' to 'finobj'
+    ** in a single pass, instead of a 'luaC_checkfinalizer' (which searches
+    ** 'allgc') per object. The collector is still stopped, so the new
+    ** state is in its pause and its lists need no other correction.
+    */
+    void separatefinalizers () {
+      global_State *g2 = G(to);
+      lua_assert(g2->gcstate == GCSpause && g2->gckind == KGC_INC);
+      size_t n = 0;
+      for (GCObject *o : finalize) {
+        if (!tofinalize(o) && gfasttm(g2, metatable(o), TM_GC) != NULL) {
+          l_setbit(o->marked, FINALIZEDBIT);
+          n++;
+        }
+      }
+      for (GCObject **p = &g2->allgc; n != 0; ) {
+        GCObject *o = *p;
+        if (tofinalize(o)) {  /* only the copies above are marked & still in 'allgc' */
+          *p = o->next;
+          o->next = g2->finobj;
+          g2->finobj = o;
+          n--;
+        }
+        else
+          p = &o->next;
+      }
+    }
+
+    static Table *metatable (GCObject *o) {
+      return o->tt == LUA_VTABLE ? gco2t(o)->metatable : gco2u(o)->metatable;
+    }
+  };
+}
+
+
+static void f_clone (lua_State *L, void *ud) {
+  UNUSED(L);
+  static_cast<Cloner*>(ud)->run();
+}
+
+
+LUA_API lua_State *lua_clonestate (lua_State *L, lua_Alloc f, void *ud) {
+  lua_State *L1;
+  global_State *g, *g1;
+  int status;
+  lua_lock(L);
+  g = G(L);
+  Cloner cloner;
+  cloner.from = L;
+  cloner.clonekey = luaS_newliteral(L, "__clone");
+  cloner.namekey = luaS_newliteral(L, "__name");
+  L1 = lua_newstate(f, ud);
+  if (L1 == NULL) {
+    lua_unlock(L);
+    return NULL;
+  }
+  cloner.to = L1;
+  g1 = G(L1);
+  g1->gcstp = GCSTPGC;  /* no GC while copying */
+  g1->gcstopem = 1;  /* not even in emergencies */
+  g1->panic = g->panic;
+  g1->warnf = g->warnf;
+  /* lauxlib's warning functions get their state as 'ud' */
+  g1->ud_warn = (g->ud_warn == g->mainthread) ? L1 : g->ud_warn;
+  g1->memlimit = g->memlimit;
+  g1->memquota = g->memquota;
+  g1->gcpause = g->gcpause;
+  g1->gcstepmul = g->gcstepmul;
+  g1->gcstepsize = g->gcstepsize;
+  g1->genminormul = g->genminormul;
+  g1->genmajormul = g->genmajormul;
+#ifndef PLUTO_LUA_LINKABLE
+  g1->user_data = g->user_data;
+  g1->have_preference_switch = g->have_preference_switch;
+  g1->preference_switch = g->preference_switch;
+  g1->have_preference_continue = g->have_preference_continue;
+  g1->preference_continue = g->preference_continue;
+  g1->have_preference_enum = g->have_preference_enum;
+  g1->preference_enum = g->preference_enum;
+  g1->have_preference_new = g->have_preference_new;
+  g1->preference_new = g->preference_new;
+  g1->have_preference_class = g->have_preference_class;
+  g1->preference_class = g->preference_class;
+  g1->have_preference_parent = g->have_preference_parent;
+  g1->preference_parent = g->preference_parent;
+  g1->have_preference_export = g->have_preference_export;
+  g1->preference_export = g->preference_export;
+  g1->have_preference_try = g->have_preference_try;
+  g1->preference_try = g->preference_try;
+  g1->have_preference_catch = g->have_preference_catch;
+  g1->preference_catch = g->preference_catch;
+#endif
+  status = luaD_rawrunprotected(L1, f_clone, &cloner);
+  if (l_unlikely(status != LUA_OK)) {
+    std::string msg = std::move(cloner.error);
+    if (msg.empty() && status != LUA_ERRMEM && ttisstring(s2v(L1->top.p - 1)))
+      msg = getstr(tsvalue(s2v(L1->top.p - 1)));  /* error in a '__clone' metamethod */
+    lua_close(L1);
+    if (msg.empty())
+      luaM_error(L);
+    luaG_runerror(L, "%s", msg.c_str());
+  }
+  lua_unlock(L);
+  return L1;
+}
@@ -0,0 +1,341 @@
+#include "lcodecache.hpp"
+
+#ifdef PLUTO_PARSER_CACHE
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib> // getenv
+#include <cstring> // memcmp, memcpy
+#include <filesystem>
+#include <mutex>
+#include <system_error>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/stat.h> // lstat, mkdir
+#include <unistd.h> // geteuid
+#endif
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lopcodes.h"
+#include "lstate.h"
+#include "lundump.h"
+
+#include "vendor/Soup/soup/filesystem.hpp"
+#include "vendor/Soup/soup/sha256.hpp"
+#include "vendor/Soup/soup/string.hpp"
+
+namespace Pluto {
+  namespace fs = std::filesystem;
+
+  static constexpr char ENTRY_MAGIC[8] = { 'P', 'l', 'u', 't', 'o', 'B', 'C', 1 };
+  static constexpr const char *ENTRY_EXT = ".plc";
+
+  struct EntryHeader {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime;  /* 0 if the source was too fresh to trust its mtime; see 'trustedMtime' */
+    uint8_t digest[32];
+  };
+
+  const std::string& CodeCache::directory() {
+    static const std::string dir = [] {
+      if (const char *env = getenv("PLUTO_CACHE_DIR"); env && *env)
+        return std::string(env);
+#ifdef PLUTO_PARSER_CACHE_DIR
+      return std::string(PLUTO_PARSER_CACHE_DIR);
+#else
+      std::error_code ec;
+      fs::path path = fs::temp_directory_path(ec) / "pluto-cache";
+#ifndef _WIN32
+      path += "-" + std::to_string(geteuid());  /* the temporary directory is shared with other users */
+#endif
+      return soup::string::fixType(path.u8string());
+#endif
+    }();
+    return dir;
+  }
+
+  bool CodeCache::usable() {
+    static const bool usable = [] {
+      fs::path dir = fs::u8path(directory()).lexically_normal();
+      if (!dir.has_filename())  /* trailing separator? */
+        dir = dir.parent_path();
+      std::error_code ec;
+#ifdef _WIN32
+      fs::create_directories(dir, ec);
+      return fs::is_directory(dir, ec);
+#else
+      if (dir.has_parent_path())
+        fs::create_directories(dir.parent_path(), ec);
+      ::mkdir(dir.c_str(), 0700);  /* fails if it exists, which the checks below deal with */
+      struct stat st;
+      return ::lstat(dir.c_str(), &st) == 0 && S_ISDIR(st.st_mode)
+          && (st.st_uid == geteuid() || st.st_uid == 0)
+          && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+#endif
+    }();
+    return usable;
+  }
+
+  /* Everything besides the source text that affects the bytecode the parser produces. */
+  static void appendCompilerTag(soup::sha256::State& st, lua_State *L) noexcept {
+    const global_State *g = G(L);
+    const uint32_t prefs =
+      (g->have_preference_switch << 0) | (g->preference_switch << 1) |
+      (g->have_preference_continue << 2) | (g->preference_continue << 3) |
+      (g->have_preference_enum << 4) | (g->preference_enum << 5) |
+      (g->have_preference_new << 6) | (g->preference_new << 7) |
+      (g->have_preference_class << 8) | (g->preference_class << 9) |
+      (g->have_preference_parent << 10) | (g->preference_parent << 11) |
+      (g->have_preference_export << 12) | (g->preference_export << 13) |
+      (g->have_preference_try << 14) | (g->preference_try << 15) |
+      (g->have_preference_catch << 16) | (g->preference_catch << 17);
+    /* configuration that changes what the parser emits or what the VM expects of it */
+    const uint8_t build = 0
+#ifdef PLUTO_ETL_ENABLE
+      | (1 << 0)
+#endif
+#ifdef PLUTO_ILP_ENABLE
+      | (1 << 1)
+#endif
+#ifdef PLUTO_USE_GLOBAL
+      | (1 << 2)
+#endif
+#ifdef PLUTO_NO_UTF8
+      | (1 << 3)
+#endif
+      ;
+    const uint8_t format[] = {
+      LUAC_VERSION, LUAC_FORMAT,
+      sizeof(Instruction), sizeof(lua_Integer), sizeof(lua_Number),
+      uint8_t(prefs), uint8_t(prefs >> 8), uint8_t(prefs >> 16),
+      NUM_OPCODES, build,
+    };
+    st.append(PLUTO_VERSION, sizeof(PLUTO_VERSION));
+    st.append(format, sizeof(format));
+    /* the compiler that built us, since code generation may change between builds of the same version */
+#if defined(__VERSION__)
+    st.append(__VERSION__, sizeof(__VERSION__));
+#elif defined(_MSC_FULL_VER)
+    const uint32_t msc = _MSC_FULL_VER;
+    st.append(&msc, sizeof(msc));
+#endif
+#ifdef PLUTO_PARSER_CACHE_BUILD_ID
+    st.append(PLUTO_PARSER_CACHE_BUILD_ID, sizeof(PLUTO_PARSER_CACHE_BUILD_ID));
+#endif
+  }
+
+  [[nodiscard]] static bool hashSource(CodeCache::Lookup& lk) noexcept {
+    size_t size;
+    soup::sha256::State st;
+    if (lk.size != 0) {
+      const void *data = soup::filesystem::createFileMapping(fs::u8path(lk.source), size);
+      if (!data)
+        return false;
+      st.append(data, size);
+      soup::filesystem::destroyFileMapping(data, size);
+    }
+    st.finalise();
+    st.getDigest(lk.digest);
+    lk.have_digest = true;
+    return true;
+  }
+
+  [[nodiscard]] static bool statSource(const std::string& path, uint64_t& size, int64_t& mtime) noexcept {
+    std::error_code ec;
+    const fs::path p = fs::u8path(path);
+    size = fs::file_size(p, ec);
+    if (ec) return false;
+    mtime = fs::last_write_time(p, ec).time_since_epoch().count();
+    return !ec;
+  }
+
+  /*
+  ** A file can be modified again within the resolution of its timestamp
+  ** without its size changing. If its mtime is that recent, don't vouch for
+  ** it, so the next load verifies the content hash instead.
+  */
+  [[nodiscard]] static int64_t trustedMtime(int64_t mtime) noexcept {
+    const auto now = fs::file_time_type::clock::now().time_since_epoch();
+    return (now - fs::file_time_type::duration(mtime) < std::chrono::seconds(2)) ? 0 : mtime;
+  }
+
+  static void touch(const std::string& path) noexcept {
+    std::error_code ec;
+    fs::last_write_time(fs::u8path(path), fs::file_time_type::clock::now(), ec);
+  }
+
+  FILE *CodeCache::open(lua_State *L, const char *filename, size_t filename_len, Lookup& lk) {
+    lk.source.assign(filename, filename_len);
+    if (!usable() || !statSource(lk.source, lk.size, lk.mtime))
+      return nullptr;  /* lk.entry stays empty, so nothing will be stored either */
+
+    std::error_code ec;
+    const fs::path abs = fs::absolute(fs::u8path(lk.source), ec);
+    if (ec) return nullptr;
+    const std::string key = soup::string::fixType(abs.u8string());
+    soup::sha256::State st;
+    st.append(key.data(), key.size() + 1);
+    appendCompilerTag(st, L);
+    st.finalise();
+    uint8_t id[soup::sha256::DIGEST_BYTES];
+    st.getDigest(id);
+    char name[32 + 4];
+    soup::string::bin2hexAt(name, (const char*)id, 16, soup::string::charset_hex_lower);
+    memcpy(name + 32, ENTRY_EXT, 4);
+    lk.entry = soup::string::fixType((fs::u8path(directory()) / std::string_view(name, sizeof(name))).u8string());
+
+    FILE *fh = luaL_fopen(lk.entry.data(), lk.entry.size(), "rb", sizeof("rb") - sizeof(""));
+    if (fh == nullptr)
+      return nullptr;
+    EntryHeader h;
+    if (fread(&h, sizeof(h), 1, fh) == 1 && memcmp(h.magic, ENTRY_MAGIC, sizeof(ENTRY_MAGIC)) == 0 && h.size == lk.size) {
+      if (h.mtime == lk.mtime && h.mtime != 0) {  /* metadata unchanged? */
+        touch(lk.entry);
+        lk.entry.clear();
+        return fh;
+      }
+      if (hashSource(lk) && memcmp(h.digest, lk.digest, sizeof(h.digest)) == 0) {  /* touched, but same content? */
+        if (FILE *wh = luaL_fopen(lk.entry.data(), lk.entry.size(), "r+b", sizeof("r+b") - sizeof(""))) {
+          h.mtime = trustedMtime(lk.mtime);
+          fwrite(&h, sizeof(h), 1, wh);  /* also bumps the entry's mtime for LRU */
+          fclose(wh);
+        }
+        lk.entry.clear();
+        return fh;
+      }
+    }
+    fclose(fh);
+    return nullptr;
+  }
+
+  /*
+  ** Tracks how many bytes the cache directory holds. The directory is scanned
+  ** once per process, after which writes are accounted for incrementally;
+  ** other processes writing to the same directory are caught up with at the
+  ** next eviction, which rescans.
+  */
+  static std::mutex usage_mtx;
+  static bool usage_known = false;
+  static uintmax_t usage = 0;
+
+  /* Only finished entries; other processes' '.plc.*.tmp' files may still be being written. */
+  [[nodiscard]] static bool isCacheFile(const fs::directory_entry& e) {
+    const auto name = e.path().filename().u8string();
+    const size_t extlen = strlen(ENTRY_EXT);
+    return name.size() >= extlen && name.compare(name.size() - extlen, extlen, ENTRY_EXT) == 0;
+  }
+
+  static void scanUsage() {
+    std::error_code ec;
+    usage = 0;
+    for (fs::directory_iterator it(fs::u8path(CodeCache::directory()), ec), end; !ec && it != end; it.increment(ec)) {
+      std::error_code fec;
+      if (isCacheFile(*it) && it->is_regular_file(fec)) {
+        const uintmax_t size = it->file_size(fec);
+        if (!fec) usage += size;
+      }
+    }
+    usage_known = true;
+  }
+
+  /* Removes the least recently used files until the cache is at 3/4 of its budget. */
+  static void evict() {
+    struct File {
+      fs::path path;
+      fs::file_time_type mtime;
+      uintmax_t size;
+    };
+    std::vector<File> files;
+    std::error_code ec;
+    usage = 0;
+    for (fs::directory_iterator it(fs::u8path(CodeCache::directory()), ec), end; !ec && it != end; it.increment(ec)) {
+      std::error_code fec;
+      if (!isCacheFile(*it) || !it->is_regular_file(fec))
+        continue;
+      File f{ it->path(), it->last_write_time(fec), it->file_size(fec) };
+      if (fec) continue;
+      usage += f.size;
+      files.emplace_back(std::move(f));
+    }
+    std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+      return a.mtime < b.mtime;
+    });
+    const uintmax_t target = (uintmax_t)PLUTO_PARSER_CACHE_SIZE / 4 * 3;
+    for (const auto& f : files) {
+      if (usage <= target) break;
+      if (fs::remove(f.path, ec))
+        usage -= f.size;
+    }
+  }
+
+  static int writer(lua_State *L, const void *p, size_t size, void *u) {
+    UNUSED(L);
+    return (fwrite(p, size, 1, (FILE*)u) != 1) && (size != 0);
+  }
+
+  void CodeCache::store(lua_State *L, const Proto *f, Lookup& lk) {
+    if (lk.entry.empty() || (!lk.have_digest && !hashSource(lk)))
+      return;
+
+    /* if the source changed while it was being compiled, the bytecode may not match the digest */
+    uint64_t size;
+    int64_t mtime;
+    if (!statSource(lk.source, size, mtime) || size != lk.size || mtime != lk.mtime)
+      return;
+
+    EntryHeader h;
+    memcpy(h.magic, ENTRY_MAGIC, sizeof(ENTRY_MAGIC));
+    h.size = lk.size;
+    h.mtime = trustedMtime(lk.mtime);
+    memcpy(h.digest, lk.digest, sizeof(h.digest));
+
+    static std::atomic<uint32_t> counter{ 0 };
+    std::string tmp = lk.entry;
+    tmp.push_back('.');
+    tmp.append(std::to_string((uint64_t)std::chrono::steady_clock::now().time_since_epoch().count() ^ ((uint64_t)(uintptr_t)&tmp << 16)));
+    tmp.push_back('.');
+    tmp.append(std::to_string(counter.fetch_add(1)));
+    tmp.append(".tmp");
+
+    FILE *D = luaL_fopen(tmp.data(), tmp.size(), "wb", sizeof("wb") - sizeof(""));
+    if (D == nullptr)
+      return;
+    bool ok = (fwrite(&h, sizeof(h), 1, D) == 1);
+    if (ok) {
+      lua_lock(L);
+      ok = (luaU_dump(L, f, writer, D, false) == 0);
+      lua_unlock(L);
+    }
+    ok &= (ferror(D) == 0);
+    ok &= (fclose(D) == 0);
+
+    std::error_code ec;
+    const fs::path tmp_path = fs::u8path(tmp);
+    const fs::path entry_path = fs::u8path(lk.entry);
+    if (!ok) {
+      fs::remove(tmp_path, ec);
+      return;
+    }
+    const uintmax_t written = fs::file_size(tmp_path, ec);
+    const uintmax_t replaced = fs::exists(entry_path, ec) ? fs::file_size(entry_path, ec) : 0;
+    fs::rename(tmp_path, entry_path, ec);  /* atomically replaces any existing entry */
+    if (ec) {
+      fs::remove(tmp_path, ec);
+      return;
+    }
+
+    std::lock_guard lock(usage_mtx);
+    if (!usage_known)
+      scanUsage();
+    else
+      usage = usage + written - std::min(usage + written, replaced);
+    if (usage > (uintmax_t)PLUTO_PARSER_CACHE_SIZE)
+      evict();
+  }
+}
+
+#endif
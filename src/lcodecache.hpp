@@ -0,0 +1,71 @@
+#pragma once
+
+/*
+** Persistent bytecode cache for luaL_loadfilex, enabled by PLUTO_PARSER_CACHE.
+**
+** Each source file gets one entry in the cache directory, named after a hash
+** of its absolute path and everything that influences the produced bytecode
+** (Pluto version, bytecode format & keyword preferences). The entry starts
+** with the size, modification time & SHA-256 of the source it was compiled
+** from, so an unchanged file is recognised with two stat calls; the source is
+** only hashed when its metadata changed, and if the content turns out to be
+** the same, the entry is revalidated instead of recompiled.
+**
+** Entries are written to a temporary file and renamed into place, so readers
+** never see a partial entry, and the least recently used entries are evicted
+** once the directory exceeds PLUTO_PARSER_CACHE_SIZE bytes.
+*/
+
+#include "luaconf.h"
+
+#ifdef PLUTO_PARSER_CACHE
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "lobject.h"
+
+#ifndef PLUTO_PARSER_CACHE_SIZE
+#define PLUTO_PARSER_CACHE_SIZE (64 * 1024 * 1024)
+#endif
+
+namespace Pluto {
+  struct CodeCache {
+    struct Lookup {
+      std::string source;  /* UTF-8 path of the source file */
+      std::string entry;  /* UTF-8 path of the cache entry; empty if the entry is up-to-date or the source can't be cached */
+      uint64_t size;
+      int64_t mtime;
+      uint8_t digest[32];
+      bool have_digest = false;
+    };
+
+    /*
+    ** Returns the cache directory: $PLUTO_CACHE_DIR if set, otherwise
+    ** PLUTO_PARSER_CACHE_DIR if defined, otherwise "pluto-cache-<uid>"
+    ** ("pluto-cache" on Windows) in the system's temporary directory.
+    */
+    [[nodiscard]] static const std::string& directory();
+
+    /*
+    ** Creates the cache directory with mode 0700 if needed, and returns
+    ** whether its entries can be trusted: on POSIX systems, it must be owned
+    ** by the effective user (or root) and not writable by group or others,
+    ** as its entries are executed without being parsed.
+    */
+    [[nodiscard]] static bool usable();
+
+    /*
+    ** Opens the up-to-date cache entry for 'filename', positioned at the start
+    ** of the bytecode, or returns nullptr, in which case the caller should
+    ** compile the source and pass the result & 'lk' to 'store'.
+    */
+    [[nodiscard]] static FILE *open(lua_State *L, const char *filename, size_t filename_len, Lookup& lk);
+
+    /* Writes the entry described by 'lk'. Failures are silently ignored; the cache is best-effort. */
+    static void store(lua_State *L, const Proto *f, Lookup& lk);
+  };
+}
+
+#endif
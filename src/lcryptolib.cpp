@@ -1,7 +1,10 @@
 #define LUA_LIB
 
+#include <cstring> // memcpy
+#include <memory> // destroy_at
 #include <random> // uniform_int_distribution
 #include <sstream>
+#include <vector>
 
 #include "lua.h"
 #include "lualib.h"
@@ -9,13 +12,19 @@
 #include "luaconf.h"
 #include "lauxlib.h"
 #include "lstring.h"
+#include "ldo.h"
 #include "lcryptolib.hpp"
+#include "lbufferlib.hpp"
+#include "ldeflate.hpp"
+#include "lmultihash.hpp"
 
 #include "vendor/Soup/soup/adler32.hpp"
 #include "vendor/Soup/soup/aes.hpp"
+#include "vendor/Soup/soup/CpuInfo.hpp"
 #include "vendor/Soup/soup/crc32.hpp"
 #include "vendor/Soup/soup/crc32c.hpp"
 #include "vendor/Soup/soup/deflate.hpp"
+#include "vendor/Soup/soup/filesystem.hpp"
 #include "vendor/Soup/soup/HardwareRng.hpp"
 #include "vendor/Soup/soup/ripemd160.hpp"
 #include "vendor/Soup/soup/rsa.hpp"
@@ -25,6 +34,10 @@
 #include "vendor/Soup/soup/sha512.hpp"
 #include "vendor/Soup/soup/string.hpp"
 
+#if SOUP_POSIX
+#include <sys/mman.h> // madvise
+#endif
+
 
 static int fnv1(lua_State *L)
 {
@@ -33,7 +46,7 @@ static int fnv1(lua_State *L)
   uint64_t hash     = FNV_offset_basis;
   
   size_t l;
-  const char* s = luaL_checklstring(L, 1, &l);
+  const char* s = pluto_checkbytes(L, 1, &l);
   for (; l--; ++s) {
     hash *= FNV_prime;
     hash ^= (uint8_t)*s;
@@ -51,7 +64,7 @@ static int fnv1a(lua_State *L)
   uint64_t hash     = FNV_offset_basis;
   
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
+  const char *s = pluto_checkbytes(L, 1, &l);
   for (; l--; ++s) {
     hash ^= (uint8_t)*s;
     hash *= FNV_prime;
@@ -66,7 +79,7 @@ static int joaat(lua_State *L)
 {
   /* get input */
   size_t size;
-  const char* data = luaL_checklstring(L, 1, &size);
+  const char* data = pluto_checkbytes(L, 1, &size);
 
   /* do partial on input */
   size_t v3 = 0;
@@ -91,7 +104,7 @@ static int times33(lua_State *L)
   unsigned long hash = 0;
  
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
+  const char *s = pluto_checkbytes(L, 1, &l);
   for (; l--; ++s) {
     hash = (hash * 33) ^ (unsigned long)*s;
   }
@@ -104,7 +117,7 @@ static int times33(lua_State *L)
 static int murmur1(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = pluto_checkbytes(L, 1, &textLen);
   const auto seed = (unsigned int)luaL_optinteger(L, 2, 0);
   const auto hash = MurmurHash1Aligned(text, (int)textLen, seed);
   lua_pushinteger(L, hash);
@@ -117,7 +130,7 @@ static int murmur1(lua_State *L)
 static int murmur2(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = pluto_checkbytes(L, 1, &textLen);
   const auto seed = luaL_optinteger(L, 2, 0);
   uint32_t hash;
 
@@ -135,7 +148,7 @@ static int murmur2(lua_State *L)
 static int murmur64a(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = pluto_checkbytes(L, 1, &textLen);
   const auto seed = (uint64_t)luaL_optinteger(L, 2, 0);
   const auto hash = MurmurHash64A(text, (int)textLen, seed);
   lua_pushinteger(L, hash);
@@ -147,7 +160,7 @@ static int murmur64a(lua_State *L)
 static int murmur64b(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = pluto_checkbytes(L, 1, &textLen);
   const auto seed = (uint64_t)luaL_optinteger(L, 2, 0);
   const auto hash = MurmurHash64B(text, (int)textLen, seed);
   lua_pushinteger(L, hash);
@@ -158,7 +171,7 @@ static int murmur64b(lua_State *L)
 static int murmur2a(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = pluto_checkbytes(L, 1, &textLen);
   const auto seed = (uint32_t)luaL_optinteger(L, 2, 0);
   const auto hash = MurmurHash2A(text, (int)textLen, seed);
   lua_pushinteger(L, hash);
@@ -170,7 +183,7 @@ static int murmur2a(lua_State *L)
 static int murmur2neutral(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = pluto_checkbytes(L, 1, &textLen);
   const auto seed = (uint32_t)luaL_optinteger(L, 2, 0);
   const auto hash = MurmurHashNeutral2(text, (int)textLen, seed);
   lua_pushinteger(L, hash);
@@ -182,7 +195,7 @@ static int murmur2neutral(lua_State *L)
 static int superfasthash(lua_State *L)
 {
   size_t textLen;
-  const auto text = luaL_checklstring(L, 1, &textLen);
+  const auto text = pluto_checkbytes(L, 1, &textLen);
   const auto hash = SuperFastHash((const signed char*)text, (int)textLen);
   lua_pushinteger(L, hash);
   return 1;
@@ -217,10 +230,454 @@ static int sdbm(lua_State *L)
 }
 
 
+/* pushes 'len' digest bytes, either as-is or as lowercase hex */
+static void pushdigest (lua_State *L, const uint8_t *digest, size_t len, bool binary) {
+  char shrtbuf[LUAI_MAXSHORTLEN];
+  if (binary) {
+    lua_pushlstring(L, (const char*)digest, len);
+  }
+  else {
+    char *out = plutoS_prealloc(L, shrtbuf, len * 2);
+    soup::string::bin2hexAt(out, (const char*)digest, len, soup::string::charset_hex_lower);
+    plutoS_commit(L, out, len * 2);
+  }
+}
+
+
+/*
+** Incremental hashing. Calling crypto.sha256 & co. without arguments returns
+** a "pluto:hashstate" object with :update(data), :digest(binary) and :clone().
+** :digest finalises a copy of the state, so more data may be added afterwards.
+*/
+struct HashState {
+  virtual ~HashState() = default;
+  virtual void update(const uint8_t *data, size_t size) = 0;
+  virtual void pushdigest(lua_State *L, bool binary) const = 0;
+  virtual void pushclone(lua_State *L) const = 0;
+};
+
+
+[[nodiscard]] static HashState *checkhashstate (lua_State *L, int i) {
+  return (HashState*)luaL_checkudata(L, i, "pluto:hashstate");
+}
+
+
+static int hashstate_update (lua_State *L) {
+  HashState *st = checkhashstate(L, 1);
+  size_t len;
+  const char *data = pluto_checkbytes(L, 2, &len);
+  st->update((const uint8_t*)data, len);
+  lua_settop(L, 1);
+  return 1;  /* allow chaining */
+}
+
+
+static int hashstate_digest (lua_State *L) {
+  checkhashstate(L, 1)->pushdigest(L, lua_istrue(L, 2));
+  return 1;
+}
+
+
+static int hashstate_clone (lua_State *L) {
+  checkhashstate(L, 1)->pushclone(L);
+  return 1;
+}
+
+
+template <typename T, typename... Args>
+static T *pushhashstate (lua_State *L, Args&&... args) {
+  T *st = new (lua_newuserdata(L, sizeof(T))) T(std::forward<Args>(args)...);
+  if (luaL_newmetatable(L, "pluto:hashstate")) {
+    lua_pushliteral(L, "__index");
+    lua_newtable(L);
+    lua_pushliteral(L, "update");
+    lua_pushcfunction(L, hashstate_update);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "digest");
+    lua_pushcfunction(L, hashstate_digest);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "clone");
+    lua_pushcfunction(L, hashstate_clone);
+    lua_settable(L, -3);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__gc");
+    lua_pushcfunction(L, [](lua_State *L) {
+      std::destroy_at<>(checkhashstate(L, 1));
+      return 0;
+    });
+    lua_settable(L, -3);
+  }
+  lua_setmetatable(L, -2);
+  return st;
+}
+
+
+template <typename Self>
+struct HashStateBase : public HashState {
+  void pushclone(lua_State *L) const final {
+    pushhashstate<Self>(L, static_cast<const Self&>(*this));
+  }
+};
+
+
+template <typename T>
+struct ShaHashState : public HashStateBase<ShaHashState<T>> {
+  static constexpr size_t DIGEST_BYTES = T::DIGEST_BYTES;
+
+  typename T::State st;
+
+  void update(const uint8_t *data, size_t size) final {
+    st.append(data, size);
+  }
+
+  void digest(uint8_t *out) const {
+    auto fin = st;
+    fin.finalise();
+    fin.getDigest(out);
+  }
+
+  void pushdigest(lua_State *L, bool binary) const final {
+    uint8_t out[DIGEST_BYTES];
+    digest(out);
+    ::pushdigest(L, out, sizeof(out), binary);
+  }
+};
+
+
+struct Md5HashState : public HashStateBase<Md5HashState> {
+  static constexpr size_t DIGEST_BYTES = 16;
+
+  md5_context ctx;
+
+  Md5HashState() {
+    md5_starts(&ctx);
+  }
+
+  void update(const uint8_t *data, size_t size) final {
+    while (size != 0) {  /* md5_update takes an int */
+      const int chunk = (size > 0x40000000 ? 0x40000000 : (int)size);
+      md5_update(&ctx, (unsigned char*)data, chunk);
+      data += chunk;
+      size -= chunk;
+    }
+  }
+
+  void digest(uint8_t *out) const {
+    md5_context fin = ctx;
+    md5_finish(&fin, out);
+  }
+
+  void pushdigest(lua_State *L, bool binary) const final {
+    uint8_t out[DIGEST_BYTES];
+    digest(out);
+    ::pushdigest(L, out, sizeof(out), binary);
+  }
+};
+
+
+/* the block functions behind soup::ripemd160, defined in Soup's ripemd160.cpp; MDbuf is 5 words, X is one 64-byte block as 16 little-endian words */
+NAMESPACE_SOUP {
+  void MDinit(uint32_t *MDbuf);
+  void compress(uint32_t *MDbuf, uint32_t *X);
+  void MDfinish(uint32_t *MDbuf, const uint8_t *strptr, uint32_t lswlen, uint32_t mswlen);
+}
+
+struct Ripemd160HashState : public HashStateBase<Ripemd160HashState> {
+  static constexpr size_t DIGEST_BYTES = 20;
+
+  uint32_t MDbuf[5];
+  uint8_t block[64];
+  uint64_t total = 0;
+
+  Ripemd160HashState() {
+    soup::MDinit(MDbuf);
+  }
+
+  void update(const uint8_t *data, size_t size) final {
+    while (size != 0) {
+      const size_t used = (size_t)(total & 63);
+      const size_t take = (size < 64 - used ? size : 64 - used);
+      memcpy(block + used, data, take);
+      total += take;
+      data += take;
+      size -= take;
+      if (used + take == 64) {
+        uint32_t X[16];
+        for (int i = 0; i != 16; ++i)
+          X[i] = (uint32_t)block[i * 4] | ((uint32_t)block[i * 4 + 1] << 8) | ((uint32_t)block[i * 4 + 2] << 16) | ((uint32_t)block[i * 4 + 3] << 24);
+        soup::compress(MDbuf, X);
+      }
+    }
+  }
+
+  void digest(uint8_t *out) const {
+    uint32_t fin[5];
+    memcpy(fin, MDbuf, sizeof(fin));
+    soup::MDfinish(fin, block, (uint32_t)total, (uint32_t)(total >> 32));
+    for (int i = 0; i != 5; ++i) {
+      out[i * 4] = (uint8_t)fin[i];
+      out[i * 4 + 1] = (uint8_t)(fin[i] >> 8);
+      out[i * 4 + 2] = (uint8_t)(fin[i] >> 16);
+      out[i * 4 + 3] = (uint8_t)(fin[i] >> 24);
+    }
+  }
+
+  void pushdigest(lua_State *L, bool binary) const final {
+    uint8_t out[DIGEST_BYTES];
+    digest(out);
+    ::pushdigest(L, out, sizeof(out), binary);
+  }
+};
+
+
+/* for checksums that take the previous value as their initial value; the digest is an integer */
+template <uint32_t(*hash)(const uint8_t*, size_t, uint32_t), uint32_t initial>
+struct ChecksumHashState : public HashStateBase<ChecksumHashState<hash, initial>> {
+  static constexpr size_t DIGEST_BYTES = 4;
+
+  uint32_t value = initial;
+
+  void update(const uint8_t *data, size_t size) final {
+    value = hash(data, size, value);
+  }
+
+  void digest(uint8_t *out) const {  /* big-endian, for crypto.hashmany */
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+  }
+
+  void pushdigest(lua_State *L, bool) const final {
+    lua_pushinteger(L, value);
+  }
+};
+
+using Crc32HashState = ChecksumHashState<&soup::crc32::hash, soup::crc32::INITIAL>;
+using Crc32cHashState = ChecksumHashState<&soup::crc32c::hash, 0>;
+using Adler32HashState = ChecksumHashState<&soup::adler32::hash, soup::adler32::INITIAL>;
+
+
+static const char *const hashstate_names[] = {
+  "sha1", "sha256", "sha384", "sha512", "md5", "ripemd160", "crc32", "crc32c", "adler32", nullptr
+};
+
+static void pushnewhashstate (lua_State *L, int algo) {
+  switch (algo) {
+    case 0: pushhashstate<ShaHashState<soup::sha1>>(L); break;
+    case 1: pushhashstate<ShaHashState<soup::sha256>>(L); break;
+    case 2: pushhashstate<ShaHashState<soup::sha384>>(L); break;
+    case 3: pushhashstate<ShaHashState<soup::sha512>>(L); break;
+    case 4: pushhashstate<Md5HashState>(L); break;
+    case 5: pushhashstate<Ripemd160HashState>(L); break;
+    case 6: pushhashstate<Crc32HashState>(L); break;
+    case 7: pushhashstate<Crc32cHashState>(L); break;
+    default: pushhashstate<Adler32HashState>(L); break;
+  }
+}
+
+
+/* crypto.hashfile(path, algo = "sha256", binary = false) hashes a file through a memory mapping, so it never has to be loaded into a string */
+static int l_hashfile (lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  pushnewhashstate(L, luaL_checkoption(L, 2, "sha256", hashstate_names));
+  HashState *st = checkhashstate(L, -1);
+  size_t len;
+#if SOUP_CPP20
+  const void *addr = soup::filesystem::createFileMapping(soup::string::toUtf8Type(path), len);
+#else
+  const void *addr = soup::filesystem::createFileMapping(std::filesystem::u8path(path), len);
+#endif
+  if (addr == nullptr)
+    luaL_error(L, "failed to open %s", path);
+#if SOUP_POSIX
+  if (len != 0)
+    madvise(const_cast<void*>(addr), len, MADV_SEQUENTIAL);
+#endif
+  constexpr size_t WINDOW = 16 * 1024 * 1024;
+  for (size_t off = 0; off < len; off += WINDOW) {
+    const size_t n = (len - off < WINDOW ? len - off : WINDOW);
+    st->update((const uint8_t*)addr + off, n);
+#if SOUP_POSIX
+    /* we won't look at these pages again, let them go so memory use stays flat */
+    madvise((uint8_t*)const_cast<void*>(addr) + off, n, MADV_DONTNEED);
+#endif
+  }
+  soup::filesystem::destroyFileMapping(addr, len);
+  st->pushdigest(L, lua_istrue(L, 3));
+  return 1;
+}
+
+
+/*
+** crypto.hashmany(algo, list) hashes each string or buffer in 'list'.
+** crypto.hashmany(algo, data, offsets) hashes slices of a single string or buffer instead,
+** where 'offsets' is either a list of the 1-based positions the slices start at or a slice size.
+** The binary digests are returned back-to-back in one string; checksums are 4 bytes big-endian.
+*/
+using HashInput = Pluto::MultiHash::Input;
+
+template <typename T>
+static void hasheach (const HashInput *msgs, size_t n, uint8_t *out) {
+  for (size_t i = 0; i != n; ++i) {
+    T st;
+    st.update(msgs[i].data, msgs[i].size);
+    st.digest(out + i * T::DIGEST_BYTES);
+  }
+}
+
+struct HashManyAlgo {
+  size_t digest_bytes;
+  void (*each)(const HashInput*, size_t, uint8_t*);
+  void (*multi)(const HashInput*, size_t, uint8_t*);
+  const char *(*multibackend)();
+};
+
+static const HashManyAlgo hashmany_algos[] = {  /* same order as hashstate_names */
+  { 20, &hasheach<ShaHashState<soup::sha1>>, nullptr, nullptr },
+  { 32, &hasheach<ShaHashState<soup::sha256>>, &Pluto::MultiHash::sha256, &Pluto::MultiHash::sha256Backend },
+  { 48, &hasheach<ShaHashState<soup::sha384>>, nullptr, nullptr },
+  { 64, &hasheach<ShaHashState<soup::sha512>>, nullptr, nullptr },
+  { 16, &hasheach<Md5HashState>, &Pluto::MultiHash::md5, &Pluto::MultiHash::md5Backend },
+  { 20, &hasheach<Ripemd160HashState>, nullptr, nullptr },
+  { 4, &hasheach<Crc32HashState>, nullptr, nullptr },
+  { 4, &hasheach<Crc32cHashState>, &Pluto::MultiHash::crc32c, &Pluto::MultiHash::crc32cBackend },
+  { 4, &hasheach<Adler32HashState>, nullptr, nullptr },
+};
+
+/* 'n' comes from '__len', so it is only trusted up to a point; beyond that, 'msgs' grows as elements are read */
+static void reservehashinputs (lua_State *L, std::vector<HashInput>& msgs, lua_Integer n, int arg) {
+  constexpr lua_Integer RESERVE_MAX = 4096;
+  luaL_argcheck(L, n >= 0, arg, "invalid length");
+  msgs.reserve((size_t)(n < RESERVE_MAX ? n : RESERVE_MAX));
+}
+
+static void checkhashinputs (lua_State *L, std::vector<HashInput>& msgs) {
+  if (lua_istable(L, 2)) {
+    luaL_argcheck(L, lua_isnoneornil(L, 3), 3, "offsets only apply to a single string or buffer");
+    const lua_Integer n = luaL_len(L, 2);
+    reservehashinputs(L, msgs, n, 2);
+    for (lua_Integer i = 1; i <= n; ++i) {
+      lua_rawgeti(L, 2, i);  /* the list keeps the element alive */
+      size_t len;
+      const char *data = pluto_tobytes(L, -1, &len);
+      if (l_unlikely(data == nullptr))
+        luaL_error(L, "bad element #%d in list (string or buffer expected, got %s)", (int)i, luaL_typename(L, -1));
+      msgs.emplace_back(HashInput{ (const uint8_t*)data, len });
+      lua_pop(L, 1);
+    }
+    return;
+  }
+  size_t len;
+  const auto data = (const uint8_t*)pluto_checkbytes(L, 2, &len);
+  if (lua_isnoneornil(L, 3)) {
+    msgs.emplace_back(HashInput{ data, len });
+  }
+  else if (lua_isinteger(L, 3)) {
+    const lua_Integer size = lua_tointeger(L, 3);
+    luaL_argcheck(L, size > 0, 3, "slice size must be positive");
+    msgs.reserve(len / (size_t)size + 1);
+    for (size_t off = 0; off < len; off += (size_t)size)
+      msgs.emplace_back(HashInput{ data + off, (len - off < (size_t)size ? len - off : (size_t)size) });
+  }
+  else {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    const lua_Integer n = luaL_len(L, 3);
+    reservehashinputs(L, msgs, n, 3);
+    size_t prev = 0;
+    for (lua_Integer i = 1; i <= n; ++i) {
+      lua_rawgeti(L, 3, i);
+      int isnum;
+      const lua_Integer pos = lua_tointegerx(L, -1, &isnum);
+      lua_pop(L, 1);
+      if (l_unlikely(!isnum || pos < 1 || (size_t)pos > len + 1 || (size_t)pos - 1 < prev))
+        luaL_error(L, "bad offset #%d (offsets must be ascending positions within the data)", (int)i);
+      if (i != 1)
+        msgs.back().size = (size_t)pos - 1 - prev;
+      msgs.emplace_back(HashInput{ data + pos - 1, len - (size_t)(pos - 1) });
+      prev = (size_t)pos - 1;
+    }
+  }
+}
+
+static int l_hashmany (lua_State *L) {
+  const HashManyAlgo& algo = hashmany_algos[luaL_checkoption(L, 1, nullptr, hashstate_names)];
+  try {
+    std::vector<HashInput> msgs;
+    checkhashinputs(L, msgs);
+    luaL_Buffer b;
+    const size_t len = msgs.size() * algo.digest_bytes;
+    auto out = (uint8_t*)luaL_buffinitsize(L, &b, len);
+    if (algo.multi && msgs.size() > 1 && algo.multibackend())
+      algo.multi(msgs.data(), msgs.size(), out);
+    else
+      algo.each(msgs.data(), msgs.size(), out);
+    luaL_pushresultsize(&b, len);
+  }
+  catch (std::bad_alloc&) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  return 1;
+}
+
+/* crypto.backend(algo) names the implementation crypto.hashmany uses for 'algo' on this machine */
+static int l_backend (lua_State *L) {
+  const int algo = luaL_checkoption(L, 1, nullptr, hashstate_names);
+  if (hashmany_algos[algo].multibackend) {
+    if (const char *name = hashmany_algos[algo].multibackend()) {
+      lua_pushstring(L, name);
+      return 1;
+    }
+  }
+  const char *name = "scalar";
+#if !SOUP_WASM && SOUP_BITS == 64
+  const soup::CpuInfo& cpu = soup::CpuInfo::get();
+  switch (algo) {
+#if SOUP_X86
+    case 0: case 1:  /* sha1, sha256 */
+      if (cpu.supportsSHA() && cpu.supportsSSE4_1())
+        name = "sha-ni";
+      break;
+    case 6:  /* crc32 */
+      if (cpu.supportsPCLMULQDQ() && cpu.supportsSSE4_1())
+        name = "pclmul";
+      break;
+    case 7:  /* crc32c */
+      if (cpu.supportsSSE4_2())
+        name = "sse4.2";
+      break;
+#elif SOUP_ARM
+    case 0:
+      if (cpu.armv8_sha1)
+        name = "armv8";
+      break;
+    case 1:
+      if (cpu.armv8_sha2)
+        name = "armv8";
+      break;
+    case 6:
+      if (cpu.armv8_crc32)
+        name = "armv8";
+      break;
+#endif
+    default:
+      (void)cpu;
+      break;
+  }
+#endif
+  lua_pushstring(L, name);
+  return 1;
+}
+
+
 static int md5(lua_State *L)
 {
+  if (lua_isnone(L, 1)) {
+    pushhashstate<Md5HashState>(L);
+    return 1;
+  }
   size_t len;
-  const auto str = luaL_checklstring(L, 1, &len);
+  const auto str = pluto_checkbytes(L, 1, &len);
   const bool binary = lua_istrue(L, 2);
 
   unsigned char buffer[16];
@@ -241,7 +698,7 @@ static int md5(lua_State *L)
 static int lookup3(lua_State *L)
 {
   size_t len;
-  const auto text = luaL_checklstring(L, 1, &len);
+  const auto text = pluto_checkbytes(L, 1, &len);
   const auto hash = lookup3_impl(text, (int)len, (uint32_t)luaL_optinteger(L, 2, 0));
   lua_pushinteger(L, hash);
   return 1;
@@ -250,8 +707,12 @@ static int lookup3(lua_State *L)
 
 static int crc32(lua_State *L)
 {
+  if (lua_isnone(L, 1)) {
+    pushhashstate<Crc32HashState>(L);
+    return 1;
+  }
   size_t len;
-  const auto text = luaL_checklstring(L, 1, &len);
+  const auto text = pluto_checkbytes(L, 1, &len);
   const auto hash = soup::crc32::hash((const uint8_t*)text, len, (uint32_t)luaL_optinteger(L, 2, 0));
   lua_pushinteger(L, hash);
   return 1;
@@ -260,8 +721,12 @@ static int crc32(lua_State *L)
 
 static int crc32c(lua_State *L)
 {
+  if (lua_isnone(L, 1)) {
+    pushhashstate<Crc32cHashState>(L);
+    return 1;
+  }
   size_t len;
-  const auto text = luaL_checklstring(L, 1, &len);
+  const auto text = pluto_checkbytes(L, 1, &len);
   const auto hash = soup::crc32c::hash((const uint8_t*)text, len, (uint32_t)luaL_optinteger(L, 2, 0));
   lua_pushinteger(L, hash);
   return 1;
@@ -273,7 +738,7 @@ static int crc32c(lua_State *L)
 static int lua(lua_State *L)
 {
   size_t l;
-  const auto text = luaL_checklstring(L, 1, &l);
+  const auto text = pluto_checkbytes(L, 1, &l);
   const auto hash = luaS_hash(text, l, (unsigned int)luaL_optinteger(L, 2, 0));
   lua_pushinteger(L, hash);
   return 1;
@@ -282,8 +747,12 @@ static int lua(lua_State *L)
 
 template <typename T>
 static int l_hashwithdigest (lua_State *L) {
+  if (lua_isnone(L, 1)) {
+    pushhashstate<ShaHashState<T>>(L);
+    return 1;
+  }
   size_t l;
-  const char *text = luaL_checklstring(L, 1, &l);
+  const char *text = pluto_checkbytes(L, 1, &l);
   const bool binary = lua_istrue(L, 2);
 
   typename T::State st;
@@ -419,7 +888,7 @@ static int l_encrypt (lua_State *L) {
   const char *mode = luaL_checklstring(L, 2, &mode_len);
   if (mode_len >= 7 && memcmp(mode, "aes-", 4) == 0) {
     size_t data_len;
-    const char *in_data = luaL_checklstring(L, 1, &data_len);
+    const char *in_data = pluto_checkbytes(L, 1, &data_len);
     char *data = reinterpret_cast<char*>(lua_newuserdata(L, data_len + 15 + 16));  /* need up to 15 for alignment and up to 16 for padding */
     if (reinterpret_cast<uintptr_t>(data) % 16) {  /* data is not aligned? */
       data = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(data) + (16 - (reinterpret_cast<uintptr_t>(data) % 16)));  /* align data */
@@ -552,7 +1021,7 @@ static int l_decrypt (lua_State *L) {
   const char *mode = luaL_checklstring(L, 2, &mode_len);
   if (mode_len >= 7 && memcmp(mode, "aes-", 4) == 0) {
     size_t data_len;
-    const char *in_data = luaL_checklstring(L, 1, &data_len);
+    const char *in_data = pluto_checkbytes(L, 1, &data_len);
     char *data = reinterpret_cast<char*>(lua_newuserdata(L, data_len + 15));  /* need up to 15 for alignment */
     if (reinterpret_cast<uintptr_t>(data) % 16) {  /* data is not aligned? */
       data = reinterpret_cast<char*>(reinterpret_cast<uintptr_t>(data) + (16 - (reinterpret_cast<uintptr_t>(data) % 16)));  /* align data */
@@ -743,8 +1212,12 @@ static int l_verify (lua_State *L) {
 
 
 static int l_adler32 (lua_State *L) {
+  if (lua_isnone(L, 1)) {
+    pushhashstate<Adler32HashState>(L);
+    return 1;
+  }
   size_t size;
-  const char *data = luaL_checklstring(L, 1, &size);
+  const char *data = pluto_checkbytes(L, 1, &size);
   lua_pushinteger(L, soup::adler32::hash(data, size));
   return 1;
 }
@@ -752,7 +1225,7 @@ static int l_adler32 (lua_State *L) {
 
 static int l_decompress (lua_State *L) {
   size_t size;
-  const char *data = luaL_checklstring(L, 1, &size);
+  const char *data = pluto_checkbytes(L, 1, &size);
   soup::deflate::DecompressResult res;
   if (lua_gettop(L) >= 2)
     res = soup::deflate::decompress(data, size, luaL_checkinteger(L, 2));
@@ -773,9 +1246,189 @@ static int l_decompress (lua_State *L) {
 }
 
 
+static const char *const deflate_formats[] = { "deflate", "zlib", "gzip", "auto", nullptr };
+
+
+[[nodiscard]] static int checkcompresslevel (lua_State *L, int i) {
+  const lua_Integer level = luaL_optinteger(L, i, Pluto::Deflater::DEFAULT_LEVEL);
+  luaL_argcheck(L, level >= 0 && level <= 9, i, "level must be between 0 and 9");
+  return (int)level;
+}
+
+
+[[nodiscard]] static Pluto::DeflateFormat checkcompressformat (lua_State *L, int i) {
+  const int format = luaL_checkoption(L, i, "deflate", deflate_formats);
+  luaL_argcheck(L, format != (int)Pluto::DeflateFormat::AUTO, i, "format must be 'deflate', 'zlib' or 'gzip'");
+  return (Pluto::DeflateFormat)format;
+}
+
+
+static int l_compress (lua_State *L) {
+  size_t size;
+  const char *data = pluto_checkbytes(L, 1, &size);
+  const int level = checkcompresslevel(L, 2);
+  const Pluto::DeflateFormat format = checkcompressformat(L, 3);
+  try {
+    Pluto::Deflater deflater(L, level, format);
+    std::string out;
+    deflater.write(data, size, out);
+    deflater.finish(out);
+    pluto_pushstring(L, out);
+  }
+  catch (std::bad_alloc&) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  return 1;
+}
+
+
+[[nodiscard]] static Pluto::Deflater *checkcompressor (lua_State *L, int i) {
+  auto deflater = (Pluto::Deflater*)luaL_checkudata(L, i, "pluto:compressor");
+  deflater->L = L;  /* the thread it was created on may be gone */
+  return deflater;
+}
+
+
+static int compressor_write (lua_State *L) {
+  Pluto::Deflater *deflater = checkcompressor(L, 1);
+  size_t size;
+  const char *data = pluto_checkbytes(L, 2, &size);
+  if (l_unlikely(deflater->isFinished()))
+    luaL_error(L, "compressor has already been finished");
+  try {
+    std::string out;
+    deflater->write(data, size, out);
+    pluto_pushstring(L, out);
+  }
+  catch (std::bad_alloc&) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  return 1;
+}
+
+
+static int compressor_finish (lua_State *L) {
+  Pluto::Deflater *deflater = checkcompressor(L, 1);
+  if (l_unlikely(deflater->isFinished()))
+    luaL_error(L, "compressor has already been finished");
+  try {
+    std::string out;
+    deflater->finish(out);
+    pluto_pushstring(L, out);
+  }
+  catch (std::bad_alloc&) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  return 1;
+}
+
+
+static int l_compressor (lua_State *L) {
+  const int level = checkcompresslevel(L, 1);
+  const Pluto::DeflateFormat format = checkcompressformat(L, 2);
+  void *ud = lua_newuserdata(L, sizeof(Pluto::Deflater));
+  try {
+    new (ud) Pluto::Deflater(L, level, format);
+  }
+  catch (std::bad_alloc&) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  if (luaL_newmetatable(L, "pluto:compressor")) {
+    lua_pushliteral(L, "__index");
+    lua_newtable(L);
+    lua_pushliteral(L, "write");
+    lua_pushcfunction(L, compressor_write);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "finish");
+    lua_pushcfunction(L, compressor_finish);
+    lua_settable(L, -3);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__gc");
+    lua_pushcfunction(L, [](lua_State *L) {
+      std::destroy_at<>(checkcompressor(L, 1));
+      return 0;
+    });
+    lua_settable(L, -3);
+  }
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
+[[nodiscard]] static Pluto::Inflater *checkdecompressor (lua_State *L, int i) {
+  auto inflater = (Pluto::Inflater*)luaL_checkudata(L, i, "pluto:decompressor");
+  inflater->L = L;  /* the thread it was created on may be gone */
+  return inflater;
+}
+
+
+static int decompressor_write (lua_State *L) {
+  Pluto::Inflater *inflater = checkdecompressor(L, 1);
+  size_t size;
+  const char *data = pluto_checkbytes(L, 2, &size);
+  std::string out;
+  Pluto::Inflater::Status status;
+  try {
+    status = inflater->write(data, size, out);
+  }
+  catch (std::bad_alloc&) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  if (l_unlikely(status == Pluto::Inflater::FAILED))
+    luaL_error(L, "decompression failed: %s", inflater->error);
+  pluto_pushstring(L, out);
+  return 1;
+}
+
+
+static int decompressor_finish (lua_State *L) {
+  if (l_unlikely(!checkdecompressor(L, 1)->isDone()))
+    luaL_error(L, "compressed stream is incomplete");
+  return 0;
+}
+
+
+static int decompressor_done (lua_State *L) {
+  lua_pushboolean(L, checkdecompressor(L, 1)->isDone());
+  return 1;
+}
+
+
+static int l_decompressor (lua_State *L) {
+  const auto format = (Pluto::DeflateFormat)luaL_checkoption(L, 1, "auto", deflate_formats);
+  new (lua_newuserdata(L, sizeof(Pluto::Inflater))) Pluto::Inflater(L, format);
+  if (luaL_newmetatable(L, "pluto:decompressor")) {
+    lua_pushliteral(L, "__index");
+    lua_newtable(L);
+    lua_pushliteral(L, "write");
+    lua_pushcfunction(L, decompressor_write);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "finish");
+    lua_pushcfunction(L, decompressor_finish);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "done");
+    lua_pushcfunction(L, decompressor_done);
+    lua_settable(L, -3);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__gc");
+    lua_pushcfunction(L, [](lua_State *L) {
+      std::destroy_at<>(checkdecompressor(L, 1));
+      return 0;
+    });
+    lua_settable(L, -3);
+  }
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+
 static int l_ripemd160 (lua_State *L) {
+  if (lua_isnone(L, 1)) {
+    pushhashstate<Ripemd160HashState>(L);
+    return 1;
+  }
   size_t size;
-  const char *data = luaL_checklstring(L, 1, &size);
+  const char *data = pluto_checkbytes(L, 1, &size);
   const bool binary = lua_istrue(L, 2);
   auto digest = soup::ripemd160(data, size);
   if (!binary) {
@@ -820,7 +1473,13 @@ static const luaL_Reg funcs_crypto[] = {
   {"verify", l_verify},
   {"adler32", l_adler32},
   {"decompress", l_decompress},
+  {"compress", l_compress},
+  {"compressor", l_compressor},
+  {"decompressor", l_decompressor},
   {"ripemd160", l_ripemd160},
+  {"hashfile", l_hashfile},
+  {"hashmany", l_hashmany},
+  {"backend", l_backend},
   {NULL, NULL}
 };
 
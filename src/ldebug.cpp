@@ -27,6 +27,7 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "lundump.h"
 #include "lvm.h"
 
 
@@ -98,8 +99,10 @@ int luaG_getfuncline (const Proto *f, int pc) {
 }
 
 
-static int getcurrentline (CallInfo *ci) {
-  return luaG_getfuncline(ci_func(ci)->p, currentpc(ci));
+static int getcurrentline (lua_State *L, CallInfo *ci) {
+  const Proto *p = ci_func(ci)->p;
+  luaU_checkdebug(L, p);
+  return luaG_getfuncline(p, currentpc(ci));
 }
 
 
@@ -202,8 +205,10 @@ const char *luaG_findlocal (lua_State *L, CallInfo *ci, int n, StkId *pos) {
   if (isLua(ci)) {
     if (n < 0)  /* access to vararg values? */
       return findvararg(ci, n, pos);
-    else
+    else {
+      luaU_checkdebug(L, ci_func(ci)->p);
       name = luaF_getlocalname(ci_func(ci)->p, n, currentpc(ci));
+    }
   }
   if (name == NULL) {  /* no 'standard' name? */
     StkId limit = (ci == L->ci) ? L->top.p : ci->next->func.p;
@@ -226,8 +231,11 @@ LUA_API const char *lua_getlocal (lua_State *L, const lua_Debug *ar, int n) {
   if (ar == NULL) {  /* information about non-active function? */
     if (!isLfunction(s2v(L->top.p - 1)))  /* not a Lua function? */
       name = NULL;
-    else  /* consider live variables at function start (parameters) */
-      name = luaF_getlocalname(clLvalue(s2v(L->top.p - 1))->p, n, 0);
+    else {  /* consider live variables at function start (parameters) */
+      const Proto *p = clLvalue(s2v(L->top.p - 1))->p;
+      luaU_checkdebug(L, p);
+      name = luaF_getlocalname(p, n, 0);
+    }
   }
   else {  /* active function; get information through 'ar' */
     StkId pos = NULL;  /* to avoid warnings */
@@ -325,6 +333,7 @@ static void collectvalidlines (lua_State *L, Closure *f) {
   else {
     const Proto *p = f->l.p;
     int currentline = p->linedefined;
+    luaU_checkdebug(L, p);
     Table *t = luaH_new(L);  /* new table to store active lines */
     sethvalue2s(L, L->top.p, t);  /* push it on stack */
     api_incr_top(L);
@@ -366,7 +375,7 @@ static int auxgetinfo (lua_State *L, const char *what, lua_Debug *ar,
         break;
       }
       case 'l': {
-        ar->currentline = (ci && isLua(ci)) ? getcurrentline(ci) : -1;
+        ar->currentline = (ci && isLua(ci)) ? getcurrentline(L, ci) : -1;
         if (ar->currentline == 'plin')
           ar->currentline = -1;
         break;
@@ -700,8 +709,10 @@ static const char *funcnamefromcall (lua_State *L, CallInfo *ci,
     *name = "__gc";
     return "metamethod";  /* report it as such */
   }
-  else if (isLua(ci))
+  else if (isLua(ci)) {
+    luaU_checkdebug(L, ci_func(ci)->p);
     return funcnamefromcode(L, ci_func(ci)->p, currentpc(ci), name);
+  }
   else
     return NULL;
 }
@@ -763,6 +774,7 @@ static const char *varinfo (lua_State *L, const TValue *o) {
   const char *name = NULL;  /* to avoid warnings */
   const char *kind = NULL;
   if (isLua(ci)) {
+    luaU_checkdebug(L, ci_func(ci)->p);
     kind = getupvalname(ci, o, &name);  /* check whether 'o' is an upvalue */
     if (!kind) {  /* not an upvalue? */
       int reg = instack(ci, o);  /* try a register */
@@ -870,7 +882,7 @@ bool luaG_addsrcinfo (lua_State *L, const char *msg) {
     ci = ci->previous;
   }
   if (ci) {
-    luaG_addinfo(L, msg, ci_func(ci)->p->source, getcurrentline(ci));
+    luaG_addinfo(L, msg, ci_func(ci)->p->source, getcurrentline(L, ci));
     return true;
   }
   return false;
@@ -899,7 +911,7 @@ l_noret luaG_runerror (lua_State *L, const char *fmt, ...) {
   msg = luaO_pushvfstring(L, fmt, argp);  /* format message */
   va_end(argp);
   if (isLua(ci)) {  /* if Lua function, add source:line information */
-    luaG_addinfo(L, msg, ci_func(ci)->p->source, getcurrentline(ci));
+    luaG_addinfo(L, msg, ci_func(ci)->p->source, getcurrentline(L, ci));
     setobjs2s(L, L->top.p - 2, L->top.p - 1);  /* remove 'msg' */
     L->top.p--;
   }
@@ -995,6 +1007,7 @@ int luaG_traceexec (lua_State *L, const Instruction *pc) {
   if (counthook)
     luaD_hook(L, LUA_HOOKCOUNT, -1, 0, 0);  /* call count hook */
   if (mask & LUA_MASKLINE) {
+    luaU_checkdebug(L, p);
     /* 'L->oldpc' may be invalid; use zero in this case */
     int oldpc = (L->oldpc < p->sizecode) ? L->oldpc : 0;
     int npci = pcRel(pc, p);
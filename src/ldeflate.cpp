@@ -0,0 +1,969 @@
+#include "ldeflate.hpp"
+
+#include <algorithm> // sort
+#include <cstring> // memcpy, memcmp
+
+#include "vendor/Soup/soup/adler32.hpp"
+#include "vendor/Soup/soup/crc32.hpp"
+
+namespace Pluto {
+  static constexpr size_t WSIZE = 32768;
+  static constexpr size_t MAX_DIST = WSIZE - 1;  /* keeps the hash chains unambiguous */
+  static constexpr size_t MIN_MATCH = 3;
+  static constexpr size_t MAX_MATCH = 258;
+  static constexpr size_t TOO_FAR = 4096;  /* a 3-byte match further away than this is not worth it */
+  static constexpr int HASH_BITS = 15;
+  static constexpr size_t BLOCK_INPUT = 64 * 1024;  /* input consumed per call to 'compress' while streaming */
+  static constexpr size_t BLOCK_SYMS = 16 * 1024;  /* symbols per block */
+
+  static constexpr uint16_t length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+  static constexpr uint8_t length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+  static constexpr uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+  static constexpr uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+  static constexpr uint8_t clen_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+  /* maps (length - 3) to its length code index, and (distance - 1) to its distance code */
+  static const struct CodeTables {
+    uint8_t length_code[256];
+    uint8_t dist_code[512];
+
+    CodeTables() noexcept {
+      for (int code = 0; code != 29; ++code) {
+        for (int len = length_base[code]; len < length_base[code] + (1 << length_extra[code]) && len <= 258; ++len)
+          length_code[len - 3] = (uint8_t)code;
+      }
+      for (int code = 0; code != 30; ++code) {
+        for (int d = dist_base[code]; d < dist_base[code] + (1 << dist_extra[code]); ++d) {
+          if (d <= 256)
+            dist_code[d - 1] = (uint8_t)code;
+          else
+            dist_code[256 + ((d - 1) >> 7)] = (uint8_t)code;
+        }
+      }
+    }
+
+    [[nodiscard]] int distCode(uint32_t dist) const noexcept {
+      return dist <= 256 ? dist_code[dist - 1] : dist_code[256 + ((dist - 1) >> 7)];
+    }
+  } tables;
+
+  /* same trade-offs as zlib's configuration_table */
+  struct LevelConfig {
+    uint16_t good_length;  /* shorten the lazy search when the current match is at least this long */
+    uint16_t max_lazy;  /* lazy: only look for a better match below this; greedy: only hash match bodies up to this */
+    uint16_t nice_length;  /* stop searching once a match is this long */
+    uint16_t max_chain;
+    bool lazy;
+  };
+
+  static constexpr LevelConfig level_config[10] = {
+    { 0, 0, 0, 0, false },  /* store */
+    { 4, 4, 8, 4, false },
+    { 4, 5, 16, 8, false },
+    { 4, 6, 32, 32, false },
+    { 4, 4, 16, 16, true },
+    { 8, 16, 32, 32, true },
+    { 8, 16, 128, 128, true },
+    { 8, 32, 128, 256, true },
+    { 32, 128, 258, 1024, true },
+    { 32, 258, 258, 4096, true },
+  };
+
+  [[nodiscard]] static uint32_t reverseBits(uint32_t code, int len) noexcept {
+    uint32_t res = 0;
+    while (len--) {
+      res = (res << 1) | (code & 1);
+      code >>= 1;
+    }
+    return res;
+  }
+
+  /* Computes length-limited Huffman code lengths for 'n' symbols with the given frequencies. */
+  static void buildLengths(const uint32_t *freq, int n, int limit, uint8_t *lens) {
+    std::vector<uint32_t> f(freq, freq + n);
+    std::vector<int> leaves;
+    std::vector<uint64_t> weight;
+    std::vector<int> parent;
+    while (true) {
+      leaves.clear();
+      for (int i = 0; i != n; ++i) {
+        lens[i] = 0;
+        if (f[i] != 0)
+          leaves.push_back(i);
+      }
+      if (leaves.empty())
+        return;
+      if (leaves.size() == 1) {
+        lens[leaves[0]] = 1;
+        return;
+      }
+      std::sort(leaves.begin(), leaves.end(), [&f](int a, int b) {
+        return f[a] != f[b] ? f[a] < f[b] : a < b;
+      });
+
+      /* two-queue construction: nodes 0..m-1 are the sorted leaves, internal nodes follow in creation order */
+      const size_t m = leaves.size();
+      weight.assign(2 * m - 1, 0);
+      parent.assign(2 * m - 1, 0);
+      for (size_t i = 0; i != m; ++i)
+        weight[i] = f[leaves[i]];
+      size_t nextleaf = 0, nextnode = m, created = m;
+      auto pick = [&]() {
+        if (nextleaf < m && (nextnode == created || weight[nextleaf] <= weight[nextnode]))
+          return nextleaf++;
+        return nextnode++;
+      };
+      while (created != 2 * m - 1) {
+        const size_t a = pick();
+        const size_t b = pick();
+        weight[created] = weight[a] + weight[b];
+        parent[a] = (int)created;
+        parent[b] = (int)created;
+        ++created;
+      }
+
+      /* depths, from the root down */
+      std::vector<int> depth(2 * m - 1, 0);
+      int maxdepth = 0;
+      for (size_t i = 2 * m - 1; i-- != 0; ) {
+        if (i != 2 * m - 2)
+          depth[i] = depth[parent[i]] + 1;
+        if (i < m && depth[i] > maxdepth)
+          maxdepth = depth[i];
+      }
+      if (maxdepth <= limit) {
+        for (size_t i = 0; i != m; ++i)
+          lens[leaves[i]] = (uint8_t)depth[i];
+        return;
+      }
+
+      /* too deep; flatten the distribution and try again */
+      for (auto& x : f) {
+        if (x != 0)
+          x = (x >> 1) | 1;
+      }
+    }
+  }
+
+  /* Assigns canonical codes, bit-reversed for LSB-first output. */
+  static void makeCodes(const uint8_t *lens, int n, uint16_t *codes) noexcept {
+    uint16_t bl_count[16]{};
+    for (int i = 0; i != n; ++i)
+      ++bl_count[lens[i]];
+    bl_count[0] = 0;
+    uint16_t next_code[16]{};
+    uint16_t code = 0;
+    for (int bits = 1; bits != 16; ++bits) {
+      code = (code + bl_count[bits - 1]) << 1;
+      next_code[bits] = code;
+    }
+    for (int i = 0; i != n; ++i) {
+      if (lens[i] != 0)
+        codes[i] = (uint16_t)reverseBits(next_code[lens[i]]++, lens[i]);
+    }
+  }
+
+  static void fixedLengths(uint8_t *litlens, uint8_t *distlens) noexcept {
+    int i = 0;
+    for (; i != 144; ++i) litlens[i] = 8;
+    for (; i != 256; ++i) litlens[i] = 9;
+    for (; i != 280; ++i) litlens[i] = 7;
+    for (; i != 288; ++i) litlens[i] = 8;
+    for (i = 0; i != 30; ++i) distlens[i] = 5;
+  }
+
+
+  /*
+  ** Deflater
+  */
+
+  Deflater::Deflater(lua_State *L, int level, DeflateFormat format)
+    : L(L), format(format), level(level < 0 ? 0 : level > 9 ? 9 : level),
+      buf(StateAllocator<uint8_t>(&this->L)), head(StateAllocator<uint64_t>(&this->L)),
+      prev(StateAllocator<uint64_t>(&this->L)), syms(StateAllocator<uint32_t>(&this->L))
+  {
+    if (format == DeflateFormat::ZLIB)
+      check = 1;
+    if (this->level != 0) {
+      head.resize((size_t)1 << HASH_BITS, 0);
+      prev.resize(WSIZE, 0);
+    }
+  }
+
+  void Deflater::putBits(uint32_t value, int n, std::string& out) {
+    bitbuf |= (uint64_t)value << bitcnt;
+    bitcnt += n;
+    if (bitcnt >= 32) {
+      char bytes[4] = { (char)bitbuf, (char)(bitbuf >> 8), (char)(bitbuf >> 16), (char)(bitbuf >> 24) };
+      out.append(bytes, 4);
+      bitbuf >>= 32;
+      bitcnt -= 32;
+    }
+  }
+
+  void Deflater::alignToByte(std::string& out) {
+    while (bitcnt > 0) {
+      out.push_back((char)bitbuf);
+      bitbuf >>= 8;
+      bitcnt = (bitcnt > 8 ? bitcnt - 8 : 0);
+    }
+    bitbuf = 0;
+  }
+
+  void Deflater::writeHeader(std::string& out) {
+    header_written = true;
+    if (format == DeflateFormat::ZLIB) {
+      const int flevel = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3);
+      uint16_t hdr = (0x78 << 8) | (flevel << 6);
+      hdr += 31 - (hdr % 31);
+      out.push_back((char)(hdr >> 8));
+      out.push_back((char)hdr);
+    }
+    else if (format == DeflateFormat::GZIP) {
+      const char hdr[10] = { '\x1f', '\x8b', 8, 0, 0, 0, 0, 0, (char)(level == 9 ? 2 : level == 1 ? 4 : 0), '\xff' };
+      out.append(hdr, sizeof(hdr));
+    }
+  }
+
+  void Deflater::write(const void *data, size_t size, std::string& out) {
+    if (!header_written)
+      writeHeader(out);
+    if (size == 0)
+      return;
+    if (format == DeflateFormat::ZLIB)
+      check = soup::adler32::hash((const uint8_t*)data, size, check);
+    else if (format == DeflateFormat::GZIP)
+      check = soup::crc32::hash((const uint8_t*)data, size, check);
+    total_in += (uint32_t)size;
+    buf.insert(buf.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+    while (buf.size() - pos >= BLOCK_INPUT + MAX_MATCH)
+      compress(pos + BLOCK_INPUT, false, out);
+  }
+
+  void Deflater::finish(std::string& out) {
+    if (finished)
+      return;
+    if (!header_written)
+      writeHeader(out);
+    compress(buf.size(), true, out);
+    alignToByte(out);
+    if (format == DeflateFormat::ZLIB) {
+      const char trailer[4] = { (char)(check >> 24), (char)(check >> 16), (char)(check >> 8), (char)check };
+      out.append(trailer, 4);
+    }
+    else if (format == DeflateFormat::GZIP) {
+      const char trailer[8] = {
+        (char)check, (char)(check >> 8), (char)(check >> 16), (char)(check >> 24),
+        (char)total_in, (char)(total_in >> 8), (char)(total_in >> 16), (char)(total_in >> 24),
+      };
+      out.append(trailer, 8);
+    }
+    finished = true;
+    buf.clear();
+    buf.shrink_to_fit();
+  }
+
+  void Deflater::insert(size_t i) noexcept {
+    const uint32_t h = ((uint32_t)buf[i] << 16 | (uint32_t)buf[i + 1] << 8 | buf[i + 2]) * 2654435761u >> (32 - HASH_BITS);
+    const uint64_t abs = base + i;
+    prev[abs & (WSIZE - 1)] = head[h];
+    head[h] = abs + 1;
+  }
+
+  size_t Deflater::longestMatch(size_t i, size_t limit, size_t& dist, int max_chain) const noexcept {
+    const LevelConfig& cfg = level_config[level];
+    const uint8_t *scan = buf.data() + i;
+    const uint32_t h = ((uint32_t)scan[0] << 16 | (uint32_t)scan[1] << 8 | scan[2]) * 2654435761u >> (32 - HASH_BITS);
+    const uint64_t abs = base + i;
+    size_t best = MIN_MATCH - 1;
+    uint64_t cand = head[h];
+    for (int chain = max_chain; cand != 0 && chain != 0; --chain) {
+      const uint64_t ca = cand - 1;
+      if (ca >= abs || abs - ca > MAX_DIST || ca < base)
+        break;
+      const uint8_t *match = buf.data() + (ca - base);
+      if (match[best] == scan[best] && match[0] == scan[0] && match[1] == scan[1]) {
+        size_t len = 2;
+        while (len + 8 <= limit && std::memcmp(match + len, scan + len, 8) == 0)
+          len += 8;
+        while (len < limit && match[len] == scan[len])
+          ++len;
+        if (len > best) {
+          best = len;
+          dist = (size_t)(abs - ca);
+          if (len >= cfg.nice_length || len == limit)
+            break;
+        }
+      }
+      const uint64_t next = prev[ca & (WSIZE - 1)];
+      if (next >= cand)
+        break;  /* overwritten by a newer position */
+      cand = next;
+    }
+    if (best == MIN_MATCH && dist > TOO_FAR)
+      return 0;
+    return best >= MIN_MATCH ? best : 0;
+  }
+
+  void Deflater::compress(size_t end, bool final, std::string& out) {
+    size_t block_start = pos;
+    if (level == 0) {
+      if (end != pos || final)
+        writeStored(pos, end, final, out);
+      pos = end;
+    }
+    else {
+      const LevelConfig& cfg = level_config[level];
+      size_t i = pos;
+      size_t lookahead_at = SIZE_MAX, lookahead_len = 0, lookahead_dist = 0;  /* result of the last lazy search */
+      while (i < end) {
+        const size_t avail = buf.size() - i;
+        size_t len = 0, dist = 0;
+        if (avail >= MIN_MATCH) {
+          if (i == lookahead_at) {
+            len = lookahead_len;
+            dist = lookahead_dist;
+          }
+          else
+            len = longestMatch(i, avail < MAX_MATCH ? avail : MAX_MATCH, dist, cfg.max_chain);
+          insert(i);
+          if (len != 0 && cfg.lazy && len < cfg.max_lazy && avail > MIN_MATCH) {
+            /* would the next position give a longer match? */
+            size_t dist2 = 0;
+            const size_t len2 = longestMatch(i + 1, avail - 1 < MAX_MATCH ? avail - 1 : MAX_MATCH, dist2, len >= cfg.good_length ? cfg.max_chain >> 2 : cfg.max_chain);
+            if (len2 > len) {
+              syms.push_back(buf[i]);
+              ++i;
+              lookahead_at = i;
+              lookahead_len = len2;
+              lookahead_dist = dist2;
+              goto next;
+            }
+          }
+        }
+        if (len != 0) {
+          syms.push_back(0x80000000u | (uint32_t)(len - MIN_MATCH) << 16 | (uint32_t)dist);
+          if (cfg.lazy || len <= cfg.max_lazy) {
+            for (size_t j = i + 1; j != i + len; ++j) {
+              if (j + MIN_MATCH <= buf.size())
+                insert(j);
+            }
+          }
+          i += len;
+        }
+        else {
+          syms.push_back(buf[i]);
+          ++i;
+        }
+      next:
+        if (syms.size() >= BLOCK_SYMS) {
+          flushBlock(block_start, i, false, out);
+          block_start = i;
+        }
+      }
+      pos = i;  /* may be a little past 'end' if the last match crossed it */
+      if (!syms.empty() || final)
+        flushBlock(block_start, pos, final, out);
+    }
+
+    /* keep WSIZE bytes of history */
+    if (pos > WSIZE) {
+      const size_t drop = pos - WSIZE;
+      buf.erase(buf.begin(), buf.begin() + drop);
+      base += drop;
+      pos -= drop;
+    }
+  }
+
+  void Deflater::writeStored(size_t start, size_t end, bool final, std::string& out) {
+    do {
+      const size_t n = (end - start > 0xffff ? 0xffff : end - start);
+      const bool last = (final && start + n == end);
+      putBits(last ? 1 : 0, 3, out);  /* BFINAL, BTYPE = 00 */
+      alignToByte(out);
+      const char hdr[4] = { (char)n, (char)(n >> 8), (char)~n, (char)(~n >> 8) };
+      out.append(hdr, 4);
+      out.append((const char*)buf.data() + start, n);
+      start += n;
+    } while (start != end);
+  }
+
+  void Deflater::flushBlock(size_t start, size_t end, bool final, std::string& out) {
+    uint32_t litfreq[286]{};
+    uint32_t distfreq[30]{};
+    for (uint32_t s : syms) {
+      if (s & 0x80000000u) {
+        ++litfreq[257 + tables.length_code[(s >> 16) & 0xff]];
+        ++distfreq[tables.distCode(s & 0xffff)];
+      }
+      else
+        ++litfreq[s];
+    }
+    litfreq[256] = 1;
+
+    /* dynamic tables */
+    uint8_t litlens[288]{};
+    uint8_t distlens[30]{};
+    buildLengths(litfreq, 286, 15, litlens);
+    buildLengths(distfreq, 30, 15, distlens);
+    if (std::all_of(distlens, distlens + 30, [](uint8_t l) { return l == 0; }))
+      distlens[0] = 1;  /* some decoders don't like an empty distance tree */
+    int hlit = 286;
+    while (hlit > 257 && litlens[hlit - 1] == 0)
+      --hlit;
+    int hdist = 30;
+    while (hdist > 1 && distlens[hdist - 1] == 0)
+      --hdist;
+
+    /* run-length encode the code lengths */
+    uint8_t all[286 + 30];
+    memcpy(all, litlens, hlit);
+    memcpy(all + hlit, distlens, hdist);
+    const int total = hlit + hdist;
+    std::vector<uint16_t> rle;  /* (extra << 5) | symbol */
+    uint32_t clfreq[19]{};
+    for (int i = 0; i < total; ) {
+      const uint8_t l = all[i];
+      int run = 1;
+      while (i + run < total && all[i + run] == l)
+        ++run;
+      i += run;
+      if (l == 0) {
+        while (run >= 11) {
+          const int n = (run > 138 ? 138 : run);
+          rle.push_back((uint16_t)((n - 11) << 5 | 18));
+          ++clfreq[18];
+          run -= n;
+        }
+        if (run >= 3) {
+          rle.push_back((uint16_t)((run - 3) << 5 | 17));
+          ++clfreq[17];
+          run = 0;
+        }
+      }
+      else {
+        rle.push_back(l);
+        ++clfreq[l];
+        --run;
+        while (run >= 3) {
+          const int n = (run > 6 ? 6 : run);
+          rle.push_back((uint16_t)((n - 3) << 5 | 16));
+          ++clfreq[16];
+          run -= n;
+        }
+      }
+      while (run-- > 0) {
+        rle.push_back(l);
+        ++clfreq[l];
+      }
+    }
+    uint8_t cllens[19]{};
+    buildLengths(clfreq, 19, 7, cllens);
+    int hclen = 19;
+    while (hclen > 4 && cllens[clen_order[hclen - 1]] == 0)
+      --hclen;
+
+    /* compare the cost of the possible encodings */
+    uint8_t fixedlit[288], fixeddist[30];
+    fixedLengths(fixedlit, fixeddist);
+    uint64_t extra = 0, dyn = 0, fix = 0;
+    for (int i = 0; i != 286; ++i) {
+      dyn += (uint64_t)litfreq[i] * litlens[i];
+      fix += (uint64_t)litfreq[i] * fixedlit[i];
+      if (i >= 257)
+        extra += (uint64_t)litfreq[i] * length_extra[i - 257];
+    }
+    for (int i = 0; i != 30; ++i) {
+      dyn += (uint64_t)distfreq[i] * distlens[i];
+      fix += (uint64_t)distfreq[i] * 5;
+      extra += (uint64_t)distfreq[i] * dist_extra[i];
+    }
+    dyn += extra + 3 + 14 + 3 * hclen;
+    for (uint16_t r : rle) {
+      const int sym = r & 31;
+      dyn += cllens[sym] + (sym == 16 ? 2 : sym == 17 ? 3 : sym == 18 ? 7 : 0);
+    }
+    fix += extra + 3;
+    const uint64_t stored = ((uint64_t)(end - start) + 5 * ((end - start) / 0xffff + 1)) * 8 + 7;
+
+    if (stored <= dyn && stored <= fix) {
+      writeStored(start, end, final, out);
+      syms.clear();
+      return;
+    }
+
+    const uint8_t *ll = litlens, *dl = distlens;
+    if (fix <= dyn) {
+      ll = fixedlit;
+      dl = fixeddist;
+      putBits(final ? 3 : 2, 3, out);  /* BTYPE = 01 */
+    }
+    else {
+      putBits(final ? 5 : 4, 3, out);  /* BTYPE = 10 */
+      putBits(hlit - 257, 5, out);
+      putBits(hdist - 1, 5, out);
+      putBits(hclen - 4, 4, out);
+      for (int i = 0; i != hclen; ++i)
+        putBits(cllens[clen_order[i]], 3, out);
+      uint16_t clcodes[19]{};
+      makeCodes(cllens, 19, clcodes);
+      for (uint16_t r : rle) {
+        const int sym = r & 31;
+        putBits(clcodes[sym], cllens[sym], out);
+        if (sym == 16)
+          putBits(r >> 5, 2, out);
+        else if (sym == 17)
+          putBits(r >> 5, 3, out);
+        else if (sym == 18)
+          putBits(r >> 5, 7, out);
+      }
+    }
+    uint16_t litcodes[288]{};
+    uint16_t distcodes[30]{};
+    makeCodes(ll, 288, litcodes);
+    makeCodes(dl, 30, distcodes);
+    for (uint32_t s : syms) {
+      if (s & 0x80000000u) {
+        const uint32_t len = (s >> 16) & 0xff;
+        const int lc = tables.length_code[len];
+        putBits(litcodes[257 + lc], ll[257 + lc], out);
+        if (length_extra[lc])
+          putBits(len + 3 - length_base[lc], length_extra[lc], out);
+        const uint32_t dist = s & 0xffff;
+        const int dc = tables.distCode(dist);
+        putBits(distcodes[dc], dl[dc], out);
+        if (dist_extra[dc])
+          putBits(dist - dist_base[dc], dist_extra[dc], out);
+      }
+      else
+        putBits(litcodes[s], ll[s], out);
+    }
+    putBits(litcodes[256], ll[256], out);
+    syms.clear();
+  }
+
+
+  /*
+  ** Inflater
+  */
+
+  bool Inflater::Huffman::build(const uint8_t *lens, int n) noexcept {
+    memset(count, 0, sizeof(count));
+    for (int i = 0; i != n; ++i)
+      ++count[lens[i]];
+    if (count[0] == n) {
+      memset(fast, 0, sizeof(fast));
+      return true;  /* no codes; only an error if one is actually needed */
+    }
+    int left = 1;
+    for (int len = 1; len != 16; ++len) {
+      left <<= 1;
+      left -= count[len];
+      if (left < 0)
+        return false;  /* over-subscribed */
+    }
+    uint16_t offs[16];
+    offs[1] = 0;
+    for (int len = 1; len != 15; ++len)
+      offs[len + 1] = offs[len] + count[len];
+    for (int i = 0; i != n; ++i) {
+      if (lens[i] != 0)
+        symbol[offs[lens[i]]++] = (uint16_t)i;
+    }
+
+    memset(fast, 0, sizeof(fast));
+    uint16_t code = 0;
+    int index = 0;
+    for (int len = 1; len <= FAST_BITS; ++len) {
+      for (int k = 0; k != count[len]; ++k, ++code) {
+        const uint32_t rev = reverseBits(code, len);
+        for (uint32_t fill = rev; fill < (1u << FAST_BITS); fill += (1u << len))
+          fast[fill] = (uint16_t)(symbol[index + k] << 4 | len);
+      }
+      index += count[len];
+      code <<= 1;
+    }
+    return true;
+  }
+
+  void Inflater::fill() noexcept {
+    while (bitcnt <= 56 && inpos != in.size()) {
+      bitbuf |= (uint64_t)(uint8_t)in[inpos++] << bitcnt;
+      bitcnt += 8;
+    }
+  }
+
+  bool Inflater::need(int n) noexcept {
+    if (bitcnt < n)
+      fill();
+    return bitcnt >= n;
+  }
+
+  uint32_t Inflater::bits(int n) noexcept {
+    const uint32_t v = (uint32_t)(bitbuf & ((1ull << n) - 1));
+    bitbuf >>= n;
+    bitcnt -= n;
+    return v;
+  }
+
+  /* returns the next symbol, -1 if more input is needed, or -2 for an invalid code */
+  int Inflater::decode(const Huffman& h) noexcept {
+    fill();
+    const uint16_t e = h.fast[bitbuf & ((1u << Huffman::FAST_BITS) - 1)];
+    if (e != 0 && (e & 15) <= bitcnt) {
+      bitbuf >>= (e & 15);
+      bitcnt -= (e & 15);
+      return e >> 4;
+    }
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len != 16; ++len) {
+      if (len > bitcnt)
+        return -1;
+      code |= (int)((bitbuf >> (len - 1)) & 1);
+      const int count = h.count[len];
+      if (code - count < first) {
+        bitbuf >>= len;
+        bitcnt -= len;
+        return h.symbol[index + (code - first)];
+      }
+      index += count;
+      first += count;
+      first <<= 1;
+      code <<= 1;
+    }
+    return -2;
+  }
+
+  bool Inflater::fail(const char *msg) noexcept {
+    error = msg;
+    stage = ERROR;
+    return false;
+  }
+
+  /* returns false if more input is needed or the header is invalid (then 'stage' is ERROR) */
+  bool Inflater::readHeader() {
+    if (!need(16))
+      return false;
+    const uint8_t b0 = (uint8_t)bitbuf, b1 = (uint8_t)(bitbuf >> 8);
+    if (format == DeflateFormat::AUTO) {
+      if (b0 == 0x1f && b1 == 0x8b)
+        format = DeflateFormat::GZIP;
+      else if ((b0 & 0x0f) == 8 && (b0 >> 4) <= 7 && ((b0 << 8) | b1) % 31 == 0)
+        format = DeflateFormat::ZLIB;
+      else
+        format = DeflateFormat::RAW;
+    }
+    if (format == DeflateFormat::ZLIB) {
+      if ((b0 & 0x0f) != 8 || ((b0 << 8) | b1) % 31 != 0)
+        return fail("invalid zlib header");
+      if (b1 & 0x20)
+        return fail("zlib streams with a preset dictionary are not supported");
+      (void)bits(16);
+      check = 1;
+    }
+    else if (format == DeflateFormat::GZIP) {
+      const Snapshot s = save();
+      if (!need(32))
+        return false;
+      if (bits(8) != 0x1f || bits(8) != 0x8b || bits(8) != 8)
+        return fail("invalid gzip header");
+      const uint32_t flags = bits(8);
+      for (int i = 0; i != 6; ++i) {  /* MTIME, XFL, OS */
+        if (!need(8)) { restore(s); return false; }
+        (void)bits(8);
+      }
+      if (flags & 4) {  /* FEXTRA */
+        if (!need(16)) { restore(s); return false; }
+        for (uint32_t xlen = bits(16); xlen != 0; --xlen) {
+          if (!need(8)) { restore(s); return false; }
+          (void)bits(8);
+        }
+      }
+      for (uint32_t flag : { 8u, 16u }) {  /* FNAME, FCOMMENT */
+        if (flags & flag) {
+          do {
+            if (!need(8)) { restore(s); return false; }
+          } while (bits(8) != 0);
+        }
+      }
+      if (flags & 2) {  /* FHCRC */
+        if (!need(16)) { restore(s); return false; }
+        (void)bits(16);
+      }
+    }
+    stage = BLOCK;
+    return true;
+  }
+
+  bool Inflater::readDynamicTables() {
+    if (!need(14))
+      return false;
+    const int hlit = (int)bits(5) + 257;
+    const int hdist = (int)bits(5) + 1;
+    const int hclen = (int)bits(4) + 4;
+    if (hlit > 286 || hdist > 30)
+      return fail("invalid dynamic block header");
+    uint8_t cllens[19]{};
+    for (int i = 0; i != hclen; ++i) {
+      if (!need(3))
+        return false;
+      cllens[clen_order[i]] = (uint8_t)bits(3);
+    }
+    Huffman cl;
+    if (!cl.build(cllens, 19))
+      return fail("invalid code lengths code");
+    uint8_t lens[286 + 30];
+    for (int i = 0; i < hlit + hdist; ) {
+      const int sym = decode(cl);
+      if (sym == -1)
+        return false;
+      if (sym < 0)
+        return fail("invalid code lengths code");
+      if (sym < 16) {
+        lens[i++] = (uint8_t)sym;
+        continue;
+      }
+      uint8_t val = 0;
+      int rep;
+      if (sym == 16) {
+        if (i == 0)
+          return fail("repeat of nonexistent code length");
+        if (!need(2))
+          return false;
+        val = lens[i - 1];
+        rep = 3 + (int)bits(2);
+      }
+      else if (sym == 17) {
+        if (!need(3))
+          return false;
+        rep = 3 + (int)bits(3);
+      }
+      else {
+        if (!need(7))
+          return false;
+        rep = 11 + (int)bits(7);
+      }
+      if (i + rep > hlit + hdist)
+        return fail("too many code lengths");
+      while (rep--)
+        lens[i++] = val;
+    }
+    if (lens[256] == 0)
+      return fail("missing end-of-block code");
+    if (!lencode.build(lens, hlit) || !distcode.build(lens + hlit, hdist))
+      return fail("invalid literal/length or distance code");
+    return true;
+  }
+
+  bool Inflater::readTrailer() {
+    (void)bits(bitcnt & 7);  /* the trailer starts at a byte boundary */
+    if (format == DeflateFormat::ZLIB) {
+      if (!need(32))
+        return false;
+      uint32_t stored = 0;
+      for (int i = 0; i != 4; ++i)
+        stored = (stored << 8) | bits(8);
+      if (stored != check)
+        return fail("checksum mismatch");
+    }
+    else if (format == DeflateFormat::GZIP) {
+      if (!need(64))
+        return false;
+      const uint32_t crc = bits(32);
+      const uint32_t isize = bits(32);
+      if (crc != check || isize != total_out)
+        return fail("checksum mismatch");
+    }
+    stage = END;
+    return true;
+  }
+
+  void Inflater::updateCheck(size_t from) noexcept {
+    const size_t n = hist.size() - from;
+    if (n == 0)
+      return;
+    total_out += (uint32_t)n;
+    if (format == DeflateFormat::ZLIB)
+      check = soup::adler32::hash((const uint8_t*)hist.data() + from, n, check);
+    else if (format == DeflateFormat::GZIP)
+      check = soup::crc32::hash((const uint8_t*)hist.data() + from, n, check);
+  }
+
+  Inflater::Status Inflater::write(const void *data, size_t size, std::string& out) {
+    if (stage == ERROR)
+      return FAILED;
+    if (stage == END)
+      return DONE;
+    in.append((const char*)data, size);
+    const size_t mark = hist.size();
+
+    while (true) {
+      if (stage == HEADER) {
+        if (!readHeader())
+          break;
+      }
+      if (stage == BLOCK) {
+        if (final) {
+          stage = TRAILER;
+          continue;
+        }
+        const Snapshot s = save();
+        if (!need(3))
+          break;
+        const bool last = bits(1);
+        const uint32_t type = bits(2);
+        if (type == 0) {
+          (void)bits(bitcnt & 7);
+          if (!need(32)) {
+            restore(s);
+            break;
+          }
+          const uint32_t len = bits(16);
+          const uint32_t nlen = bits(16);
+          if (len != (~nlen & 0xffff)) {
+            fail("invalid stored block lengths");
+            break;
+          }
+          stored_left = len;
+          final = last;
+          stage = STORED;
+        }
+        else if (type == 1) {
+          uint8_t lens[288 + 30];
+          fixedLengths(lens, lens + 288);
+          (void)lencode.build(lens, 288);
+          (void)distcode.build(lens + 288, 30);
+          final = last;
+          stage = CODES;
+        }
+        else if (type == 2) {
+          if (!readDynamicTables()) {
+            if (stage != ERROR)
+              restore(s);
+            break;
+          }
+          final = last;
+          stage = CODES;
+        }
+        else {
+          fail("invalid block type");
+          break;
+        }
+      }
+      if (stage == STORED) {
+        /* whole bytes may still be in the bit buffer */
+        while (stored_left != 0 && bitcnt >= 8) {
+          hist.push_back((char)bits(8));
+          --stored_left;
+        }
+        if (stored_left != 0 && bitcnt == 0) {
+          bitbuf = 0;
+          const size_t n = std::min<size_t>(stored_left, in.size() - inpos);
+          hist.append(in, inpos, n);
+          inpos += n;
+          stored_left -= (uint32_t)n;
+        }
+        if (stored_left != 0)
+          break;
+        stage = BLOCK;
+        continue;
+      }
+      if (stage == CODES) {
+        bool more = true;
+        while (true) {
+          const Snapshot s = save();
+          int sym = decode(lencode);
+          if (sym < 256) {
+            if (sym < 0) {
+              if (sym == -1)
+                restore(s);
+              else
+                fail("invalid literal/length code");
+              more = false;
+              break;
+            }
+            hist.push_back((char)sym);
+            continue;
+          }
+          if (sym == 256) {
+            stage = BLOCK;
+            break;
+          }
+          sym -= 257;
+          if (sym >= 29) {
+            fail("invalid literal/length code");
+            more = false;
+            break;
+          }
+          if (!need(length_extra[sym])) {
+            restore(s);
+            more = false;
+            break;
+          }
+          const size_t len = length_base[sym] + bits(length_extra[sym]);
+          const int dsym = decode(distcode);
+          if (dsym < 0 || dsym >= 30) {
+            if (dsym == -1)
+              restore(s);
+            else
+              fail("invalid distance code");
+            more = false;
+            break;
+          }
+          if (!need(dist_extra[dsym])) {
+            restore(s);
+            more = false;
+            break;
+          }
+          const size_t dist = dist_base[dsym] + bits(dist_extra[dsym]);
+          if (dist > hist.size()) {
+            fail("invalid distance too far back");
+            more = false;
+            break;
+          }
+          const size_t from = hist.size() - dist;
+          hist.reserve(hist.size() + len);
+          if (dist >= len)
+            hist.append(hist.data() + from, len);
+          else {
+            for (size_t i = 0; i != len; ++i)
+              hist.push_back(hist[from + i]);
+          }
+        }
+        if (!more)
+          break;
+        continue;
+      }
+      if (stage == TRAILER) {
+        updateCheck(mark);
+        if (!readTrailer()) {
+          if (stage == ERROR)
+            break;
+          out.append(hist.data() + mark, hist.size() - mark);
+          hist.erase(0, hist.size() > WSIZE ? hist.size() - WSIZE : 0);
+          in.erase(0, inpos);
+          inpos = 0;
+          return NEED_MORE;
+        }
+        out.append(hist.data() + mark, hist.size() - mark);
+        hist.clear();
+        hist.shrink_to_fit();
+        in.clear();
+        in.shrink_to_fit();
+        inpos = 0;
+        return DONE;
+      }
+      break;
+    }
+
+    if (stage == ERROR)
+      return FAILED;
+    updateCheck(mark);
+    out.append(hist.data() + mark, hist.size() - mark);
+    if (hist.size() > 2 * WSIZE)
+      hist.erase(0, hist.size() - WSIZE);
+    in.erase(0, inpos);
+    inpos = 0;
+    return NEED_MORE;
+  }
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+/*
+** Streaming DEFLATE (RFC 1951) encoder and decoder with optional zlib
+** (RFC 1950) or gzip (RFC 1952) framing. Both take input in arbitrary chunks
+** and append whatever output they can produce to a caller-provided string,
+** so neither the input nor the output has to be held in memory as a whole.
+** The work buffers are allocated through the owning state, so they count
+** towards its memory limit and 'collectgarbage' statistics.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <new> // bad_alloc
+#include <string>
+#include <vector>
+
+#include "lua.h"
+#include "lmem.h"
+
+namespace Pluto {
+  /* Allocates through the state that '*L' points to, which the owner may update between calls. */
+  template <typename T>
+  struct StateAllocator {
+    using value_type = T;
+
+    lua_State *const *L;
+
+    explicit StateAllocator(lua_State *const *L) noexcept : L(L) {}
+    template <typename U>
+    StateAllocator(const StateAllocator<U>& b) noexcept : L(b.L) {}
+
+    [[nodiscard]] T *allocate(size_t n) {
+      if (void *p = luaM_realloc_(*L, nullptr, 0, n * sizeof(T)))
+        return static_cast<T*>(p);
+      throw std::bad_alloc{};
+    }
+
+    void deallocate(T *p, size_t n) noexcept {
+      luaM_free_(*L, p, n * sizeof(T));
+    }
+
+    template <typename U>
+    [[nodiscard]] bool operator==(const StateAllocator<U>& b) const noexcept { return L == b.L; }
+    template <typename U>
+    [[nodiscard]] bool operator!=(const StateAllocator<U>& b) const noexcept { return L != b.L; }
+  };
+
+  template <typename T>
+  using StateVector = std::vector<T, StateAllocator<T>>;
+  using StateString = std::basic_string<char, std::char_traits<char>, StateAllocator<char>>;
+
+  enum class DeflateFormat : uint8_t {
+    RAW,
+    ZLIB,
+    GZIP,
+    AUTO,  /* decoder only: detect zlib & gzip headers, otherwise assume raw */
+  };
+
+  class Deflater {
+  public:
+    static constexpr int DEFAULT_LEVEL = 6;
+
+    lua_State *L;  /* must be a live thread of the owning state whenever this is used or destroyed */
+
+  private:
+    DeflateFormat format;
+    int level;  /* 0 (store) to 9 (best) */
+    bool header_written = false;
+    bool finished = false;
+
+    /* the last WSIZE bytes of already compressed input, followed by pending input */
+    StateVector<uint8_t> buf;
+    size_t pos = 0;  /* index into 'buf' of the first byte that has not been compressed yet */
+    uint64_t base = 0;  /* stream offset of buf[0] */
+    StateVector<uint64_t> head;  /* hash chain heads, stream offsets + 1 (0 = none) */
+    StateVector<uint64_t> prev;
+
+    StateVector<uint32_t> syms;  /* literals (< 256) and matches of the current block */
+    uint64_t bitbuf = 0;
+    int bitcnt = 0;
+
+    uint32_t check = 0;  /* adler32 or crc32 of the input */
+    uint32_t total_in = 0;  /* modulo 2^32, for gzip */
+
+  public:
+    Deflater(lua_State *L, int level = DEFAULT_LEVEL, DeflateFormat format = DeflateFormat::RAW);
+    Deflater(const Deflater&) = delete;  /* the buffers' allocators refer to 'L' */
+    Deflater& operator=(const Deflater&) = delete;
+
+    /* Compresses 'data'. May hold back some input until enough is buffered to make a block. */
+    void write(const void *data, size_t size, std::string& out);
+
+    /* Compresses the remaining input and terminates the stream. */
+    void finish(std::string& out);
+
+    [[nodiscard]] bool isFinished() const noexcept { return finished; }
+
+  private:
+    void writeHeader(std::string& out);
+    void compress(size_t end, bool final, std::string& out);
+    [[nodiscard]] size_t longestMatch(size_t i, size_t limit, size_t& dist, int max_chain) const noexcept;
+    void insert(size_t i) noexcept;
+    void flushBlock(size_t start, size_t end, bool final, std::string& out);
+    void writeStored(size_t start, size_t end, bool final, std::string& out);
+
+    void putBits(uint32_t value, int n, std::string& out);
+    void alignToByte(std::string& out);
+  };
+
+  class Inflater {
+  public:
+    enum Status : uint8_t {
+      NEED_MORE,  /* all input was consumed, more is needed to finish the stream */
+      DONE,  /* the end of the stream has been reached */
+      FAILED,  /* see 'error' */
+    };
+
+    lua_State *L;  /* must be a live thread of the owning state whenever this is used or destroyed */
+    const char *error = nullptr;
+
+  private:
+    struct Huffman {
+      static constexpr int FAST_BITS = 10;
+      uint16_t count[16];
+      uint16_t symbol[320];
+      uint16_t fast[1 << FAST_BITS];  /* (symbol << 4) | length, 0 for codes longer than FAST_BITS */
+
+      [[nodiscard]] bool build(const uint8_t *lens, int n) noexcept;
+    };
+
+    enum Stage : uint8_t {
+      HEADER,
+      BLOCK,
+      STORED,
+      CODES,
+      TRAILER,
+      END,
+      ERROR,
+    };
+
+    DeflateFormat format;
+    Stage stage = HEADER;
+    bool final = false;
+    uint32_t stored_left = 0;
+
+    StateString in;
+    size_t inpos = 0;
+    uint64_t bitbuf = 0;
+    int bitcnt = 0;
+
+    Huffman lencode, distcode;
+
+    StateString hist;  /* output, of which the last WSIZE bytes are kept between calls */
+    uint32_t check = 0;
+    uint32_t total_out = 0;
+
+  public:
+    explicit Inflater(lua_State *L, DeflateFormat format = DeflateFormat::AUTO) noexcept
+      : L(L), format(format), in(StateAllocator<char>(&this->L)), hist(StateAllocator<char>(&this->L))
+    {
+    }
+    Inflater(const Inflater&) = delete;  /* the buffers' allocators refer to 'L' */
+    Inflater& operator=(const Inflater&) = delete;
+
+    /* Decompresses 'data', appending the output to 'out'. */
+    Status write(const void *data, size_t size, std::string& out);
+
+    [[nodiscard]] bool isDone() const noexcept { return stage == END; }
+
+  private:
+    struct Snapshot {
+      size_t inpos;
+      uint64_t bitbuf;
+      int bitcnt;
+    };
+
+    [[nodiscard]] Snapshot save() const noexcept { return { inpos, bitbuf, bitcnt }; }
+    void restore(const Snapshot& s) noexcept { inpos = s.inpos; bitbuf = s.bitbuf; bitcnt = s.bitcnt; }
+
+    void fill() noexcept;
+    [[nodiscard]] bool need(int n) noexcept;
+    [[nodiscard]] uint32_t bits(int n) noexcept;
+    [[nodiscard]] int decode(const Huffman& h) noexcept;
+
+    bool fail(const char *msg) noexcept;
+    [[nodiscard]] bool readHeader();
+    [[nodiscard]] bool readDynamicTables();
+    [[nodiscard]] bool readTrailer();
+    void updateCheck(size_t from) noexcept;
+  };
+}
@@ -13,6 +13,8 @@
 #include <limits.h>
 #include <stddef.h>
 
+#include <string>
+
 #include "lua.h"
 
 #include "lobject.h"
@@ -29,6 +31,7 @@ typedef struct {
   int status;
   bool lua_vm_compatible;
   lu_byte min_required_version;
+  std::string *out;  /* [Pluto] if set, blocks go here instead of to 'writer' */
 } DumpState;
 
 
@@ -42,6 +45,10 @@ typedef struct {
 
 
 static void dumpBlock (DumpState *D, const void *b, size_t size) {
+  if (D->out) {
+    D->out->append(static_cast<const char *>(b), size);
+    return;
+  }
   if (D->status == 0 && size > 0) {
     lua_unlock(D->L);
     D->status = (*D->writer)(D->L, b, size, D->data);
@@ -201,9 +208,59 @@ static void dumpFunction (DumpState *D, const Proto *f, TString *psource) {
 }
 
 
-static void dumpHeader (DumpState *D) {
+/*
+** [Pluto] In an indexed chunk, each nested function and the debug information
+** of each function are dumped to a buffer first, to prefix them with their
+** size. The loader can then skip them and come back when they are needed.
+*/
+static void dumpSized (DumpState *D, void (*dump)(DumpState *, const Proto *, TString *),
+                       const Proto *f, TString *psource) {
+  std::string block;
+  std::string *out = D->out;
+  D->out = &block;
+  dump(D, f, psource);
+  D->out = out;
+  dumpSize(D, block.size());
+  dumpBlock(D, block.data(), block.size());
+}
+
+
+static void dumpIndexedDebug (DumpState *D, const Proto *f, TString *psource) {
+  UNUSED(psource);
+  dumpDebug(D, f);
+}
+
+
+static void dumpIndexedFunction (DumpState *D, const Proto *f, TString *psource) {
+  if (D->strip || f->source == psource)
+    dumpString(D, NULL);  /* no debug info or same source as its parent */
+  else
+    dumpString(D, f->source);
+  dumpInt(D, f->linedefined);
+  dumpInt(D, f->lastlinedefined);
+  dumpByte(D, f->numparams);
+  dumpByte(D, f->is_vararg);
+  dumpByte(D, f->maxstacksize);
+  dumpCode(D, f);
+  dumpConstants(D, f);
+  dumpUpvalues(D, f);
+  dumpInt(D, f->sizep);
+  for (int i = 0; i < f->sizep; i++)
+    dumpSized(D, dumpIndexedFunction, f->p[i], f->source);
+  if (D->strip)
+    dumpSize(D, 0);  /* no debug information */
+  else
+    dumpSized(D, dumpIndexedDebug, f, NULL);
+}
+
+
+static void dumpHeader (DumpState *D, bool indexed) {
   dumpLiteral(D, LUA_SIGNATURE);
-  if (D->lua_vm_compatible) {
+  if (indexed) {
+    dumpByte(D, D->min_required_version);
+    dumpByte(D, LUAC_FORMAT_INDEXED);
+  }
+  else if (D->lua_vm_compatible) {
     dumpByte(D, LUAC_VERSION);
     dumpByte(D, LUAC_FORMAT);
   }
@@ -233,11 +290,13 @@ static void check_vm_compatibility (const Proto *f, bool& lua_vm_compatible, lu_
 
 
 /*
-** dump Lua function as precompiled chunk
+** dump Lua function as precompiled chunk; [Pluto] an indexed one (see
+** 'dumpSized') if 'indexed' is set
 */
 int luaU_dump(lua_State *L, const Proto *f, lua_Writer w, void *data,
-              int strip) {
+              int strip, bool indexed) {
   DumpState D;
+  luaU_loadall(L, cast(Proto *, f), !strip);  /* it may have been loaded from an indexed chunk */
   D.L = L;
   D.writer = w;
   D.data = data;
@@ -245,10 +304,14 @@ int luaU_dump(lua_State *L, const Proto *f, lua_Writer w, void *data,
   D.status = 0;
   D.lua_vm_compatible = true;
   D.min_required_version = 0;
+  D.out = NULL;
   check_vm_compatibility(f, D.lua_vm_compatible, D.min_required_version);
-  dumpHeader(&D);
+  dumpHeader(&D, indexed);
   dumpByte(&D, f->sizeupvalues);
-  dumpFunction(&D, f, NULL);
+  if (indexed)
+    dumpSized(&D, dumpIndexedFunction, f, NULL);
+  else
+    dumpFunction(&D, f, NULL);
   return D.status;
 }
 
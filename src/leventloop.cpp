@@ -0,0 +1,269 @@
+#define LUA_CORE
+
+#include "leventloop.hpp"
+
+#if !SOUP_WASM
+
+#include <cerrno>
+
+#if SOUP_LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h> // read, write, close
+#elif SOUP_POSIX
+#include <fcntl.h>
+#include <unistd.h> // pipe, read, write, close
+#endif
+
+#include "vendor/Soup/soup/Scheduler.hpp"
+#include "vendor/Soup/soup/Socket.hpp"
+#include "vendor/Soup/soup/time.hpp"
+
+namespace Pluto {
+  EventLoop::EventLoop() {
+#if SOUP_LINUX
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wakefd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+#elif SOUP_POSIX
+    if (pipe(wakepipe) == 0) {
+      for (int fd : wakepipe) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+    }
+#endif
+  }
+
+  EventLoop::~EventLoop() {
+#if SOUP_LINUX
+    ::close(wakefd);
+    ::close(epfd);
+#elif SOUP_POSIX
+    ::close(wakepipe[0]);
+    ::close(wakepipe[1]);
+#endif
+  }
+
+  EventLoop& EventLoop::get(lua_State *L) {
+    if (G(L)->eventloop == nullptr) {
+      G(L)->eventloop = new EventLoop();
+    }
+    return *reinterpret_cast<EventLoop*>(G(L)->eventloop);
+  }
+
+  void EventLoop::want(fd_t fd, const void *owner) {
+#if SOUP_LINUX
+    /* keep epoll's interest list in sync with what was wanted since the last 'wait' */
+    auto [it, inserted] = registered.emplace(fd, Registration{ owner, generation });
+    if (!inserted) {
+      it->second.generation = generation;
+      if (it->second.owner == owner)
+        return;  /* already registered */
+      it->second.owner = owner;  /* the descriptor was closed and reused; the kernel forgot about it */
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0 && errno == EEXIST)
+      epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+#else
+    (void)owner;
+    interest.emplace_back(pollfd{ fd, POLLIN });
+#endif
+  }
+
+  bool EventLoop::want(soup::Scheduler& sched) {
+    if (!sched.pending_workers.empty() || sched.workers.empty())
+      return false;
+    for (const auto& w : sched.workers) {
+      if (w->type != soup::WORKER_TYPE_SOCKET || w->holdup_type != soup::Worker::SOCKET)
+        return false;
+      const auto fd = static_cast<fd_t>(static_cast<soup::Socket*>(w.get())->fd);
+      if (fd == (fd_t)-1)
+        return false;
+      want(fd, w.get());
+    }
+    return true;
+  }
+
+  bool EventLoop::want(const WaitSet& set) {
+    bool pollable = true;
+    for (auto sched : set.scheds) {
+      if (!want(*sched))
+        pollable = false;
+    }
+    return pollable;
+  }
+
+  void EventLoop::wait(int timeout) {
+    if (timeout < 0 || timeout > MAX_WAIT_MS)
+      timeout = MAX_WAIT_MS;
+    ready.clear();
+#if SOUP_LINUX
+    for (auto it = registered.begin(); it != registered.end(); ) {
+      if (it->second.generation != generation) {  /* no longer wanted? */
+        epoll_ctl(epfd, EPOLL_CTL_DEL, it->first, nullptr);
+        it = registered.erase(it);
+      }
+      else
+        ++it;
+    }
+    ++generation;
+    epoll_event events[64];
+    int n = epoll_wait(epfd, events, 64, timeout);
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.fd == wakefd) {
+        uint64_t count;
+        (void)!::read(wakefd, &count, sizeof(count));
+      }
+      else
+        ready.insert(static_cast<fd_t>(events[i].data.fd));
+    }
+    if (n == 64) {  /* there may be more; collect them without blocking */
+      while ((n = epoll_wait(epfd, events, 64, 0)) > 0) {
+        for (int i = 0; i < n; ++i) {
+          if (events[i].data.fd != wakefd)
+            ready.insert(static_cast<fd_t>(events[i].data.fd));
+        }
+        if (n != 64) break;
+      }
+    }
+#else
+#if SOUP_POSIX
+    if (wakepipe[0] != -1)
+      interest.emplace_back(pollfd{ wakepipe[0], POLLIN });
+#endif
+#if SOUP_WINDOWS
+    if (interest.empty())
+      Sleep(timeout);  /* WSAPoll does not accept an empty set */
+    else if (::WSAPoll(interest.data(), static_cast<ULONG>(interest.size()), timeout) > 0)
+#else
+    if (::poll(interest.data(), interest.size(), timeout) > 0)
+#endif
+    {
+      for (const auto& pfd : interest) {
+        if (pfd.revents != 0) {
+#if SOUP_POSIX
+          if (pfd.fd == wakepipe[0]) {
+            char buf[64];
+            while (::read(wakepipe[0], buf, sizeof(buf)) > 0);
+            continue;
+          }
+#endif
+          ready.insert(pfd.fd);
+        }
+      }
+    }
+    interest.clear();
+#endif
+  }
+
+  bool EventLoop::isReady(fd_t fd) const noexcept {
+    return ready.count(fd) != 0;
+  }
+
+  bool EventLoop::isReady(soup::Scheduler& sched) const {
+    if (!sched.pending_workers.empty() || sched.workers.empty())
+      return true;
+    for (const auto& w : sched.workers) {
+      if (w->type != soup::WORKER_TYPE_SOCKET || w->holdup_type != soup::Worker::SOCKET)
+        return true;
+      const auto fd = static_cast<fd_t>(static_cast<soup::Socket*>(w.get())->fd);
+      if (fd == (fd_t)-1 || isReady(fd))
+        return true;
+    }
+    return false;
+  }
+
+  bool EventLoop::isReady(const WaitSet& set) const {
+    if (set.deadline != -1 && soup::time::millis() >= set.deadline)
+      return true;
+    for (auto sched : set.scheds) {
+      if (isReady(*sched))
+        return true;
+    }
+    return false;
+  }
+
+  bool EventLoop::isReady(lua_State *L) const {
+    switch (L->waitreason) {
+      case WAIT_SCHED:
+        return isReady(*reinterpret_cast<soup::Scheduler*>(L->waitdata));
+      case WAIT_WORKER:
+        return reinterpret_cast<soup::Worker*>(L->waitdata)->isWorkDone();
+      case WAIT_TIMER:
+        return soup::time::millis() >= L->waituntil;
+      case WAIT_SET:
+        return isReady(*reinterpret_cast<const WaitSet*>(L->waitdata));
+      default:
+        return true;
+    }
+  }
+
+  void EventLoop::block(soup::Scheduler* const *scheds, size_t n, int timeout, std::vector<bool> *ready) {
+    if (timeout < 0 || timeout > MAX_WAIT_MS)
+      timeout = MAX_WAIT_MS;
+    std::vector<pollfd> pollfds;
+    std::vector<size_t> owners;  /* index of the scheduler of each entry in 'pollfds' */
+    if (ready)
+      ready->assign(n, false);
+    for (size_t i = 0; i != n; ++i) {
+      soup::Scheduler& sched = *scheds[i];
+      if (!sched.pending_workers.empty() || sched.workers.empty()) {
+        timeout = 0;
+        if (ready)
+          (*ready)[i] = true;
+      }
+      for (const auto& w : sched.workers) {
+        const auto fd = (w->type == soup::WORKER_TYPE_SOCKET ? static_cast<fd_t>(static_cast<soup::Socket*>(w.get())->fd) : (fd_t)-1);
+        if (w->holdup_type != soup::Worker::SOCKET || fd == (fd_t)-1) {
+          if (timeout > 1)
+            timeout = 1;  /* has work other than waiting for data; tick it again soon */
+          if (ready)
+            (*ready)[i] = true;
+        }
+        else {
+          pollfds.emplace_back(pollfd{ fd, POLLIN });
+          owners.emplace_back(i);
+        }
+      }
+    }
+    int nready;
+#if SOUP_WINDOWS
+    if (pollfds.empty()) {
+      Sleep(timeout);
+      nready = 0;
+    }
+    else
+      nready = ::WSAPoll(pollfds.data(), static_cast<ULONG>(pollfds.size()), timeout);
+#else
+    nready = ::poll(pollfds.data(), pollfds.size(), timeout);
+#endif
+    if (ready && nready > 0) {
+      for (size_t j = 0; j != pollfds.size(); ++j) {
+        if (pollfds[j].revents != 0)
+          (*ready)[owners[j]] = true;
+      }
+    }
+  }
+
+  bool EventLoop::wake() noexcept {
+#if SOUP_LINUX
+    const uint64_t one = 1;
+    (void)!::write(wakefd, &one, sizeof(one));
+    return true;
+#elif SOUP_POSIX
+    const char one = 1;
+    (void)!::write(wakepipe[1], &one, sizeof(one));
+    return true;
+#else
+    return false;
+#endif
+  }
+}
+
+#endif
@@ -0,0 +1,164 @@
+#pragma once
+
+/*
+** Per-state event loop used to park coroutines until whatever they are
+** waiting on (readable socket, finished worker, timer) is ready, so that
+** schedulers can sleep in the kernel instead of polling every millisecond.
+*/
+
+#include "lstate.h"
+
+#include <ctime> // time_t
+
+#include "vendor/Soup/soup/base.hpp"
+
+#if !SOUP_WASM
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#if SOUP_WINDOWS
+#include <winsock2.h>
+#else
+#include <poll.h>
+#endif
+
+#include "vendor/Soup/soup/fwd.hpp"
+#include "vendor/Soup/soup/Worker.hpp"
+
+namespace Pluto {
+  class EventLoop {
+  public:
+#if SOUP_WINDOWS
+    using fd_t = ::SOCKET;
+#else
+    using fd_t = int;
+#endif
+
+    /*
+    ** Even if nothing is ready, 'wait' returns after this many milliseconds so
+    ** that sockets closed from our side (which the kernel won't report) and
+    ** workers on other threads (where we may not have a wake-up channel) are
+    ** still noticed in a timely manner.
+    */
+    static constexpr int MAX_WAIT_MS = 50;
+
+    /* A set of schedulers; the waiting thread is ready as soon as any of them is, or once 'deadline' (ms, -1 = none) passes. */
+    struct WaitSet {
+      std::vector<soup::Scheduler*> scheds;
+      std::time_t deadline = -1;
+    };
+
+  private:
+#if SOUP_LINUX
+    int epfd = -1;
+    int wakefd = -1;
+    uint32_t generation = 0;
+    struct Registration {
+      const void *owner;
+      uint32_t generation;
+    };
+    std::unordered_map<int, Registration> registered;
+#elif SOUP_POSIX
+    int wakepipe[2] = { -1, -1 };
+#endif
+    std::vector<pollfd> interest;
+    std::unordered_set<fd_t> ready;  /* looked up for every parked coroutine on every pass */
+
+  public:
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    [[nodiscard]] static EventLoop& get(lua_State *L);
+
+    /* Adds 'fd' to the set of descriptors the next 'wait' should watch for readability. */
+    void want(fd_t fd, const void *owner);
+
+    /*
+    ** Adds the sockets 'sched' is waiting on to the interest set.
+    ** Returns false if 'sched' has work that can't be expressed as a readable socket,
+    ** in which case it should simply be ticked again soon.
+    */
+    [[nodiscard]] bool want(soup::Scheduler& sched);
+    [[nodiscard]] bool want(const WaitSet& set);
+
+    /* Blocks until one of the wanted descriptors is readable, 'wake' is called, or 'timeout' (ms, -1 = MAX_WAIT_MS) passes. */
+    void wait(int timeout);
+
+    /* Was 'fd' reported as readable by the last 'wait'? */
+    [[nodiscard]] bool isReady(fd_t fd) const noexcept;
+
+    /* Is 'sched' ready to make progress, based on the last 'wait'? */
+    [[nodiscard]] bool isReady(soup::Scheduler& sched) const;
+    [[nodiscard]] bool isReady(const WaitSet& set) const;
+
+    /* Is 'L' ready to be resumed, based on the reason it gave for its last yield? */
+    [[nodiscard]] bool isReady(lua_State *L) const;
+
+    /*
+    ** Interrupts an ongoing or the next call to 'wait'. May be called from any thread.
+    ** Returns false if this platform has no wake-up channel.
+    */
+    bool wake() noexcept;
+
+    /*
+    ** Blocks until one of the sockets of the given schedulers is readable or 'timeout' (ms, -1 = MAX_WAIT_MS) passes.
+    ** This is a one-off poll for blocking calls outside of a scheduler and does not touch any event loop's state.
+    ** If 'ready' is given, it is set to which of the schedulers have something to tick.
+    */
+    static void block(soup::Scheduler* const *scheds, size_t n, int timeout, std::vector<bool> *ready = nullptr);
+
+    static void block(soup::Scheduler& sched, int timeout = -1) {
+      soup::Scheduler *p = &sched;
+      block(&p, 1, timeout);
+    }
+
+    [[nodiscard]] static bool canWake() noexcept {
+#if SOUP_POSIX
+      return true;
+#else
+      return false;
+#endif
+    }
+  };
+}
+
+/*
+** Functions to record why a thread is about to yield. Must be called right
+** before 'lua_yieldk'; 'lua_resume' clears the reason again.
+*/
+
+inline void pluto_waitsched (lua_State *L, soup::Scheduler *sched) {
+  L->waitreason = WAIT_SCHED;
+  L->waitdata = sched;
+}
+
+inline void pluto_waitworker (lua_State *L, soup::Worker *w) {
+  L->waitreason = WAIT_WORKER;
+  L->waitdata = w;
+}
+
+inline void pluto_waituntil (lua_State *L, std::time_t millis) {
+  L->waitreason = WAIT_TIMER;
+  L->waituntil = millis;
+}
+
+inline void pluto_waitset (lua_State *L, Pluto::EventLoop::WaitSet *set) {
+  L->waitreason = WAIT_SET;
+  L->waitdata = set;
+}
+
+#else
+
+inline void pluto_waitsched (lua_State *, void *) {}
+inline void pluto_waitworker (lua_State *, void *) {}
+inline void pluto_waituntil (lua_State *L, std::time_t millis) {
+  L->waitreason = WAIT_TIMER;
+  L->waituntil = millis;
+}
+
+#endif
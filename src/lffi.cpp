@@ -1,10 +1,16 @@
 #define LUA_LIB
 #include "lualib.h"
 
-#include <cstring> // strcmp
+#include <algorithm> // fill_n, find_if
+#include <array>
+#include <cstring> // strcmp, memcpy
+#include <mutex>
 #include <unordered_set>
+#include <utility> // index_sequence
 #include <vector>
 
+#include "lvectorops.hpp"
+
 #include "vendor/Soup/soup/ffi.hpp"
 #include "vendor/Soup/soup/rflFunc.hpp"
 #include "vendor/Soup/soup/rflParser.hpp"
@@ -26,10 +32,10 @@ enum FfiType : uint8_t {
   FFI_F64,
   FFI_PTR,
   FFI_STR,
+  FFI_STRUCT,  /* by value; only used for parameters & return values */
 };
 
-[[nodiscard]] static FfiType check_ffi_type (lua_State *L, int i) {
-  const char *str = luaL_checkstring(L, i);
+[[nodiscard]] static FfiType ffi_type_from_string (const char *str) noexcept {
   if (strcmp(str, "void") == 0) return FFI_VOID;
   if (strcmp(str, "i8") == 0) return FFI_I8;
   if (strcmp(str, "i16") == 0) return FFI_I16;
@@ -43,7 +49,15 @@ enum FfiType : uint8_t {
   if (strcmp(str, "f64") == 0) return FFI_F64;
   if (strcmp(str, "ptr") == 0) return FFI_PTR;
   if (strcmp(str, "str") == 0) return FFI_STR;
-  luaL_error(L, "unknown type '%s'", str);
+  return FFI_UNKNOWN;
+}
+
+[[nodiscard]] static FfiType check_ffi_type (lua_State *L, int i) {
+  const char *str = luaL_checkstring(L, i);
+  const FfiType type = ffi_type_from_string(str);
+  if (l_unlikely(type == FFI_UNKNOWN))
+    luaL_error(L, "unknown type '%s'", str);
+  return type;
 }
 
 [[nodiscard]] static FfiType rfl_type_to_ffi_type (const soup::rflType& type) noexcept {
@@ -82,7 +96,8 @@ enum FfiType : uint8_t {
 static int push_ffi_value (lua_State *L, FfiType type, void *value) {
   switch (type) {
     case FFI_UNKNOWN:
-      /* 'handling' this case makes the compiler happy */
+    case FFI_STRUCT:
+      /* 'handling' these cases makes the compiler happy */
       break;
     case FFI_VOID:
       return 0;
@@ -126,10 +141,14 @@ static int push_ffi_value (lua_State *L, FfiType type, void *value) {
   SOUP_UNREACHABLE;
 }
 
+/* The address a userdata is passed as: that of its elements for typed arrays, and of its code for callbacks. */
+static void *ffi_userdata_address (lua_State *L, int i);
+
 static uint64_t check_ffi_value (lua_State *L, int i, FfiType type) {
   switch (type) {
     case FFI_UNKNOWN:
-      /* 'handling' this case makes the compiler happy */
+    case FFI_STRUCT:
+      /* 'handling' these cases makes the compiler happy */
       break;
     case FFI_VOID:
       return 0;
@@ -160,8 +179,9 @@ static uint64_t check_ffi_value (lua_State *L, int i, FfiType type) {
       static_assert(sizeof(double) == sizeof(uint64_t));
     }
     case FFI_PTR:
-      if (lua_type(L, i) != LUA_TUSERDATA)
-        luaL_checktype(L, i, LUA_TLIGHTUSERDATA);
+      if (lua_type(L, i) == LUA_TUSERDATA)
+        return reinterpret_cast<uint64_t>(ffi_userdata_address(L, i));
+      luaL_checktype(L, i, LUA_TLIGHTUSERDATA);
       return reinterpret_cast<uint64_t>(lua_touserdata(L, i));
     case FFI_STR:
       if (lua_type(L, i) == LUA_TNIL)
@@ -193,10 +213,492 @@ static void *weaklycheckudata (lua_State *L, int ud, const char *tname) {
   return p;
 }
 
+struct FfiStruct : public soup::rflStruct {
+  inline auto operator=(soup::rflStruct&& strct) noexcept {
+    return soup::rflStruct::operator=(std::move(strct));
+  }
+
+  [[nodiscard]] const soup::rflType& getMemberType(const std::string& memname) const {
+    for (const auto& mem : this->members) {
+      if (mem.name == memname) {
+        return mem.type;
+      }
+    }
+    SOUP_ASSERT_UNREACHABLE;
+  }
+};
+
+/*
+** {======================================================
+** Native calling convention
+** =======================================================
+**
+** Foreign functions are called by casting their address to a function
+** pointer type whose parameters mirror the argument registers of the
+** platform, so the compiler emits the actual calling sequence. On x86-64
+** System V & AArch64, that's all integer registers, then all floating-point
+** registers, then a number of 8-byte stack slots; on Windows x64, it's four
+** positional registers, each of which is either an integer or a
+** floating-point one. When a function is wrapped, every parameter is assigned
+** its register(s) or stack slot(s) and an invoker is picked for the return
+** type, so a call only has to convert its arguments into an FfiFrame.
+**
+** Other platforms fall back to soup::ffi::call, which only passes integers.
+*/
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define FFI_ABI_SYSV
+static constexpr int FFI_INT_REGS = 6;
+static constexpr int FFI_FP_REGS = 8;
+static constexpr int FFI_MEM_RET_INT_REGS = 5;  /* the hidden return pointer takes %rdi */
+#elif defined(_M_X64) || (defined(__x86_64__) && defined(_WIN32))
+#define FFI_ABI_WIN64
+static constexpr int FFI_INT_REGS = 4;  /* positions, each either in 'ints' or in 'fps' */
+static constexpr int FFI_FP_REGS = 4;
+static constexpr int FFI_MEM_RET_INT_REGS = 3;  /* the hidden return pointer takes the first position */
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define FFI_ABI_ARM64
+static constexpr int FFI_INT_REGS = 8;
+static constexpr int FFI_FP_REGS = 8;
+static constexpr int FFI_MEM_RET_INT_REGS = 8;  /* the hidden return pointer goes in x8 */
+#else
+#define FFI_ABI_GENERIC
+static constexpr int FFI_INT_REGS = soup::ffi::MAX_ARGS;
+static constexpr int FFI_FP_REGS = 0;
+static constexpr int FFI_MEM_RET_INT_REGS = 0;
+#endif
+
+#ifdef FFI_ABI_GENERIC
+static constexpr int FFI_MAX_STACK = 0;
+#else
+static constexpr int FFI_MAX_STACK = 32;
+#endif
+static constexpr size_t FFI_MAX_STRUCT = 256;  /* bytes that can be passed or returned by value */
+static constexpr size_t FFI_MAX_SCRATCH = 1024;  /* bytes for the copies of structs passed by reference */
+static constexpr uint16_t FFI_NO_SCRATCH = 0xFFFF;
+
+enum FfiClass : uint8_t {
+  FFI_CLASS_INT,
+  FFI_CLASS_FP,
+  FFI_CLASS_STACK,
+};
+
+/* Where (a part of) an argument is passed. */
+struct FfiPart {
+  FfiClass cls;
+  uint8_t index;  /* register, or first stack slot */
+  uint16_t offset;  /* of the part within its struct */
+  uint16_t size;
+};
+
+struct FfiParam {
+  FfiType type;
+  uint8_t nparts = 1;
+  uint16_t size = 0;  /* of a struct */
+  uint16_t scratch = FFI_NO_SCRATCH;  /* for a struct passed by reference, the offset of its copy; parts[0] receives the address */
+  FfiPart parts[4];
+};
+
+enum FfiRetKind : uint8_t {
+  FFI_RET_INT,  /* also void & pointers */
+  FFI_RET_F32,
+  FFI_RET_F64,
+  FFI_RET_INT_INT,  /* structs returned in two registers */
+  FFI_RET_FP_FP,
+  FFI_RET_INT_FP,
+  FFI_RET_FP_INT,
+  FFI_RET_HFA_F32,  /* AArch64 homogeneous floating-point aggregates */
+  FFI_RET_HFA_F64,
+  FFI_RET_MEM,  /* structs returned through a hidden pointer */
+};
+
+struct FfiRetIntInt { uint64_t a, b; };
+struct FfiRetFpFp { double a, b; };
+struct FfiRetIntFp { uint64_t a; double b; };
+struct FfiRetFpInt { double a; uint64_t b; };
+struct FfiRetHfaF32 { float v[4]; };
+struct FfiRetHfaF64 { double v[4]; };
+struct FfiRetMem { alignas(16) unsigned char data[FFI_MAX_STRUCT]; };
+
+struct FfiFrame {
+  std::array<uint64_t, FFI_INT_REGS> ints;
+  std::array<double, FFI_FP_REGS> fps;
+  std::array<uint64_t, FFI_MAX_STACK> stack;
+#ifdef FFI_ABI_GENERIC
+  size_t nints;
+#endif
+};
+
+using FfiInvoker = void(*)(void *fn, const FfiFrame& fr, void *ret);
+
+template <size_t, class T> using FfiRepeat = T;
+
+#if defined(FFI_ABI_SYSV) || defined(FFI_ABI_ARM64)
+template <class R, bool VARIADIC, size_t... I, size_t... F, size_t... S>
+static R ffi_native_call (void *fn, const FfiFrame& fr, std::index_sequence<I...>, std::index_sequence<F...>, std::index_sequence<S...>) {
+  if constexpr (VARIADIC) {
+    /* through a variadic prototype, %al receives the number of vector registers, as System V requires */
+    return reinterpret_cast<R(*)(FfiRepeat<I, uint64_t>..., ...)>(fn)(fr.ints[I]..., fr.fps[F]..., fr.stack[S]...);
+  }
+  else {
+    return reinterpret_cast<R(*)(FfiRepeat<I, uint64_t>..., FfiRepeat<F, double>..., FfiRepeat<S, uint64_t>...)>(fn)(fr.ints[I]..., fr.fps[F]..., fr.stack[S]...);
+  }
+}
+
+template <class R, int NINT, bool VARIADIC, int NSTACK>
+static void ffi_invoke (void *fn, const FfiFrame& fr, void *ret) {
+  R r = ffi_native_call<R, VARIADIC>(fn, fr, std::make_index_sequence<NINT>(), std::make_index_sequence<FFI_FP_REGS>(), std::make_index_sequence<NSTACK>());
+  memcpy(ret, &r, sizeof(R));
+}
+
+template <int NSTACK, bool VARIADIC>
+[[nodiscard]] static FfiInvoker ffi_select_invoker (FfiRetKind kind, unsigned mask) noexcept {
+  (void)mask;
+#ifndef FFI_ABI_SYSV
+  static_assert(!VARIADIC);  /* AArch64 passes variadic arguments like named ones, barring Apple's stack slots */
+#endif
+  switch (kind) {
+    case FFI_RET_INT: return &ffi_invoke<uint64_t, FFI_INT_REGS, VARIADIC, NSTACK>;
+    case FFI_RET_F32: return &ffi_invoke<float, FFI_INT_REGS, VARIADIC, NSTACK>;
+    case FFI_RET_F64: return &ffi_invoke<double, FFI_INT_REGS, VARIADIC, NSTACK>;
+    case FFI_RET_INT_INT: return &ffi_invoke<FfiRetIntInt, FFI_INT_REGS, VARIADIC, NSTACK>;
+#ifdef FFI_ABI_SYSV
+    case FFI_RET_FP_FP: return &ffi_invoke<FfiRetFpFp, FFI_INT_REGS, VARIADIC, NSTACK>;
+    case FFI_RET_INT_FP: return &ffi_invoke<FfiRetIntFp, FFI_INT_REGS, VARIADIC, NSTACK>;
+    case FFI_RET_FP_INT: return &ffi_invoke<FfiRetFpInt, FFI_INT_REGS, VARIADIC, NSTACK>;
+#else
+    case FFI_RET_HFA_F32: return &ffi_invoke<FfiRetHfaF32, FFI_INT_REGS, VARIADIC, NSTACK>;
+    case FFI_RET_HFA_F64: return &ffi_invoke<FfiRetHfaF64, FFI_INT_REGS, VARIADIC, NSTACK>;
+#endif
+    case FFI_RET_MEM: return &ffi_invoke<FfiRetMem, FFI_MEM_RET_INT_REGS, VARIADIC, NSTACK>;
+    default: break;
+  }
+  SOUP_UNREACHABLE;
+}
+#elif defined(FFI_ABI_WIN64)
+template <bool FP> struct FfiWin64Reg {
+  using type = uint64_t;
+  [[nodiscard]] static uint64_t get (const FfiFrame& fr, size_t i) noexcept { return fr.ints[i]; }
+};
+
+template <> struct FfiWin64Reg<true> {
+  using type = double;
+  [[nodiscard]] static double get (const FfiFrame& fr, size_t i) noexcept { return fr.fps[i]; }
+};
+
+template <class R, unsigned MASK, size_t... P, size_t... S>
+static R ffi_native_call (void *fn, const FfiFrame& fr, std::index_sequence<P...>, std::index_sequence<S...>) {
+  return reinterpret_cast<R(*)(typename FfiWin64Reg<((MASK >> P) & 1) != 0>::type..., FfiRepeat<S, uint64_t>...)>(fn)(FfiWin64Reg<((MASK >> P) & 1) != 0>::get(fr, P)..., fr.stack[S]...);
+}
+
+template <class R, int NREG, unsigned MASK, int NSTACK>
+static void ffi_invoke (void *fn, const FfiFrame& fr, void *ret) {
+  R r = ffi_native_call<R, MASK>(fn, fr, std::make_index_sequence<NREG>(), std::make_index_sequence<NSTACK>());
+  memcpy(ret, &r, sizeof(R));
+}
+
+template <class R, int NREG, int NSTACK, unsigned... MASK>
+[[nodiscard]] static FfiInvoker ffi_win64_invoker (unsigned mask, std::integer_sequence<unsigned, MASK...>) noexcept {
+  static constexpr FfiInvoker invokers[] = { &ffi_invoke<R, NREG, MASK, NSTACK>... };
+  return invokers[mask];
+}
+
+/* 'mask' has a bit set for every position that is passed in a floating-point register. */
+template <int NSTACK, bool VARIADIC>
+[[nodiscard]] static FfiInvoker ffi_select_invoker (FfiRetKind kind, unsigned mask) noexcept {
+  switch (kind) {
+    case FFI_RET_INT: return ffi_win64_invoker<uint64_t, FFI_INT_REGS, NSTACK>(mask, std::make_integer_sequence<unsigned, 1 << FFI_INT_REGS>());
+    case FFI_RET_F32: return ffi_win64_invoker<float, FFI_INT_REGS, NSTACK>(mask, std::make_integer_sequence<unsigned, 1 << FFI_INT_REGS>());
+    case FFI_RET_F64: return ffi_win64_invoker<double, FFI_INT_REGS, NSTACK>(mask, std::make_integer_sequence<unsigned, 1 << FFI_INT_REGS>());
+    case FFI_RET_MEM: return ffi_win64_invoker<FfiRetMem, FFI_MEM_RET_INT_REGS, NSTACK>(mask, std::make_integer_sequence<unsigned, 1 << FFI_MEM_RET_INT_REGS>());
+    default: break;
+  }
+  SOUP_UNREACHABLE;
+}
+#else
+static void ffi_invoke (void *fn, const FfiFrame& fr, void *ret) {
+  uintptr_t args[soup::ffi::MAX_ARGS];
+  for (size_t i = 0; i != fr.nints; ++i)
+    args[i] = static_cast<uintptr_t>(fr.ints[i]);
+  const uint64_t r = soup::ffi::call(fn, args, fr.nints);
+  memcpy(ret, &r, sizeof(r));
+}
+
+template <int NSTACK, bool VARIADIC>
+[[nodiscard]] static FfiInvoker ffi_select_invoker (FfiRetKind kind, unsigned mask) noexcept {
+  (void)kind;
+  (void)mask;
+  return &ffi_invoke;
+}
+#endif
+
+/* The number of stack slots an invoker passes; the smallest bucket that fits. */
+[[nodiscard]] static int ffi_stack_bucket (int nstack, bool variadic) noexcept {
+  if (variadic) return FFI_MAX_STACK;
+  if (nstack == 0) return 0;
+  if (nstack <= 4) return 4;
+  return FFI_MAX_STACK;
+}
+
+[[nodiscard]] static FfiInvoker ffi_select_invoker (FfiRetKind kind, unsigned mask, int nstack, bool variadic) noexcept {
+#ifdef FFI_ABI_SYSV
+  if (variadic) return ffi_select_invoker<FFI_MAX_STACK, true>(kind, mask);
+#endif
+  switch (ffi_stack_bucket(nstack, variadic)) {
+    case 0: return ffi_select_invoker<0, false>(kind, mask);
+    case 4: return ffi_select_invoker<4, false>(kind, mask);
+    default: return ffi_select_invoker<FFI_MAX_STACK, false>(kind, mask);
+  }
+}
+
+[[nodiscard]] static bool ffi_is_fp (FfiType type) noexcept {
+  return type == FFI_F32 || type == FFI_F64;
+}
+
+/* Hands out registers & stack slots in the order the ABI does. */
+struct FfiAllocator {
+  uint8_t ngrn = 0;  /* next integer register; on Windows x64, the next position */
+  uint8_t nsrn = 0;  /* next floating-point register */
+  uint8_t nsaa = 0;  /* next stack slot */
+  uint8_t max_int = FFI_INT_REGS;
+  bool ints_only = false;  /* variadic arguments on Windows don't go into floating-point registers */
+  bool stack_only = false;  /* variadic arguments on Apple's AArch64 all go on the stack */
+
+  [[nodiscard]] bool stack (FfiPart& part, size_t size) noexcept {
+    const size_t nslots = (size + 7) / 8;
+    if (nsaa + nslots > FFI_MAX_STACK)
+      return false;
+    part.cls = FFI_CLASS_STACK;
+    part.index = nsaa;
+    nsaa += static_cast<uint8_t>(nslots);
+    return true;
+  }
+};
+
+[[nodiscard]] static bool ffi_assign_scalar (FfiAllocator& a, FfiType type, FfiPart& part) noexcept {
+  part.offset = 0;
+  part.size = 8;
+#if defined(FFI_ABI_WIN64)
+  if (a.ngrn < a.max_int) {
+    part.cls = (ffi_is_fp(type) && !a.ints_only) ? FFI_CLASS_FP : FFI_CLASS_INT;
+    part.index = a.ngrn++;
+    return true;
+  }
+  ++a.ngrn;
+  return a.stack(part, 8);
+#elif defined(FFI_ABI_GENERIC)
+  if (ffi_is_fp(type) || a.ngrn == a.max_int)
+    return false;
+  part.cls = FFI_CLASS_INT;
+  part.index = a.ngrn++;
+  return true;
+#else
+  if (!a.stack_only) {
+    if (ffi_is_fp(type) && !a.ints_only) {
+      if (a.nsrn < FFI_FP_REGS) {
+        part.cls = FFI_CLASS_FP;
+        part.index = a.nsrn++;
+        return true;
+      }
+    }
+    else if (a.ngrn < a.max_int) {
+      part.cls = FFI_CLASS_INT;
+      part.index = a.ngrn++;
+      return true;
+    }
+#if defined(FFI_ABI_ARM64) && defined(__APPLE__)
+    /* Apple packs named stack arguments by their natural size, which our 8-byte slots can't express */
+    if (type != FFI_I64 && type != FFI_U64 && type != FFI_F64 && type != FFI_PTR && type != FFI_STR)
+      return false;
+#endif
+  }
+  return a.stack(part, 8);
+#endif
+}
+
+struct FfiMember {
+  size_t offset;
+  size_t size;
+  FfiType type;
+};
+
+[[nodiscard]] static std::vector<FfiMember> ffi_struct_layout (const FfiStruct& strct) {
+  std::vector<FfiMember> layout;
+  layout.reserve(strct.members.size());
+  for (const auto& mem : strct.members)
+    layout.emplace_back(FfiMember{ strct.getOffsetOf(mem.name), mem.type.getSize(), rfl_type_to_ffi_type(mem.type) });
+  return layout;
+}
+
+#ifdef FFI_ABI_SYSV
+/* System V classifies each eightbyte of a small struct as SSE if it only holds floating-point members. */
+[[nodiscard]] static bool ffi_eightbyte_is_fp (const std::vector<FfiMember>& layout, size_t eightbyte) noexcept {
+  bool any = false;
+  for (const auto& mem : layout) {
+    if (mem.offset / 8 == eightbyte) {
+      if (!ffi_is_fp(mem.type))
+        return false;
+      any = true;
+    }
+  }
+  return any;
+}
+#endif
+
+#ifdef FFI_ABI_ARM64
+/* Returns the member type of a homogeneous floating-point aggregate, or FFI_UNKNOWN. */
+[[nodiscard]] static FfiType ffi_hfa_type (const std::vector<FfiMember>& layout) noexcept {
+  if (layout.empty() || layout.size() > 4 || !ffi_is_fp(layout[0].type))
+    return FFI_UNKNOWN;
+  for (const auto& mem : layout) {
+    if (mem.type != layout[0].type)
+      return FFI_UNKNOWN;
+  }
+  return layout[0].type;
+}
+#endif
+
+[[nodiscard]] static bool ffi_assign_struct (FfiAllocator& a, const FfiStruct& strct, FfiParam& p, size_t& scratch) {
+  const auto layout = ffi_struct_layout(strct);
+  const size_t size = strct.getSize();
+  p.size = static_cast<uint16_t>(size);
+  p.parts[0].offset = 0;
+  p.parts[0].size = p.size;
+  const auto by_reference = [&] {
+    p.scratch = static_cast<uint16_t>(scratch);
+    scratch += (size + 15) & ~size_t(15);
+    return scratch <= FFI_MAX_SCRATCH && ffi_assign_scalar(a, FFI_PTR, p.parts[0]);
+  };
+  (void)by_reference;
+  if (size == 0) {
+    p.nparts = 0;
+    return true;
+  }
+#if defined(FFI_ABI_SYSV)
+  if (size <= 16) {
+    const size_t nwords = (size + 7) / 8;
+    size_t nfp = 0;
+    for (size_t i = 0; i != nwords; ++i)
+      nfp += ffi_eightbyte_is_fp(layout, i);
+    if (a.ngrn + (nwords - nfp) <= a.max_int && a.nsrn + nfp <= FFI_FP_REGS) {
+      for (size_t i = 0; i != nwords; ++i) {
+        FfiPart& part = p.parts[i];
+        if (ffi_eightbyte_is_fp(layout, i)) {
+          part.cls = FFI_CLASS_FP;
+          part.index = a.nsrn++;
+        }
+        else {
+          part.cls = FFI_CLASS_INT;
+          part.index = a.ngrn++;
+        }
+        part.offset = static_cast<uint16_t>(i * 8);
+        part.size = static_cast<uint16_t>(size - i * 8 < 8 ? size - i * 8 : 8);
+      }
+      p.nparts = static_cast<uint8_t>(nwords);
+      return true;
+    }
+  }
+  return a.stack(p.parts[0], size);  /* larger structs, and those that don't fit into registers, are copied onto the stack */
+#elif defined(FFI_ABI_ARM64)
+  if (const FfiType hfa = ffi_hfa_type(layout); hfa != FFI_UNKNOWN) {
+    if (a.nsrn + layout.size() <= FFI_FP_REGS) {
+      for (size_t i = 0; i != layout.size(); ++i) {
+        FfiPart& part = p.parts[i];
+        part.cls = FFI_CLASS_FP;
+        part.index = a.nsrn++;
+        part.offset = static_cast<uint16_t>(layout[i].offset);
+        part.size = static_cast<uint16_t>(layout[i].size);
+      }
+      p.nparts = static_cast<uint8_t>(layout.size());
+      return true;
+    }
+    a.nsrn = FFI_FP_REGS;
+  }
+  else if (size > 16) {
+    return by_reference();
+  }
+  else {
+    const size_t nwords = (size + 7) / 8;
+    if (a.ngrn + nwords <= a.max_int) {
+      for (size_t i = 0; i != nwords; ++i) {
+        FfiPart& part = p.parts[i];
+        part.cls = FFI_CLASS_INT;
+        part.index = a.ngrn++;
+        part.offset = static_cast<uint16_t>(i * 8);
+        part.size = static_cast<uint16_t>(size - i * 8 < 8 ? size - i * 8 : 8);
+      }
+      p.nparts = static_cast<uint8_t>(nwords);
+      return true;
+    }
+    a.ngrn = a.max_int;
+  }
+#ifdef __APPLE__
+  return false;
+#else
+  return a.stack(p.parts[0], size);
+#endif
+#elif defined(FFI_ABI_WIN64)
+  if (size == 1 || size == 2 || size == 4 || size == 8) {  /* passed like an integer of the same size */
+    if (!ffi_assign_scalar(a, FFI_U64, p.parts[0]))
+      return false;
+    p.parts[0].cls = (p.parts[0].cls == FFI_CLASS_STACK) ? FFI_CLASS_STACK : FFI_CLASS_INT;
+    p.parts[0].size = p.size;
+    return true;
+  }
+  return by_reference();
+#else
+  (void)a;
+  (void)layout;
+  (void)scratch;
+  return false;
+#endif
+}
+
+[[nodiscard]] static bool ffi_classify_struct_return (const FfiStruct& strct, FfiRetKind& kind) {
+  const auto layout = ffi_struct_layout(strct);
+  const size_t size = strct.getSize();
+  (void)layout;
+#if defined(FFI_ABI_SYSV)
+  if (size > 16)
+    kind = FFI_RET_MEM;
+  else if (size > 8)
+    kind = ffi_eightbyte_is_fp(layout, 0)
+      ? (ffi_eightbyte_is_fp(layout, 1) ? FFI_RET_FP_FP : FFI_RET_FP_INT)
+      : (ffi_eightbyte_is_fp(layout, 1) ? FFI_RET_INT_FP : FFI_RET_INT_INT);
+  else
+    kind = ffi_eightbyte_is_fp(layout, 0) ? FFI_RET_F64 : FFI_RET_INT;
+  return true;
+#elif defined(FFI_ABI_ARM64)
+  if (const FfiType hfa = ffi_hfa_type(layout); hfa != FFI_UNKNOWN)
+    kind = (hfa == FFI_F32) ? FFI_RET_HFA_F32 : FFI_RET_HFA_F64;
+  else if (size > 16)
+    kind = FFI_RET_MEM;
+  else
+    kind = (size > 8) ? FFI_RET_INT_INT : FFI_RET_INT;
+  return true;
+#elif defined(FFI_ABI_WIN64)
+  kind = (size == 1 || size == 2 || size == 4 || size == 8) ? FFI_RET_INT : FFI_RET_MEM;
+  return true;
+#else
+  (void)kind;
+  (void)size;
+  return false;
+#endif
+}
+
+/* }====================================================== */
+
 struct FfiFuncWrapper {
   void* addr;
-  std::vector<FfiType> args;
-  FfiType ret;
+  std::vector<FfiParam> params;
+  FfiType ret = FFI_VOID;
+  FfiRetKind ret_kind = FFI_RET_INT;
+  uint16_t ret_size = 0;  /* of a struct */
+  bool variadic = false;
+  uint8_t nstack = 0;  /* stack slots passed by the invoker */
+  size_t scratch = 0;
+  FfiAllocator alloc;  /* after the fixed parameters */
+  FfiInvoker invoker = nullptr;
   soup::SharedPtr<soup::SharedLibrary> owner;
 };
 
@@ -218,37 +720,223 @@ struct FfiFuncWrapper {
   return (FfiFuncWrapper*)luaL_checkudata(L, i, "pluto:ffi-funcwrapper");
 }
 
+/* Pushes the struct type that ffi.cdef declared as 'name', or nothing & returns false. */
+[[nodiscard]] static bool push_named_struct (lua_State *L, const char *name) {
+  if (lua_getfield(L, LUA_REGISTRYINDEX, "pluto:ffi") == LUA_TTABLE) {
+    if (lua_getfield(L, -1, name) == LUA_TUSERDATA && weaklytestudata(L, -1, "pluto:ffi-struct-type")) {
+      lua_remove(L, -2);
+      return true;
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return false;
+}
+
+/* Like check_ffi_type, but also accepts struct types & their names, pushing the struct type for FFI_STRUCT and nil otherwise. */
+[[nodiscard]] static FfiType check_ffi_type_or_struct (lua_State *L, int i) {
+  if (lua_type(L, i) == LUA_TSTRING) {
+    const FfiType type = ffi_type_from_string(lua_tostring(L, i));
+    if (type != FFI_UNKNOWN) {
+      lua_pushnil(L);
+      return type;
+    }
+    if (push_named_struct(L, lua_tostring(L, i)))
+      return FFI_STRUCT;
+    luaL_error(L, "unknown type '%s'", lua_tostring(L, i));
+  }
+  weaklycheckudata(L, i, "pluto:ffi-struct-type");
+  lua_pushvalue(L, i);
+  return FFI_STRUCT;
+}
+
+/* Like rfl_type_to_ffi_type, but also resolves struct names, pushing the struct type for FFI_STRUCT and nil otherwise. */
+[[nodiscard]] static FfiType rfl_type_to_ffi_type_or_struct (lua_State *L, const soup::rflType& type) {
+  const FfiType t = rfl_type_to_ffi_type(type);
+  if (t == FFI_UNKNOWN && push_named_struct(L, type.name.c_str()))
+    return FFI_STRUCT;
+  lua_pushnil(L);
+  return t;
+}
+
+static void ffi_set_return (lua_State *L, FfiFuncWrapper *fw, FfiType type, const FfiStruct *strct) {
+  fw->ret = type;
+  if (type == FFI_STRUCT) {
+    if (l_unlikely(strct->getSize() > FFI_MAX_STRUCT || !ffi_classify_struct_return(*strct, fw->ret_kind)))
+      luaL_error(L, "struct '%s' can't be returned by value", strct->name.c_str());
+    fw->ret_size = static_cast<uint16_t>(strct->getSize());
+    if (fw->ret_kind == FFI_RET_MEM)
+      fw->alloc.max_int = FFI_MEM_RET_INT_REGS;
+  }
+  else if (type == FFI_F32)
+    fw->ret_kind = FFI_RET_F32;
+  else if (type == FFI_F64)
+    fw->ret_kind = FFI_RET_F64;
+#ifdef FFI_ABI_GENERIC
+  if (l_unlikely(fw->ret_kind != FFI_RET_INT))
+    luaL_error(L, "floating-point & struct return values are not supported on this platform");
+#endif
+}
+
+static void ffi_add_param (lua_State *L, FfiFuncWrapper *fw, FfiType type, const FfiStruct *strct) {
+  FfiParam& p = fw->params.emplace_back();
+  p.type = type;
+  bool ok;
+  if (type == FFI_STRUCT) {
+    if (l_unlikely(strct->getSize() > FFI_MAX_STRUCT))
+      luaL_error(L, "struct '%s' is too large to be passed by value", strct->name.c_str());
+    ok = ffi_assign_struct(fw->alloc, *strct, p, fw->scratch);
+  }
+  else {
+    ok = ffi_assign_scalar(fw->alloc, type, p.parts[0]);
+  }
+  if (l_unlikely(!ok)) {
+#ifdef FFI_ABI_GENERIC
+    if (type == FFI_STRUCT || ffi_is_fp(type))
+      luaL_error(L, "floating-point & struct parameters are not supported on this platform");
+#endif
+    luaL_error(L, "function has too many parameters");
+  }
+}
+
+static void ffi_finish (FfiFuncWrapper *fw) {
+  unsigned mask = 0;
+  for (const auto& p : fw->params) {
+    for (uint8_t i = 0; i != p.nparts; ++i) {
+      if (p.parts[i].cls == FFI_CLASS_FP)
+        mask |= (1u << p.parts[i].index);
+    }
+  }
+  fw->nstack = static_cast<uint8_t>(ffi_stack_bucket(fw->alloc.nsaa, fw->variadic));
+  fw->invoker = ffi_select_invoker(fw->ret_kind, mask, fw->alloc.nsaa, fw->variadic);
+}
+
+[[nodiscard]] static FfiType ffi_vararg_type (lua_State *L, int i) noexcept {
+  switch (lua_type(L, i)) {
+    case LUA_TNUMBER: return lua_isinteger(L, i) ? FFI_I64 : FFI_F64;  /* C promotes float to double */
+    case LUA_TSTRING: case LUA_TNIL: return FFI_STR;
+    case LUA_TUSERDATA: case LUA_TLIGHTUSERDATA: return FFI_PTR;
+    default: return FFI_I64;  /* raises a type error */
+  }
+}
+
+static void ffi_put (FfiFrame& fr, const FfiPart& part, uint64_t word) noexcept {
+  switch (part.cls) {
+    case FFI_CLASS_INT: fr.ints[part.index] = word; break;
+    case FFI_CLASS_FP: memcpy(&fr.fps[part.index], &word, sizeof(word)); break;
+    case FFI_CLASS_STACK: fr.stack[part.index] = word; break;
+  }
+}
+
+static void ffi_set_arg (lua_State *L, int i, const FfiParam& p, FfiFrame& fr, unsigned char *scratch) {
+  if (p.type != FFI_STRUCT) {
+    ffi_put(fr, p.parts[0], check_ffi_value(L, i, p.type));
+    return;
+  }
+  luaL_checktype(L, i, LUA_TUSERDATA);
+  luaL_argcheck(L, lua_rawlen(L, i) >= p.size, i, "struct is too small");
+  const auto data = static_cast<const unsigned char*>(lua_touserdata(L, i));
+  if (p.scratch != FFI_NO_SCRATCH) {
+    memcpy(scratch + p.scratch, data, p.size);  /* the callee owns its copy */
+    ffi_put(fr, p.parts[0], reinterpret_cast<uint64_t>(scratch + p.scratch));
+    return;
+  }
+  for (uint8_t j = 0; j != p.nparts; ++j) {
+    const FfiPart& part = p.parts[j];
+    if (part.cls == FFI_CLASS_STACK) {
+      memcpy(&fr.stack[part.index], data + part.offset, part.size);
+    }
+    else {
+      uint64_t word = 0;
+      memcpy(&word, data + part.offset, part.size);
+      ffi_put(fr, part, word);
+    }
+  }
+}
+
+/*
+** The Pluto thread that is calling a foreign function on this OS thread.
+** Callbacks run on it, and report their errors to it.
+*/
+static thread_local lua_State *ffi_caller = nullptr;
+static thread_local bool ffi_callback_failed = false;  /* its address also keys the error in the registry */
+
+static void ffi_raise_callback_error (lua_State *L) {
+  ffi_callback_failed = false;
+  lua_rawgetp(L, LUA_REGISTRYINDEX, &ffi_callback_failed);
+  lua_pushnil(L);
+  lua_rawsetp(L, LUA_REGISTRYINDEX, &ffi_callback_failed);
+  lua_error(L);
+}
+
 #ifdef PLUTO_FFI_CALL_HOOK
 extern bool PLUTO_FFI_CALL_HOOK (lua_State *L, void *addr);
 #endif
 
+static int ffi_push_new (lua_State *L, int i);
+
 static int ffi_funcwrapper_call (lua_State *L) {
-  auto fw = checkfuncwrapper(L, lua_upvalueindex(1));
+  const auto fw = static_cast<const FfiFuncWrapper*>(lua_touserdata(L, lua_upvalueindex(1)));
 #ifdef PLUTO_FFI_CALL_HOOK
   if (!PLUTO_FFI_CALL_HOOK(L, fw->addr)) {
     luaL_error(L, "disallowed by content moderation policy");
   }
 #endif
-  uintptr_t args[soup::ffi::MAX_ARGS];
-  int i = 0;
-  for (const auto& arg_type : fw->args) {
-    lua_assert(i < soup::ffi::MAX_ARGS);
-    args[i] = check_ffi_value(L, 1 + i, arg_type);
-    ++i;
+  FfiFrame fr;
+  fr.ints.fill(0);
+  fr.fps.fill(0);
+  memset(fr.stack.data(), 0, fw->nstack * sizeof(uint64_t));
+  alignas(16) unsigned char scratch[FFI_MAX_SCRATCH];
+  int i = 1;
+  for (const auto& p : fw->params) {
+    ffi_set_arg(L, i++, p, fr, scratch);
   }
-  uintptr_t retval;
+  FfiAllocator varargs = fw->alloc;
+  if (fw->variadic) {
+#if defined(FFI_ABI_WIN64) || defined(_M_ARM64)
+    varargs.ints_only = true;
+#elif defined(FFI_ABI_ARM64) && defined(__APPLE__)
+    varargs.stack_only = true;
+#endif
+    for (const int top = lua_gettop(L); i <= top; ++i) {
+      FfiParam p;
+      p.type = ffi_vararg_type(L, i);
+      if (l_unlikely(!ffi_assign_scalar(varargs, p.type, p.parts[0]))) {
+        luaL_error(L, "too many arguments");
+      }
+      ffi_set_arg(L, i, p, fr, scratch);
+    }
+  }
+#ifdef FFI_ABI_GENERIC
+  fr.nints = varargs.ngrn;
+#endif
+  alignas(16) unsigned char retval[sizeof(FfiRetMem)];
+  lua_State *const caller = ffi_caller;
+  ffi_caller = L;
   try {
-    retval = soup::ffi::call(fw->addr, args, i);
+    fw->invoker(fw->addr, fr, retval);
   }
   catch (std::exception& e) {
+    ffi_caller = caller;
     luaL_error(L, "C++ exception: %s", e.what());
   }
   catch (...) {
+    ffi_caller = caller;
     luaL_error(L, "C++ exception");
   }
-  return push_ffi_value(L, fw->ret, &retval);
+  ffi_caller = caller;
+  if (l_unlikely(ffi_callback_failed)) {
+    ffi_raise_callback_error(L);
+  }
+  if (fw->ret == FFI_STRUCT) {
+    ffi_push_new(L, lua_upvalueindex(2));
+    memcpy(lua_touserdata(L, -1), retval, fw->ret_size);
+    return 1;
+  }
+  return push_ffi_value(L, fw->ret, retval);
 }
 
+/* Pushes a wrapper userdata; push the return struct type (or nil) & then finish with pushfuncwrapper. */
 static FfiFuncWrapper *newfuncwrapper (lua_State *L) {
   auto fw = new (lua_newuserdata(L, sizeof(FfiFuncWrapper))) FfiFuncWrapper();
   if (luaL_newmetatable(L, "pluto:ffi-funcwrapper")) {
@@ -260,28 +948,37 @@ static FfiFuncWrapper *newfuncwrapper (lua_State *L) {
     lua_settable(L, -3);
   }
   lua_setmetatable(L, -2);
-  lua_pushcclosure(L, ffi_funcwrapper_call, 1);
   return fw;
 }
 
+static void pushfuncwrapper (lua_State *L, FfiFuncWrapper *fw) {
+  ffi_finish(fw);
+  lua_pushcclosure(L, ffi_funcwrapper_call, 2);
+}
+
 static int ffi_lib_wrap (lua_State *L) {
-  auto fw = newfuncwrapper(L);
-  fw->ret = check_ffi_type(L, 2);
   const char *name = luaL_checkstring(L, 3);
   auto pSpLib = checkffilibfromtable(L, 1);
-  fw->addr = (*pSpLib)->getAddress(name);
-  if (l_unlikely(fw->addr == nullptr)) {
+  void *addr = (*pSpLib)->getAddress(name);
+  if (l_unlikely(addr == nullptr)) {
     luaL_error(L, "could not find '%s' in library", name);
   }
-  const auto nargtypes = lua_gettop(L) - 4;
-  if (nargtypes > soup::ffi::MAX_ARGS) {
-    luaL_error(L, "function has too many parameters");
-  }
-  fw->args.reserve(nargtypes);
-  for (int i = 4; i != 4 + nargtypes; ++i) {
-    fw->args.emplace_back(check_ffi_type(L, i));
+  const int top = lua_gettop(L);
+  auto fw = newfuncwrapper(L);
+  fw->addr = addr;
+  const FfiType ret = check_ffi_type_or_struct(L, 2);
+  ffi_set_return(L, fw, ret, (const FfiStruct*)lua_touserdata(L, -1));
+  for (int i = 4; i <= top; ++i) {
+    if (i == top && lua_type(L, i) == LUA_TSTRING && strcmp(lua_tostring(L, i), "...") == 0) {
+      fw->variadic = true;
+      break;
+    }
+    const FfiType type = check_ffi_type_or_struct(L, i);
+    ffi_add_param(L, fw, type, (const FfiStruct*)lua_touserdata(L, -1));
+    lua_pop(L, 1);
   }
   fw->owner = *pSpLib;
+  pushfuncwrapper(L, fw);
   return 1;
 }
 
@@ -294,6 +991,42 @@ static int ffi_lib_value (lua_State *L) {
   return push_ffi_value(L, check_ffi_type(L, 2), addr);
 }
 
+/*
+** Soup's parser has no notion of variadic functions, so a '...' ending the
+** parameter list of the function at 'par.i' is removed before it's read.
+*/
+[[nodiscard]] static bool ffi_strip_ellipsis (soup::rflParser& par) {
+  const auto isliteral = [](const soup::Lexeme& l, const char *s) {
+    return l.isLiteral() && l.val.getString() == s;
+  };
+  const auto close = std::find_if(par.i, par.tks.end(), [&](const soup::Lexeme& l) { return isliteral(l, ")"); });
+  if (close == par.tks.end())
+    return false;
+  auto j = close;
+  const auto prev = [&] {  /* moves 'j' to the previous lexeme that's not a space */
+    do {
+      if (j == par.i)
+        return false;
+      --j;
+    } while (j->isSpace());
+    return true;
+  };
+  for (int dots = 0; dots != 3; ++dots) {  /* '.' terminates tokens, so the ellipsis is 3 of them */
+    if (!prev() || !isliteral(*j, "."))
+      return false;
+  }
+  const auto first = j;
+  if (!prev())
+    return false;
+  if (isliteral(*j, ","))
+    par.tks.erase(j, close);
+  else if (isliteral(*j, "("))
+    par.tks.erase(first, close);
+  else
+    return false;
+  return true;
+}
+
 static int ffi_lib_cdef (lua_State *L) {
   const auto pSpLib = checkffilibfromtable(L, 1);
   const auto lib = pSpLib->get();
@@ -310,6 +1043,7 @@ static int ffi_lib_cdef (lua_State *L) {
     }
     if (par->align(), par->i->isLiteral() && par->i->val.getString() == "(") {
       par->i = i;
+      const bool variadic = ffi_strip_ellipsis(*par);
       try {
           *func = par->readFunc();
       }
@@ -318,23 +1052,25 @@ static int ffi_lib_cdef (lua_State *L) {
       }
       pluto_pushstring(L, func->name);
       auto fw = newfuncwrapper(L);
-      fw->ret = rfl_type_to_ffi_type(func->return_type);
-      if (l_unlikely(fw->ret == FFI_UNKNOWN))
-        luaL_error(L, "malformed function");
       fw->addr = lib->getAddress(func->name.c_str());
       if (l_unlikely(fw->addr == nullptr)) {
         luaL_error(L, "could not find '%s' in library", func->name.c_str());
       }
-      if (func->parameters.size() > soup::ffi::MAX_ARGS) {
-        luaL_error(L, "'%s' has too many parameters", func->name.c_str());
-      }
-      fw->args.reserve(func->parameters.size());
+      const FfiType ret = rfl_type_to_ffi_type_or_struct(L, func->return_type);
+      if (l_unlikely(ret == FFI_UNKNOWN))
+        luaL_error(L, "malformed function");
+      ffi_set_return(L, fw, ret, (const FfiStruct*)lua_touserdata(L, -1));
+      fw->params.reserve(func->parameters.size());
       for (const auto& param : func->parameters) {
-        fw->args.emplace_back(rfl_type_to_ffi_type(param.type));
-        if (l_unlikely(fw->args.back() == FFI_UNKNOWN))
+        const FfiType type = rfl_type_to_ffi_type_or_struct(L, param.type);
+        if (l_unlikely(type == FFI_UNKNOWN))
           luaL_error(L, "malformed function");
+        ffi_add_param(L, fw, type, (const FfiStruct*)lua_touserdata(L, -1));
+        lua_pop(L, 1);
       }
+      fw->variadic = variadic;
       fw->owner = *pSpLib;
+      pushfuncwrapper(L, fw);
       lua_settable(L, 1);
     }
     else {
@@ -354,6 +1090,604 @@ static int ffi_lib_cdef (lua_State *L) {
   return 0;
 }
 
+/*
+** {======================================================
+** Callbacks
+** =======================================================
+**
+** C code can't call a Pluto function directly, so ffi.callback hands out one
+** of a fixed set of precompiled thunks. Each one takes all argument registers
+** as parameters (ignoring those the C signature doesn't use), looks up the
+** callback occupying its slot and calls its function. Parameters therefore
+** have to fit into registers, and can't be structs.
+*/
+
+#ifdef FFI_ABI_WIN64
+static constexpr int FFI_CALLBACK_FP_REGS = 0;  /* the thunks can't know which positions are floating-point */
+#else
+static constexpr int FFI_CALLBACK_FP_REGS = FFI_FP_REGS;
+#endif
+
+struct FfiCallback {
+  void *code;
+  lua_State *L;  /* main thread of the creating state */
+  const void *registry;  /* identifies the creating state */
+  int slot = -1;
+  FfiType ret;
+  std::vector<FfiParam> params;
+};
+
+static FfiCallback *ffi_callbacks[PLUTO_FFI_MAX_CALLBACKS];
+static std::mutex ffi_callbacks_mtx;
+
+struct FfiCallbackInvocation {
+  const void *key;  /* the callback's address; it is only dereferenced once the state confirms it is still alive */
+  const uint64_t *ints;
+  const double *fps;
+  uint64_t result;
+};
+
+static int ffi_callback_body (lua_State *L) {
+  auto inv = static_cast<FfiCallbackInvocation*>(lua_touserdata(L, 1));
+  lua_getfield(L, LUA_REGISTRYINDEX, "pluto:ffi-callbacks");
+  lua_rawgetp(L, -1, inv->key);
+  auto cb = static_cast<const FfiCallback*>(lua_touserdata(L, -1));
+  if (cb == nullptr)  /* collected since it was looked up */
+    return 0;
+  lua_getiuservalue(L, -1, 1);
+  luaL_checkstack(L, static_cast<int>(cb->params.size()), nullptr);
+  for (const auto& p : cb->params) {
+    uint64_t word;
+    if (p.parts[0].cls == FFI_CLASS_FP)
+      memcpy(&word, &inv->fps[p.parts[0].index], sizeof(word));
+    else
+      word = inv->ints[p.parts[0].index];
+    push_ffi_value(L, p.type, &word);
+  }
+  lua_call(L, static_cast<int>(cb->params.size()), 1);
+  inv->result = check_ffi_value(L, -1, cb->ret);
+  return 0;
+}
+
+[[nodiscard]] static uint64_t ffi_run_callback (size_t slot, const uint64_t *ints, const double *fps) {
+  const void *key;
+  lua_State *L;
+  const void *registry;
+  {  /* the slot may be released or reused by another thread at any time */
+    std::lock_guard lock(ffi_callbacks_mtx);
+    const FfiCallback *cb = ffi_callbacks[slot];
+    if (cb == nullptr)  /* already collected */
+      return 0;
+    key = cb;
+    L = cb->L;
+    registry = cb->registry;
+  }
+  if (ffi_caller != nullptr && lua_topointer(ffi_caller, LUA_REGISTRYINDEX) == registry)
+    L = ffi_caller;
+  if (!lua_checkstack(L, 2))
+    return 0;
+  FfiCallbackInvocation inv{ key, ints, fps, 0 };
+  lua_pushcfunction(L, ffi_callback_body);
+  lua_pushlightuserdata(L, &inv);
+  if (l_unlikely(lua_pcall(L, 1, 0, 0) != LUA_OK)) {
+    if (L == ffi_caller && !ffi_callback_failed) {  /* raise it once the foreign function returns */
+      ffi_callback_failed = true;
+      lua_rawsetp(L, LUA_REGISTRYINDEX, &ffi_callback_failed);
+    }
+    else {
+      lua_warning(L, "error in FFI callback: ", 1);
+      lua_warning(L, luaL_tolstring(L, -1, nullptr), 0);
+      lua_pop(L, 2);
+    }
+  }
+  return inv.result;
+}
+
+template <size_t N, class I, class F> struct FfiThunk;
+
+template <size_t N, size_t... I, size_t... F>
+struct FfiThunk<N, std::index_sequence<I...>, std::index_sequence<F...>> {
+  static uint64_t intRet (FfiRepeat<I, uint64_t>... ints, FfiRepeat<F, double>... fps) {
+    const uint64_t iv[] = { ints..., 0 };
+    const double fv[] = { fps..., 0 };
+    return ffi_run_callback(N, iv, fv);
+  }
+
+  static double fpRet (FfiRepeat<I, uint64_t>... ints, FfiRepeat<F, double>... fps) {
+    const uint64_t iv[] = { ints..., 0 };
+    const double fv[] = { fps..., 0 };
+    const uint64_t word = ffi_run_callback(N, iv, fv);  /* for f32, the low half of the register */
+    double d;
+    memcpy(&d, &word, sizeof(d));
+    return d;
+  }
+};
+
+template <size_t... N>
+[[nodiscard]] static void *ffi_thunk (size_t slot, bool fp, std::index_sequence<N...>) noexcept {
+  using Ints = std::make_index_sequence<FFI_INT_REGS>;
+  using Fps = std::make_index_sequence<FFI_CALLBACK_FP_REGS>;
+  static void *const int_thunks[] = { reinterpret_cast<void*>(&FfiThunk<N, Ints, Fps>::intRet)... };
+  static void *const fp_thunks[] = { reinterpret_cast<void*>(&FfiThunk<N, Ints, Fps>::fpRet)... };
+  return fp ? fp_thunks[slot] : int_thunks[slot];
+}
+
+static int ffi_callback (lua_State *L) {
+#ifdef FFI_ABI_GENERIC
+  luaL_error(L, "callbacks are not supported on this platform");
+  return 0;
+#else
+  luaL_checktype(L, 1, LUA_TFUNCTION);
+  const FfiType ret = check_ffi_type(L, 2);
+  const int top = lua_gettop(L);
+  auto cb = new (lua_newuserdatauv(L, sizeof(FfiCallback), 1)) FfiCallback();
+  if (luaL_newmetatable(L, "pluto:ffi-callback")) {
+    lua_pushliteral(L, "__gc");
+    lua_pushcfunction(L, [](lua_State *L) {
+      auto cb = static_cast<FfiCallback*>(lua_touserdata(L, 1));
+      if (cb->slot != -1) {
+        std::lock_guard lock(ffi_callbacks_mtx);
+        ffi_callbacks[cb->slot] = nullptr;
+      }
+      std::destroy_at<>(cb);
+      return 0;
+    });
+    lua_settable(L, -3);
+  }
+  lua_setmetatable(L, -2);
+  cb->ret = ret;
+  FfiAllocator a;
+  for (int i = 3; i <= top; ++i) {
+    FfiParam& p = cb->params.emplace_back();
+    p.type = check_ffi_type(L, i);
+    if (l_unlikely(!ffi_assign_scalar(a, p.type, p.parts[0]) || p.parts[0].cls == FFI_CLASS_STACK))
+      luaL_error(L, "callback has too many parameters");
+    if (l_unlikely(p.parts[0].cls == FFI_CLASS_FP && FFI_CALLBACK_FP_REGS == 0))
+      luaL_error(L, "floating-point callback parameters are not supported on this platform");
+  }
+  lua_pushvalue(L, 1);
+  lua_setiuservalue(L, -2, 1);
+  lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+  cb->L = lua_tothread(L, -1);
+  lua_pop(L, 1);
+  cb->registry = lua_topointer(L, LUA_REGISTRYINDEX);
+
+  /* the thunks find the callback through a weak table, so a function referring to its own callback can still be collected */
+  if (luaL_getsubtable(L, LUA_REGISTRYINDEX, "pluto:ffi-callbacks") == 0) {
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+  }
+  lua_pushvalue(L, -2);
+  lua_rawsetp(L, -2, cb);
+  lua_pop(L, 1);
+
+  int slot = -1;
+  {
+    std::lock_guard lock(ffi_callbacks_mtx);
+    for (int i = 0; i != PLUTO_FFI_MAX_CALLBACKS; ++i) {
+      if (ffi_callbacks[i] == nullptr) {
+        ffi_callbacks[i] = cb;
+        slot = i;
+        break;
+      }
+    }
+  }
+  if (l_unlikely(slot == -1))
+    luaL_error(L, "too many callbacks (the limit is %d)", PLUTO_FFI_MAX_CALLBACKS);
+  cb->slot = slot;
+  cb->code = ffi_thunk(slot, ffi_is_fp(ret), std::make_index_sequence<PLUTO_FFI_MAX_CALLBACKS>());
+  return 1;
+#endif
+}
+
+/* }====================================================== */
+
+/*
+** {======================================================
+** Typed arrays
+** =======================================================
+**
+** A contiguous buffer of one numeric type, which can be passed wherever a
+** 'ptr' is expected. Owned arrays keep their elements in the userdata itself;
+** views made by 'slice' keep the owner alive through their user value.
+*/
+
+struct FfiArray {
+  void *data;
+  size_t length;
+  size_t offset;  /* of the elements in the block of an owner, or in those of its owner for a view */
+  FfiType type;
+};
+
+static constexpr size_t FFI_ARRAY_ALIGN = 32;
+
+/* The elements of an array that owns them, which follow it in its block. */
+[[nodiscard]] static void *ffi_array_storage (FfiArray *arr) noexcept {
+  const auto addr = reinterpret_cast<uintptr_t>(arr + 1);
+  return reinterpret_cast<void*>((addr + FFI_ARRAY_ALIGN - 1) & ~static_cast<uintptr_t>(FFI_ARRAY_ALIGN - 1));
+}
+
+[[nodiscard]] static size_t ffi_array_elemsize (FfiType type) noexcept {
+  switch (type) {
+    case FFI_I8: case FFI_U8: return 1;
+    case FFI_I16: case FFI_U16: return 2;
+    case FFI_I32: case FFI_U32: case FFI_F32: return 4;
+    case FFI_I64: case FFI_U64: case FFI_F64: return 8;
+    default: return 0;
+  }
+}
+
+/* Calls 'f' with a value-initialised element of the array type. */
+template <typename F>
+static decltype(auto) ffi_array_visit (FfiType type, F&& f) {
+  switch (type) {
+    case FFI_I8: return f(int8_t{});
+    case FFI_I16: return f(int16_t{});
+    case FFI_I32: return f(int32_t{});
+    case FFI_I64: return f(int64_t{});
+    case FFI_U8: return f(uint8_t{});
+    case FFI_U16: return f(uint16_t{});
+    case FFI_U32: return f(uint32_t{});
+    case FFI_U64: return f(uint64_t{});
+    case FFI_F32: return f(float{});
+    default: return f(double{});
+  }
+}
+
+template <typename T>
+static void ffi_array_push (lua_State *L, T x) {
+  if constexpr (std::is_floating_point_v<T>)
+    lua_pushnumber(L, static_cast<lua_Number>(x));
+  else
+    lua_pushinteger(L, static_cast<lua_Integer>(x));
+}
+
+template <typename T>
+[[nodiscard]] static T ffi_array_check (lua_State *L, int i) {
+  if constexpr (std::is_floating_point_v<T>)
+    return static_cast<T>(luaL_checknumber(L, i));
+  else
+    return static_cast<T>(luaL_checkinteger(L, i));
+}
+
+[[nodiscard]] static FfiArray *checkffiarray (lua_State *L, int i) {
+  return static_cast<FfiArray*>(luaL_checkudata(L, i, "pluto:ffi-array"));
+}
+
+static void ffi_array_setmetatable (lua_State *L);
+
+/* Pushes a zeroed array with room for 'spare' more elements than its length. */
+static FfiArray *ffi_array_new (lua_State *L, FfiType type, size_t length, size_t spare = 0) {
+  const size_t elemsize = ffi_array_elemsize(type);
+  if (l_unlikely(length > (SIZE_MAX - sizeof(FfiArray) - FFI_ARRAY_ALIGN) / elemsize - spare))
+    luaL_error(L, "array is too large");
+  const size_t bytes = (length + spare) * elemsize;
+  auto arr = static_cast<FfiArray*>(lua_newuserdatauv(L, sizeof(FfiArray) + FFI_ARRAY_ALIGN - 1 + bytes, 1));
+  arr->data = ffi_array_storage(arr);
+  arr->length = length;
+  arr->offset = static_cast<size_t>(static_cast<char*>(arr->data) - reinterpret_cast<char*>(arr + 1));
+  arr->type = type;
+  memset(arr->data, 0, bytes);
+  ffi_array_setmetatable(L);
+  return arr;
+}
+
+static int ffi_array (lua_State *L) {
+  const FfiType type = check_ffi_type(L, 1);
+  const size_t elemsize = ffi_array_elemsize(type);
+  luaL_argcheck(L, elemsize != 0, 1, "expected a numeric type");
+  switch (lua_type(L, 2)) {
+    case LUA_TTABLE: {
+      const lua_Integer n = luaL_len(L, 2);
+      FfiArray *arr = ffi_array_new(L, type, n < 0 ? 0 : static_cast<size_t>(n));
+      ffi_array_visit(type, [&](auto zero) {
+        auto data = static_cast<decltype(zero)*>(arr->data);
+        for (size_t i = 0; i != arr->length; ++i) {
+          lua_geti(L, 2, static_cast<lua_Integer>(i + 1));
+          data[i] = ffi_array_check<decltype(zero)>(L, -1);
+          lua_pop(L, 1);
+        }
+      });
+      break;
+    }
+    case LUA_TSTRING: {
+      size_t len;
+      const char *str = lua_tolstring(L, 2, &len);
+      luaL_argcheck(L, len % elemsize == 0, 2, "length is not a multiple of the element size");
+      FfiArray *arr = ffi_array_new(L, type, len / elemsize);
+      memcpy(arr->data, str, len);
+      break;
+    }
+    default: {
+      const lua_Integer n = luaL_checkinteger(L, 2);
+      luaL_argcheck(L, n >= 0, 2, "length must not be negative");
+      ffi_array_new(L, type, static_cast<size_t>(n));
+    }
+  }
+  return 1;
+}
+
+static int ffi_array_index (lua_State *L) {
+  auto arr = static_cast<FfiArray*>(lua_touserdata(L, 1));
+  if (lua_type(L, 2) == LUA_TNUMBER) {
+    int isint;
+    const lua_Integer i = lua_tointegerx(L, 2, &isint);
+    if (isint && i >= 1 && static_cast<lua_Unsigned>(i) <= arr->length) {
+      ffi_array_visit(arr->type, [&](auto zero) {
+        ffi_array_push(L, static_cast<const decltype(zero)*>(arr->data)[i - 1]);
+      });
+      return 1;
+    }
+    return 0;
+  }
+  lua_pushvalue(L, 2);
+  lua_rawget(L, lua_upvalueindex(1));  /* a method? */
+  return 1;
+}
+
+static int ffi_array_newindex (lua_State *L) {
+  auto arr = static_cast<FfiArray*>(lua_touserdata(L, 1));
+  const lua_Integer i = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, i >= 1 && static_cast<lua_Unsigned>(i) <= arr->length, 2, "index out of range");
+  ffi_array_visit(arr->type, [&](auto zero) {
+    static_cast<decltype(zero)*>(arr->data)[i - 1] = ffi_array_check<decltype(zero)>(L, 3);
+  });
+  return 0;
+}
+
+static int ffi_array_len (lua_State *L) {
+  lua_pushinteger(L, static_cast<lua_Integer>(checkffiarray(L, 1)->length));
+  return 1;
+}
+
+static int ffi_array_type (lua_State *L) {
+  static const char *const names[] = { "i8", "i16", "i32", "i64", "u8", "u16", "u32", "u64", "f32", "f64" };
+  lua_pushstring(L, names[checkffiarray(L, 1)->type - FFI_I8]);
+  return 1;
+}
+
+static int ffi_array_totable (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  luaL_argcheck(L, arr->length <= INT_MAX, 1, "array is too large");
+  lua_createtable(L, static_cast<int>(arr->length), 0);
+  ffi_array_visit(arr->type, [&](auto zero) {
+    auto data = static_cast<const decltype(zero)*>(arr->data);
+    for (size_t i = 0; i != arr->length; ++i) {
+      ffi_array_push(L, data[i]);
+      lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+    }
+  });
+  return 1;
+}
+
+static int ffi_array_tostring (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  lua_pushlstring(L, static_cast<const char*>(arr->data), arr->length * ffi_array_elemsize(arr->type));
+  return 1;
+}
+
+/* Like string.sub, but the result shares its elements with the array. */
+static int ffi_array_slice (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  const lua_Integer len = static_cast<lua_Integer>(arr->length);
+  lua_Integer i = luaL_optinteger(L, 2, 1);
+  lua_Integer j = luaL_optinteger(L, 3, -1);
+  if (i < 0) i = (i < -len ? 1 : len + i + 1);
+  else if (i == 0) i = 1;
+  if (j > len) j = len;
+  else if (j < 0) j = (j < -len ? 0 : len + j + 1);
+  const size_t first = static_cast<size_t>(i - 1);
+  const size_t length = (i <= j ? static_cast<size_t>(j - i + 1) : 0);
+  auto view = static_cast<FfiArray*>(lua_newuserdatauv(L, sizeof(FfiArray), 1));
+  const size_t skip = (length != 0 ? first * ffi_array_elemsize(arr->type) : 0);
+  view->data = static_cast<char*>(arr->data) + skip;
+  view->offset = skip;
+  view->length = length;
+  view->type = arr->type;
+  ffi_array_setmetatable(L);
+  if (lua_getiuservalue(L, 1, 1) == LUA_TNIL) {  /* 'arr' owns its elements? */
+    lua_pop(L, 1);
+    lua_pushvalue(L, 1);
+  }
+  else
+    view->offset += arr->offset;
+  lua_setiuservalue(L, -2, 1);
+  return 1;
+}
+
+static int ffi_array_copy (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  FfiArray *copy = ffi_array_new(L, arr->type, arr->length);
+  memcpy(copy->data, arr->data, arr->length * ffi_array_elemsize(arr->type));
+  return 1;
+}
+
+static int ffi_array_fill (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  ffi_array_visit(arr->type, [&](auto zero) {
+    using T = decltype(zero);
+    std::fill_n(static_cast<T*>(arr->data), arr->length, ffi_array_check<T>(L, 2));
+  });
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int ffi_array_sum (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  ffi_array_visit(arr->type, [&](auto zero) {
+    using T = decltype(zero);
+    const auto sum = Pluto::VectorOps::sum(static_cast<const T*>(arr->data), arr->length);
+    if constexpr (std::is_floating_point_v<T>)
+      lua_pushnumber(L, sum);
+    else
+      lua_pushinteger(L, static_cast<lua_Integer>(sum));
+  });
+  return 1;
+}
+
+template <bool MAX>
+static int ffi_array_extreme (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  if (arr->length == 0)
+    return 0;
+  ffi_array_visit(arr->type, [&](auto zero) {
+    using T = decltype(zero);
+    auto data = static_cast<const T*>(arr->data);
+    ffi_array_push(L, MAX ? Pluto::VectorOps::max(data, arr->length) : Pluto::VectorOps::min(data, arr->length));
+  });
+  return 1;
+}
+
+/* Checks that argument 'i' is an array with the same type & length as 'arr'. */
+static FfiArray *ffi_array_checkpeer (lua_State *L, int i, const FfiArray *arr) {
+  FfiArray *other = checkffiarray(L, i);
+  luaL_argcheck(L, other->type == arr->type, i, "arrays have different types");
+  luaL_argcheck(L, other->length == arr->length, i, "arrays have different lengths");
+  return other;
+}
+
+static int ffi_array_dot (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  FfiArray *other = ffi_array_checkpeer(L, 2, arr);
+  ffi_array_visit(arr->type, [&](auto zero) {
+    using T = decltype(zero);
+    const auto dot = Pluto::VectorOps::dot(static_cast<const T*>(arr->data), static_cast<const T*>(other->data), arr->length);
+    if constexpr (std::is_floating_point_v<T>)
+      lua_pushnumber(L, dot);
+    else
+      lua_pushinteger(L, static_cast<lua_Integer>(dot));
+  });
+  return 1;
+}
+
+static int ffi_array_scale (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  ffi_array_visit(arr->type, [&](auto zero) {
+    using T = decltype(zero);
+    Pluto::VectorOps::scale(static_cast<T*>(arr->data), arr->length, ffi_array_check<T>(L, 2));
+  });
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int ffi_array_add (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  if (lua_type(L, 2) == LUA_TUSERDATA) {
+    FfiArray *other = ffi_array_checkpeer(L, 2, arr);
+    ffi_array_visit(arr->type, [&](auto zero) {
+      using T = decltype(zero);
+      Pluto::VectorOps::add(static_cast<T*>(arr->data), static_cast<const T*>(other->data), arr->length);
+    });
+  }
+  else {
+    ffi_array_visit(arr->type, [&](auto zero) {
+      using T = decltype(zero);
+      Pluto::VectorOps::addScalar(static_cast<T*>(arr->data), arr->length, ffi_array_check<T>(L, 2));
+    });
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+[[nodiscard]] static Pluto::VectorOps::Cmp ffi_array_checkop (lua_State *L, int i) {
+  static const char *const ops[] = { "<", "<=", ">", ">=", "==", "~=", "!=", nullptr };
+  const int op = luaL_checkoption(L, i, nullptr, ops);
+  return static_cast<Pluto::VectorOps::Cmp>(op == 6 ? Pluto::VectorOps::NE : op);
+}
+
+static int ffi_array_count (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  const auto op = ffi_array_checkop(L, 2);
+  ffi_array_visit(arr->type, [&](auto zero) {
+    using T = decltype(zero);
+    const size_t n = Pluto::VectorOps::filter(static_cast<const T*>(arr->data), arr->length, op, ffi_array_check<T>(L, 3), static_cast<T*>(nullptr));
+    lua_pushinteger(L, static_cast<lua_Integer>(n));
+  });
+  return 1;
+}
+
+/* Returns a new array of the elements 'x' for which 'x <op> v' holds. */
+static int ffi_array_filter (lua_State *L) {
+  FfiArray *arr = checkffiarray(L, 1);
+  const auto op = ffi_array_checkop(L, 2);
+  ffi_array_visit(arr->type, [&](auto zero) {
+    using T = decltype(zero);
+    const T v = ffi_array_check<T>(L, 3);
+    auto data = static_cast<const T*>(arr->data);
+    const size_t n = Pluto::VectorOps::filter(data, arr->length, op, v, static_cast<T*>(nullptr));
+    FfiArray *res = ffi_array_new(L, arr->type, n, 1);
+    (void)Pluto::VectorOps::filter(data, arr->length, op, v, static_cast<T*>(res->data));
+  });
+  return 1;
+}
+
+/*
+** A copy made by lua_clonestate must use its own elements, or those of its
+** copied owner. The copied block may be aligned differently, so an owner
+** moves its elements into place; a view only depends on where they end up.
+*/
+static int ffi_array_clone (lua_State *L) {
+  auto arr = static_cast<FfiArray*>(lua_touserdata(L, 1));
+  if (lua_getiuservalue(L, 1, 1) == LUA_TNIL) {
+    auto base = reinterpret_cast<char*>(arr + 1);
+    arr->data = ffi_array_storage(arr);
+    memmove(arr->data, base + arr->offset, lua_rawlen(L, 1) - sizeof(FfiArray) - (FFI_ARRAY_ALIGN - 1));
+    arr->offset = static_cast<size_t>(static_cast<char*>(arr->data) - base);
+  }
+  else
+    arr->data = static_cast<char*>(ffi_array_storage(static_cast<FfiArray*>(lua_touserdata(L, -1)))) + arr->offset;
+  return 0;
+}
+
+static const luaL_Reg funcs_ffi_array[] = {
+  {"type", ffi_array_type},
+  {"totable", ffi_array_totable},
+  {"tostring", ffi_array_tostring},
+  {"slice", ffi_array_slice},
+  {"copy", ffi_array_copy},
+  {"fill", ffi_array_fill},
+  {"sum", ffi_array_sum},
+  {"min", ffi_array_extreme<false>},
+  {"max", ffi_array_extreme<true>},
+  {"dot", ffi_array_dot},
+  {"scale", ffi_array_scale},
+  {"add", ffi_array_add},
+  {"count", ffi_array_count},
+  {"filter", ffi_array_filter},
+  {nullptr, nullptr}
+};
+
+static void ffi_array_setmetatable (lua_State *L) {
+  if (luaL_newmetatable(L, "pluto:ffi-array")) {
+    lua_pushliteral(L, "__index");
+    luaL_newlib(L, funcs_ffi_array);
+    lua_pushcclosure(L, ffi_array_index, 1);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__newindex");
+    lua_pushcfunction(L, ffi_array_newindex);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__len");
+    lua_pushcfunction(L, ffi_array_len);
+    lua_settable(L, -3);
+    lua_pushliteral(L, "__clone");
+    lua_pushcfunction(L, ffi_array_clone);
+    lua_settable(L, -3);
+  }
+  lua_setmetatable(L, -2);
+}
+
+static void *ffi_userdata_address (lua_State *L, int i) {
+  if (auto cb = static_cast<FfiCallback*>(luaL_testudata(L, i, "pluto:ffi-callback")))
+    return cb->code;
+  if (auto arr = static_cast<FfiArray*>(luaL_testudata(L, i, "pluto:ffi-array")))
+    return arr->data;
+  return lua_touserdata(L, i);
+}
+
+/* }====================================================== */
+
 static int ffi_open (lua_State *L) {
 #ifndef PLUTO_NO_BINARIES
   const char *libname = luaL_checkstring(L, 1);
@@ -391,21 +1725,6 @@ static int ffi_open (lua_State *L) {
   return 1;
 }
 
-struct FfiStruct : public soup::rflStruct {
-  inline auto operator=(soup::rflStruct&& strct) noexcept {
-    return soup::rflStruct::operator=(std::move(strct));
-  }
-
-  [[nodiscard]] const soup::rflType& getMemberType(const std::string& memname) const {
-    for (const auto& mem : this->members) {
-      if (mem.name == memname) {
-        return mem.type;
-      }
-    }
-    SOUP_ASSERT_UNREACHABLE;
-  }
-};
-
 static int ffi_push_new (lua_State *L, int i) {
   const auto strct = (FfiStruct*)weaklycheckudata(L, i, "pluto:ffi-struct-type");
   const auto size = strct->getSize();
@@ -621,12 +1940,18 @@ static const luaL_Reg funcs_ffi[] = {
   {"alloc", ffi_alloc},
   {"write", ffi_write},
   {"read", ffi_read},
+  {"callback", ffi_callback},
+  {"array", ffi_array},
   {nullptr, nullptr}
 };
 
 LUAMOD_API int luaopen_ffi(lua_State *L) {
   luaL_newlib(L, funcs_ffi);
 
+  /* for struct names in lib:wrap & lib:cdef */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, "pluto:ffi");
+
   lua_pushliteral(L, "new");
   lua_pushvalue(L, -2);
   lua_pushcclosure(L, ffi_new, 1);
@@ -21,6 +21,7 @@
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
+#include "lundump.h"
 
 
 
@@ -260,6 +261,9 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+  f->lazy = NULL;
+  f->lazybody = 0;
+  f->lazydebug = 0;
   f->lua_vm_compatible = true;
   return f;
 }
@@ -273,6 +277,8 @@ void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
+  if (f->lazy)
+    luaU_chunkunref(f->lazy);
   luaM_free(L, f);
 }
 
@@ -1741,3 +1741,70 @@ void luaC_fullgc (lua_State *L, int isemergency) {
 /* }====================================================== */
 
 
+
+/*
+** {======================================================
+** [Pluto] Memory accounting
+** =======================================================
+*/
+
+
+static lu_mem protosize (const Proto *f) {
+  return sizeof(Proto)
+       + cast(lu_mem, f->sizecode) * sizeof(Instruction)
+       + cast(lu_mem, f->sizep) * sizeof(Proto *)
+       + cast(lu_mem, f->sizek) * sizeof(TValue)
+       + cast(lu_mem, f->sizelineinfo) * sizeof(ls_byte)
+       + cast(lu_mem, f->sizeabslineinfo) * sizeof(AbsLineInfo)
+       + cast(lu_mem, f->sizelocvars) * sizeof(LocVar)
+       + cast(lu_mem, f->sizeupvalues) * sizeof(Upvaldesc);
+}
+
+
+/* Adds the size of every object in list 'o' to its category in 'stats'; mirrors 'freeobj'. */
+static void addobjsizes (GCObject *o, lua_MemStats *stats) {
+  for (; o != NULL; o = o->next) {
+    switch (o->tt) {
+      case LUA_VPROTO: stats->functions += protosize(gco2p(o)); break;
+      case LUA_VUPVAL: stats->functions += sizeof(UpVal); break;
+      case LUA_VLCL: stats->functions += sizeLclosure(gco2lcl(o)->nupvalues); break;
+      case LUA_VCCL: stats->functions += sizeCclosure(gco2ccl(o)->nupvalues); break;
+      case LUA_VTABLE: {
+        Table *t = gco2t(o);
+        stats->tables += sizeof(Table) + cast_sizet(luaH_realasize(t)) * sizeof(TValue);
+        if (!isdummy(t))
+          stats->tables += cast_sizet(sizenode(t)) * sizeof(Node);
+        break;
+      }
+      case LUA_VTHREAD: stats->threads += luaE_threadsize(gco2th(o)); break;
+      case LUA_VUSERDATA: stats->userdata += sizeudata(gco2u(o)->nuvalue, gco2u(o)->len); break;
+      case LUA_VSHRSTR: stats->strings += sizelstring(gco2ts(o)->shrlen); break;
+      case LUA_VLNGSTR: stats->strings += sizelstring(gco2ts(o)->u.lnglen); break;
+      default: lua_assert(0);
+    }
+  }
+}
+
+
+/*
+** Walks all collectable objects, so this is meant for diagnostics rather
+** than for being called frequently.
+*/
+void luaC_memstats (lua_State *L, lua_MemStats *stats) {
+  global_State *g = G(L);
+  *stats = lua_MemStats{};
+  stats->total = gettotalbytes(g);
+  addobjsizes(g->allgc, stats);
+  addobjsizes(g->finobj, stats);
+  addobjsizes(g->tobefnz, stats);
+  addobjsizes(g->fixedgc, stats);
+  stats->threads += luaE_threadsize(g->mainthread);
+  stats->buffers = cast_sizet(g->buffermem);
+  const size_t counted = stats->strings + stats->tables + stats->functions
+                       + stats->userdata + stats->buffers + stats->threads;
+  stats->other = (stats->total > counted) ? stats->total - counted : 0;
+}
+
+/* }====================================================== */
+
+
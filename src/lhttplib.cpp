@@ -2,15 +2,31 @@
 #include "lualib.h"
 
 #include "lstate.h"
+#include "leventloop.hpp"
 
-#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory> // destroy_at
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 #include "vendor/Soup/soup/DetachedScheduler.hpp"
 #include "vendor/Soup/soup/HttpRequest.hpp"
 #include "vendor/Soup/soup/HttpRequestTask.hpp"
+#include "vendor/Soup/soup/HttpResponse.hpp"
+#include "vendor/Soup/soup/netConnectTask.hpp"
 #include "vendor/Soup/soup/netStatus.hpp"
+#include "vendor/Soup/soup/ObfusString.hpp"
+#include "vendor/Soup/soup/Socket.hpp"
+#include "vendor/Soup/soup/string.hpp"
+#include "vendor/Soup/soup/time.hpp"
 #include "vendor/Soup/soup/Uri.hpp"
 
+#if SOUP_WASM
 static int push_http_response (lua_State *L, soup::HttpRequestTask& task) {
   if (task.result.has_value()) {
     // Return value order is 'body, status_code, response_headers, status_text' for compatibility with luasocket.
@@ -28,36 +44,584 @@ static int push_http_response (lua_State *L, soup::HttpRequestTask& task) {
   }
   // Return value order is 'nil, message' for compatibility with luasocket.
   luaL_pushfail(L);
-#if SOUP_WASM
   return 1;  /* specialized HttpRequestTask for WASM doesn't have `getStatus` */
-#else
-  pluto_pushstring(L, task.getStatus());
-  return 2;
-#endif
 }
 
 template <typename Task, int(*callback)(lua_State* L, Task&)>
 static int await_task_cont (lua_State *L, int status, lua_KContext ctx) {
   auto pTask = reinterpret_cast<Task*>(ctx);
   if (!pTask->isWorkDone()) {
+    pluto_waitworker(L, pTask);
     return lua_yieldk(L, 0, ctx, &await_task_cont<Task, callback>);
   }
   return callback(L, *pTask);
 }
+#endif
 
 #if !SOUP_WASM
-template <typename Task, int(*callback)(lua_State* L, Task&)>
-static int await_task (lua_State *L, soup::SharedPtr<Task>&& spTask) {
-  if (lua_isyieldable(L)) {
-    auto pTask = spTask.get();
+/*
+** Keep-alive connections shared by all requests of a state. Each origin (scheme,
+** host & port) may have at most 'maxperhost' connections open, busy or idle;
+** further requests to it wait for one to be handed back. Up to 'maxidle' of
+** them are kept around for reuse once their response has been received.
+**
+** The scheduler thread acquires & releases connections, while the Lua side
+** reads stats and changes limits, so everything here is behind 'mtx'.
+*/
+struct HttpPool {
+  struct Origin {
+    std::vector<soup::SharedPtr<soup::Socket>> idle;
+    size_t open = 0;  /* idle, busy & connecting */
+  };
+
+  struct Stats {
+    uint64_t requests = 0;
+    uint64_t connections = 0;  /* opened */
+    uint64_t reused = 0;  /* requests sent over an idle connection */
+    uint64_t retried = 0;  /* idempotent requests resent because their idle connection had been closed by the server */
+    uint64_t waited = 0;  /* requests that had to wait for a connection slot */
+  };
+
+  enum Acquired : uint8_t {
+    REUSE,
+    CONNECT,
+    WAIT,
+  };
+
+  std::mutex mtx;
+  std::unordered_map<std::string, Origin> origins;
+  Stats stats;
+  size_t maxperhost = 6;
+  size_t maxidle = 6;
+  bool closing = false;  /* no more connections are parked */
+
+  [[nodiscard]] static std::string key (const std::string& host, uint16_t port, bool tls) {
+    std::string k = host;
+    k.push_back(':');
+    k.append(std::to_string(port));
+    if (tls)
+      k.append("+tls");
+    return k;
+  }
+
+  /* On REUSE, 'sock' is set to the idle connection. On CONNECT, the caller owns a slot which it must release. */
+  [[nodiscard]] Acquired acquire (const std::string& k, soup::SharedPtr<soup::Socket>& sock, bool reuse) {
+    std::lock_guard lock(mtx);
+    auto& o = origins[k];
+    while (!o.idle.empty()) {
+      auto s = std::move(o.idle.back());
+      o.idle.pop_back();
+      if (s->isWorkDoneOrClosed()) {  /* closed by the server while idle */
+        --o.open;
+        continue;
+      }
+      if (!reuse) {  /* make room for a fresh connection */
+        s->close();
+        --o.open;
+        break;
+      }
+      ++stats.reused;
+      sock = std::move(s);
+      return REUSE;
+    }
+    if (o.open < maxperhost) {
+      ++o.open;
+      return CONNECT;
+    }
+    return WAIT;
+  }
+
+  /* Gives back a slot, parking its connection for reuse if 'keep' is true & there is room. */
+  void release (const std::string& k, soup::SharedPtr<soup::Socket>&& sock, bool keep) {
+    std::lock_guard lock(mtx);
+    auto& o = origins[k];
+    if (keep && !closing && o.idle.size() < maxidle) {
+      o.idle.emplace_back(std::move(sock));
+      return;
+    }
+    --o.open;
+    if (sock)
+      sock->close();
+  }
+
+  void closeIdle () {
+    std::lock_guard lock(mtx);
+    for (auto& [k, o] : origins) {
+      for (auto& s : o.idle)
+        s->close();
+      o.open -= o.idle.size();
+      o.idle.clear();
+    }
+  }
+};
+
+/* wakes up the state's event loop whenever one of our tasks is done, so coroutines awaiting it are resumed right away */
+struct HttpScheduler : public soup::DetachedScheduler {
+  Pluto::EventLoop *loop;
+  HttpPool pool;
+  std::atomic_bool cancelling = false;  /* set once the state is closing; cancels every request still in flight */
+
+  HttpScheduler(Pluto::EventLoop& loop) : loop(&loop) {
+    on_work_done = [](soup::Worker&, soup::Scheduler& sched) {
+      static_cast<HttpScheduler&>(sched).loop->wake();
+    };
+  }
 
-    pluto_newclassinst(L, soup::SharedPtr<Task>, std::move(spTask));
+  ~HttpScheduler() {
+    /* idle connections would keep the thread running, and tasks still in flight use the pool */
+    setDontMakeReusableSockets();
+    cancelling = true;  /* a paused streaming request would otherwise never finish */
+    {
+      std::lock_guard lock(pool.mtx);
+      pool.closing = true;
+    }
+    pool.closeIdle();
+    awaitCompletion();
+  }
+};
 
-    return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(pTask), &await_task_cont<Task, callback>);
+[[nodiscard]] static HttpScheduler& get_scheduler (lua_State *L) {
+  if (G(L)->scheduler == nullptr) {
+    G(L)->scheduler = new HttpScheduler(Pluto::EventLoop::get(L));
   }
-  while (!spTask->isWorkDone())
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
-  return callback(L, *spTask);
+  return *reinterpret_cast<HttpScheduler*>(G(L)->scheduler);
+}
+
+/*
+** A request over a pooled connection. The response is parsed as it comes in,
+** so that bodies can be handed to the Lua side chunk by chunk while they are
+** still being received.
+*/
+struct PooledRequestTask : public soup::Task {
+  enum State : uint8_t {
+    START,
+    CONNECTING,
+    AWAIT_RESPONSE,
+    DONE,
+  };
+
+  enum Phase : uint8_t {
+    STATUS_LINE,
+    HEADERS,
+    BODY_LENGTH,
+    BODY_CHUNK_SIZE,
+    BODY_CHUNK_DATA,
+    BODY_CHUNK_END,
+    BODY_TRAILERS,
+    BODY_CLOSE,  /* body ends when the server closes the connection */
+  };
+
+  static constexpr std::time_t TIMEOUT_SECONDS = 30;
+
+  /* A streaming response stops reading from its connection while this much of it has yet to be consumed. */
+  static constexpr size_t STREAM_HIGH_WATER = 1024 * 1024;
+
+  HttpScheduler& sched;
+  soup::HttpRequest hr;
+  std::string origin;
+  State state = START;
+  bool prefer_ipv6 = false;
+  bool dont_reuse = false;
+  bool dont_make_reusable = false;
+  bool streaming = false;
+  bool reused = false;
+  bool got_data = false;
+  bool waited = false;
+  bool paused = false;
+  soup::Optional<soup::netConnectTask> connector;
+  soup::SharedPtr<soup::Socket> sock;
+  std::time_t last_activity;
+
+  /* response parsing, on the scheduler thread */
+  Phase phase = STATUS_LINE;
+  uint64_t remain = 0;
+  std::string buf;
+  soup::HttpResponse resp;
+
+  /* shared with the Lua side */
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<std::string> chunks;
+  size_t queued = 0;
+  bool finished = false;
+  bool ok = false;
+  std::atomic_bool cancelled = false;
+  std::string error;
+  soup::Worker signal{ soup::WORKER_TYPE_UNSPECIFIED };  /* "done" whenever there's something for the Lua side to pick up */
+
+  PooledRequestTask(HttpScheduler& sched, soup::HttpRequest&& hr, bool streaming)
+    : sched(sched), hr(std::move(hr)), origin(HttpPool::key(this->hr.getHost(), this->hr.port, this->hr.use_tls)), streaming(streaming)
+  {
+    signal.holdup_type = soup::Worker::IDLE;
+  }
+
+  void onTick() final {
+    if (l_unlikely(cancelled || sched.cancelling) && state != DONE) {
+      if (state == CONNECTING)
+        sched.pool.release(origin, {}, false);
+      else if (state == AWAIT_RESPONSE)
+        detach(false);
+      fail("cancelled");
+      return;
+    }
+    switch (state) {
+      case START: {
+        soup::SharedPtr<soup::Socket> s;
+        switch (sched.pool.acquire(origin, s, !dont_reuse)) {
+          case HttpPool::REUSE:
+            sock = std::move(s);
+            reused = true;
+            sendRequest();
+            break;
+          case HttpPool::CONNECT:
+            reused = false;
+            state = CONNECTING;
+            connector.emplace(hr.getHost(), hr.port, prefer_ipv6);
+            break;
+          case HttpPool::WAIT:
+            if (!waited) {
+              waited = true;
+              std::lock_guard lock(sched.pool.mtx);
+              ++sched.pool.stats.waited;
+            }
+            break;
+        }
+        break;
+      }
+      case CONNECTING:
+        if (connector->tickUntilDone()) {
+          if (!connector->wasSuccessful()) {
+            sched.pool.release(origin, {}, false);
+            fail(soup::netStatusToString(connector->getStatus()));
+            return;
+          }
+          sock = connector->getSocket();
+          connector.reset();
+          {
+            std::lock_guard lock(sched.pool.mtx);
+            ++sched.pool.stats.connections;
+          }
+          if (hr.use_tls) {
+            state = AWAIT_RESPONSE;
+            last_activity = soup::time::unixSeconds();
+            sock->enableCryptoClient(hr.getHost(), [](soup::Socket&, soup::Capture&& cap) SOUP_EXCAL {
+              cap.get<PooledRequestTask*>()->recvMore();
+            }, this, hr.getDataToSend());
+          }
+          else {
+            sendRequest();
+          }
+        }
+        break;
+      case AWAIT_RESPONSE:
+        if (paused) {
+          /* the socket's idle holdup resumes receiving */
+        }
+        else if (sock->isWorkDoneOrClosed()) {
+          if (reused && !got_data && isIdempotent()) {  /* the server dropped the idle connection as we sent on it; try again on a new one */
+            detach(false);
+            {
+              std::lock_guard lock(sched.pool.mtx);
+              ++sched.pool.stats.retried;
+            }
+            dont_reuse = true;
+            state = START;
+          }
+          else {
+            using soup::SocketCloseReason;
+            std::string reason = (sock->custom_data.isStructInMap(SocketCloseReason)
+              ? sock->custom_data.getStructFromMapConst(SocketCloseReason)
+              : std::string(soup::netStatusToString(soup::NET_FAIL_L7_PREMATURE_END))
+            );
+            detach(false);
+            fail(std::move(reason));
+          }
+        }
+        else if (soup::time::unixSecondsSince(last_activity) > TIMEOUT_SECONDS) {
+          detach(false);
+          fail(soup::netStatusToString(soup::NET_FAIL_L7_TIMEOUT));
+        }
+        break;
+      case DONE:
+        break;
+    }
+  }
+
+  /* Whether the request may be sent again, as the server may have processed it before closing the connection (RFC 9110, 9.2.2). */
+  [[nodiscard]] bool isIdempotent() const noexcept {
+    return hr.method == "GET" || hr.method == "HEAD" || hr.method == "OPTIONS" || hr.method == "TRACE" || hr.method == "PUT" || hr.method == "DELETE";
+  }
+
+  void sendRequest() {
+    state = AWAIT_RESPONSE;
+    last_activity = soup::time::unixSeconds();
+    hr.send(*sock);
+    recvMore();
+  }
+
+  void recvMore() {
+    sock->recv([](soup::Socket&, std::string&& data, soup::Capture&& cap) SOUP_EXCAL {
+      cap.get<PooledRequestTask*>()->onData(std::move(data));
+    }, this);
+  }
+
+  /* Stops using 'sock', handing it back to the pool. Its pending receive no longer refers to us afterwards. */
+  void detach(bool keep) {
+    sock->callback_recv_on_close = false;
+    sock->keepAlive();
+    sched.pool.release(origin, std::move(sock), keep);
+  }
+
+  void onData(std::string&& data) {
+    last_activity = soup::time::unixSeconds();
+    if (data.empty()) {  /* connection closed */
+      if (phase == BODY_CLOSE) {
+        complete(false);
+      }
+      else {
+        detach(false);
+        fail(soup::netStatusToString(soup::NET_FAIL_L7_PREMATURE_END));
+      }
+      return;
+    }
+    got_data = true;
+    buf.append(data);
+    if (!parse())
+      return;
+    if (streaming) {
+      std::lock_guard lock(mtx);
+      if (queued >= STREAM_HIGH_WATER) {
+        pause();
+        return;
+      }
+    }
+    recvMore();
+  }
+
+  /*
+  ** Stops receiving until the Lua side has caught up. The socket gets an idle
+  ** holdup rather than none, which would have the scheduler drop it.
+  */
+  void pause() {
+    paused = true;
+    sock->holdup_type = soup::Worker::IDLE;
+    sock->holdup_callback.set([](soup::Worker&, soup::Capture&& cap) SOUP_EXCAL {
+      auto task = cap.get<PooledRequestTask*>();
+      {
+        std::lock_guard lock(task->mtx);
+        if (task->queued >= STREAM_HIGH_WATER / 2)
+          return;
+      }
+      task->paused = false;
+      task->last_activity = soup::time::unixSeconds();
+      task->recvMore();
+    }, this);
+  }
+
+  /* Processes 'buf'. Returns false once the response is complete or has failed. */
+  [[nodiscard]] bool parse() {
+    size_t pos = 0;
+    auto line = [&](std::string_view& out) {
+      const size_t i = buf.find("\r\n", pos);
+      if (i == std::string::npos)
+        return false;
+      out = std::string_view(buf).substr(pos, i - pos);
+      pos = i + 2;
+      return true;
+    };
+    std::string_view l;
+    auto done = [&](bool reusable) {
+      buf.erase(0, pos);
+      complete(reusable);
+      return false;
+    };
+    while (true) {
+      switch (phase) {
+        case STATUS_LINE: {
+          if (!line(l))
+            goto need_more;
+          const size_t sp1 = l.find(' ');
+          if (sp1 == std::string_view::npos || l.substr(0, 5) != "HTTP/") {
+            detach(false);
+            fail("Protocol Error");
+            return false;
+          }
+          const size_t sp2 = l.find(' ', sp1 + 1);
+          resp.status_code = soup::string::toInt<uint16_t>(std::string(l.substr(sp1 + 1, sp2 == std::string_view::npos ? std::string_view::npos : sp2 - sp1 - 1)), 0);
+          resp.status_text = (sp2 == std::string_view::npos ? std::string() : std::string(l.substr(sp2 + 1)));
+          phase = HEADERS;
+          break;
+        }
+        case HEADERS:
+          if (!line(l))
+            goto need_more;
+          if (!l.empty()) {
+            resp.addHeader(std::string(l));
+            break;
+          }
+          if (resp.status_code < 200 && resp.status_code >= 100) {  /* interim response, e.g. 100 Continue */
+            resp = soup::HttpResponse{};
+            phase = STATUS_LINE;
+            break;
+          }
+          if (hr.method == "HEAD" || resp.status_code == 204 || resp.status_code == 304)
+            return done(true);
+          if (auto enc = resp.findHeader("Transfer-Encoding"); enc && soup::string::lower(std::move(*enc)).find("chunked") != std::string::npos) {
+            phase = BODY_CHUNK_SIZE;
+          }
+          else if (auto len = resp.findHeader("Content-Length")) {
+            auto opt = soup::string::toIntOpt<uint64_t>(*len, soup::string::TI_FULL);
+            if (!opt.has_value()) {
+              detach(false);
+              fail("Protocol Error");
+              return false;
+            }
+            remain = *opt;
+            if (remain == 0)
+              return done(true);
+            phase = BODY_LENGTH;
+          }
+          else {
+            phase = BODY_CLOSE;
+            sock->callback_recv_on_close = true;
+          }
+          break;
+        case BODY_LENGTH:
+        case BODY_CHUNK_DATA: {
+          const size_t n = static_cast<size_t>(std::min<uint64_t>(remain, buf.size() - pos));
+          if (n == 0)
+            goto need_more;
+          deliver(buf.data() + pos, n);
+          pos += n;
+          remain -= n;
+          if (remain == 0) {
+            if (phase == BODY_LENGTH)
+              return done(true);
+            phase = BODY_CHUNK_END;
+          }
+          break;
+        }
+        case BODY_CHUNK_SIZE: {
+          if (!line(l))
+            goto need_more;
+          auto opt = soup::string::hexToIntOpt<uint64_t>(std::string(l.substr(0, l.find(';'))));
+          if (!opt.has_value()) {
+            detach(false);
+            fail("Protocol Error");
+            return false;
+          }
+          remain = *opt;
+          phase = (remain == 0 ? BODY_TRAILERS : BODY_CHUNK_DATA);
+          break;
+        }
+        case BODY_CHUNK_END:
+          if (!line(l))
+            goto need_more;
+          phase = BODY_CHUNK_SIZE;
+          break;
+        case BODY_TRAILERS:
+          if (!line(l))
+            goto need_more;
+          if (l.empty())
+            return done(true);
+          break;
+        case BODY_CLOSE:
+          if (pos != buf.size())
+            deliver(buf.data() + pos, buf.size() - pos);
+          pos = buf.size();
+          goto need_more;
+      }
+    }
+  need_more:
+    buf.erase(0, pos);
+    return true;
+  }
+
+  void deliver(const char *data, size_t size) {
+    if (!streaming) {
+      resp.body.append(data, size);
+      return;
+    }
+    {
+      std::lock_guard lock(mtx);
+      chunks.emplace_back(data, size);
+      queued += size;
+      signal.setWorkDone();
+    }
+    cv.notify_all();
+    sched.loop->wake();
+  }
+
+  /* The response has been received in full; 'reusable' is whether the connection is in a state to carry another one. */
+  void complete(bool reusable) {
+    if (reusable) {
+      if (dont_make_reusable || sched.dont_make_reusable_sockets || !buf.empty())
+        reusable = false;
+      else if (auto con = resp.findHeader("Connection"); con && soup::string::lower(std::move(*con)) == "close")
+        reusable = false;
+    }
+    detach(reusable);
+    if (!streaming) {
+      resp.decode();
+      if (soup::HttpRequest::isChallengeResponse(resp)) {
+        fail(soup::ObfusString("Protocol Error Or Blocked By Security Solution").str());
+        return;
+      }
+    }
+    finish(true, {});
+  }
+
+  void fail(std::string&& msg) {
+    finish(false, std::move(msg));
+  }
+
+  void finish(bool success, std::string&& msg) {
+    state = DONE;
+    {
+      std::lock_guard lock(mtx);
+      finished = true;
+      ok = success;
+      error = std::move(msg);
+      signal.setWorkDone();
+    }
+    cv.notify_all();
+    setWorkDone();
+    sched.loop->wake();
+  }
+
+  /* Lua side: waits until there are chunks to pick up or the response is complete. */
+  void block() {
+    std::unique_lock lock(mtx);
+    cv.wait(lock, [this] { return finished || !chunks.empty(); });
+  }
+
+  /* Lua side: resets 'signal' if there's nothing to pick up. Returns false if there is. */
+  [[nodiscard]] bool rearm() {
+    std::lock_guard lock(mtx);
+    if (finished || !chunks.empty())
+      return false;
+    signal.holdup_type = soup::Worker::IDLE;
+    return true;
+  }
+
+  [[nodiscard]] std::string toString() const SOUP_EXCAL final {
+    std::string str = "PooledRequestTask(";
+    str.append(hr.getHost());
+    str.append(hr.path);
+    str.push_back(')');
+    return str;
+  }
+};
+
+#define HTTP_REQUEST_HANDLE "pluto:http-request"
+
+/* Userdata for a request in flight; its user value is the 'stream' callback, if any. */
+struct HttpRequestHandle {
+  soup::SharedPtr<PooledRequestTask> task;
+};
+
+[[nodiscard]] static PooledRequestTask& checkrequest (lua_State *L, int i) {
+  return *((HttpRequestHandle*)luaL_checkudata(L, i, HTTP_REQUEST_HANDLE))->task;
 }
 #endif
 
@@ -65,21 +629,22 @@ static int await_task (lua_State *L, soup::SharedPtr<Task>&& spTask) {
 extern bool PLUTO_HTTP_REQUEST_HOOK(lua_State* L, const char* url);
 #endif
 
-static int http_request (lua_State *L) {
+/* Builds the request for the URL or option table at 'idx'. Sets 'optionsidx' to the option table's index, or 0 if there is none. */
+static soup::HttpRequest check_http_request (lua_State *L, int idx, int& optionsidx) {
   std::string uri;
-  int optionsidx = 0;
-  if (lua_type(L, 1) == LUA_TTABLE) {
+  optionsidx = 0;
+  if (lua_type(L, idx) == LUA_TTABLE) {
     lua_pushliteral(L, "url");
-    if (lua_rawget(L, 1) != LUA_TSTRING)
+    if (lua_rawget(L, idx) != LUA_TSTRING)
       luaL_error(L, "Table is missing 'url' option");
     uri = pluto_checkstring(L, -1);
     lua_pop(L, 1);
-    optionsidx = 1;
+    optionsidx = idx;
   }
   else {
-    uri = pluto_checkstring(L, 1);
-    if (lua_type(L, 2) == LUA_TTABLE)
-      optionsidx = 2;
+    uri = pluto_checkstring(L, idx);
+    if (lua_type(L, idx + 1) == LUA_TTABLE)
+      optionsidx = idx + 1;
   }
   if (uri.find_first_of("\n\r") != std::string::npos) {  /* URL contains forbidden characters? */
     uri.clear(); uri.shrink_to_fit();  /* free memory */
@@ -109,7 +674,7 @@ static int http_request (lua_State *L) {
         lua_pop(L, 1);
       }
       const char *str = lua_tostring(L, -2);
-      if (strcmp(str, "url") != 0 && strcmp(str, "method") != 0 && strcmp(str, "headers") != 0 && strcmp(str, "body") != 0 && strcmp(str, "prefer_ipv6") != 0 && strcmp(str, "dont_reuse") != 0 && strcmp(str, "dont_make_reusable") != 0) {
+      if (strcmp(str, "url") != 0 && strcmp(str, "method") != 0 && strcmp(str, "headers") != 0 && strcmp(str, "body") != 0 && strcmp(str, "prefer_ipv6") != 0 && strcmp(str, "dont_reuse") != 0 && strcmp(str, "dont_make_reusable") != 0 && strcmp(str, "stream") != 0) {
         pluto_warning(L, luaO_pushfstring(L, "unrecognized http request option: %s", lua_tostring(L, -2)));
         lua_pop(L, 1);
       }
@@ -147,15 +712,37 @@ static int http_request (lua_State *L) {
       hr.setPayload("");
     lua_pop(L, 1);
   }
+  return hr;
+}
 
-#if SOUP_WASM
-  auto pTask = pluto_newclassinst(L, soup::HttpRequestTask, std::move(hr));
-  return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(pTask), &await_task_cont<soup::HttpRequestTask, push_http_response>);
-#else
-  if (G(L)->scheduler == nullptr) {
-    G(L)->scheduler = new soup::DetachedScheduler();
+#if !SOUP_WASM
+static void setrequestmetatable (lua_State *L);
+
+/* Starts the request described by the value(s) at 'idx' and pushes its handle. */
+static void start_http_request (lua_State *L, int idx) {
+  int optionsidx;
+  soup::HttpRequest hr = check_http_request(L, idx, optionsidx);
+  bool streaming = false;
+  if (optionsidx) {
+    lua_pushliteral(L, "stream");
+    if (lua_rawget(L, optionsidx) > LUA_TNIL) {
+      luaL_argcheck(L, lua_isfunction(L, -1), idx, "'stream' must be a function");
+      streaming = true;
+      const int top = lua_gettop(L);
+      lua_pushliteral(L, "headers");
+      if (lua_rawget(L, optionsidx) != LUA_TTABLE || lua_getfield(L, -1, "Accept-Encoding") == LUA_TNIL)
+        hr.setHeader("Accept-Encoding", "identity");  /* chunks are passed on as received, so we can't decompress them */
+      lua_settop(L, top);
+    }
   }
-  auto spTask = reinterpret_cast<soup::DetachedScheduler*>(G(L)->scheduler)->add<soup::HttpRequestTask>(std::move(hr));
+  else {
+    lua_pushnil(L);
+  }
+  /* stream callback is on the top */
+  auto& sched = get_scheduler(L);
+  if (!sched.dont_make_reusable_sockets)
+    hr.setKeepAlive();
+  auto spTask = soup::make_shared<PooledRequestTask>(sched, std::move(hr), streaming);
   if (optionsidx) {
     lua_pushliteral(L, "prefer_ipv6");
     if (lua_rawget(L, optionsidx) > LUA_TNIL)
@@ -163,59 +750,266 @@ static int http_request (lua_State *L) {
     lua_pop(L, 1);
     lua_pushliteral(L, "dont_reuse");
     if (lua_rawget(L, optionsidx) > LUA_TNIL)
-      spTask->dont_use_reusable_sockets = lua_istrue(L, -1);
+      spTask->dont_reuse = lua_istrue(L, -1);
     lua_pop(L, 1);
     lua_pushliteral(L, "dont_make_reusable");
     if (lua_rawget(L, optionsidx) > LUA_TNIL)
-      spTask->dont_make_reusable_sockets = lua_istrue(L, -1);
+      spTask->dont_make_reusable = lua_istrue(L, -1);
     lua_pop(L, 1);
   }
-  return await_task<soup::HttpRequestTask, push_http_response>(L, std::move(spTask));
+  new (lua_newuserdatauv(L, sizeof(HttpRequestHandle), 1)) HttpRequestHandle{ spTask };
+  setrequestmetatable(L);
+  lua_insert(L, -2);
+  lua_setiuservalue(L, -2, 1);
+  {
+    std::lock_guard lock(sched.pool.mtx);
+    ++sched.pool.stats.requests;
+  }
+  sched.addWorker(std::move(spTask));
+}
+
+/* Hands the chunks received so far to the stream callback of the request at 'idx'. Returns true once the request is finished. */
+static bool pump_http_request (lua_State *L, int idx) {
+  auto& task = checkrequest(L, idx);
+  while (true) {
+    std::string chunk;
+    {
+      std::lock_guard lock(task.mtx);
+      if (task.chunks.empty())
+        break;
+      chunk = std::move(task.chunks.front());
+      task.chunks.pop_front();
+      task.queued -= chunk.size();
+    }
+    lua_getiuservalue(L, idx, 1);
+    pluto_pushstring(L, chunk);
+    lua_call(L, 1, 0);
+  }
+  std::lock_guard lock(task.mtx);
+  return task.finished && task.chunks.empty();
+}
+
+/* Pushes the result of a finished request as its table fields, for http.requestmany. */
+static void push_http_result_table (lua_State *L, PooledRequestTask& task) {
+  lua_newtable(L);
+  if (!task.ok) {
+    pluto_pushstring(L, task.error);
+    lua_setfield(L, -2, "error");
+    return;
+  }
+  pluto_pushstring(L, task.resp.body);
+  lua_setfield(L, -2, "body");
+  lua_pushinteger(L, task.resp.status_code);
+  lua_setfield(L, -2, "status_code");
+  lua_newtable(L);
+  for (auto& e : task.resp.getHeaderFields()) {
+    pluto_pushstring(L, e.first);
+    pluto_pushstring(L, e.second);
+    lua_settable(L, -3);
+  }
+  lua_setfield(L, -2, "headers");
+  pluto_pushstring(L, task.resp.status_text);
+  lua_setfield(L, -2, "status_text");
+}
+
+static int push_http_response (lua_State *L, PooledRequestTask& task) {
+  if (task.ok) {
+    // Return value order is 'body, status_code, response_headers, status_text' for compatibility with luasocket.
+    pluto_pushstring(L, task.resp.body);
+    lua_pushinteger(L, task.resp.status_code);
+    lua_newtable(L);
+    for (auto& e : task.resp.getHeaderFields()) {
+      pluto_pushstring(L, e.first);
+      pluto_pushstring(L, e.second);
+      lua_settable(L, -3);
+    }
+    pluto_pushstring(L, task.resp.status_text);
+    return 4;
+  }
+  // Return value order is 'nil, message' for compatibility with luasocket.
+  luaL_pushfail(L);
+  pluto_pushstring(L, task.error);
+  return 2;
+}
+
+/* Awaits the request whose handle is at index 1, yielding if possible and blocking on it otherwise. */
+static int await_http_request (lua_State *L, int status, lua_KContext ctx) {
+  while (!pump_http_request(L, 1)) {
+    auto& task = checkrequest(L, 1);
+    if (lua_isyieldable(L)) {
+      if (!task.rearm())
+        continue;
+      pluto_waitworker(L, &task.signal);
+      return lua_yieldk(L, 0, 0, &await_http_request);
+    }
+    task.block();
+  }
+  return push_http_response(L, checkrequest(L, 1));
+}
+#endif
+
+static int http_request (lua_State *L) {
+#if SOUP_WASM
+  int optionsidx;
+  soup::HttpRequest hr = check_http_request(L, 1, optionsidx);
+  auto pTask = pluto_newclassinst(L, soup::HttpRequestTask, std::move(hr));
+  return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(pTask), &await_task_cont<soup::HttpRequestTask, push_http_response>);
+#else
+  start_http_request(L, 1);
+  lua_replace(L, 1);
+  lua_settop(L, 1);
+  return await_http_request(L, LUA_OK, 0);
 #endif
 }
 
 #if !SOUP_WASM
-struct HasConnectionTask : public soup::PromiseTask<bool> {
-  std::string host;
-  uint16_t port;
-  bool tls;
+/* http.async(url|options) starts a request and returns a handle to await it later. */
+static int http_async (lua_State *L) {
+  start_http_request(L, 1);
+  return 1;
+}
+
+static int http_request_await (lua_State *L) {
+  luaL_checkudata(L, 1, HTTP_REQUEST_HANDLE);
+  lua_settop(L, 1);
+  return await_http_request(L, LUA_OK, 0);
+}
+
+static int http_request_done (lua_State *L) {
+  auto& task = checkrequest(L, 1);
+  std::lock_guard lock(task.mtx);
+  lua_pushboolean(L, task.finished);
+  return 1;
+}
 
-  HasConnectionTask(std::string&& host, uint16_t port, bool tls) : host(std::move(host)), port(port), tls(tls) {}
+static int http_request_cancel (lua_State *L) {
+  checkrequest(L, 1).cancelled = true;  /* picked up on the task's next tick */
+  return 0;
+}
 
-  void onTick() {
-    fulfil(soup::Scheduler::get()->findReusableSocket(host, port, tls));
+static int http_requestmany_cont (lua_State *L, int status, lua_KContext ctx) {
+  const lua_Integer n = luaL_len(L, 2);
+  for (lua_Integer i = static_cast<lua_Integer>(ctx); i <= n; ++i) {
+    lua_geti(L, 2, i);
+    const int h = lua_gettop(L);
+    while (!pump_http_request(L, h)) {
+      auto& task = checkrequest(L, h);
+      if (lua_isyieldable(L)) {
+        if (!task.rearm())
+          continue;
+        pluto_waitworker(L, &task.signal);
+        lua_settop(L, 3);
+        return lua_yieldk(L, 0, static_cast<lua_KContext>(i), &http_requestmany_cont);
+      }
+      task.block();
+    }
+    push_http_result_table(L, checkrequest(L, h));
+    lua_seti(L, 3, i);
+    lua_settop(L, 3);
   }
-};
+  return 1;
+}
 
-static int http_hasconnection_result (lua_State *L, HasConnectionTask& task) {
-  lua_pushboolean(L, task.result);
+/*
+** http.requestmany(list) sends every request of 'list' (each a URL or option
+** table, as for http.request) at once and returns a list of result tables with
+** either 'body', 'status_code', 'headers' & 'status_text', or 'error'.
+*/
+static int http_requestmany (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  const lua_Integer n = luaL_len(L, 1);
+  lua_createtable(L, static_cast<int>(n), 0);  /* 2: handles */
+  for (lua_Integer i = 1; i <= n; ++i) {
+    lua_geti(L, 1, i);
+    start_http_request(L, lua_gettop(L));
+    lua_seti(L, 2, i);
+    lua_pop(L, 1);
+  }
+  lua_createtable(L, static_cast<int>(n), 0);  /* 3: results */
+  return http_requestmany_cont(L, LUA_OK, 1);
+}
+
+/* http.setpoollimits(perhost [, idle]) */
+static int http_setpoollimits (lua_State *L) {
+  const lua_Integer perhost = luaL_checkinteger(L, 1);
+  const lua_Integer idle = luaL_optinteger(L, 2, perhost);
+  luaL_argcheck(L, perhost >= 1, 1, "must be at least 1");
+  luaL_argcheck(L, idle >= 0 && idle <= perhost, 2, "must be between 0 and the per-host limit");
+  auto& pool = get_scheduler(L).pool;
+  std::lock_guard lock(pool.mtx);
+  pool.maxperhost = static_cast<size_t>(perhost);
+  pool.maxidle = static_cast<size_t>(idle);
+  return 0;
+}
+
+static int http_poolstats (lua_State *L) {
+  HttpPool::Stats stats;
+  size_t open = 0, idle = 0;
+  if (G(L)->scheduler) {
+    auto& pool = reinterpret_cast<HttpScheduler*>(G(L)->scheduler)->pool;
+    std::lock_guard lock(pool.mtx);
+    stats = pool.stats;
+    for (const auto& [k, o] : pool.origins) {
+      open += o.open;
+      idle += o.idle.size();
+    }
+  }
+  lua_createtable(L, 0, 7);
+  lua_pushinteger(L, static_cast<lua_Integer>(stats.requests));
+  lua_setfield(L, -2, "requests");
+  lua_pushinteger(L, static_cast<lua_Integer>(stats.connections));
+  lua_setfield(L, -2, "connections");
+  lua_pushinteger(L, static_cast<lua_Integer>(stats.reused));
+  lua_setfield(L, -2, "reused");
+  lua_pushinteger(L, static_cast<lua_Integer>(stats.retried));
+  lua_setfield(L, -2, "retried");
+  lua_pushinteger(L, static_cast<lua_Integer>(stats.waited));
+  lua_setfield(L, -2, "waited");
+  lua_pushinteger(L, static_cast<lua_Integer>(open));
+  lua_setfield(L, -2, "open");
+  lua_pushinteger(L, static_cast<lua_Integer>(idle));
+  lua_setfield(L, -2, "idle");
   return 1;
 }
 
 static int http_hasconnection (lua_State *L) {
   soup::Uri uri(pluto_checkstring(L, 1));
-  if (G(L)->scheduler
-    && reinterpret_cast<soup::DetachedScheduler*>(G(L)->scheduler)->isActive()
-    ) {
+  bool found = false;
+  if (G(L)->scheduler) {
     bool tls = (uri.scheme != "http");
     uint16_t port = uri.port;
     if (port == 0) {
       port = (tls ? 443 : 80);
     }
-    auto spTask = reinterpret_cast<soup::DetachedScheduler*>(G(L)->scheduler)->add<HasConnectionTask>(std::move(uri.host), port, tls);
-    return await_task<HasConnectionTask, http_hasconnection_result>(L, std::move(spTask));
+    auto& pool = reinterpret_cast<HttpScheduler*>(G(L)->scheduler)->pool;
+    std::lock_guard lock(pool.mtx);
+    if (auto o = pool.origins.find(HttpPool::key(uri.host, port, tls)); o != pool.origins.end())
+      found = (o->second.open != 0);
   }
-  lua_pushboolean(L, false);
+  lua_pushboolean(L, found);
   return 1;
 }
 
+/* closes the idle connections of the pool on the scheduler thread */
+struct ClosePoolTask : public soup::Task {
+  HttpPool& pool;
+
+  ClosePoolTask(HttpPool& pool) : pool(pool) {}
+
+  void onTick() final {
+    pool.closeIdle();
+    setWorkDone();
+  }
+};
+
 static int http_closeconnections_cont (lua_State *L, int status, lua_KContext ctx) {
   if (G(L)->scheduler
     && reinterpret_cast<soup::DetachedScheduler*>(G(L)->scheduler)->isActive()
     ) {
     return lua_yieldk(L, 0, 0, http_closeconnections_cont);
   }
-  delete reinterpret_cast<soup::DetachedScheduler*>(G(L)->scheduler);
+  delete reinterpret_cast<HttpScheduler*>(G(L)->scheduler);
   G(L)->scheduler = nullptr;
   return 0;
 }
@@ -230,17 +1024,50 @@ static int http_closeconnections (lua_State *L) {
   if (G(L)->scheduler
     && reinterpret_cast<soup::DetachedScheduler*>(G(L)->scheduler)->isActive()
     ) {
-    reinterpret_cast<soup::DetachedScheduler*>(G(L)->scheduler)->setDontMakeReusableSockets();
-    reinterpret_cast<soup::DetachedScheduler*>(G(L)->scheduler)->closeReusableSockets();
+    auto sched = reinterpret_cast<HttpScheduler*>(G(L)->scheduler);
+    sched->setDontMakeReusableSockets();
+    {
+      std::lock_guard lock(sched->pool.mtx);
+      sched->pool.closing = true;
+    }
+    sched->add<ClosePoolTask>(sched->pool);
     return lua_yieldk(L, 0, 0, http_closeconnections_cont);
   }
 #endif
   return 0;
 }
 
+#if !SOUP_WASM
+static const luaL_Reg funcs_http_request[] = {
+  {"await", http_request_await},
+  {"done", http_request_done},
+  {"cancel", http_request_cancel},
+  {nullptr, nullptr}
+};
+
+static void setrequestmetatable (lua_State *L) {
+  if (luaL_newmetatable(L, HTTP_REQUEST_HANDLE)) {
+    lua_pushcfunction(L, [](lua_State *L) {
+      auto handle = (HttpRequestHandle*)luaL_checkudata(L, 1, HTTP_REQUEST_HANDLE);
+      handle->task->cancelled = true;  /* nothing can consume the response anymore */
+      std::destroy_at(handle);
+      return 0;
+    });
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, funcs_http_request);
+    lua_setfield(L, -2, "__index");
+  }
+  lua_setmetatable(L, -2);
+}
+#endif
+
 static const luaL_Reg funcs_http[] = {
   {"request", http_request},
 #if !SOUP_WASM
+  {"async", http_async},
+  {"requestmany", http_requestmany},
+  {"setpoollimits", http_setpoollimits},
+  {"poolstats", http_poolstats},
   {"hasconnection", http_hasconnection},
 #endif
   {"closeconnections", http_closeconnections},
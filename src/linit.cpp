@@ -28,12 +28,49 @@
 
 
 #include <stddef.h>
-#include <cstring>
 
 #include "lua.h"
 
 #include "lualib.h"
 #include "lauxlib.h"
+#include "lstdlibcode.hpp"
+
+
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+const Pluto::StdlibChunk Pluto::stdlib_startup{ "Pluto Standard Library", R"EOC(
+pluto_use "0.6.0"
+
+class exception
+    __name = "pluto:exception"
+
+    function __construct(public what)
+        local caller
+        local i = 2
+        while true do
+            caller = debug.getinfo(i)
+            if caller == nil then
+                error("exception instances must be created with 'pluto_new'", 0)
+            end
+            ++i
+            if caller.name == "Pluto_operator_new" then
+                caller = debug.getinfo(i)
+                break
+            end
+        end
+        self.where = $"{caller.short_src}:{caller.currentline}"
+        error(self, 0)
+    end
+
+    function __tostring()
+        return $"{self.where}: {tostring(self.what)}"
+    end
+end
+
+function instanceof(a, b)
+  return a instanceof b
+end
+)EOC" };
+#endif
 
 
 /*
@@ -77,40 +114,7 @@ LUALIB_API void luaL_openlibs (lua_State *L) {
   lua_pop(L, 1);
 
 #ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
-  const auto startup_code = R"EOC(
-pluto_use "0.6.0"
-
-class exception
-    __name = "pluto:exception"
-
-    function __construct(public what)
-        local caller
-        local i = 2
-        while true do
-            caller = debug.getinfo(i)
-            if caller == nil then
-                error("exception instances must be created with 'pluto_new'", 0)
-            end
-            ++i
-            if caller.name == "Pluto_operator_new" then
-                caller = debug.getinfo(i)
-                break
-            end
-        end
-        self.where = $"{caller.short_src}:{caller.currentline}"
-        error(self, 0)
-    end
-
-    function __tostring()
-        return $"{self.where}: {tostring(self.what)}"
-    end
-end
-
-function instanceof(a, b)
-  return a instanceof b
-end
-)EOC";
-  luaL_loadbuffer(L, startup_code, strlen(startup_code), "Pluto Standard Library");
+  Pluto::loadStdlibChunk(L, Pluto::stdlib_startup);
   lua_call(L, 0, 0);
 #endif
 }
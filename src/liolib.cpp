@@ -16,13 +16,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "lua.h"
 
 #include "lauxlib.h"
 #include "lualib.h"
+#include "lbufferlib.hpp"
 
 #include "vendor/Soup/soup/filesystem.hpp"
 #include "vendor/Soup/soup/string.hpp"
@@ -781,7 +790,7 @@ static int g_write (lua_State *L, FILE *f, int arg) {
     }
     else {
       size_t l;
-      const char *s = luaL_checklstring(L, arg, &l);
+      const char *s = pluto_checkbytes(L, arg, &l);
       status = status && (fwrite(s, sizeof(char), l, f) == l);
     }
   }
@@ -1213,6 +1222,21 @@ static int contents (lua_State *L) {
 }
 
 
+/* io.mmap(path) maps the file read-only, returning a buffer that is paged in on demand instead of copied into a string. */
+static int io_mmap (lua_State *L) {
+  const auto path = getStringStreamPathForRead(L, 1);
+  size_t len;
+  const void *addr = soup::filesystem::createFileMapping(path, len);
+  if (addr == nullptr) {
+    luaL_pushfail(L);
+    lua_pushfstring(L, "%s: cannot map file", luaL_checkstring(L, 1));
+    return 2;
+  }
+  pluto_pushmapping(L, addr, len);
+  return 1;
+}
+
+
 static int io_chmod (lua_State *L) {
   switch (lua_gettop(L)) {
     case 0: {  /* availability check */
@@ -1242,12 +1266,340 @@ static int io_chmod (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Lazy directory walking
+** =======================================================
+*/
+
+#define WALKERHANDLE "pluto:io-walker"
+
+/* How many unconsumed directory listings the prefetcher may hold. */
+#define WALK_PREFETCH_AHEAD 64
+
+namespace {
+  struct WalkEntry {
+    std::filesystem::path path;
+    lua_Integer size = -1;
+    lua_Integer mtime = -1;
+    uint64_t listing = 0;  /* prefetch request for this directory's contents */
+    bool isdir = false;
+    bool islink = false;
+    bool descend = false;
+  };
+
+  using WalkListing = std::vector<WalkEntry>;
+
+  /* The entry's type comes from the directory scan itself (d_type), so only 'want_stat' costs a syscall. */
+  void walk_read_entry (WalkEntry& e, const std::filesystem::directory_entry& dir_entry, bool want_stat) {
+    std::error_code ec;
+    e.path = dir_entry.path();
+    e.islink = dir_entry.is_symlink(ec);
+    e.isdir = dir_entry.is_directory(ec);
+    if (want_stat) {
+#if SOUP_WINDOWS
+      /* cached from FindNextFile */
+      if (!e.isdir) {
+        const auto size = dir_entry.file_size(ec);
+        if (!ec) e.size = (lua_Integer)size;
+      }
+      const auto ft = dir_entry.last_write_time(ec);
+      if (!ec) e.mtime = file_time_to_unix_time(ft);
+#else
+      /* one stat for both, where directory_entry would make a call for each */
+      struct stat st;
+      if (stat(e.path.c_str(), &st) == 0) {
+        if (!S_ISDIR(st.st_mode)) e.size = (lua_Integer)st.st_size;
+        e.mtime = (lua_Integer)st.st_mtime;
+      }
+#endif
+    }
+  }
+
+  void walk_read_listing (WalkListing& listing, std::filesystem::directory_iterator it, bool want_stat) {
+    std::error_code ec;
+    for (; !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+      walk_read_entry(listing.emplace_back(), *it, want_stat);
+    }
+  }
+
+  /*
+  ** Reads directory listings on a worker thread. Every listing's subdirectories are
+  ** queued in front of older requests, so reads happen in the walker's depth-first order.
+  */
+  struct WalkPrefetcher {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::pair<uint64_t, std::filesystem::path>> requests;
+    std::unordered_map<uint64_t, WalkListing> ready;
+    uint64_t next_id = 1;
+    uint64_t urgent = 0;  /* listing the walker is blocked on */
+    bool stop = false;
+    const bool want_stat;
+    std::thread thread;
+
+    WalkPrefetcher (bool want_stat)
+      : want_stat(want_stat), thread(&WalkPrefetcher::run, this) {}
+
+    ~WalkPrefetcher () {
+      {
+        std::lock_guard lock(mtx);
+        stop = true;
+      }
+      cv.notify_all();
+      thread.join();
+    }
+
+    void request (WalkListing& listing) {
+      std::lock_guard lock(mtx);
+      auto pos = requests.begin();
+      for (auto& e : listing) {
+        if (e.descend) {
+          e.listing = next_id++;
+          pos = requests.emplace(pos, e.listing, e.path) + 1;
+        }
+      }
+      cv.notify_all();
+    }
+
+    WalkListing take (uint64_t id) {
+      std::unique_lock lock(mtx);
+      if (ready.count(id) == 0) {
+        urgent = id;
+        cv.notify_all();
+        cv.wait(lock, [&] { return ready.count(id) != 0; });
+        urgent = 0;
+      }
+      return std::move(ready.extract(id).mapped());
+    }
+
+    void run () {
+      std::unique_lock lock(mtx);
+      while (true) {
+        cv.wait(lock, [&] {
+          return stop || (!requests.empty() && (ready.size() < WALK_PREFETCH_AHEAD || (urgent != 0 && ready.count(urgent) == 0)));
+        });
+        if (stop) break;
+        auto it = requests.begin();
+        if (ready.size() >= WALK_PREFETCH_AHEAD) {
+          /* the walker skipped ahead of us, e.g. because a prune callback dropped a subtree */
+          it = std::find_if(requests.begin(), requests.end(), [&](const auto& req) { return req.first == urgent; });
+        }
+        const uint64_t id = it->first;
+        const std::filesystem::path dir = std::move(it->second);
+        requests.erase(it);
+        lock.unlock();
+        WalkListing listing;
+        try {
+          std::error_code ec;
+          walk_read_listing(listing, std::filesystem::directory_iterator(dir, ec), want_stat);
+        }
+        catch (const std::exception&) {}  /* keep what we have, like an unreadable directory */
+        lock.lock();
+        ready.emplace(id, std::move(listing));
+        cv.notify_all();
+      }
+    }
+  };
+
+  struct Walker {
+    struct Frame {
+      std::filesystem::directory_iterator it;  /* when reading directories on demand */
+      WalkListing listing;  /* when they are prefetched */
+      size_t next = 0;
+      lua_Integer depth;
+    };
+
+    std::vector<Frame> stack;
+    WalkEntry pending;  /* directory to enter on the next step */
+    lua_Integer pending_depth = 0;
+    lua_Integer maxdepth = LUA_MAXINTEGER;
+    bool want_stat = false;
+    std::unique_ptr<WalkPrefetcher> prefetcher;
+  };
+}
+
+static void walk_pushinfo (lua_State *L, const Walker *w, const WalkEntry& e, lua_Integer depth) {
+  lua_createtable(L, 0, w->want_stat ? 5 : 3);
+  lua_pushboolean(L, e.isdir);
+  lua_setfield(L, -2, "isdir");
+  lua_pushboolean(L, e.islink);
+  lua_setfield(L, -2, "islink");
+  lua_pushinteger(L, depth);
+  lua_setfield(L, -2, "depth");
+  if (e.size != -1) {
+    lua_pushinteger(L, e.size);
+    lua_setfield(L, -2, "size");
+  }
+  if (e.mtime != -1) {
+    lua_pushinteger(L, e.mtime);
+    lua_setfield(L, -2, "mtime");
+  }
+}
+
+/* Expects the entry's path & info on the stack; the walker is at index 1. */
+static bool walk_shoulddescend (lua_State *L, const Walker *w, const WalkEntry& e, lua_Integer depth) {
+  if (!e.isdir || e.islink || depth >= w->maxdepth)
+    return false;
+  if (lua_getiuservalue(L, 1, 1) != LUA_TFUNCTION) {  /* no prune callback? */
+    lua_pop(L, 1);
+    return true;
+  }
+  lua_pushvalue(L, -3);
+  lua_pushvalue(L, -3);
+  lua_call(L, 2, 1);
+  const bool prune = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return !prune;
+}
+
+static void walk_accept (lua_State *L, Walker *w, WalkListing& listing, lua_Integer depth) {
+  for (auto& e : listing) {
+    if (e.isdir && !e.islink && depth < w->maxdepth) {
+      lua_pushstring(L, (const char*)e.path.u8string().c_str());
+      walk_pushinfo(L, w, e, depth);
+      e.descend = walk_shoulddescend(L, w, e, depth);
+      lua_pop(L, 2);
+    }
+  }
+  w->prefetcher->request(listing);
+}
+
+static int walk_next (lua_State *L) {
+  auto w = (Walker *)luaL_checkudata(L, 1, WALKERHANDLE);
+  if (w->pending_depth != 0) {  /* enter the directory we yielded last */
+    Walker::Frame f;
+    f.depth = w->pending_depth;
+    w->pending_depth = 0;
+    if (w->prefetcher) {
+      f.listing = w->prefetcher->take(w->pending.listing);
+      walk_accept(L, w, f.listing, f.depth);
+    }
+    else {
+      std::error_code ec;
+      f.it = std::filesystem::directory_iterator(w->pending.path, ec);
+    }
+    w->stack.emplace_back(std::move(f));
+  }
+  while (!w->stack.empty()) {
+    auto& f = w->stack.back();
+    const lua_Integer depth = f.depth;
+    WalkEntry e;
+    if (w->prefetcher) {
+      if (f.next == f.listing.size()) {
+        w->stack.pop_back();
+        continue;
+      }
+      e = std::move(f.listing[f.next++]);
+    }
+    else {
+      if (f.it == std::filesystem::directory_iterator()) {
+        w->stack.pop_back();
+        continue;
+      }
+      Protect(walk_read_entry(e, *f.it, w->want_stat));
+      std::error_code ec;
+      f.it.increment(ec);
+      if (ec) f.it = std::filesystem::directory_iterator();  /* skip the rest of this directory */
+    }
+    lua_pushstring(L, (const char*)e.path.u8string().c_str());
+    walk_pushinfo(L, w, e, depth);
+    if (!w->prefetcher)
+      e.descend = walk_shoulddescend(L, w, e, depth);
+    if (e.descend) {
+      w->pending = std::move(e);
+      w->pending_depth = depth + 1;
+    }
+    return 2;
+  }
+  return 0;
+}
+
+static int walk_close (lua_State *L) {
+  auto w = (Walker *)luaL_checkudata(L, 1, WALKERHANDLE);
+  w->prefetcher.reset();
+  w->stack.clear();
+  w->pending_depth = 0;
+  return 0;
+}
+
+static int walk_gc (lua_State *L) {
+  std::destroy_at((Walker *)luaL_checkudata(L, 1, WALKERHANDLE));
+  return 0;
+}
+
+/*
+** io.walk(path [, opts]) iterates a directory tree depth-first, yielding each entry's
+** path and an info table, without first building the whole tree in memory like listdir.
+*/
+static int io_walk (lua_State *L) {
+  const auto root = getStringStreamPathForRead(L, 1);
+  lua_Integer maxdepth = LUA_MAXINTEGER;
+  bool want_stat = false, prefetch = false;
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (lua_getfield(L, 2, "depth") != LUA_TNIL) {
+      int isnum;
+      maxdepth = lua_tointegerx(L, -1, &isnum);
+      luaL_argcheck(L, isnum && maxdepth >= 1, 2, "'depth' must be a positive integer");
+    }
+    lua_getfield(L, 2, "stat");
+    want_stat = lua_toboolean(L, -1);
+    lua_getfield(L, 2, "prefetch");
+    prefetch = lua_toboolean(L, -1);
+    if (lua_getfield(L, 2, "prune") != LUA_TNIL)
+      luaL_argcheck(L, lua_isfunction(L, -1), 2, "'prune' must be a function");
+    lua_replace(L, 2);  /* keep only the callback */
+    lua_settop(L, 2);
+  }
+  else {
+    lua_settop(L, 1);
+    lua_pushnil(L);
+  }
+  auto w = new (lua_newuserdatauv(L, sizeof(Walker), 1)) Walker{};
+  if (luaL_newmetatable(L, WALKERHANDLE)) {
+    lua_pushcfunction(L, walk_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, walk_close);
+    lua_setfield(L, -2, "__close");
+  }
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 2);
+  lua_setiuservalue(L, -2, 1);
+  lua_replace(L, 1);  /* the walker is at index 1, as in walk_next */
+  w->maxdepth = maxdepth;
+  w->want_stat = want_stat;
+  Walker::Frame f;
+  f.depth = 1;
+  Protect(f.it = std::filesystem::directory_iterator(root));
+  if (prefetch) {
+    try {
+      w->prefetcher = std::make_unique<WalkPrefetcher>(want_stat);
+    }
+    catch (const std::exception&) {}  /* no threads; read on demand instead */
+  }
+  if (w->prefetcher) {
+    Protect(walk_read_listing(f.listing, std::move(f.it), want_stat));
+    walk_accept(L, w, f.listing, f.depth);
+  }
+  w->stack.emplace_back(std::move(f));
+  lua_pushcfunction(L, walk_next);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  lua_pushvalue(L, 1);  /* to-be-closed */
+  return 4;
+}
+
+/* }====================================================== */
+
+
 /*
 ** functions for 'io' library
 */
 static const luaL_Reg iolib[] = {
   {"chmod", io_chmod},
   {"contents", contents},
+  {"mmap", io_mmap},
   {"writetime", writetime},
   {"currentdir", currentdir},
   {"chdir", currentdir},
@@ -1255,6 +1607,7 @@ static const luaL_Reg iolib[] = {
   {"rename", l_rename},
   {"remove", l_remove},
   {"listdir", listdir},
+  {"walk", io_walk},
   {"makedir", makedir},
   {"mkdir", makedir},
   {"makedirs", makedirs},
@@ -1298,6 +1651,20 @@ static const luaL_Reg meth[] = {
 };
 
 
+static int io_noclose (lua_State *L);
+
+/*
+** A state cloned by lua_clonestate shares the standard files with its
+** template, but other files stay with the template, so they appear closed.
+*/
+static int f_clone (lua_State *L) {
+  LStream *p = tolstream(L);
+  if (p->closef != &io_noclose)
+    p->closef = NULL;
+  return 0;
+}
+
+
 /*
 ** metamethods for file handles
 */
@@ -1305,6 +1672,7 @@ static const luaL_Reg metameth[] = {
   {"__index", NULL},  /* placeholder */
   {"__gc", f_gc},
   {"__close", f_gc},
+  {"__clone", f_clone},
   {"__tostring", f_tostring},
   {NULL, NULL}
 };
@@ -2,6 +2,7 @@
 
 #include "lauxlib.h"
 #include "lualib.h"
+#include "lbufferlib.hpp"
 
 #include "ljson.hpp"
 
@@ -180,7 +181,7 @@ static int encode(lua_State* L) {
 static int decode(lua_State* L)
 {
 	size_t size;
-	const char* data = luaL_checklstring(L, 1, &size);
+	const char* data = pluto_checkbytes(L, 1, &size); // the decoder is bounded by 'size', so buffers & file mappings are read in place
 	int flags = (int)luaL_optinteger(L, 2, 0);
 	lua_checkstack(L, 1);
 	soup::JsonTreeWriter jtw;
@@ -670,6 +670,15 @@ static const luaL_Reg randfuncs[] = {
 };
 
 
+/*
+** A state cloned by lua_clonestate gets its own seed, like a new state.
+*/
+static int rand_clone (lua_State *L) {
+  randseed(L, (RanState *)lua_touserdata(L, 1));
+  return 0;
+}
+
+
 /*
 ** Register the random functions and initialize their state.
 */
@@ -677,6 +686,10 @@ static void setrandfunc (lua_State *L) {
   RanState *state = (RanState *)lua_newuserdatauv(L, sizeof(RanState), 0);
   randseed(L, state);  /* initialize with a "random" seed */
   lua_pop(L, 2);  /* remove pushed seeds */
+  lua_createtable(L, 0, 1);
+  lua_pushcfunction(L, rand_clone);
+  lua_setfield(L, -2, "__clone");
+  lua_setmetatable(L, -2);
   luaL_setfuncs(L, randfuncs, 1);
 
   // Provide "rand" as an alias to "random"
@@ -170,6 +170,25 @@ static void *tryagain (lua_State *L, void *block,
 }
 
 
+/*
+** [Pluto] Checks whether growing a block from 'osize' to 'nsize' bytes
+** would exceed the state's memory limit, even after an emergency
+** collection.
+*/
+static int overlimit (lua_State *L, size_t osize, size_t nsize) {
+  global_State *g = G(L);
+  if (l_likely(g->memlimit == 0 || nsize <= osize))
+    return 0;
+  if (gettotalbytes(g) + (nsize - osize) <= g->memlimit)
+    return 0;
+  if (cantryagain(g)) {
+    luaC_fullgc(L, 1);  /* try to free some memory... */
+    return gettotalbytes(g) + (nsize - osize) > g->memlimit;
+  }
+  return 1;
+}
+
+
 /*
 ** Generic allocation routine.
 */
@@ -177,6 +196,8 @@ void *luaM_realloc_ (lua_State *L, void *block, size_t osize, size_t nsize) {
   void *newblock;
   global_State *g = G(L);
   lua_assert((osize == 0) == (block == NULL));
+  if (l_unlikely(overlimit(L, block ? osize : 0, nsize)))
+    return NULL;  /* do not update 'GCdebt' */
   newblock = firsttry(g, block, osize, nsize);
   if (l_unlikely(newblock == NULL && nsize > 0)) {
     newblock = tryagain(L, block, osize, nsize);
@@ -203,6 +224,8 @@ void *luaM_malloc_ (lua_State *L, size_t size, int tag) {
     return NULL;  /* that's all */
   else {
     global_State *g = G(L);
+    if (l_unlikely(overlimit(L, 0, size)))
+      luaM_error(L);
     void *newblock = firsttry(g, NULL, tag, size);
     if (l_unlikely(newblock == NULL)) {
       newblock = tryagain(L, NULL, tag, size);
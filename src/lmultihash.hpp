@@ -0,0 +1,34 @@
+#pragma once
+
+/*
+** Multi-buffer hashing: hashes many independent messages at once by running
+** one message per SIMD lane (or, for CRC32C, by interleaving several
+** dependency chains). This pays off for large batches of small messages,
+** where single-message hashing can't keep the execution units busy.
+*/
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Pluto {
+  struct MultiHash {
+    struct Input {
+      const uint8_t *data;
+      size_t size;
+    };
+
+    /*
+    ** Each *Backend function names the multi-buffer implementation the CPU
+    ** supports, or returns nullptr if there is none, in which case the
+    ** messages should be hashed one at a time instead.
+    */
+    [[nodiscard]] static const char *sha256Backend() noexcept;
+    [[nodiscard]] static const char *md5Backend() noexcept;
+    [[nodiscard]] static const char *crc32cBackend() noexcept;
+
+    /* These write 'n' digests back-to-back to 'out'; CRC32C values are written as big-endian. */
+    static void sha256(const Input *msgs, size_t n, uint8_t *out) noexcept;
+    static void md5(const Input *msgs, size_t n, uint8_t *out) noexcept;
+    static void crc32c(const Input *msgs, size_t n, uint8_t *out) noexcept;
+  };
+}
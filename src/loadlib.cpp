@@ -366,6 +366,20 @@ static int gctm (lua_State *L) {
 }
 
 
+/*
+** __clone tag method for CLIBS table: a state cloned by lua_clonestate
+** unloads its libraries on its own, so it needs its own reference to them
+*/
+static int clonetm (lua_State *L) {
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {
+    if (lua_type(L, -2) == LUA_TSTRING && lsys_load(L, lua_tostring(L, -2), 0) == NULL)
+      lua_pop(L, 1);  /* pop error message */
+    lua_pop(L, 1);  /* pop handle */
+  }
+  return 0;
+}
+
 
 /* error codes for 'lookforfunc' */
 #define ERRLIB		1
@@ -776,9 +790,11 @@ static void createsearcherstable (lua_State *L) {
 */
 static void createclibstable (lua_State *L) {
   luaL_getsubtable(L, LUA_REGISTRYINDEX, CLIBS);  /* create CLIBS table */
-  lua_createtable(L, 0, 1);  /* create metatable for CLIBS */
+  lua_createtable(L, 0, 2);  /* create metatable for CLIBS */
   lua_pushcfunction(L, gctm);
   lua_setfield(L, -2, "__gc");  /* set finalizer for CLIBS table */
+  lua_pushcfunction(L, clonetm);
+  lua_setfield(L, -2, "__clone");
   lua_setmetatable(L, -2);
 }
 
@@ -569,6 +569,9 @@ typedef struct Proto {
   LocVar *locvars;  /* information about local variables (debug information) */
   TString  *source;  /* used for debug information */
   GCObject *gclist;
+  struct LazyChunk *lazy;  /* [Pluto] indexed chunk that parts of this function are still to be loaded from */
+  size_t lazybody;  /* [Pluto] offset of the body in 'lazy', or 0 if it is loaded */
+  size_t lazydebug;  /* [Pluto] offset of the debug information in 'lazy', or 0 if it is loaded or absent */
   bool lua_vm_compatible;
   lu_byte min_required_version;
 
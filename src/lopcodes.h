@@ -313,6 +313,8 @@ else
   push R(B):contains(R(A)) ~= nil
 */
 
+OP_TESTRANGE,/* A k	if ((R[A] is the standard 'range') ~= k) then pc++	*/
+
 NUM_OPCODES
 } OpCode;
 
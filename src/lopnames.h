@@ -96,6 +96,7 @@ static const char *const opnames[] = {
   "EXTRAARG",
   // end of lua opcodes
   "IN",
+  "TESTRANGE",
   // end of pluto opcodes
   NULL
 };
@@ -405,7 +405,7 @@ static int os_sleep (lua_State *L) {
 #ifdef PLUTO_ETL_ENABLE
   std::time_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
   t += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::milliseconds(ms)).count();
-  if (L->l_G->deadline < t) {
+  if (L->l_G->deadline != 0 && L->l_G->deadline < t) {
     luaL_error(L, "os.sleep would exceed execution time limit");
   }
 #endif
@@ -4469,6 +4469,169 @@ static void forvlist (LexState *ls, TypeHint *prop) {
 }
 
 
+/*
+** Is this 'range(...) AS NAME' or 'NAME IN range(n)' with the global 'range'?
+** While that global is the standard 'range', such loops run as numeric loops,
+** so that the range is never built.
+*/
+static bool israngeloop (LexState *ls) {
+  size_t i = luaX_getpos(ls);
+  bool in = false;
+  if (ls->t.token == TK_NAME && luaX_lookahead(ls) == TK_IN) {
+    in = true;
+    i += 2;
+  }
+  const Token& fn = ls->tokens.at(i);
+  if (fn.token != TK_NAME || !eqstr(fn.seminfo.ts, luaX_newliteral(ls, "range")) || ls->tokens.at(i + 1).token != '(')
+    return false;
+  for (FuncState *fs = ls->fs; fs != nullptr; fs = fs->prev) {  /* must be global */
+    expdesc var;
+    if (searchvar(fs, fn.seminfo.ts, &var) >= 0 || searchupvalue(fs, fn.seminfo.ts) >= 0)
+      return false;
+  }
+  int depth = 0, nargs = 1;
+  for (i += 2; ; ++i) {
+    switch (ls->tokens.at(i).token) {
+      case '(': case '{': case '[':
+        ++depth;
+        continue;
+      case ']': case '}':
+        --depth;
+        continue;
+      case ',':
+        if (depth == 0)
+          ++nargs;
+        continue;
+      case ')':
+        if (depth-- != 0)
+          continue;
+        break;
+      case TK_EOS:
+        return false;
+      default:
+        continue;
+    }
+    break;
+  }
+  if (i == luaX_getpos(ls) + (in ? 4 : 2))  /* no arguments */
+    return false;
+  switch (ls->tokens.at(i - 1).token) {
+    case ')': case '}': case TK_STRING: case TK_DOTS:  /* the last argument may be a call with multiple results */
+      return false;
+  }
+  return in ? (nargs == 1 && ls->tokens.at(i + 1).token == TK_DO) : (nargs <= 3 && ls->tokens.at(i + 1).token == TK_AS);
+}
+
+
+/*
+** R[reg] := R[arg] >> 0, which converts the value to an integer like 'range'
+** does, so e.g. 1.0 counts as 1 and 2.5 raises "number has no integer
+** representation".
+*/
+static void rangeint (FuncState *fs, int reg, int arg, int line) {
+  luaK_codeABCk(fs, OP_SHRI, reg, arg, int2sC(0), 0);
+  luaK_fixline(fs, line);
+  luaK_codeABCk(fs, OP_MMBINI, arg, int2sC(0), TM_SHR, 0);
+  luaK_fixline(fs, line);
+}
+
+
+/*
+** The arguments are passed to the global 'range' like in any call. If it is
+** the standard 'range', they become the control variables of a numeric loop;
+** otherwise, its results are iterated over like in a generic loop. Both
+** loops share the body, with their loop variables in the same registers.
+*/
+static void forrange (LexState *ls, TypeHint *prop, int line) {
+  /* forrange -> [NAME IN] range '(' exp [',' exp [',' exp]] ')' [AS NAME] forbody */
+  FuncState *fs = ls->fs;
+  BlockCnt bl;
+  expdesc e;
+  int base = fs->freereg;
+  TString *varname = nullptr;
+  if (luaX_lookahead(ls) == TK_IN) {  /* the index is the value when iterating over range(n) */
+    varname = str_checkname(ls);
+    luaX_next(ls);  /* skip 'in' */
+  }
+  const int nvars = (varname ? 1 : 2);  /* declared variables of the generic loop */
+  const int nbase = base + nvars;  /* control variables of the numeric loop */
+  new_localvarliteral(ls, "(for state)");
+  new_localvarliteral(ls, "(for state)");
+  new_localvarliteral(ls, "(for state)");
+  new_localvarliteral(ls, "(for state)");
+  if (varname == nullptr)  /* key */
+    new_localvar(ls, luaS_newliteral(ls->L, "(for state)"), {}, true);
+  int vidx = new_localvar(ls, varname ? varname : luaS_newliteral(ls->L, "(for state)"));
+  singlevar(ls, &e);  /* 'range' */
+  luaK_exp2nextreg(fs, &e);
+  const int callline = ls->getLineNumber();
+  checknext(ls, '(');
+  int nargs = 0;
+  do {
+    expr(ls, &e);
+    luaK_exp2nextreg(fs, &e);
+    ++nargs;
+  } while (testnext(ls, ','));
+  check_match(ls, ')', '(', callline);
+  if (varname == nullptr) {
+    checknext(ls, TK_AS);
+    TString *name = str_checkname(ls);
+    checkforshadowing(ls, fs, name, line);
+    getlocalvardesc(fs, vidx)->vd.name = name;
+  }
+  checknext(ls, TK_DO);
+  luaK_reserveregs(fs, base + 4 - fs->freereg);
+  adjustlocalvars(ls, 4);  /* control variables */
+  marktobeclosed(fs);  /* last control var. must be closed */
+  luaK_checkstack(fs, 3);  /* extra space to call generator */
+  luaK_codeABCk(fs, OP_TESTRANGE, base, 0, 0, 1);
+  const int tonumeric = luaK_jump(fs);
+  fs->f->onPlutoOpUsed(0);
+  /* generic loop over the results of another 'range' */
+  luaK_codeABC(fs, OP_CALL, base, nargs + 1, 5);
+  luaK_fixline(fs, callline);
+  const int tprep = luaK_codeABx(fs, OP_TFORPREP, base, 0);
+  /* numeric loop */
+  luaK_patchtohere(fs, tonumeric);
+  if (nargs == 1) {  /* range(n) counts from 1 to n */
+    rangeint(fs, nbase + 1, base + 1, callline);
+    luaK_int(fs, nbase, 1);
+    luaK_int(fs, nbase + 2, 1);
+  }
+  else {  /* 'nbase' is 'base + 2', so each argument moves up by one */
+    if (nargs == 3)
+      rangeint(fs, nbase + 2, base + 3, callline);  /* step */
+    else
+      luaK_int(fs, nbase + 2, 1);
+    rangeint(fs, nbase + 1, base + 2, callline);  /* limit */
+    rangeint(fs, nbase, base + 1, callline);
+  }
+  luaK_codeABC(fs, OP_LOADFALSE, base, 0, 0);  /* the generic loop's iterator is never false */
+  const int prep = luaK_codeABx(fs, OP_FORPREP, nbase, 0);
+  const int body = luaK_getlabel(fs);
+  enterblock(fs, &bl, BlockType::BT_CONTINUE);  /* scope for declared variables */
+  adjustlocalvars(ls, nvars);
+  luaK_reserveregs(fs, nvars);
+  block(ls, prop);
+  leaveblock(fs);  /* end of scope for declared variables */
+  luaK_codeABCk(fs, OP_TEST, base, 0, 0, 1);
+  const int togeneric = luaK_jump(fs);
+  fixforjump(fs, prep, luaK_getlabel(fs), 0);
+  const int endfor = luaK_codeABx(fs, OP_FORLOOP, nbase, 0);
+  fixforjump(fs, endfor, body, 1);
+  luaK_fixline(fs, line);
+  const int toexit = luaK_jump(fs);
+  luaK_patchtohere(fs, togeneric);
+  fixforjump(fs, tprep, luaK_getlabel(fs), 0);
+  luaK_codeABC(fs, OP_TFORCALL, base, 0, nvars);
+  luaK_fixline(fs, line);
+  const int tendfor = luaK_codeABx(fs, OP_TFORLOOP, base, 0);
+  fixforjump(fs, tendfor, body, 1);
+  luaK_fixline(fs, line);
+  luaK_patchtohere(fs, toexit);
+}
+
+
 static void forstat (LexState *ls, int line, TypeHint *prop) {
   /* forstat -> FOR (fornum | forlist) END */
   FuncState *fs = ls->fs;
@@ -4480,6 +4643,9 @@ static void forstat (LexState *ls, int line, TypeHint *prop) {
     TString *varname = str_checkname(ls);  /* first variable name */
     fornum(ls, varname, prop, line);
   }
+  else if (israngeloop(ls)) {
+    forrange(ls, prop, line);
+  }
   else if (luaX_lookahead(ls) == ',' || luaX_lookahead(ls) == TK_IN) {
     TString *varname = str_checkname(ls);  /* first variable name */
     forlist(ls, varname, prop);
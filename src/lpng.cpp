@@ -0,0 +1,428 @@
+#include "lpng.hpp"
+
+#include <cstring> // memcmp, memcpy, memset
+#include <thread>
+#include <vector>
+
+#include "ldeflate.hpp"
+
+#include "vendor/Soup/soup/base.hpp"
+#include "vendor/Soup/soup/crc32.hpp"
+
+namespace Pluto {
+  static constexpr uint8_t SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+  static constexpr size_t MAX_IDAT = 1024 * 1024;  /* bytes of compressed data per IDAT chunk */
+  static constexpr size_t INFLATE_PIECE = 16 * 1024;  /* IDAT data is inflated this much at a time, to notice excess output early */
+
+  enum Colour : uint8_t {
+    GREY = 0,
+    RGB = 2,
+    PALETTE = 3,
+    GREY_ALPHA = 4,
+    RGB_ALPHA = 6,
+  };
+
+  enum Filter : uint8_t {
+    NONE,
+    SUB,
+    UP,
+    AVERAGE,
+    PAETH,
+  };
+
+  /* Adam7 interlacing */
+  static constexpr uint8_t PASS_X[7] = { 0, 4, 0, 2, 0, 1, 0 };
+  static constexpr uint8_t PASS_Y[7] = { 0, 0, 4, 0, 2, 0, 1 };
+  static constexpr uint8_t PASS_DX[7] = { 8, 8, 4, 4, 2, 2, 1 };
+  static constexpr uint8_t PASS_DY[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+  static void put32 (std::string& out, uint32_t v) {
+    const char bytes[4] = { (char)(v >> 24), (char)(v >> 16), (char)(v >> 8), (char)v };
+    out.append(bytes, 4);
+  }
+
+  [[nodiscard]] static uint32_t get32 (const uint8_t *p) noexcept {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+  }
+
+  static void writeChunk (std::string& out, const char *type, const void *data, size_t size) {
+    put32(out, (uint32_t)size);
+    const size_t start = out.size();
+    out.append(type, 4);
+    out.append((const char*)data, size);
+    put32(out, soup::crc32::hash((const uint8_t*)out.data() + start, size + 4));
+  }
+
+  [[nodiscard]] static SOUP_FORCEINLINE uint8_t paeth (uint8_t a, uint8_t b, uint8_t c) noexcept {
+    const int p = a + b - c;
+    const int pa = p > a ? p - a : a - p;
+    const int pb = p > b ? p - b : b - p;
+    const int pc = p > c ? p - c : c - p;
+    if (pa <= pb && pa <= pc)
+      return a;
+    return pb <= pc ? b : c;
+  }
+
+
+  /*
+  ** {======================================================
+  ** Encoder
+  ** =======================================================
+  */
+
+  static constexpr size_t RGB_BPP = 3;
+
+  template <Filter F>
+  [[nodiscard]] static SOUP_FORCEINLINE uint8_t applyFilter (uint8_t x, uint8_t a, uint8_t b, uint8_t c) noexcept {
+    if constexpr (F == NONE) return x;
+    if constexpr (F == SUB) return (uint8_t)(x - a);
+    if constexpr (F == UP) return (uint8_t)(x - b);
+    if constexpr (F == AVERAGE) return (uint8_t)(x - ((a + b) >> 1));
+    return (uint8_t)(x - paeth(a, b, c));
+  }
+
+  /* Calls 'op(i, filtered byte)' for each byte of 'row'. */
+  template <Filter F, typename Op>
+  static SOUP_FORCEINLINE void forEachFiltered (const uint8_t *row, const uint8_t *prev, size_t stride, Op&& op) {
+    for (size_t i = 0; i != RGB_BPP; ++i)
+      op(i, applyFilter<F>(row[i], 0, prev[i], 0));
+    for (size_t i = RGB_BPP; i != stride; ++i)
+      op(i, applyFilter<F>(row[i], row[i - RGB_BPP], prev[i], prev[i - RGB_BPP]));
+  }
+
+  /* The usual heuristic: the sum of the filtered bytes taken as signed magnitudes. */
+  template <Filter F>
+  [[nodiscard]] static uint64_t filterCost (const uint8_t *row, const uint8_t *prev, size_t stride) noexcept {
+    uint64_t cost = 0;
+    forEachFiltered<F>(row, prev, stride, [&](size_t, uint8_t v) {
+      cost += (v < 128 ? v : 256 - v);
+    });
+    return cost;
+  }
+
+  template <Filter F>
+  static void filterInto (const uint8_t *row, const uint8_t *prev, size_t stride, uint8_t *out) noexcept {
+    out[0] = F;
+    forEachFiltered<F>(row, prev, stride, [&](size_t i, uint8_t v) {
+      out[1 + i] = v;
+    });
+  }
+
+  /* Filters rows [y0, y1) with the filter that is cheapest for each. 'zero' is a row of 0 bytes. */
+  static void filterRows (const uint8_t *rgb, size_t stride, uint32_t y0, uint32_t y1, const uint8_t *zero, uint8_t *out) noexcept {
+    for (uint32_t y = y0; y != y1; ++y) {
+      const uint8_t *row = rgb + y * stride;
+      const uint8_t *prev = (y == 0 ? zero : row - stride);
+      uint8_t *dst = out + y * (stride + 1);
+      const uint64_t costs[5] = {
+        filterCost<NONE>(row, prev, stride),
+        filterCost<SUB>(row, prev, stride),
+        filterCost<UP>(row, prev, stride),
+        filterCost<AVERAGE>(row, prev, stride),
+        filterCost<PAETH>(row, prev, stride),
+      };
+      int best = NONE;
+      for (int f = SUB; f <= PAETH; ++f) {
+        if (costs[f] < costs[best])
+          best = f;
+      }
+      switch (best) {
+        case NONE: filterInto<NONE>(row, prev, stride, dst); break;
+        case SUB: filterInto<SUB>(row, prev, stride, dst); break;
+        case UP: filterInto<UP>(row, prev, stride, dst); break;
+        case AVERAGE: filterInto<AVERAGE>(row, prev, stride, dst); break;
+        default: filterInto<PAETH>(row, prev, stride, dst); break;
+      }
+    }
+  }
+
+  std::string Png::encode (lua_State *L, const uint8_t *rgb, uint32_t width, uint32_t height, int level) {
+    const size_t stride = (size_t)width * RGB_BPP;
+    std::vector<uint8_t> filtered((stride + 1) * height);
+    if (level == 0) {
+      for (uint32_t y = 0; y != height; ++y) {
+        filtered[y * (stride + 1)] = NONE;
+        memcpy(&filtered[y * (stride + 1) + 1], rgb + y * stride, stride);
+      }
+    }
+    else if (width != 0) {
+      const std::vector<uint8_t> zero(stride);
+      unsigned nthreads = 1;
+      if ((uint64_t)width * height >= PARALLEL_THRESHOLD) {
+        nthreads = std::thread::hardware_concurrency();
+        if (nthreads > height)
+          nthreads = height;
+        if (nthreads == 0)
+          nthreads = 1;
+      }
+      /* every row only depends on itself and the one above, so they can be split up freely */
+      std::vector<std::thread> threads;
+      uint32_t y = 0;
+      for (unsigned t = 1; t < nthreads; ++t) {
+        const auto end = (uint32_t)((uint64_t)height * t / nthreads);
+        try {
+          threads.emplace_back(filterRows, rgb, stride, y, end, zero.data(), filtered.data());
+        }
+        catch (...) {  /* no threads available, do the work here */
+          filterRows(rgb, stride, y, end, zero.data(), filtered.data());
+        }
+        y = end;
+      }
+      filterRows(rgb, stride, y, height, zero.data(), filtered.data());
+      for (auto& t : threads)
+        t.join();
+    }
+
+    std::string zdata;
+    Deflater deflater(L, level, DeflateFormat::ZLIB);
+    deflater.write(filtered.data(), filtered.size(), zdata);
+    deflater.finish(zdata);
+    filtered.clear();
+    filtered.shrink_to_fit();
+
+    std::string out;
+    out.reserve(sizeof(SIGNATURE) + 25 + zdata.size() + (zdata.size() / MAX_IDAT + 1) * 12 + 12);
+    out.append((const char*)SIGNATURE, sizeof(SIGNATURE));
+    uint8_t ihdr[13] = {
+      (uint8_t)(width >> 24), (uint8_t)(width >> 16), (uint8_t)(width >> 8), (uint8_t)width,
+      (uint8_t)(height >> 24), (uint8_t)(height >> 16), (uint8_t)(height >> 8), (uint8_t)height,
+      8, RGB, 0, 0, 0
+    };
+    writeChunk(out, "IHDR", ihdr, sizeof(ihdr));
+    for (size_t off = 0; off < zdata.size(); off += MAX_IDAT)
+      writeChunk(out, "IDAT", zdata.data() + off, zdata.size() - off < MAX_IDAT ? zdata.size() - off : MAX_IDAT);
+    writeChunk(out, "IEND", nullptr, 0);
+    return out;
+  }
+
+  /* }====================================================== */
+
+
+  /*
+  ** {======================================================
+  ** Decoder
+  ** =======================================================
+  */
+
+  [[nodiscard]] static unsigned channelsOf (uint8_t colour) noexcept {
+    switch (colour) {
+      case RGB: return 3;
+      case GREY_ALPHA: return 2;
+      case RGB_ALPHA: return 4;
+      default: return 1;
+    }
+  }
+
+  [[nodiscard]] static size_t rowBytes (const Png::Info& info, uint32_t width) noexcept {
+    return ((uint64_t)width * channelsOf(info.colour) * info.depth + 7) / 8;
+  }
+
+  /* Gets the dimensions of an interlacing pass (or of the whole image for pass -1). */
+  static void passSize (const Png::Info& info, int pass, uint32_t& w, uint32_t& h) noexcept {
+    if (pass == -1) {
+      w = info.width;
+      h = info.height;
+      return;
+    }
+    w = (info.width > PASS_X[pass] ? (info.width - PASS_X[pass] + PASS_DX[pass] - 1) / PASS_DX[pass] : 0);
+    h = (info.height > PASS_Y[pass] ? (info.height - PASS_Y[pass] + PASS_DY[pass] - 1) / PASS_DY[pass] : 0);
+  }
+
+  /* Deflate can't compress more than this, so the data must be at least 1/1032 of the size of the filtered image. */
+  static constexpr uint64_t MAX_INFLATE_RATIO = 1032;
+
+  [[nodiscard]] static uint64_t rawSize (const Png::Info& info) noexcept {
+    uint64_t size = 0;
+    for (int pass = (info.interlaced ? 0 : -1); pass != (info.interlaced ? 7 : 0); ++pass) {
+      uint32_t w, h;
+      passSize(info, pass, w, h);
+      if (w != 0 && h != 0)
+        size += (uint64_t)h * (1 + rowBytes(info, w));
+    }
+    return size;
+  }
+
+  const char *Png::readInfo (const void *data, size_t size, Info& info) noexcept {
+    const auto p = (const uint8_t*)data;
+    if (size < sizeof(SIGNATURE) || memcmp(p, SIGNATURE, sizeof(SIGNATURE)) != 0)
+      return "not a PNG image";
+    if (size < sizeof(SIGNATURE) + 8 + 13 + 4 || get32(p + 8) != 13 || memcmp(p + 12, "IHDR", 4) != 0)
+      return "missing header";
+    const uint8_t *h = p + 16;
+    if (get32(h + 13) != soup::crc32::hash(p + 12, 4 + 13))
+      return "chunk checksum mismatch";
+    info.width = get32(h);
+    info.height = get32(h + 4);
+    info.depth = h[8];
+    info.colour = h[9];
+    if (info.width == 0 || info.height == 0 || info.width > 0x7FFFFFFF || info.height > 0x7FFFFFFF)
+      return "invalid dimensions";
+    if ((uint64_t)info.width * info.height > MAX_PIXELS)
+      return "image is too large";
+    bool valid_depth;
+    switch (info.colour) {
+      case GREY: valid_depth = (info.depth == 1 || info.depth == 2 || info.depth == 4 || info.depth == 8 || info.depth == 16); break;
+      case PALETTE: valid_depth = (info.depth == 1 || info.depth == 2 || info.depth == 4 || info.depth == 8); break;
+      case RGB: case GREY_ALPHA: case RGB_ALPHA: valid_depth = (info.depth == 8 || info.depth == 16); break;
+      default: return "invalid colour type";
+    }
+    if (!valid_depth)
+      return "invalid bit depth";
+    if (h[10] != 0 || h[11] != 0)
+      return "unsupported compression or filter method";
+    if (h[12] > 1)
+      return "unsupported interlace method";
+    info.interlaced = (h[12] == 1);
+    if (rawSize(info) > SIZE_MAX / 2)
+      return "image is too large";
+    if (rawSize(info) / MAX_INFLATE_RATIO > size)  /* don't let the header alone make us allocate the image */
+      return "not enough image data";
+    return nullptr;
+  }
+
+  /* Reverses the filters of 'rows' rows in place. */
+  [[nodiscard]] static bool unfilter (uint8_t *p, size_t stride, uint32_t rows, size_t bpp, const uint8_t *zero) noexcept {
+    const uint8_t *prev = zero;
+    for (uint32_t y = 0; y != rows; ++y, p += stride + 1) {
+      uint8_t *row = p + 1;
+      switch (p[0]) {
+        case NONE:
+          break;
+        case SUB:
+          for (size_t i = bpp; i < stride; ++i)
+            row[i] += row[i - bpp];
+          break;
+        case UP:
+          for (size_t i = 0; i != stride; ++i)
+            row[i] += prev[i];
+          break;
+        case AVERAGE:
+          for (size_t i = 0; i != bpp && i != stride; ++i)
+            row[i] += prev[i] >> 1;
+          for (size_t i = bpp; i < stride; ++i)
+            row[i] += (uint8_t)((row[i - bpp] + prev[i]) >> 1);
+          break;
+        case PAETH:
+          for (size_t i = 0; i != bpp && i != stride; ++i)
+            row[i] += prev[i];  /* paeth(0, b, 0) = b */
+          for (size_t i = bpp; i < stride; ++i)
+            row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+          break;
+        default:
+          return false;
+      }
+      prev = row;
+    }
+    return true;
+  }
+
+  /* Converts 'w' pixels of an unfiltered row to RGB, writing every 'step'th pixel of 'dst'. */
+  static void convertRow (const Png::Info& info, const uint8_t *row, uint32_t w, const uint8_t *palette, uint8_t *dst, size_t step) noexcept {
+    if (info.depth < 8) {
+      const unsigned mask = (1u << info.depth) - 1;
+      for (uint32_t x = 0; x != w; ++x, dst += step * 3) {
+        const size_t bit = (size_t)x * info.depth;
+        const unsigned v = (row[bit / 8] >> (8 - info.depth - bit % 8)) & mask;
+        if (info.colour == PALETTE) {
+          memcpy(dst, palette + v * 3, 3);
+        }
+        else {
+          dst[0] = dst[1] = dst[2] = (uint8_t)(v * 255 / mask);
+        }
+      }
+      return;
+    }
+    if (info.colour == RGB && info.depth == 8 && step == 1) {
+      memcpy(dst, row, (size_t)w * 3);
+      return;
+    }
+    const size_t sample = info.depth / 8;  /* of 16-bit samples, only the high byte is kept */
+    const size_t pixel = sample * channelsOf(info.colour);
+    for (uint32_t x = 0; x != w; ++x, row += pixel, dst += step * 3) {
+      switch (info.colour) {
+        case GREY: case GREY_ALPHA:
+          dst[0] = dst[1] = dst[2] = row[0];
+          break;
+        case PALETTE:
+          memcpy(dst, palette + row[0] * 3, 3);
+          break;
+        default:
+          dst[0] = row[0];
+          dst[1] = row[sample];
+          dst[2] = row[sample * 2];
+      }
+    }
+  }
+
+  const char *Png::decode (lua_State *L, const void *data, size_t size, const Info& info, uint8_t *rgb) {
+    const auto begin = (const uint8_t*)data;
+    const uint8_t *end = begin + size;
+    const uint8_t *p = begin + sizeof(SIGNATURE);
+    uint8_t palette[256 * 3] = {};  /* indices beyond the palette give black */
+    bool has_palette = false;
+    const size_t expected = (size_t)rawSize(info);
+    std::string raw;
+    raw.reserve(expected);
+    Inflater inflater(L, DeflateFormat::ZLIB);
+    while (true) {
+      if (end - p < 12)
+        return "truncated image";
+      const uint32_t len = get32(p);
+      if (len > 0x7FFFFFFF || (size_t)(end - p - 12) < len)
+        return "truncated image";
+      const uint8_t *type = p + 4;
+      const uint8_t *body = p + 8;
+      const bool critical = !(type[0] & 0x20);
+      if (critical && get32(body + len) != soup::crc32::hash(type, len + 4))
+        return "chunk checksum mismatch";
+      if (memcmp(type, "IDAT", 4) == 0) {
+        for (uint32_t off = 0; off < len && !inflater.isDone(); off += INFLATE_PIECE) {
+          const size_t piece = (len - off < INFLATE_PIECE ? len - off : INFLATE_PIECE);
+          if (inflater.write(body + off, piece, raw) == Inflater::FAILED)
+            return inflater.error;
+          if (raw.size() > expected)
+            return "too much image data";
+        }
+      }
+      else if (memcmp(type, "PLTE", 4) == 0) {
+        if (len == 0 || len % 3 != 0 || len > sizeof(palette))
+          return "invalid palette";
+        memcpy(palette, body, len);
+        has_palette = true;
+      }
+      else if (memcmp(type, "IEND", 4) == 0) {
+        break;
+      }
+      else if (critical && memcmp(type, "IHDR", 4) != 0) {
+        return "unsupported critical chunk";
+      }
+      p = body + len + 4;
+    }
+    if (raw.size() != expected)
+      return "not enough image data";
+    if (info.colour == PALETTE && !has_palette)
+      return "missing palette";
+
+    const size_t bpp = (channelsOf(info.colour) * info.depth + 7) / 8;
+    const std::vector<uint8_t> zero(rowBytes(info, info.width));
+    auto q = (uint8_t*)raw.data();
+    for (int pass = (info.interlaced ? 0 : -1); pass != (info.interlaced ? 7 : 0); ++pass) {
+      uint32_t w, h;
+      passSize(info, pass, w, h);
+      if (w == 0 || h == 0)
+        continue;
+      const size_t stride = rowBytes(info, w);
+      if (!unfilter(q, stride, h, bpp, zero.data()))
+        return "invalid filter type";
+      const size_t x0 = (pass == -1 ? 0 : PASS_X[pass]);
+      const size_t y0 = (pass == -1 ? 0 : PASS_Y[pass]);
+      const size_t dx = (pass == -1 ? 1 : PASS_DX[pass]);
+      const size_t dy = (pass == -1 ? 1 : PASS_DY[pass]);
+      for (uint32_t y = 0; y != h; ++y, q += stride + 1)
+        convertRow(info, q + 1, w, palette, rgb + ((y0 + y * dy) * info.width + x0) * 3, dx);
+    }
+    return nullptr;
+  }
+
+  /* }====================================================== */
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+/*
+** PNG encoder with adaptive scanline filtering and DEFLATE compression, and a
+** decoder for all standard colour types, bit depths and interlacing. Pixels
+** are 8-bit RGB triplets in row-major order, like soup::Canvas keeps them;
+** the decoder drops alpha and reduces 16-bit samples to their high byte.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct lua_State;
+
+namespace Pluto {
+  struct Png {
+    static constexpr int DEFAULT_LEVEL = 6;
+
+    /* Images with at least this many pixels have their filters chosen on multiple threads. */
+    static constexpr size_t PARALLEL_THRESHOLD = 256 * 1024;
+
+    /* Images with more pixels than this are rejected by the decoder. */
+    static constexpr uint64_t MAX_PIXELS = 0x3FFFFFFF;
+
+    struct Info {
+      uint32_t width;
+      uint32_t height;
+      uint8_t depth;
+      uint8_t colour;
+      bool interlaced;
+    };
+
+    /* 'level' is that of the Deflater; at 0, rows are also stored unfiltered. The codec's work buffers are allocated through 'L'. */
+    [[nodiscard]] static std::string encode(lua_State *L, const uint8_t *rgb, uint32_t width, uint32_t height, int level = DEFAULT_LEVEL);
+
+    /* Both return nullptr on success and a message otherwise. 'rgb' must have room for width * height * 3 bytes. */
+    [[nodiscard]] static const char *readInfo(const void *data, size_t size, Info& info) noexcept;
+    [[nodiscard]] static const char *decode(lua_State *L, const void *data, size_t size, const Info& info, uint8_t *rgb);
+  };
+}
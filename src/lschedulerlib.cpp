@@ -1,22 +1,210 @@
-#include <cstring>
-
 #define LUA_LIB
 #include "lualib.h"
+#include "lstdlibcode.hpp"
+
+#include "leventloop.hpp"
+
+#include "vendor/Soup/soup/os.hpp"
+#include "vendor/Soup/soup/time.hpp"
 
 static const luaL_Reg funcs[] = {
   {nullptr, nullptr}
 };
 
-LUAMOD_API int luaopen_scheduler (lua_State *L) {
-#ifdef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
-    return 0;
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+[[nodiscard]] static bool issuspended (lua_State *co) {
+  switch (lua_status(co)) {
+    case LUA_YIELD:
+      return true;
+    case LUA_OK: {
+      lua_Debug ar;
+      return !lua_getstack(co, 0, &ar) && lua_gettop(co) != 0;  /* initial state? */
+    }
+    default:
+      return false;
+  }
+}
+
+[[nodiscard]] static bool isdead (lua_State *co) {
+  switch (lua_status(co)) {
+    case LUA_YIELD:
+      return false;
+    case LUA_OK: {
+      lua_Debug ar;
+      return !lua_getstack(co, 0, &ar) && lua_gettop(co) == 0;
+    }
+    default:
+      return true;
+  }
+}
+
+/* removes dead coroutines from 'self.coros' (at index 'coros'), keeping the order of the others */
+static void compactcoros (lua_State *L, int coros) {
+  lua_Integer n = luaL_len(L, coros);
+  lua_Integer j = 1;
+  for (lua_Integer i = 1; i <= n; i++) {
+    lua_rawgeti(L, coros, i);
+    lua_State *co = lua_tothread(L, -1);
+    if (co != nullptr && !isdead(co)) {
+      if (i != j)
+        lua_rawseti(L, coros, j);
+      else
+        lua_pop(L, 1);
+      j++;
+    }
+    else
+      lua_pop(L, 1);
+  }
+  for (; j <= n; j++) {
+    lua_pushnil(L);
+    lua_rawseti(L, coros, j);
+  }
+}
+
+/*
+** The scheduler's main loop. Each pass resumes the coroutines that are able
+** to make progress; coroutines that yielded from a blocking native function
+** (socket, HTTP request, sleep) are only resumed once their event fired.
+** Between passes, the state's event loop blocks until something becomes ready.
+*/
+static int scheduler_run (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_getfield(L, 1, "coros");
+  const int coros = lua_gettop(L);
+#if !SOUP_WASM
+  Pluto::EventLoop& loop = Pluto::EventLoop::get(L);
+#endif
+  while (true) {
+    lua_getfield(L, 1, "yieldfunc");
+    const bool legacy = !lua_isnil(L, -1);  /* user-provided yield function? then resume everything on every pass. */
+    lua_pop(L, 1);
+
+    bool alive = false;
+    bool sawdead = false;
+    int timeout = -1;
+    const auto atmost = [&timeout](std::time_t ms) {  /* each coroutine can only shorten the wait */
+      if (timeout == -1 || ms < timeout)
+        timeout = static_cast<int>(ms);
+    };
+    const lua_Integer n = luaL_len(L, coros);
+    for (lua_Integer i = 1; i <= n; i++) {
+      lua_rawgeti(L, coros, i);
+      lua_State *co = lua_tothread(L, -1);
+      if (co == nullptr || isdead(co)) {
+        sawdead = true;
+        lua_pop(L, 1);
+        continue;
+      }
+      if (!issuspended(co)) {  /* running or normal, e.g. the coroutine running us */
+        lua_pop(L, 1);
+        continue;
+      }
+#if SOUP_WASM
+      const bool ready = true;
+#else
+      const bool ready = (legacy || loop.isReady(co));
+#endif
+      if (ready) {
+        lua_getfield(L, 1, "internalresume");
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, -3);
+        lua_call(L, 2, 0);
+        if (!issuspended(co)) {
+          sawdead = true;
+          lua_pop(L, 1);
+          continue;
+        }
+      }
+      alive = true;
+      lua_pop(L, 1);
+      /* figure out how long we may sleep before this coroutine needs attention */
+      switch (co->waitreason) {
+#if !SOUP_WASM
+        case WAIT_SCHED:
+          if (!loop.want(*reinterpret_cast<soup::Scheduler*>(co->waitdata)))
+            atmost(1);
+          break;
+        case WAIT_SET: {
+          auto& set = *reinterpret_cast<Pluto::EventLoop::WaitSet*>(co->waitdata);
+          if (!loop.want(set))
+            atmost(1);
+          else if (set.deadline != -1) {
+            const std::time_t left = set.deadline - soup::time::millis();
+            atmost(left < 0 ? 0 : left);
+          }
+          break;
+        }
+        case WAIT_WORKER:
+          if (reinterpret_cast<soup::Worker*>(co->waitdata)->isWorkDone())
+            atmost(0);
+          else if (!Pluto::EventLoop::canWake())
+            atmost(1);
+          break;
+#endif
+        case WAIT_TIMER: {
+          const std::time_t left = co->waituntil - soup::time::millis();
+          atmost(left < 0 ? 0 : left);
+          break;
+        }
+        default:  /* plain yield; revisit it soon, but don't spin */
+          atmost(1);
+      }
+    }
+    if (sawdead)
+      compactcoros(L, coros);
+    if (!alive)
+      break;
+    if (legacy) {
+      lua_getfield(L, 1, "yieldfunc");
+      lua_call(L, 0, 0);
+      continue;
+    }
+#if SOUP_WASM
+    soup::os::sleep(1);
 #else
-    const auto code = R"EOC(pluto_use "0.6.0"
+    loop.wait(timeout);
+#endif
+  }
+  return 0;
+}
+
+static int sleepcont (lua_State *L, int status, lua_KContext ctx) {
+  if (soup::time::millis() < L->waituntil) {
+    pluto_waituntil(L, L->waituntil);
+    return lua_yieldk(L, 0, ctx, sleepcont);
+  }
+  return 0;
+}
+
+/* suspends the current coroutine for the given amount of milliseconds without blocking the scheduler */
+static int scheduler_sleep (lua_State *L) {
+  const lua_Integer ms = luaL_checkinteger(L, 1);
+  if (!lua_isyieldable(L)) {
+    if (ms > 0)
+      soup::os::sleep(static_cast<unsigned int>(ms));
+    return 0;
+  }
+  pluto_waituntil(L, soup::time::millis() + (ms > 0 ? ms : 0));
+  return lua_yieldk(L, 0, 0, sleepcont);
+}
+
+static const luaL_Reg funcs_native[] = {
+  {"run", scheduler_run},
+  {"sleep", scheduler_sleep},
+  {nullptr, nullptr}
+};
+#endif
+
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+const Pluto::StdlibChunk Pluto::stdlib_scheduler{ "pluto:scheduler", R"EOC(pluto_use "0.6.0"
+
+local native = ...
 
 return class
     __name = "pluto:scheduler"
 
-    yieldfunc = || -> do os.sleep(1) end
+    -- If set, 'run' resumes every suspended coroutine on each pass and calls this in between.
+    yieldfunc = nil
 
     function __construct()
         self.coros = {}
@@ -81,26 +269,23 @@ return class
         end
     end
 
+    function sleep(ms)
+        native.sleep(ms)
+    end
+
     function run()
-        while true do
-            local all_dead = true
-            for i, coro in self.coros do
-                if coroutine.status(coro) == "suspended" then
-                    self:internalresume(coro)
-                    all_dead = false
-                elseif coroutine.status(coro) == "dead" then
-                    self.coros[i] = nil
-                end
-            end
-            if all_dead then
-                break
-            end
-            self.yieldfunc()
-        end
+        native.run(self)
     end
-end)EOC";
-    luaL_loadbuffer(L, code, strlen(code), "pluto:scheduler");
-    lua_call(L, 0, 1);
+end)EOC" };
+#endif
+
+LUAMOD_API int luaopen_scheduler (lua_State *L) {
+#ifdef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+    return 0;
+#else
+    Pluto::loadStdlibChunk(L, Pluto::stdlib_scheduler);
+    luaL_newlib(L, funcs_native);
+    lua_call(L, 1, 1);
     return 1;
 #endif
 }
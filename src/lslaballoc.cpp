@@ -0,0 +1,225 @@
+#include "lslaballoc.hpp"
+
+#include <algorithm> // lower_bound, binary_search
+#include <cstdlib> // malloc, realloc, free
+#include <cstring> // memcpy
+#include <new> // nothrow
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace Pluto {
+  /* Returns SLAB_PAGE_SIZE bytes aligned to SLAB_PAGE_SIZE, or nullptr. */
+  [[nodiscard]] static void *osAllocPage() noexcept {
+    constexpr size_t size = SlabAllocator::SLAB_PAGE_SIZE;
+#ifdef _WIN32
+    /* The allocation granularity on Windows is 64 KiB, so this is aligned already. */
+    return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void *p = mmap(nullptr, size * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+      return nullptr;
+    /* map twice the size, then unmap the misaligned head & the excess tail */
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+    const uintptr_t aligned = (addr + size - 1) & ~(size - 1);
+    if (aligned != addr)
+      munmap(p, aligned - addr);
+    munmap(reinterpret_cast<void*>(aligned + size), addr + size - aligned);
+    return reinterpret_cast<void*>(aligned);
+#endif
+  }
+
+  static void osFreePage(void *p) noexcept {
+#ifdef _WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, SlabAllocator::SLAB_PAGE_SIZE);
+#endif
+  }
+
+  SlabAllocator *SlabAllocator::create() noexcept {
+    return new (std::nothrow) SlabAllocator();
+  }
+
+  void SlabAllocator::release() noexcept {
+    if (--live == 0)
+      destroy();
+  }
+
+  void *SlabAllocator::alloc(void *ud, void *ptr, size_t osize, size_t nsize) noexcept {
+    SlabAllocator *self = static_cast<SlabAllocator*>(ud);
+    if (ptr == nullptr)
+      osize = 0;  /* for new blocks, Lua passes the object type instead */
+    if (nsize == 0) {
+      if (ptr != nullptr)
+        self->free(ptr, osize);
+      return nullptr;
+    }
+    if (ptr == nullptr)
+      return self->allocate(nsize);
+    if (osize <= MAX_SMALL && nsize <= MAX_SMALL) {
+      if (classOf(osize) == classOf(nsize))
+        return ptr;  /* still fits & wouldn't fit in a smaller class */
+    }
+    else if (osize > MAX_SMALL && nsize > MAX_SMALL) {
+      void *block = realloc(ptr, nsize);
+      return (block == nullptr && nsize < osize) ? ptr : block;
+    }
+    void *block = self->allocate(nsize);
+    if (block != nullptr) {
+      memcpy(block, ptr, osize < nsize ? osize : nsize);
+      self->free(ptr, osize);
+    }
+    else if (nsize < osize) {  /* shrinking must not fail, so keep the block */
+      if (osize > MAX_SMALL)
+        ++self->foreign;
+      return ptr;
+    }
+    return block;
+  }
+
+  void *SlabAllocator::allocate(size_t size) noexcept {
+    void *block = (size <= MAX_SMALL) ? allocateSmall(classOf(size)) : malloc(size);
+    if (block != nullptr)
+      ++live;
+    return block;
+  }
+
+  void SlabAllocator::free(void *block, size_t size) noexcept {
+    if (size > MAX_SMALL)
+      ::free(block);
+    else if (foreign == 0 || ownsPage(pageOf(block)))
+      freeSmall(block);
+    else {
+      --foreign;
+      ::free(block);
+    }
+    if (--live == 0)
+      destroy();
+  }
+
+  void *SlabAllocator::allocateSmall(int cls) noexcept {
+    Page *p = avail[cls];
+    if (p == nullptr) {
+      p = newPage(cls);
+      if (p == nullptr)
+        return nullptr;
+      link(avail[cls], p);
+    }
+    void *block;
+    if (p->freelist != nullptr) {
+      block = p->freelist;
+      p->freelist = *static_cast<void**>(block);
+    }
+    else {
+      block = p->bump;
+      p->bump += (cls + 1) * GRANULE;
+    }
+    if (++p->used == p->capacity)
+      unlink(avail[cls], p);  /* full pages aren't in any list */
+    return block;
+  }
+
+  void SlabAllocator::freeSmall(void *block) noexcept {
+    Page *p = pageOf(block);
+    *static_cast<void**>(block) = p->freelist;
+    p->freelist = block;
+    if (p->used-- == p->capacity)
+      link(avail[p->cls], p);
+    if (p->used == 0) {
+      unlink(avail[p->cls], p);
+      link(empty, p);
+      if (++num_empty > MAX_EMPTY_PAGES)
+        trim(MAX_EMPTY_PAGES / 2);
+    }
+  }
+
+  SlabAllocator::Page *SlabAllocator::newPage(int cls) noexcept {
+    Page *p = empty;
+    if (p != nullptr) {
+      unlink(empty, p);
+      --num_empty;
+    }
+    else {
+      p = static_cast<Page*>(osAllocPage());
+      if (p == nullptr)
+        return nullptr;
+      if (!addPage(p)) {
+        osFreePage(p);
+        return nullptr;
+      }
+    }
+    const size_t block_size = (cls + 1) * GRANULE;
+    p->prev = p->next = nullptr;
+    p->freelist = nullptr;
+    p->bump = reinterpret_cast<char*>(p) + HEADER_SIZE;
+    p->used = 0;
+    p->capacity = static_cast<uint32_t>((SLAB_PAGE_SIZE - HEADER_SIZE) / block_size);
+    p->cls = static_cast<uint8_t>(cls);
+    return p;
+  }
+
+  /* Returns empty pages to the OS until at most 'keep' are left. */
+  void SlabAllocator::trim(size_t keep) noexcept {
+    while (num_empty > keep) {
+      Page *p = empty;
+      unlink(empty, p);
+      --num_empty;
+      removePage(p);
+      osFreePage(p);
+    }
+  }
+
+  bool SlabAllocator::addPage(Page *p) noexcept {
+    if (num_pages == max_pages) {
+      const size_t n = (max_pages == 0) ? 16 : max_pages * 2;
+      auto list = static_cast<Page**>(realloc(pages, n * sizeof(Page*)));
+      if (list == nullptr)
+        return false;
+      pages = list;
+      max_pages = n;
+    }
+    Page **pos = std::lower_bound(pages, pages + num_pages, p);
+    memmove(pos + 1, pos, (pages + num_pages - pos) * sizeof(Page*));
+    *pos = p;
+    ++num_pages;
+    return true;
+  }
+
+  void SlabAllocator::removePage(Page *p) noexcept {
+    Page **pos = std::lower_bound(pages, pages + num_pages, p);
+    memmove(pos, pos + 1, (pages + num_pages - pos - 1) * sizeof(Page*));
+    --num_pages;
+  }
+
+  bool SlabAllocator::ownsPage(Page *p) const noexcept {
+    return std::binary_search(pages, pages + num_pages, p);
+  }
+
+  void SlabAllocator::destroy() noexcept {
+    /* all blocks have been freed, so every page is empty */
+    trim(0);
+    ::free(pages);
+    delete this;
+  }
+
+  void SlabAllocator::link(Page *&list, Page *p) noexcept {
+    p->prev = nullptr;
+    p->next = list;
+    if (list != nullptr)
+      list->prev = p;
+    list = p;
+  }
+
+  void SlabAllocator::unlink(Page *&list, Page *p) noexcept {
+    if (p->prev != nullptr)
+      p->prev->next = p->next;
+    else
+      list = p->next;
+    if (p->next != nullptr)
+      p->next->prev = p->prev;
+  }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+/*
+** Size-class slab allocator for states whose heap is dominated by small,
+** short-lived objects (tables, short strings, closures, upvalues & small
+** node arrays). Blocks of up to MAX_SMALL bytes are carved out of 64 KiB
+** pages, each dedicated to one size class; larger blocks go to malloc.
+**
+** Since Lua always passes the size of the block being freed, the size class
+** is known without per-block headers, and the page is found by masking the
+** address. Freeing during the GC's sweep phase is therefore just a push onto
+** the page's free list. Pages that become empty are kept for reuse, up to
+** MAX_EMPTY_PAGES, beyond which they are returned to the OS in a batch.
+**
+** Lua requires that shrinking a block never fails. When there is no page
+** for the smaller size class, the block is kept where it is; a malloc'd
+** block then has a small size, so while there are any, 'free' checks the
+** page of small blocks against a sorted list of the pages it allocated.
+**
+** An instance belongs to a single state and is not thread-safe.
+*/
+
+#include <cstddef>
+#include <cstdint>
+
+namespace Pluto {
+  class SlabAllocator {
+  public:
+    static constexpr size_t SLAB_PAGE_SIZE = 64 * 1024;
+    static constexpr size_t GRANULE = 16;
+    static constexpr size_t MAX_SMALL = 256;
+    static constexpr int NUM_CLASSES = MAX_SMALL / GRANULE;
+    static constexpr size_t MAX_EMPTY_PAGES = 16;
+
+  private:
+    struct Page {
+      Page *prev;
+      Page *next;
+      void *freelist;  /* blocks that were freed */
+      char *bump;  /* start of the never allocated part of the page */
+      uint32_t used;
+      uint32_t capacity;
+      uint8_t cls;
+    };
+    static constexpr size_t HEADER_SIZE = (sizeof(Page) + GRANULE - 1) & ~(GRANULE - 1);
+
+    Page *avail[NUM_CLASSES] = {};  /* pages with at least one free block */
+    Page *empty = nullptr;
+    size_t num_empty = 0;
+    Page **pages = nullptr;  /* all pages, sorted by address */
+    size_t num_pages = 0;
+    size_t max_pages = 0;
+    size_t foreign = 0;  /* malloc'd blocks that were shrunk to a small size */
+    size_t live = 1;  /* outstanding blocks, plus the creator's reference */
+
+    SlabAllocator() = default;
+
+  public:
+    /* The returned instance destroys itself once 'release' was called and all blocks were freed. */
+    [[nodiscard]] static SlabAllocator *create() noexcept;
+
+    /* Drops the creator's reference. Call this after lua_newstate, whether it succeeded or not. */
+    void release() noexcept;
+
+    /* lua_Alloc, with 'ud' being a SlabAllocator. */
+    static void *alloc(void *ud, void *ptr, size_t osize, size_t nsize) noexcept;
+
+  private:
+    [[nodiscard]] static int classOf(size_t size) noexcept { return static_cast<int>((size - 1) / GRANULE); }
+    [[nodiscard]] static Page *pageOf(void *block) noexcept { return reinterpret_cast<Page*>(reinterpret_cast<uintptr_t>(block) & ~(SLAB_PAGE_SIZE - 1)); }
+
+    [[nodiscard]] void *allocate(size_t size) noexcept;
+    void free(void *block, size_t size) noexcept;
+    [[nodiscard]] void *allocateSmall(int cls) noexcept;
+    void freeSmall(void *block) noexcept;
+    [[nodiscard]] Page *newPage(int cls) noexcept;
+    [[nodiscard]] bool addPage(Page *p) noexcept;
+    void removePage(Page *p) noexcept;
+    [[nodiscard]] bool ownsPage(Page *p) const noexcept;
+    void trim(size_t keep) noexcept;
+    void destroy() noexcept;
+
+    static void link(Page *&list, Page *p) noexcept;
+    static void unlink(Page *&list, Page *p) noexcept;
+  };
+}
@@ -2,27 +2,35 @@
 
 #define LUA_LIB
 #include "lualib.h"
+#include "lstdlibcode.hpp"
 #include "lstate.h"
+#include "lbufferlib.hpp"
+#include "ldo.h"
+#include "leventloop.hpp"
 
+#include <algorithm> // max
 #include <deque>
 #include <queue>
-#include <thread>
+#include <vector>
 
 #undef MAX_SIZE
 
 #include "vendor/Soup/soup/CertStore.hpp"
 #include "vendor/Soup/soup/netConnectTask.hpp"
-#include "vendor/Soup/soup/os.hpp"
 #include "vendor/Soup/soup/ResolveIpAddrTask.hpp"
 #include "vendor/Soup/soup/Scheduler.hpp"
 #include "vendor/Soup/soup/Server.hpp"
 #include "vendor/Soup/soup/ServerService.hpp"
 #include "vendor/Soup/soup/Socket.hpp"
+#include "vendor/Soup/soup/time.hpp"
 
 struct StandaloneSocket {
   soup::Scheduler sched;
   soup::SharedPtr<soup::Socket> sock;
   std::deque<std::string> recvd;
+  size_t recvd_off = 0;  /* bytes of 'recvd.front()' that were already consumed by recvexact & co. */
+  size_t recvd_scanned = 0;  /* length of 'recvd.front()' when recvuntil last searched it for 'recvd_delim' in vain */
+  std::string recvd_delim;
   bool udp = false;
   bool did_tls_handshake = false;
   bool from_listener = false;
@@ -35,6 +43,45 @@ struct StandaloneSocket {
     }, this);
   }
 
+  [[nodiscard]] size_t buffered() const noexcept {
+    size_t n = 0;
+    for (const auto& chunk : recvd)
+      n += chunk.size();
+    return n - recvd_off;
+  }
+
+  /* drops the consumed part of the front chunk, for functions that deal in whole chunks */
+  void normalise() {
+    if (recvd_off != 0) {
+      recvd.front().erase(0, recvd_off);
+      recvd_scanned = (recvd_scanned > recvd_off ? recvd_scanned - recvd_off : 0);
+      recvd_off = 0;
+    }
+  }
+
+  /* passes the first 'n' buffered bytes to 'f' in contiguous pieces and removes them */
+  template <typename F>
+  void consume(size_t n, F&& f) {
+    while (n != 0) {
+      const std::string& front = recvd.front();
+      const size_t avail = front.size() - recvd_off;
+      const size_t take = (n < avail ? n : avail);
+      f(front.data() + recvd_off, take);
+      n -= take;
+      if (take == avail) {
+        recvd.pop_front();
+        recvd_off = 0;
+        recvd_scanned = 0;
+      }
+      else
+        recvd_off += take;
+    }
+  }
+
+  void discard(size_t n) {
+    consume(n, [](const char*, size_t) {});
+  }
+
   void recvLoopUdp(soup::Socket& s) {
     s.udpRecv([](soup::Socket& s, soup::SocketAddr&& addr, std::string&& data, soup::Capture&& cap) SOUP_EXCAL {
 #if !SOUP_WINDOWS
@@ -88,6 +135,7 @@ static int connectcont (lua_State *L, int status, lua_KContext ctx) {
     return 1;
   }
   ss.sched.tick();
+  pluto_waitsched(L, &ss.sched);
   return lua_yieldk(L, 0, ctx, connectcont);
 }
 
@@ -107,6 +155,7 @@ static int connectudpcont (lua_State *L, int status, lua_KContext ctx) {
     return restconnectudp(L, pTask);
   StandaloneSocket& ss = *checksocket(L, -1);
   ss.sched.tick();
+  pluto_waitsched(L, &ss.sched);
   return lua_yieldk(L, 0, ctx, connectudpcont);
 }
 
@@ -136,10 +185,11 @@ static int l_connect (lua_State *L) {
       if (lua_isyieldable(L)) {
         const auto ctx = reinterpret_cast<lua_KContext>(spTask.get());
         spTask.reset();
+        pluto_waitsched(L, &ss.sched);
         return lua_yieldk(L, 0, ctx, connectudpcont);
       }
       do {
-        soup::os::sleep(1);
+        Pluto::EventLoop::block(ss.sched);
         ss.sched.tick();
       } while (!spTask->isWorkDone());
       return restconnectudp(L, spTask.get());
@@ -158,12 +208,13 @@ static int l_connect (lua_State *L) {
   auto pTask = ss.sched.add<soup::netConnectTask>(host, port).get();
   ss.sched.tick();
   lua_assert(!pTask->isWorkDone());
+  pluto_waitsched(L, &ss.sched);
   return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(pTask), connectcont);
 }
 
 static int l_send (lua_State *L) {
   size_t len;
-  const char *str = luaL_checklstring(L, 2, &len);
+  const char *str = pluto_checkbytes(L, 2, &len);
   StandaloneSocket& ss = *checksocket(L, 1);
   if (ss.udp)
     ss.sock->udpServerSend(ss.sock->peer, str, len);
@@ -174,8 +225,10 @@ static int l_send (lua_State *L) {
 
 static int restrecv (lua_State *L, StandaloneSocket& ss) {
   if (!ss.recvd.empty()) {
+    ss.normalise();
     pluto_pushstring(L, std::move(ss.recvd.front()));
     ss.recvd.pop_front();
+    ss.recvd_scanned = 0;
     return 1;
   }
   return 0;
@@ -185,7 +238,8 @@ static int recvcont (lua_State *L, int status, lua_KContext ctx) {
   StandaloneSocket& ss = *reinterpret_cast<StandaloneSocket*>(ctx);
   if (ss.recvd.empty()) {
     ss.sched.tick();
-    if (!ss.sock->isWorkDone()) {
+    if (ss.recvd.empty() && !ss.sock->isWorkDone()) {
+      pluto_waitsched(L, &ss.sched);
       return lua_yieldk(L, 0, ctx, recvcont);
     }
   }
@@ -196,7 +250,7 @@ static int l_peek (lua_State *L) {
   StandaloneSocket& ss = *checksocket(L, 1);
   ss.sched.tick();
   if (!ss.recvd.empty()) {
-    pluto_pushstring(L, ss.recvd.front());
+    lua_pushlstring(L, ss.recvd.front().data() + ss.recvd_off, ss.recvd.front().size() - ss.recvd_off);
     return 1;
   }
   return 0;
@@ -206,10 +260,12 @@ static int l_recv (lua_State *L) {
   StandaloneSocket& ss = *checksocket(L, 1);
   ss.sched.tick();
   if (ss.recvd.empty()) {
-    if (lua_isyieldable(L))
+    if (lua_isyieldable(L)) {
+      pluto_waitsched(L, &ss.sched);
       return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(&ss), recvcont);
+    }
     while (ss.recvd.empty() && !ss.sock->isWorkDone()) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      Pluto::EventLoop::block(ss.sched);
       ss.sched.tick();
     }
   }
@@ -217,15 +273,143 @@ static int l_recv (lua_State *L) {
 }
 
 static int unrecv (lua_State *L) {
-  checksocket(L, 1)->recvd.push_front(pluto_checkstring(L, 2));
+  StandaloneSocket& ss = *checksocket(L, 1);
+  ss.normalise();
+  ss.recvd.push_front(pluto_checkstring(L, 2));
+  ss.recvd_scanned = 0;
   return 0;
 }
 
+/*
+** Framed receive functions. 'attempt' tries to satisfy the request from the
+** data buffered so far, returning the number of results or -1 if more data
+** is needed. Buffered data is consumed in place, so no intermediate strings
+** are created for the parts of chunks that are passed over.
+*/
+template <int(*attempt)(lua_State*, StandaloneSocket&)>
+static int framedrecv (lua_State *L, StandaloneSocket& ss);
+
+template <int(*attempt)(lua_State*, StandaloneSocket&)>
+static int framedcont (lua_State *L, int status, lua_KContext ctx) {
+  return framedrecv<attempt>(L, *reinterpret_cast<StandaloneSocket*>(ctx));
+}
+
+template <int(*attempt)(lua_State*, StandaloneSocket&)>
+static int framedrecv (lua_State *L, StandaloneSocket& ss) {
+  while (true) {
+    int nres = attempt(L, ss);
+    if (nres != -1)
+      return nres;
+    ss.sched.tick();
+    if ((nres = attempt(L, ss)) != -1)
+      return nres;
+    if (ss.sock->isWorkDone())
+      return 0;  /* connection is gone; whatever was received stays buffered */
+    if (lua_isyieldable(L)) {
+      pluto_waitsched(L, &ss.sched);
+      return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(&ss), framedcont<attempt>);
+    }
+    Pluto::EventLoop::block(ss.sched);
+  }
+}
+
+static int tryrecvexact (lua_State *L, StandaloneSocket& ss) {
+  const lua_Integer len = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, len >= 0, 2, "length must not be negative");
+  const auto n = static_cast<size_t>(len);
+  if (ss.buffered() < n)
+    return -1;
+  if (n == 0 || ss.recvd.front().size() - ss.recvd_off >= n)
+    lua_pushlstring(L, n == 0 ? "" : ss.recvd.front().data() + ss.recvd_off, n);
+  else {
+    luaL_Buffer b;
+    char *p = luaL_buffinitsize(L, &b, n);
+    ss.consume(n, [&p](const char *data, size_t size) {
+      memcpy(p, data, size);
+      p += size;
+    });
+    luaL_pushresultsize(&b, n);
+    return 1;
+  }
+  ss.discard(n);
+  return 1;
+}
+
+static int tryrecvuntil (lua_State *L, StandaloneSocket& ss) {
+  size_t dlen;
+  const char *delim = luaL_checklstring(L, 2, &dlen);
+  luaL_argcheck(L, dlen != 0, 2, "delimiter must not be empty");
+  size_t from = ss.recvd_off;
+  /* resume where the last attempt left off, so a long line arriving in small pieces is not rescanned every time */
+  if (ss.recvd_scanned >= from + dlen && ss.recvd_delim.size() == dlen && memcmp(ss.recvd_delim.data(), delim, dlen) == 0)
+    from = ss.recvd_scanned - dlen + 1;
+  while (!ss.recvd.empty()) {
+    std::string& front = ss.recvd.front();
+    if (const auto pos = front.find(delim, from, dlen); pos != std::string::npos) {
+      lua_pushlstring(L, front.data() + ss.recvd_off, pos - ss.recvd_off);
+      ss.discard(pos - ss.recvd_off + dlen);
+      return 1;
+    }
+    if (ss.recvd.size() == 1) {
+      ss.recvd_scanned = front.size();
+      ss.recvd_delim.assign(delim, dlen);
+      break;
+    }
+    /* the delimiter may straddle chunks, so merge the next one into the front */
+    from = (front.size() - ss.recvd_off >= dlen ? front.size() - dlen + 1 : ss.recvd_off);
+    front.append(ss.recvd[1]);
+    ss.recvd.erase(ss.recvd.begin() + 1);
+  }
+  return -1;
+}
+
+static int tryrecvinto (lua_State *L, StandaloneSocket& ss) {
+  soup::Buffer& buf = checkbuffer(L, 2)->buffer;
+  const lua_Integer max = luaL_optinteger(L, 3, -1);
+  if (max == 0) {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+  if (ss.recvd.empty())
+    return -1;
+  size_t n = ss.buffered();
+  if (max > 0 && static_cast<size_t>(max) < n)
+    n = static_cast<size_t>(max);
+  try {
+    buf.reserve(buf.size() + n);  /* so the appends below can't fail halfway through */
+  }
+  catch (std::bad_alloc&) {
+    luaD_throw(L, LUA_ERRMEM);
+  }
+  ss.consume(n, [&buf](const char *data, size_t size) {
+    buf.append(data, size);
+  });
+  lua_pushinteger(L, static_cast<lua_Integer>(n));
+  return 1;
+}
+
+/* socket:recvexact(n): receives exactly 'n' bytes */
+static int recvexact (lua_State *L) {
+  return framedrecv<tryrecvexact>(L, *checksocket(L, 1));
+}
+
+/* socket:recvuntil(delim): receives up to the next occurrence of 'delim', which is consumed but not returned */
+static int recvuntil (lua_State *L) {
+  return framedrecv<tryrecvuntil>(L, *checksocket(L, 1));
+}
+
+/* socket:recvinto(buf, max): appends up to 'max' bytes (default: everything received) to a pluto:buffer, returns the byte count */
+static int recvinto (lua_State *L) {
+  return framedrecv<tryrecvinto>(L, *checksocket(L, 1));
+}
+
 static int starttlscont (lua_State *L, int status, lua_KContext ctx) {
   StandaloneSocket& ss = *reinterpret_cast<StandaloneSocket*>(ctx);
   ss.sched.tick();
-  if (l_likely(!ss.did_tls_handshake && !ss.sock->isWorkDone()))
+  if (l_likely(!ss.did_tls_handshake && !ss.sock->isWorkDone())) {
+    pluto_waitsched(L, &ss.sched);
     return lua_yieldk(L, 0, ctx, starttlscont);
+  }
   lua_pushboolean(L, ss.did_tls_handshake);
   return 1;
 }
@@ -269,6 +453,7 @@ static int starttls (lua_State *L) {
     }
 
     /* We may have already consumed the client_hello, so we need to give it back to Soup. */
+    ss.normalise();
     while (!ss.recvd.empty()) {
       ss.sock->transport_unrecv(ss.recvd.back());
       ss.recvd.pop_back();
@@ -280,11 +465,13 @@ static int starttls (lua_State *L) {
     ss.sock->enableCryptoClient(luaL_checkstring(L, 2), starttlscallback, &ss);
   }
 
-  if (lua_isyieldable(L))
+  if (lua_isyieldable(L)) {
+    pluto_waitsched(L, &ss.sched);
     return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(&ss), starttlscont);
+  }
 
   do {
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    Pluto::EventLoop::block(ss.sched);
     ss.sched.tick();
   } while (!ss.did_tls_handshake && !ss.sock->isWorkDone());
   lua_pushboolean(L, ss.did_tls_handshake);
@@ -366,7 +553,10 @@ static int acceptcont (lua_State *L, int status, lua_KContext ctx) {
   auto& l = *reinterpret_cast<Listener*>(ctx);
   if (!l.accepted) {
     l.serv.tick();
-    return lua_yieldk(L, 0, ctx, acceptcont);
+    if (!l.accepted) {
+      pluto_waitsched(L, &l.serv);
+      return lua_yieldk(L, 0, ctx, acceptcont);
+    }
   }
   return restaccept(L, l);
 }
@@ -376,12 +566,14 @@ static int listener_accept (lua_State *L) {
   if (!l.accepted) {
     if (lua_isyieldable(L)) {
       l.serv.tick();
-      return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(&l), acceptcont);
+      if (!l.accepted) {
+        pluto_waitsched(L, &l.serv);
+        return lua_yieldk(L, 0, reinterpret_cast<lua_KContext>(&l), acceptcont);
+      }
+      return restaccept(L, l);
     }
-    do {
-      l.serv.tick();
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    } while (!l.accepted);
+    while (l.serv.tick(), !l.accepted)
+      Pluto::EventLoop::block(l.serv);
   }
   return restaccept(L, l);
 }
@@ -398,6 +590,93 @@ static int listener_hasconnection (lua_State *L) {
   return 1;
 }
 
+/* Gives the scheduler of the socket or listener at index 'i'. */
+static soup::Scheduler *selectsched (lua_State *L, int i) {
+  if (auto ss = (StandaloneSocket*)luaL_testudata(L, i, "pluto:socket"))
+    return &ss->sched;
+  if (auto l = (Listener*)luaL_testudata(L, i, "pluto:socket-listener"))
+    return &l->serv;
+  luaL_error(L, "bad element in socket list (expected pluto:socket or pluto:socket-listener, got %s)", luaL_typename(L, i));
+}
+
+/*
+** Returns whether a call to recv or accept on the socket or listener at index
+** 'i' would not block. Only ticks it if 'tick', i.e. if it has news to process.
+*/
+static bool selectready (lua_State *L, int i, bool tick) {
+  if (auto ss = (StandaloneSocket*)luaL_testudata(L, i, "pluto:socket")) {
+    if (ss->recvd.empty() && tick)
+      ss->sched.tick();
+    return !ss->recvd.empty() || ss->sock->isWorkDoneOrClosed();
+  }
+  auto l = (Listener*)lua_touserdata(L, i);  /* checked by 'selectsched' */
+  if (!l->accepted && tick)
+    l->serv.tick();
+  return static_cast<bool>(l->accepted);
+}
+
+/*
+** Pushes a table of the sockets in the list at index 1 that are ready, or
+** nothing if none are. 'ready' tells which of them have news, as reported by
+** 'EventLoop::block'; if it is empty, they are polled (once for the whole list).
+*/
+static bool pushselected (lua_State *L, Pluto::EventLoop::WaitSet& set, std::vector<bool>& ready) {
+  set.scheds.clear();
+  const lua_Integer n = luaL_len(L, 1);
+  for (lua_Integer i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    set.scheds.emplace_back(selectsched(L, -1));
+    lua_pop(L, 1);
+  }
+  if (ready.size() != set.scheds.size())
+    Pluto::EventLoop::block(set.scheds.data(), set.scheds.size(), 0, &ready);
+  lua_newtable(L);
+  lua_Integer nready = 0;
+  for (lua_Integer i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    if (selectready(L, -1, ready[i - 1]))
+      lua_rawseti(L, -2, ++nready);
+    else
+      lua_pop(L, 1);
+  }
+  ready.clear();
+  if (nready != 0 || (set.deadline != -1 && soup::time::millis() >= set.deadline))
+    return true;
+  lua_pop(L, 1);
+  return false;
+}
+
+static int selectcont (lua_State *L, int status, lua_KContext ctx) {
+  lua_settop(L, 3);
+  auto& set = *reinterpret_cast<Pluto::EventLoop::WaitSet*>(ctx);
+  std::vector<bool> ready;
+  if (pushselected(L, set, ready))
+    return 1;
+  pluto_waitset(L, &set);
+  return lua_yieldk(L, 0, ctx, selectcont);
+}
+
+/* socket.select(list, timeout): waits until at least one socket or listener in 'list' is readable, returns a table of those */
+static int l_select (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  const lua_Integer timeout = luaL_optinteger(L, 2, -1);
+  luaL_argcheck(L, timeout >= 0 || luaL_len(L, 1) != 0, 1, "empty socket list without a timeout would wait forever");
+  lua_settop(L, 2);
+  auto& set = *pluto_newclassinst(L, Pluto::EventLoop::WaitSet);
+  if (timeout >= 0)
+    set.deadline = soup::time::millis() + timeout;
+  if (lua_isyieldable(L))
+    return selectcont(L, LUA_OK, reinterpret_cast<lua_KContext>(&set));
+  std::vector<bool> ready;
+  while (!pushselected(L, set, ready)) {
+    int left = -1;
+    if (set.deadline != -1)
+      left = static_cast<int>(std::max<std::time_t>(set.deadline - soup::time::millis(), 0));
+    Pluto::EventLoop::block(set.scheds.data(), set.scheds.size(), left, &ready);
+  }
+  return 1;
+}
+
 [[nodiscard]] static soup::SocketAddr checkaddr (lua_State *L, int i) {
   soup::SocketAddr addr;
   if (lua_type(L, i) == LUA_TSTRING) {
@@ -467,6 +746,9 @@ static const luaL_Reg funcs_socket[] = {
   {"peek", l_peek},
   {"recv", l_recv},
   {"unrecv", unrecv},
+  {"recvexact", recvexact},
+  {"recvuntil", recvuntil},
+  {"recvinto", recvinto},
   {"starttls", starttls},
   {"istls", socket_istls},
   {"isudp", socket_isudp},
@@ -476,15 +758,12 @@ static const luaL_Reg funcs_socket[] = {
   {"getpeer", socket_getpeer},
   {"listen", l_listen},
   {"udpserver", l_udpserver},
+  {"select", l_select},
   {NULL, NULL}
 };
 
-LUAMOD_API int luaopen_socket (lua_State *L) {
-  luaL_newlib(L, funcs_socket);
-
 #ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
-  lua_pushliteral(L, "bind");
-  luaL_loadstring(L, R"EOC(
+const Pluto::StdlibChunk Pluto::stdlib_socket_bind{ nullptr, R"EOC(
 return function(sched, port, callback)
     local l = require"pluto:socket".listen(port)
     assert(l, "Failed to bind port "..port)
@@ -495,7 +774,15 @@ return function(sched, port, callback)
             end)
         end
     end)
-end)EOC");
+end)EOC" };
+#endif
+
+LUAMOD_API int luaopen_socket (lua_State *L) {
+  luaL_newlib(L, funcs_socket);
+
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+  lua_pushliteral(L, "bind");
+  Pluto::loadStdlibChunk(L, Pluto::stdlib_socket_bind);
   lua_call(L, 0, 1);
   lua_settable(L, -3);
 #endif
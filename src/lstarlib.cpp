@@ -1,24 +1,26 @@
-#include <cstring>
-
 #define LUA_LIB
 #include "lualib.h"
+#include "lstdlibcode.hpp"
 
 static const luaL_Reg funcs[] = {
   {nullptr, nullptr}
 };
 
-LUAMOD_API int luaopen_star (lua_State *L) {
-#ifdef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
-  return 0;
-#else
-  const auto code = R"EOC(local t = {}
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+const Pluto::StdlibChunk Pluto::stdlib_star{ "pluto:*", R"EOC(local t = {}
 for k in package.preload do
   if k ~= "*" then
     t[k] = require $"pluto:{k}"
   end
 end
-return t)EOC";
-  luaL_loadbuffer(L, code, strlen(code), "pluto:*");
+return t)EOC" };
+#endif
+
+LUAMOD_API int luaopen_star (lua_State *L) {
+#ifdef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+  return 0;
+#else
+  Pluto::loadStdlibChunk(L, Pluto::stdlib_star);
   lua_call(L, 0, 1);
   return 1;
 #endif
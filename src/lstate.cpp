@@ -26,6 +26,7 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "leventloop.hpp"
 
 #include "vendor/Soup/soup/DetachedScheduler.hpp"
 
@@ -268,6 +269,7 @@ static void preinit_thread (lua_State *L, global_State *g) {
   L->status = LUA_OK;
   L->errfunc = 0;
   L->oldpc = 0;
+  L->waitreason = WAIT_NONE;
 }
 
 
@@ -285,6 +287,7 @@ static void close_state (lua_State *L) {
     if (g->scheduler) {
       delete reinterpret_cast<soup::DetachedScheduler*>(g->scheduler);
     }
+    delete reinterpret_cast<Pluto::EventLoop*>(g->eventloop);
 #endif
     luai_userstateclose(L);
   }
@@ -322,6 +325,18 @@ LUA_API lua_State *lua_newthread (lua_State *L) {
 }
 
 
+/*
+** [Pluto] Memory held by a thread, not counting the main thread's
+** 'lua_State', which is part of the global state.
+*/
+lu_mem luaE_threadsize (lua_State *L1) {
+  lu_mem size = (L1 == G(L1)->mainthread) ? 0 : sizeof(LX);
+  if (L1->stack.p != NULL)
+    size += cast(lu_mem, stacksize(L1) + EXTRA_STACK) * sizeof(StackValue);
+  return size + cast(lu_mem, L1->nci) * sizeof(CallInfo);
+}
+
+
 void luaE_freethread (lua_State *L, lua_State *L1) {
   LX *l = fromstate(L1);
   luaF_closeupval(L1, L1->stack.p);  /* close all upvalues */
@@ -409,6 +424,9 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->twups = NULL;
   g->totalbytes = sizeof(LG);
   g->GCdebt = 0;
+  g->memlimit = 0;
+  g->memquota = 0;
+  g->buffermem = 0;
   g->lastatomic = 0;
   setivalue(&g->nilvalue, 0);  /* to signal that state is not yet built */
   setgcparam(g->gcpause, LUAI_GCPAUSE);
@@ -474,8 +492,12 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
 #endif
 
   g->scheduler = nullptr;
+  g->eventloop = nullptr;
 #ifdef PLUTO_ETL_ENABLE
-  g->deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() + PLUTO_ETL_NANOS;
+  g->deadline = 0;
+  g->etl_fuel = PLUTO_ETL_INTERVAL;
+  if constexpr (PLUTO_ETL_NANOS > 0)
+    g->deadline = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() + PLUTO_ETL_NANOS;
 #endif
   if (luaD_rawrunprotected(L, f_luaopen, NULL) != LUA_OK) {
     /* memory allocation error: free partial state */
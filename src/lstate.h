@@ -16,6 +16,8 @@ typedef struct CallInfo CallInfo;
 #include "ltm.h"
 #include "lzio.h"
 
+#include <ctime> // time_t
+
 #ifdef PLUTO_ETL_ENABLE
 #include <chrono>
 #endif
@@ -258,6 +260,9 @@ typedef struct global_State {
   void *ud;         /* auxiliary data to 'frealloc' */
   l_mem totalbytes;  /* number of bytes currently allocated - GCdebt */
   l_mem GCdebt;  /* bytes allocated not yet compensated by the collector */
+  lu_mem memlimit;  /* [Pluto] maximum for 'gettotalbytes'; 0 if unlimited */
+  lu_mem memquota;  /* [Pluto] limit set by the host, which scripts cannot raise 'memlimit' above; 0 if none */
+  l_mem buffermem;  /* [Pluto] bytes held by the contents of pluto:buffer objects */
   lu_mem GCestimate;  /* an estimate of the non-garbage memory in use */
   lu_mem lastatomic;  /* see function 'genstep' in file 'lgc.c' */
   stringtable strt;  /* hash table for strings */
@@ -331,9 +336,11 @@ typedef struct global_State {
   bool preference_catch : 1;
 
   void* scheduler;  /* internal use only; do not use this in your own code. */
+  void* eventloop;  /* internal use only; do not use this in your own code. */
 #endif
 #ifdef PLUTO_ETL_ENABLE
   std::time_t deadline;  /* internal use only; do not use this in your own code. */
+  int etl_fuel;  /* internal use only; do not use this in your own code. */
 #endif
 #ifndef PLUTO_NO_DEFAULT_TABLE_METATABLE
   TValue table_mt;  /* internal use only; do not use this in your own code. */
@@ -380,6 +387,17 @@ public:
   Registry(lua_State *L) : state(L) {}
 };
 
+/*
+** Reasons for a thread to be suspended (field 'waitreason'), so a scheduler
+** can park it until the event fires instead of resuming it on every pass.
+*/
+#define WAIT_NONE	0  /* plain yield */
+#define WAIT_SCHED	1  /* 'waitdata' is a soup::Scheduler waiting on sockets */
+#define WAIT_WORKER	2  /* 'waitdata' is a soup::Worker run by another thread */
+#define WAIT_TIMER	3  /* waiting until 'waituntil' (steady clock, in ms) */
+#define WAIT_SET	4  /* 'waitdata' is a Pluto::EventLoop::WaitSet */
+
+
 /*
 ** 'per thread' state
 */
@@ -406,6 +424,11 @@ struct lua_State {
   int basehookcount;
   int hookcount;
   volatile l_signalT hookmask;
+#ifndef PLUTO_LUA_LINKABLE
+  lu_byte waitreason;  /* internal use only; do not use this in your own code. */
+  void *waitdata;  /* internal use only; do not use this in your own code. */
+  std::time_t waituntil;  /* internal use only; do not use this in your own code. */
+#endif
 
   // Lua registry abstration.
   [[nodiscard]] inline Registry GetReg() {
@@ -413,7 +436,12 @@ struct lua_State {
   }
 
 #ifdef PLUTO_ETL_ENABLE
-  void checkEtl();
+  /* Cheap enough to call in loops; the clock is only read every PLUTO_ETL_INTERVAL calls. */
+  void checkEtl() {
+    if (luai_unlikely(--l_G->etl_fuel < 0))
+      checkEtlDeadline();
+  }
+  void checkEtlDeadline();
 #else
   void checkEtl() {}
 #endif
@@ -481,6 +509,8 @@ union GCUnion {
 /* actual number of total bytes allocated */
 #define gettotalbytes(g)	cast(lu_mem, (g)->totalbytes + (g)->GCdebt)
 
+LUAI_FUNC lu_mem luaE_threadsize (lua_State *L1);
+
 LUAI_FUNC void luaE_setdebt (global_State *g, l_mem debt);
 LUAI_FUNC void luaE_freethread (lua_State *L, lua_State *L1);
 LUAI_FUNC CallInfo *luaE_extendCI (lua_State *L);
@@ -0,0 +1,68 @@
+#include "lstdlibcode.hpp"
+
+#include <cstring> // strlen
+#include <string>
+
+#include "lua.h"
+#include "lauxlib.h"
+
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+
+#ifdef PLUTO_STDLIB_BYTECODE
+#include <iterator> // size
+
+#include "lstdlibbytecode.h"  /* generated by plutoc --stdlib-header */
+
+static_assert(std::size(stdlib_bytecode) == std::size(Pluto::all_stdlib_chunks), "lstdlibbytecode.h is out of date");
+#endif
+
+void Pluto::loadStdlibChunk(lua_State *L, const StdlibChunk& chunk) {
+  const char *name = chunk.name ? chunk.name : chunk.source;
+#ifdef PLUTO_STDLIB_BYTECODE
+  for (size_t i = 0; i != std::size(all_stdlib_chunks); ++i) {
+    if (all_stdlib_chunks[i] == &chunk) {
+      luaL_loadbufferx(L, reinterpret_cast<const char*>(stdlib_bytecode[i].data), stdlib_bytecode[i].size, name, "b");
+      return;
+    }
+  }
+#endif
+  luaL_loadbuffer(L, chunk.source, strlen(chunk.source), name);
+}
+
+static int writer (lua_State *L, const void *p, size_t size, void *ud) {
+  (void)L;
+  static_cast<std::string*>(ud)->append(static_cast<const char*>(p), size);
+  return 0;
+}
+
+#endif
+
+/*
+** Used by 'plutoc --stdlib-header'. plutoc is linked from the same objects as
+** the library that embeds the header, so the bytecode always matches the
+** parser & VM it will be loaded by.
+*/
+void Pluto::writeStdlibHeader(lua_State *L, FILE *f) {
+  fprintf(f, "/* Generated by plutoc --stdlib-header; do not edit. */\n");
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+  size_t i = 0;
+  for (const StdlibChunk *chunk : all_stdlib_chunks) {
+    const char *name = chunk->name ? chunk->name : chunk->source;
+    if (luaL_loadbuffer(L, chunk->source, strlen(chunk->source), name) != LUA_OK)
+      lua_error(L);
+    std::string bytecode;
+    lua_dump(L, writer, &bytecode, 0);  /* keep debug information for tracebacks */
+    lua_pop(L, 1);
+    fprintf(f, "\nstatic const unsigned char stdlib_bytecode_%zu[] = {", i++);
+    for (size_t j = 0; j != bytecode.size(); ++j)
+      fprintf(f, "%s%u,", j % 20 == 0 ? "\n  " : "", static_cast<unsigned char>(bytecode[j]));
+    fprintf(f, "\n};\n");
+  }
+  fprintf(f, "\nstatic const struct { const unsigned char *data; size_t size; } stdlib_bytecode[] = {\n");
+  for (size_t j = 0; j != i; ++j)
+    fprintf(f, "  { stdlib_bytecode_%zu, sizeof(stdlib_bytecode_%zu) },\n", j, j);
+  fprintf(f, "};\n");
+#else
+  (void)L;
+#endif
+}
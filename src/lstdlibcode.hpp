@@ -0,0 +1,64 @@
+#pragma once
+
+/*
+** Standard library code written in Pluto.
+**
+** The chunks are defined next to the libraries that run them. The Makefile,
+** scripts/compile.php and Pluto.vcxproj first link plutoc, whose
+** '--stdlib-header' option compiles them into lstdlibbytecode.h, and then
+** build lstdlibcode.cpp with PLUTO_STDLIB_BYTECODE to embed that bytecode, so
+** creating a state or requiring these libraries only has to undump them.
+** Builds without that step (the .sun files, cross-compiled targets, the
+** Makefile with STDLIB_BYTECODE=0 and plutoc itself) compile the sources when
+** they are loaded, as before.
+*/
+
+#include <cstdio> // FILE
+
+#include "luaconf.h"
+
+struct lua_State;
+
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+
+namespace Pluto {
+  struct StdlibChunk {
+    const char *name;  /* chunk name; if null, the source is used as its name like luaL_loadstring does */
+    const char *source;
+  };
+
+  extern const StdlibChunk stdlib_startup;
+  extern const StdlibChunk stdlib_table_min;
+  extern const StdlibChunk stdlib_table_max;
+  extern const StdlibChunk stdlib_assert;
+  extern const StdlibChunk stdlib_vector3;
+  extern const StdlibChunk stdlib_star;
+  extern const StdlibChunk stdlib_scheduler;
+#ifndef __EMSCRIPTEN__
+  extern const StdlibChunk stdlib_socket_bind;
+#endif
+
+  /* the order of this list is the order of the bytecode in lstdlibbytecode.h */
+  inline const StdlibChunk* const all_stdlib_chunks[] = {
+    &stdlib_startup,
+    &stdlib_table_min,
+    &stdlib_table_max,
+    &stdlib_assert,
+    &stdlib_vector3,
+    &stdlib_star,
+    &stdlib_scheduler,
+#ifndef __EMSCRIPTEN__
+    &stdlib_socket_bind,
+#endif
+  };
+
+  /* pushes the compiled chunk as a function; this never parses if the build embedded its bytecode */
+  void loadStdlibChunk(lua_State *L, const StdlibChunk& chunk);
+}
+
+#endif
+
+namespace Pluto {
+  /* compiles every chunk in all_stdlib_chunks and writes lstdlibbytecode.h to 'f'; raises an error if one does not compile */
+  void writeStdlibHeader(lua_State *L, FILE *f);
+}
@@ -25,6 +25,7 @@
 #include "lauxlib.h"
 #include "lualib.h"
 #include "lstring.h"
+#include "lbufferlib.hpp"
 
 
 #include "vendor/Soup/soup/bitutil.hpp"
@@ -395,7 +396,7 @@ static const luaL_Reg stringmetamethods[] = {
 
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
-  const char *src_end;  /* end ('\0') of source string */
+  const char *src_end;  /* end of source string; not necessarily '\0' for buffers & file mappings */
   const char *p_end;  /* end ('\0') of pattern */
   lua_State *L;
   int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
@@ -525,7 +526,7 @@ static const char *matchbalance (MatchState *ms, const char *s,
                                    const char *p) {
   if (l_unlikely(p >= ms->p_end - 1))
     luaL_error(ms->L, "malformed pattern (missing arguments to '%%b')");
-  if (*s != *p) return NULL;
+  if (s >= ms->src_end || *s != *p) return NULL;
   else {
     int b = *p;
     int e = *(p+1);
@@ -645,7 +646,7 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
             ep = classend(ms, p);  /* points to what is next */
             previous = (s == ms->src_init) ? '\0' : *(s - 1);
             if (!matchbracketclass(uchar(previous), p, ep - 1) &&
-               matchbracketclass(uchar(*s), p, ep - 1)) {
+               matchbracketclass((s == ms->src_end) ? '\0' : uchar(*s), p, ep - 1)) {
               p = ep; goto init;  /* return match(ms, s, ep); */
             }
             s = NULL;  /* match failed */
@@ -847,7 +848,7 @@ static int str_find_aux (lua_State *L, const char *s, size_t ls, const char *p,
 
 static int str_find_aux (lua_State *L, int find) {
   size_t ls, lp;
-  const char *s = luaL_checklstring(L, 1, &ls);
+  const char *s = pluto_checkbytes(L, 1, &ls);  /* buffers & file mappings are searched in place */
   const char *p = luaL_checklstring(L, 2, &lp);
   size_t init = posrelatI(luaL_optinteger(L, 3, 1), ls) - 1;
   if (init > ls) {  /* start after string's end? */
@@ -1670,9 +1671,10 @@ static KOption getdetails (Header *h, size_t totalsize,
 ** the size of a Lua integer, correcting the extra sign-extension
 ** bytes if necessary (by default they would be zeros).
 */
-static void packint (luaL_Buffer *b, lua_Unsigned n,
+template <typename Sink>
+static void packint (Sink& b, lua_Unsigned n,
                      int islittle, int size, int neg) {
-  char *buff = luaL_prepbuffsize(b, size);
+  char *buff = b.prep(size);
   int i;
   buff[islittle ? 0 : size - 1] = (char)(n & MC);  /* first byte */
   for (i = 1; i < size; i++) {
@@ -1683,7 +1685,7 @@ static void packint (luaL_Buffer *b, lua_Unsigned n,
     for (i = SZINT; i < size; i++)  /* correct extra bytes */
       buff[islittle ? i : size - 1 - i] = (char)MC;
   }
-  luaL_addsize(b, size);  /* add result to buffer */
+  b.add(size);  /* add result to buffer */
 }
 
 
@@ -1703,21 +1705,50 @@ static void copywithendian (char *dest, const char *src,
 }
 
 
-static int str_pack (lua_State *L) {
+/*
+** Destinations for 'packto'. 'string.pack' collects its result in a
+** luaL_Buffer; 'buffer:pack' writes straight into a pluto:buffer.
+*/
+struct LuaBufferSink {
   luaL_Buffer b;
+
+  char *prep (size_t n) { return luaL_prepbuffsize(&b, n); }
+  void add (size_t n) { luaL_addsize(&b, n); }
+  void addchar (char c) { luaL_addchar(&b, c); }
+  void addlstring (const char *s, size_t l) { luaL_addlstring(&b, s, l); }
+};
+
+struct SoupBufferSink {
+  soup::Buffer& buf;
+  size_t pos;  /* where the next byte goes; may be inside of existing data */
+
+  char *prep (size_t n) {
+    if (buf.size() < pos + n)
+      buf.resize(pos + n);
+    return reinterpret_cast<char*>(buf.data()) + pos;
+  }
+  void add (size_t n) { pos += n; }
+  void addchar (char c) { *prep(1) = c; add(1); }
+  void addlstring (const char *s, size_t l) { memcpy(prep(l), s, l); add(l); }
+};
+
+
+/*
+** Packs the values after index 'arg' according to the format at index
+** 'arg' into 'b'.
+*/
+template <typename Sink>
+static void packto (lua_State *L, int arg, Sink& b) {
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
-  int arg = 1;  /* current argument to pack */
+  const char *fmt = luaL_checkstring(L, arg);  /* format string */
   size_t totalsize = 0;  /* accumulate total size of result */
   initheader(L, &h);
-  lua_pushnil(L);  /* mark to separate arguments from string buffer */
-  luaL_buffinit(L, &b);
   while (*fmt != '\0') {
     int size, ntoalign;
     KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
     totalsize += ntoalign + size;
     while (ntoalign-- > 0)
-     luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
+     b.addchar(LUAL_PACKPADBYTE);  /* fill alignment */
     arg++;
     switch (opt) {
       case Kint: {  /* signed integers */
@@ -1726,7 +1757,7 @@ static int str_pack (lua_State *L) {
           lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
           luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
         }
-        packint(&b, (lua_Unsigned)n, h.islittle, size, (n < 0));
+        packint(b, (lua_Unsigned)n, h.islittle, size, (n < 0));
         break;
       }
       case Kuint: {  /* unsigned integers */
@@ -1734,31 +1765,31 @@ static int str_pack (lua_State *L) {
         if (size < SZINT)  /* need overflow check? */
           luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
                            arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, size, 0);
+        packint(b, (lua_Unsigned)n, h.islittle, size, 0);
         break;
       }
       case Kfloat: {  /* C float */
         float f = (float)luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
+        char *buff = b.prep(sizeof(f));
         /* move 'f' to final result, correcting endianness if needed */
         copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
+        b.add(size);
         break;
       }
       case Knumber: {  /* Lua float */
         lua_Number f = luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
+        char *buff = b.prep(sizeof(f));
         /* move 'f' to final result, correcting endianness if needed */
         copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
+        b.add(size);
         break;
       }
       case Kdouble: {  /* C double */
         double f = (double)luaL_checknumber(L, arg);  /* get argument */
-        char *buff = luaL_prepbuffsize(&b, sizeof(f));
+        char *buff = b.prep(sizeof(f));
         /* move 'f' to final result, correcting endianness if needed */
         copywithendian(buff, (char *)&f, sizeof(f), h.islittle);
-        luaL_addsize(&b, size);
+        b.add(size);
         break;
       }
       case Kchar: {  /* fixed-size string */
@@ -1766,9 +1797,9 @@ static int str_pack (lua_State *L) {
         const char *s = luaL_checklstring(L, arg, &len);
         luaL_argcheck(L, len <= (size_t)size, arg,
                          "string longer than given size");
-        luaL_addlstring(&b, s, len);  /* add string */
+        b.addlstring(s, len);  /* add string */
         while (len++ < (size_t)size)  /* pad extra space */
-          luaL_addchar(&b, LUAL_PACKPADBYTE);
+          b.addchar(LUAL_PACKPADBYTE);
         break;
       }
       case Kstring: {  /* strings with length count */
@@ -1777,8 +1808,8 @@ static int str_pack (lua_State *L) {
         luaL_argcheck(L, size >= (int)sizeof(size_t) ||
                          len < ((size_t)1 << (size * NB)),
                          arg, "string length does not fit in given size");
-        packint(&b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
-        luaL_addlstring(&b, s, len);
+        packint(b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
+        b.addlstring(s, len);
         totalsize += len;
         break;
       }
@@ -1786,22 +1817,37 @@ static int str_pack (lua_State *L) {
         size_t len;
         const char *s = luaL_checklstring(L, arg, &len);
         luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
+        b.addlstring(s, len);
+        b.addchar('\0');  /* add zero at the end */
         totalsize += len + 1;
         break;
       }
-      case Kpadding: luaL_addchar(&b, LUAL_PACKPADBYTE); [[fallthrough]];
+      case Kpadding: b.addchar(LUAL_PACKPADBYTE); [[fallthrough]];
       case Kpaddalign: case Knop:
         arg--;  /* undo increment */
         break;
     }
   }
-  luaL_pushresult(&b);
+}
+
+
+static int str_pack (lua_State *L) {
+  LuaBufferSink b;
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &b.b);
+  packto(L, 1, b);
+  luaL_pushresult(&b.b);
   return 1;
 }
 
 
+size_t pluto_packinto (lua_State *L, int arg, soup::Buffer& buf, size_t pos) {
+  SoupBufferSink b{ buf, pos };
+  packto(L, arg, b);
+  return b.pos;
+}
+
+
 static int str_packsize (lua_State *L) {
   Header h;
   const char *fmt = luaL_checkstring(L, 1);  /* format string */
@@ -1856,19 +1902,19 @@ static lua_Integer unpackint (lua_State *L, const char *str,
 }
 
 
-static int str_unpack (lua_State *L) {
+/*
+** Unpacks 'data' according to 'fmt', starting at (0-based) 'pos'.
+** Problems with the data are reported for argument 'dataarg'.
+*/
+static int unpackfrom (lua_State *L, const char *fmt, int dataarg,
+                       const char *data, size_t ld, size_t pos) {
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);
-  size_t ld;
-  const char *data = luaL_checklstring(L, 2, &ld);
-  size_t pos = posrelatI(luaL_optinteger(L, 3, 1), ld) - 1;
   int n = 0;  /* number of results */
-  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
   initheader(L, &h);
   while (*fmt != '\0') {
     int size, ntoalign;
     KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
-    luaL_argcheck(L, (size_t)ntoalign + size <= ld - pos, 2,
+    luaL_argcheck(L, (size_t)ntoalign + size <= ld - pos, dataarg,
                     "data string too short");
     pos += ntoalign;  /* skip alignment */
     /* stack space for item + next position */
@@ -1906,15 +1952,16 @@ static int str_unpack (lua_State *L) {
       }
       case Kstring: {
         size_t len = (size_t)unpackint(L, data + pos, h.islittle, size, 0);
-        luaL_argcheck(L, len <= ld - pos - size, 2, "data string too short");
+        luaL_argcheck(L, len <= ld - pos - size, dataarg, "data string too short");
         lua_pushlstring(L, data + pos + size, len);
         pos += len;  /* skip string */
         break;
       }
       case Kzstr: {
-        size_t len = strlen(data + pos);
-        luaL_argcheck(L, pos + len < ld, 2,
+        const char *end = (const char *)memchr(data + pos, '\0', ld - pos);  /* buffers need not end with '\0' */
+        luaL_argcheck(L, end != NULL, dataarg,
                          "unfinished string for format 'z'");
+        size_t len = end - (data + pos);
         lua_pushlstring(L, data + pos, len);
         pos += len + 1;  /* skip string plus final '\0' */
         break;
@@ -1930,6 +1977,21 @@ static int str_unpack (lua_State *L) {
 }
 
 
+static int str_unpack (lua_State *L) {
+  const char *fmt = luaL_checkstring(L, 1);
+  size_t ld;
+  const char *data = pluto_checkbytes(L, 2, &ld);
+  size_t pos = posrelatI(luaL_optinteger(L, 3, 1), ld) - 1;
+  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
+  return unpackfrom(L, fmt, 2, data, ld, pos);
+}
+
+
+int pluto_unpackfrom (lua_State *L, int fmtarg, int dataarg, const char *data, size_t ld, size_t pos) {
+  return unpackfrom(L, luaL_checkstring(L, fmtarg), dataarg, data, ld, pos);
+}
+
+
 static int str_startswith (lua_State *L) {
   size_t len;
   const char *str = luaL_checkstring(L, 1);
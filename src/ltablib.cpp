@@ -14,12 +14,21 @@
 #include <stddef.h>
 #include <string.h>
 
+#include <algorithm> // copy, min, sort, stable_sort
+#include <numeric> // iota
+#include <vector>
+
 #include "lua.h"
 
 #include "lauxlib.h"
 #include "lualib.h"
+#include "lstdlibcode.hpp"
+#include "lapi.h"
+#include "ldo.h"
+#include "lgc.h"
 #include "lstate.h"
 #include "ltable.h"
+#include "lvm.h"
 
 
 /*
@@ -235,6 +244,55 @@ static int tunpack (lua_State *L) {
 
 
 
+/*
+** Fast paths for array-like tables. The array part is walked directly and
+** results are written straight into the presized array part of the result;
+** whatever is in the hash part is then traversed with lua_next, resuming
+** after the array part. Callbacks may resize the table, so the array size
+** is re-read after each call.
+*/
+TValue *index2value (lua_State *L, int idx);
+
+[[nodiscard]] static Table *totable (lua_State *L, int idx) {
+  return hvalue(index2value(L, idx));
+}
+
+
+/* can the array part of 't' be written to directly? */
+[[nodiscard]] static bool iswritable (const Table *t) {
+#ifdef PLUTO_ENABLE_TABLE_FREEZING
+  return !t->isfrozen;
+#else
+  (void)t;
+  return true;
+#endif
+}
+
+
+static void pushslot (lua_State *L, const TValue *v) {
+  setobj2s(L, L->top.p, v);
+  api_incr_top(L);
+}
+
+
+/* pops a value and stores it into t[i + 1], which must be inside the array part */
+static void popslot (lua_State *L, Table *t, unsigned int i) {
+  TValue *v = s2v(L->top.p - 1);
+  setobj2t(L, &t->array[i], v);
+  luaC_barrierback(L, obj2gco(t), v);
+  L->top.p--;
+}
+
+
+/* pushes the key lua_next needs to continue after the first 'i' array slots */
+static void pushresumekey (lua_State *L, unsigned int i) {
+  if (i == 0)
+    lua_pushnil(L);
+  else
+    lua_pushinteger(L, i);
+}
+
+
 /*
 ** {======================================================
 ** Quicksort
@@ -438,6 +496,201 @@ static void trivialcopy (lua_State* L) {
 }
 
 
+/*
+** {======================================================
+** Native & stable sorting
+** =======================================================
+*/
+
+
+/* same order as 'l_strcmp' in lvm.cpp */
+[[nodiscard]] static bool strless (const TString *ts1, const TString *ts2) {
+  const char *s1 = getstr(ts1);
+  size_t rl1 = tsslen(ts1);
+  const char *s2 = getstr(ts2);
+  size_t rl2 = tsslen(ts2);
+  for (;;) {
+    const int temp = strcoll(s1, s2);
+    if (temp != 0)
+      return temp < 0;
+    const size_t zl1 = strlen(s1);
+    const size_t zl2 = strlen(s2);
+    if (zl2 == rl2)
+      return false;
+    else if (zl1 == rl1)
+      return true;
+    s1 += zl1 + 1; rl1 -= zl1 + 1; s2 += zl2 + 1; rl2 -= zl2 + 1;
+  }
+}
+
+
+/*
+** Sorts t[1..n] in place without calling back into Lua if they are all
+** integers, all floats (none NaN) or all strings, and all in the array part.
+** Returns false if that's not the case.
+*/
+static bool sortnative (lua_State *L, IdxT n, bool stable) {
+  Table *t = totable(L, 1);
+  if (n > luaH_realasize(t) || !iswritable(t))
+    return false;
+  TValue *a = t->array;
+  const lu_byte tag = ttypetag(&a[0]);
+  if (tag == LUA_VNUMINT) {
+    for (IdxT i = 1; i != n; ++i) {
+      if (!ttisinteger(&a[i]))
+        return false;
+    }
+    std::sort(a, a + n, [](const TValue& x, const TValue& y) {  /* equal integers are indistinguishable, so this is stable too */
+      return ivalue(&x) < ivalue(&y);
+    });
+  }
+  else if (tag == LUA_VNUMFLT) {
+    for (IdxT i = 0; i != n; ++i) {
+      if (!ttisfloat(&a[i]) || luai_numisnan(fltvalue(&a[i])))
+        return false;
+    }
+    const auto less = [](const TValue& x, const TValue& y) {
+      return fltvalue(&x) < fltvalue(&y);
+    };
+    if (stable)  /* -0.0 == 0.0 */
+      std::stable_sort(a, a + n, less);
+    else
+      std::sort(a, a + n, less);
+  }
+  else if (ttisstring(&a[0])) {
+    for (IdxT i = 1; i != n; ++i) {
+      if (!ttisstring(&a[i]))
+        return false;
+    }
+    const auto less = [](const TValue& x, const TValue& y) {
+      return strless(tsvalue(&x), tsvalue(&y));
+    };
+    if (stable)  /* distinct strings may collate equal */
+      std::stable_sort(a, a + n, less);
+    else
+      std::sort(a, a + n, less);
+  }
+  else
+    return false;
+  return true;
+}
+
+
+/*
+** Stably reorders t[1..n] by the values in the table at 'keys' (the
+** elements themselves if 'keys' is 1), using the comparator at index 2 if
+** there is one. The elements are first copied to an anchor table, since
+** the comparator may modify 't'. This is a plain bottom-up merge sort
+** rather than std::stable_sort, which may step out of bounds when the
+** comparator is not a strict weak order.
+*/
+static void sortstable (lua_State *L, IdxT n, int keys) {
+  lua_createtable(L, (int)n, 0);
+  const int values = lua_gettop(L);
+  for (IdxT i = 1; i <= n; ++i) {
+    lua_geti(L, 1, i);
+    lua_rawseti(L, values, i);
+  }
+  if (keys == 1)
+    keys = values;
+  const bool hascomp = !lua_isnil(L, 2);
+  const auto less = [L, keys, hascomp](IdxT a, IdxT b) {
+    if (hascomp)
+      lua_pushvalue(L, 2);
+    lua_rawgeti(L, keys, a);
+    lua_rawgeti(L, keys, b);
+    bool res;
+    if (hascomp) {
+      lua_call(L, 2, 1);
+      res = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+    }
+    else {
+      res = lua_compare(L, -2, -1, LUA_OPLT);
+      lua_pop(L, 2);
+    }
+    return res;
+  };
+  if (less(1, 1))  /* e.g. '<=' instead of '<' */
+    luaL_error(L, "invalid order function for sorting");
+  std::vector<IdxT> perm(n);
+  std::vector<IdxT> tmp(n);
+  std::iota(perm.begin(), perm.end(), 1);
+  for (IdxT width = 1; width < n; width *= 2) {
+    for (IdxT lo = 0; lo < n - width; lo += 2 * width) {
+      const IdxT mid = lo + width;
+      const IdxT hi = std::min(mid + width, n);
+      IdxT i = lo, j = mid, k = lo;
+      while (i != mid && j != hi)
+        tmp[k++] = less(perm[j], perm[i]) ? perm[j++] : perm[i++];
+      while (i != mid)
+        tmp[k++] = perm[i++];
+      while (j != hi)
+        tmp[k++] = perm[j++];
+      std::copy(tmp.begin() + lo, tmp.begin() + hi, perm.begin() + lo);
+    }
+  }
+  for (IdxT i = 1; i <= n; ++i) {
+    lua_rawgeti(L, values, perm[i - 1]);
+    lua_seti(L, 1, i);
+  }
+  lua_settop(L, values - 1);
+}
+
+
+/*
+** Orders t[1..n] by the keys in the table at 'keys', which are all
+** integers, floats (none NaN) or strings. Ties keep their original order.
+** Returns false if the keys are not homogeneous.
+*/
+static bool sortbynative (lua_State *L, IdxT n, int keys) {
+  const Table *k = totable(L, keys);
+  if (n > luaH_realasize(k))
+    return false;
+  const TValue *a = k->array;
+  const lu_byte tag = ttypetag(&a[0]);
+  for (IdxT i = 0; i != n; ++i) {
+    if (tag == LUA_VNUMINT ? !ttisinteger(&a[i])
+        : tag == LUA_VNUMFLT ? (!ttisfloat(&a[i]) || luai_numisnan(fltvalue(&a[i])))
+        : (!ttisstring(&a[0]) || !ttisstring(&a[i])))
+      return false;
+  }
+  std::vector<IdxT> perm(n);
+  std::iota(perm.begin(), perm.end(), 0);
+  if (tag == LUA_VNUMINT) {
+    std::sort(perm.begin(), perm.end(), [a](IdxT x, IdxT y) {
+      return ivalue(&a[x]) < ivalue(&a[y]) || (ivalue(&a[x]) == ivalue(&a[y]) && x < y);
+    });
+  }
+  else if (tag == LUA_VNUMFLT) {
+    std::sort(perm.begin(), perm.end(), [a](IdxT x, IdxT y) {
+      return fltvalue(&a[x]) < fltvalue(&a[y]) || (fltvalue(&a[x]) == fltvalue(&a[y]) && x < y);
+    });
+  }
+  else {
+    std::sort(perm.begin(), perm.end(), [a](IdxT x, IdxT y) {
+      const TString *sx = tsvalue(&a[x]);
+      const TString *sy = tsvalue(&a[y]);
+      return strless(sx, sy) || (!strless(sy, sx) && x < y);
+    });
+  }
+  lua_createtable(L, (int)n, 0);  /* anchor the values while they are moved */
+  const int values = lua_gettop(L);
+  for (IdxT i = 1; i <= n; ++i) {
+    lua_geti(L, 1, i);
+    lua_rawseti(L, values, i);
+  }
+  for (IdxT i = 1; i <= n; ++i) {
+    lua_rawgeti(L, values, perm[i - 1] + 1);
+    lua_seti(L, 1, i);
+  }
+  lua_pop(L, 1);
+  return true;
+}
+
+/* }====================================================== */
+
+
 template <bool make_copy>
 static int sort (lua_State *L) {
   if (make_copy) {
@@ -451,8 +704,59 @@ static int sort (lua_State *L) {
     luaL_argcheck(L, n < INT_MAX, 1, "array too big");
     if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
       luaL_checktype(L, 2, LUA_TFUNCTION);  /* must be a function */
+    const bool stable = lua_toboolean(L, 3);
     lua_settop(L, 2);  /* make sure there are two arguments */
-    auxsort(L, 1, (IdxT)n, 0);
+    try {
+      if (lua_isnil(L, 2) && sortnative(L, (IdxT)n, stable))
+        ;  /* done */
+      else if (stable)
+        sortstable(L, (IdxT)n, 1);
+      else
+        auxsort(L, 1, (IdxT)n, 0);
+    }
+    catch (std::bad_alloc&) {
+      luaD_throw(L, LUA_ERRMEM);
+    }
+  }
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+/*
+** table.sortby(t, keyfn, comp) sorts t by keyfn(value), calling keyfn once
+** per element. The sort is stable.
+*/
+template <bool make_copy>
+static int sortby (lua_State *L) {
+  if (make_copy) {
+    lua_newtable(L);
+    lua_pushvalue(L, 1);
+    trivialcopy(L);
+    lua_replace(L, 1);
+  }
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  const lua_Integer n = aux_getn(L, 1, TAB_RW);
+  if (n > 1) {
+    luaL_argcheck(L, n < INT_MAX, 1, "array too big");
+    if (!lua_isnoneornil(L, 3))
+      luaL_checktype(L, 3, LUA_TFUNCTION);
+    lua_settop(L, 3);
+    lua_createtable(L, (int)n, 0);  /* keys */
+    for (IdxT i = 1; i <= (IdxT)n; ++i) {
+      lua_pushvalue(L, 2);
+      lua_geti(L, 1, i);
+      lua_call(L, 1, 1);
+      lua_rawseti(L, 4, i);
+    }
+    lua_remove(L, 2);  /* comparator (or nil) is now at 2, keys at 3 */
+    try {
+      if (!(lua_isnil(L, 2) && sortbynative(L, (IdxT)n, 3)))
+        sortstable(L, (IdxT)n, 3);
+    }
+    catch (std::bad_alloc&) {
+      luaD_throw(L, LUA_ERRMEM);
+    }
   }
   lua_settop(L, 1);
   return 1;
@@ -489,9 +793,22 @@ static int tisfrozen (lua_State *L) {
 static int tcontains (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
   luaL_checkany(L, 2);
+  lua_settop(L, 2);
+
+  unsigned int i = 0;
+  if (!lua_istable(L, 2) && lua_type(L, 2) != LUA_TUSERDATA) {  /* no __eq can get involved? */
+    const Table *t = totable(L, 1);
+    const TValue *needle = index2value(L, 2);
+    for (; i < luaH_realasize(t); ++i) {
+      if (luaV_rawequalobj(&t->array[i], needle)) {
+        lua_pushinteger(L, i + 1);
+        return 1;
+      }
+    }
+  }
 
   lua_pushvalue(L, 1);
-  lua_pushnil(L);
+  pushresumekey(L, i);
   while (lua_next(L, -2)) {
     lua_pushvalue(L, -2);
     if (lua_compare(L, 2, -2, LUA_OPEQ)) {
@@ -514,17 +831,56 @@ static int tfilter (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
   luaL_checktype(L, 2, LUA_TFUNCTION);
   const bool callwithkey = lua_istrue(L, 3);
+  lua_settop(L, 3);
 
+  Table *t = totable(L, 1);
   if (make_copy)
-    lua_newtable(L);
-  lua_pushvalue(L, 1);
-  if (make_copy) {
-    trivialcopy(L);
+    lua_createtable(L, (int)luaH_realasize(t), isdummy(t) ? 0 : (int)sizenode(t));
+  else
+    lua_pushvalue(L, 1);
+  /* stack now: table, func, callwithkey, result */
+  Table *res = totable(L, 4);
+  unsigned int i = 0;
+  if (iswritable(res)) {
+    for (; i < luaH_realasize(t); ++i) {
+      if (isempty(&t->array[i]))
+        continue;
+      lua_pushvalue(L, 2);
+      if (callwithkey)
+        lua_pushinteger(L, i + 1);
+      pushslot(L, &t->array[i]);
+      lua_call(L, callwithkey ? 2 : 1, 1);
+      const bool keep = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+      if (i >= luaH_realasize(t)) {  /* resized by the callback? */
+        if (make_copy ? keep : !keep) {
+          if (make_copy)
+            lua_rawgeti(L, 1, i + 1);
+          else
+            lua_pushnil(L);
+          lua_rawseti(L, 4, i + 1);
+        }
+        ++i;
+        break;
+      }
+      if (make_copy) {
+        if (keep) {
+          pushslot(L, &t->array[i]);
+          if (i < luaH_realasize(res))
+            popslot(L, res, i);
+          else
+            lua_rawseti(L, 4, i + 1);
+        }
+      }
+      else if (!keep)
+        setnilvalue(&t->array[i]);
+    }
   }
-  lua_pushnil(L);
-  /* stack now: table, key */
-  while (lua_next(L, -2)) {
-    /* stack now: table, key, value */
+
+  pushresumekey(L, i);
+  /* stack now: table, func, callwithkey, result, key */
+  while (lua_next(L, 1)) {
+    /* stack now: table, func, callwithkey, result, key, value */
     lua_pushvalue(L, 2);
     if (callwithkey) {
       lua_pushvalue(L, -3);
@@ -535,24 +891,25 @@ static int tfilter (lua_State *L) {
       lua_pushvalue(L, -2);
       lua_call(L, 1, 1);
     }
-    /* stack now: table, key, value, bKeep */
+    /* stack now: table, func, callwithkey, result, key, value, bKeep */
 
     const bool bKeep = lua_toboolean(L, -1);
     lua_pop(L, 1);
-    /* stack now: table, key, value */
-    if (!bKeep) {
+    /* stack now: table, func, callwithkey, result, key, value */
+    if (make_copy ? bKeep : !bKeep) {
       lua_pushvalue(L, -2);
-      /* stack now: table, key, value, key */
-      lua_pushnil(L);
-      /* stack now: table, key, value, key, value */
-      lua_settable(L, -5);
-      /* stack now: table, key, value */
+      if (make_copy)
+        lua_pushvalue(L, -2);
+      else
+        lua_pushnil(L);
+      /* stack now: table, func, callwithkey, result, key, value, key, value */
+      lua_settable(L, 4);
     }
 
     lua_pop(L, 1);
-    /* stack now: table, key */
+    /* stack now: table, func, callwithkey, result, key */
   }
-  /* stack now: table */
+  /* stack now: table, func, callwithkey, result */
   return 1;
 }
 
@@ -562,14 +919,40 @@ static int tmap (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
   luaL_checktype(L, 2, LUA_TFUNCTION);
   const bool callwithkey = lua_istrue(L, 3);
+  lua_settop(L, 3);
 
+  Table *t = totable(L, 1);
   if (make_copy)
-    lua_newtable(L);
-  lua_pushvalue(L, 1);
-  lua_pushnil(L);
-  /* stack now: table, key */
-  while (lua_next(L, -2)) {
-    /* stack now: table, key, value */
+    lua_createtable(L, (int)luaH_realasize(t), isdummy(t) ? 0 : (int)sizenode(t));
+  else
+    lua_pushvalue(L, 1);
+  /* stack now: table, func, callwithkey, result */
+  Table *res = totable(L, 4);
+  unsigned int i = 0;
+  if (iswritable(res)) {
+    for (; i < luaH_realasize(t); ++i) {
+      if (isempty(&t->array[i]))
+        continue;
+      lua_pushvalue(L, 2);
+      if (callwithkey)
+        lua_pushinteger(L, i + 1);
+      pushslot(L, &t->array[i]);
+      lua_call(L, callwithkey ? 2 : 1, 1);
+      if (i < luaH_realasize(res))
+        popslot(L, res, i);
+      else
+        lua_rawseti(L, 4, i + 1);
+      if (i >= luaH_realasize(t)) {
+        ++i;
+        break;  /* resized by the callback */
+      }
+    }
+  }
+
+  pushresumekey(L, i);
+  /* stack now: table, func, callwithkey, result, key */
+  while (lua_next(L, 1)) {
+    /* stack now: table, func, callwithkey, result, key, value */
     lua_pushvalue(L, 2);
     if (callwithkey) {
       lua_pushvalue(L, -3);
@@ -580,18 +963,16 @@ static int tmap (lua_State *L) {
       lua_pushvalue(L, -2);
       lua_call(L, 1, 1);
     }
-    /* stack now: table, key, value, mapped_value */
+    /* stack now: table, func, callwithkey, result, key, value, mapped_value */
     lua_pushvalue(L, -3);
     lua_pushvalue(L, -2);
-    /* stack now: table, key, value, mapped_value, key, mapped_value */
-    lua_settable(L, make_copy ? -7 : -6);
-    /* stack now: table, key, value, mapped_value */
+    /* stack now: table, func, callwithkey, result, key, value, mapped_value, key, mapped_value */
+    lua_settable(L, 4);
+    /* stack now: table, func, callwithkey, result, key, value, mapped_value */
     lua_pop(L, 2);
-    /* stack now: table, key */
+    /* stack now: table, func, callwithkey, result, key */
   }
-  /* stack now: table */
-  if (make_copy)
-    lua_pop(L, 1);
+  /* stack now: table, func, callwithkey, result */
   return 1;
 }
 
@@ -600,11 +981,31 @@ template <bool make_copy>
 static int treverse (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
 
-  if (make_copy) {
+  if (make_copy)
     lua_settop(L, 1);
-    lua_newtable(L);
-  }
   const lua_Unsigned l = lua_rawlen(L, 1);
+  Table *t = totable(L, 1);
+  if (l <= luaH_realasize(t) && (make_copy || iswritable(t))) {  /* entirely in the array part? */
+    if (make_copy) {
+      lua_createtable(L, (int)l, 0);
+      Table *res = totable(L, 2);
+      for (lua_Unsigned i = 0; i != l; ++i) {
+        setobj2t(L, &res->array[i], &t->array[l - 1 - i]);
+        luaC_barrierback(L, obj2gco(res), &res->array[i]);
+      }
+    }
+    else {
+      for (lua_Unsigned i = 0; i != l / 2; ++i) {
+        TValue tmp;
+        setobj(L, &tmp, &t->array[i]);
+        setobj(L, &t->array[i], &t->array[l - 1 - i]);
+        setobj(L, &t->array[l - 1 - i], &tmp);
+      }
+    }
+    return 1;
+  }
+  if (make_copy)
+    lua_newtable(L);
   for (lua_Unsigned i = 1; i <= l/2; ++i) {
     lua_pushinteger(L, l - i + 1);
     lua_pushinteger(L, i);
@@ -626,7 +1027,6 @@ static int treverse (lua_State *L) {
 }
 
 
-TValue *index2value (lua_State *L, int idx);
 template <bool make_copy>
 static int treorder (lua_State* L) {
   luaL_checktype(L, 1, LUA_TTABLE);
@@ -888,10 +1288,31 @@ static int tdeduplicated (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
   lua_settop(L, 1);
 
+  Table *t = totable(L, 1);
+  lua_createtable(L, (int)luaH_realasize(t), 0);  /* result */
+  lua_createtable(L, 0, (int)luaH_realasize(t) + (isdummy(t) ? 0 : (int)sizenode(t)));  /* set of seen values */
+  Table *res = totable(L, 2);
   lua_Integer i = 1;
-  lua_newtable(L);  /* result */
-  lua_newtable(L);  /* set of seen values */
-  lua_pushnil(L);
+  unsigned int j = 0;
+  for (; j < luaH_realasize(t); ++j) {
+    if (isempty(&t->array[j]))
+      continue;
+    pushslot(L, &t->array[j]);
+    if (lua_rawget(L, 3) == LUA_TNIL) {  /* value not seen before? */
+      pushslot(L, &t->array[j]);
+      lua_pushboolean(L, true);
+      lua_rawset(L, 3);
+      pushslot(L, &t->array[j]);
+      if ((lua_Unsigned)i <= luaH_realasize(res))
+        popslot(L, res, (unsigned int)(i - 1));
+      else
+        lua_rawseti(L, 2, i);
+      ++i;
+    }
+    lua_pop(L, 1);
+  }
+
+  pushresumekey(L, j);
   while (lua_next(L, 1)) {
     lua_pushvalue(L, 5);
     if (lua_gettable(L, 3) <= LUA_TNIL) {  /* value not seen before? */
@@ -1056,22 +1477,29 @@ static const luaL_Reg tab_funcs[] = {
   {"move", tmove},
   {"sort", sort<false>},
   {"sorted", sort<true>},
+  {"sortby", sortby<false>},
+  {"sortedby", sortby<true>},
   {"getn", getn},
   {NULL, NULL}
 };
 
 
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+const Pluto::StdlibChunk Pluto::stdlib_table_min{ nullptr, "return |t| -> table.reduce(t, math.min, math.maxinteger)" };
+const Pluto::StdlibChunk Pluto::stdlib_table_max{ nullptr, "return |t| -> table.reduce(t, math.max, math.mininteger)" };
+#endif
+
 LUAMOD_API int luaopen_table (lua_State *L) {
   luaL_newlib(L, tab_funcs);
 
 #ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
   lua_pushliteral(L, "min");
-  luaL_loadstring(L, "return |t| -> table.reduce(t, math.min, math.maxinteger)");
+  Pluto::loadStdlibChunk(L, Pluto::stdlib_table_min);
   lua_call(L, 0, 1);
   lua_settable(L, -3);
 
   lua_pushliteral(L, "max");
-  luaL_loadstring(L, "return |t| -> table.reduce(t, math.max, math.mininteger)");
+  Pluto::loadStdlibChunk(L, Pluto::stdlib_table_max);
   lua_call(L, 0, 1);
   lua_settable(L, -3);
 #endif
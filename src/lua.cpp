@@ -710,7 +710,9 @@ int main (int argc, char **argv) {
   _setmode(_fileno(stdout), O_BINARY);
 #endif
   int status, result;
-  lua_State *L = luaL_newstate();  /* create state */
+  const char *allocator = getenv("PLUTO_ALLOCATOR");  /* [Pluto] "slab" or "malloc" overrides the default */
+  lua_State *L = (allocator == NULL) ? luaL_newstate()
+               : luaL_newstatex(strcmp(allocator, "slab") == 0 ? LUAL_SLABALLOC : 0);  /* create state */
   if (L == NULL) {
     l_message(argv[0], "cannot create state: not enough memory");
     return EXIT_FAILURE;
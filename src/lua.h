@@ -124,6 +124,9 @@ typedef const char * (*lua_Reader) (lua_State *L, void *ud, size_t *sz);
 
 typedef int (*lua_Writer) (lua_State *L, const void *p, size_t sz, void *ud);
 
+/* [Pluto] frees a block given to 'lua_loadmapped' */
+typedef void (*lua_Release) (void *ud, const char *p, size_t sz);
+
 
 /*
 ** Type for memory-allocation functions
@@ -168,6 +171,7 @@ extern const char lua_ident[];
 */
 LUA_API lua_State *(lua_newstate) (lua_Alloc f, void *ud);
 LUA_API void       (lua_close) (lua_State *L);
+LUA_API lua_State *(lua_clonestate) (lua_State *L, lua_Alloc f, void *ud);
 LUA_API lua_State *(lua_newthread) (lua_State *L);
 LUA_API int        (lua_closethread) (lua_State *L, lua_State *from);
 LUA_API int        (lua_resetthread) (lua_State *L);  /* Deprecated! */
@@ -316,8 +320,16 @@ LUA_API int   (lua_pcallk) (lua_State *L, int nargs, int nresults, int errfunc,
 LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                           const char *chunkname, const char *mode);
 
+LUA_API int   (lua_loadmapped) (lua_State *L, const char *buff, size_t sz,
+                                const char *chunkname, const char *mode,
+                                lua_Release release, void *ud);
+
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data, int strip);
 
+#ifdef PLUTO_ETL_ENABLE
+LUA_API void (lua_setexecutionlimit) (lua_State *L, lua_Integer nanos);
+#endif
+
 
 /*
 ** coroutine functions
@@ -360,6 +372,25 @@ PLUTO_API void (pluto_warning) (lua_State *L, const char *msg);
 
 LUA_API int (lua_gc) (lua_State *L, int what, ...);
 
+/*
+** [Pluto] memory limit & accounting
+*/
+typedef struct lua_MemStats {
+  size_t total;  /* same as collectgarbage("count"), in bytes */
+  size_t strings;
+  size_t tables;
+  size_t functions;  /* closures, prototypes & upvalues */
+  size_t userdata;
+  size_t buffers;  /* contents of pluto:buffer objects */
+  size_t threads;  /* coroutine states, stacks & call frames */
+  size_t other;  /* everything else, e.g. the string table & parser */
+} lua_MemStats;
+
+LUA_API void   (lua_setmemorylimit) (lua_State *L, size_t limit);
+LUA_API int    (lua_trysetmemorylimit) (lua_State *L, size_t limit);
+LUA_API size_t (lua_getmemorylimit) (lua_State *L);
+LUA_API void   (lua_getmemstats) (lua_State *L, lua_MemStats *stats);
+
 
 /*
 ** miscellaneous functions
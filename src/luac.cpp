@@ -18,6 +18,10 @@
 #ifdef _WIN32
 #include <vector>
 #endif
+#ifdef PLUTO_PARSER_CACHE
+#include <filesystem>
+#include <string>
+#endif
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -28,6 +32,12 @@
 #include "lopnames.h"
 #include "lstate.h"
 #include "lundump.h"
+#include "lstdlibcode.hpp"
+#ifdef PLUTO_PARSER_CACHE
+#include "lcodecache.hpp"
+
+#include "vendor/Soup/soup/string.hpp"
+#endif
 
 static void PrintFunction(const Proto* f, int full);
 #define luaU_print	PrintFunction
@@ -39,9 +49,12 @@ static int listing=0;			/* list bytecodes? */
 static int dumping=1;			/* dump bytecodes? */
 static int stripping=0;			/* strip debug information? */
 static int compat=0;            /* [Pluto] compatibility mode? */
+static int indexed=0;			/* [Pluto] dump an indexed chunk? */
 static char Output[]={ OUTPUT };	/* default output file name */
 static const char* output=Output;	/* actual output file name */
 static const char* progname=PROGNAME;	/* actual program name */
+static const char* warm_dir=NULL;	/* [Pluto] directory to precompile into the parser cache */
+static int stdlib_header=0;		/* [Pluto] write lstdlibbytecode.h? */
 static TString **tmname;
 
 static void fatal(const char* message)
@@ -70,7 +83,10 @@ static void usage(const char* message)
   "  -p       parse only\n"
   "  -s       strip debug information\n"
   "  -v       show version information\n"
-  "  -c       enable compatibility mode"
+  "  -c       enable compatibility mode\n"
+  "  -i       output an indexed chunk, whose functions are loaded when first used\n"
+  "  --warm-cache dir  compile all .pluto & .lua files under 'dir' into the parser cache\n"
+  "  --stdlib-header   write the bytecode of the standard library code written in Pluto as a C header\n"
   "  --       stop handling options\n"
   "  -        stop handling options and process stdin\n"
   ,progname,Output);
@@ -111,8 +127,17 @@ static int doargs(int argc, char* argv[])
    stripping=1;
   else if (IS("-c"))			/* enable compatibility mode */
    compat=1;
+  else if (IS("-i"))			/* [Pluto] indexed chunk */
+   indexed=1;
   else if (IS("-v"))			/* show version */
    ++version;
+  else if (IS("--warm-cache"))		/* [Pluto] populate parser cache */
+  {
+   warm_dir=argv[++i];
+   if (warm_dir==NULL || *warm_dir==0) usage("'--warm-cache' needs argument");
+  }
+  else if (IS("--stdlib-header"))	/* [Pluto] build step for lstdlibcode.cpp */
+   stdlib_header=1;
   else					/* unknown option */
    usage(argv[i]);
  }
@@ -176,6 +201,49 @@ static int writer(lua_State* L, const void* p, size_t size, void* u)
  return (fwrite(p,size,1,(FILE*)u)!=1) && (size!=0);
 }
 
+/*
+** [Pluto] loads every source file under 'warm_dir' so that luaL_loadfilex
+** stores its bytecode in the parser cache
+*/
+static int warmcache(lua_State* L)
+{
+#ifdef PLUTO_PARSER_CACHE
+ namespace fs = std::filesystem;
+ if (!Pluto::CodeCache::usable())
+  fatal("cannot use the parser cache directory (it must not be writable by other users)");
+ std::error_code ec;
+ size_t compiled=0, failed=0;
+ for (fs::recursive_directory_iterator it(fs::u8path(warm_dir),ec), end; !ec && it!=end; it.increment(ec))
+ {
+  std::error_code fec;
+  const fs::path ext=it->path().extension();
+  if ((ext!=".pluto" && ext!=".lua") || !it->is_regular_file(fec)) continue;
+  const std::string path=soup::string::fixType(it->path().u8string());
+  if (luaL_loadfile(L,path.c_str())==LUA_OK)
+   ++compiled;
+  else
+  {
+   fprintf(stderr,"%s: %s\n",progname,lua_tostring(L,-1));
+   ++failed;
+  }
+  lua_pop(L,1);
+ }
+ if (ec)
+ {
+  fprintf(stderr,"%s: cannot read %s: %s\n",progname,warm_dir,ec.message().c_str());
+  exit(EXIT_FAILURE);
+ }
+ printf("%zu files cached in %s",compiled,Pluto::CodeCache::directory().c_str());
+ if (failed) printf(", %zu failed",failed);
+ printf("\n");
+ if (failed) exit(EXIT_FAILURE);
+#else
+ UNUSED(L);
+ fatal("'--warm-cache' requires a build with PLUTO_PARSER_CACHE defined");
+#endif
+ return 0;
+}
+
 static int pmain(lua_State* L)
 {
  int argc=(int)lua_tointeger(L,1);
@@ -187,10 +255,21 @@ static int pmain(lua_State* L)
  if (compat) {
    L->l_G->setCompatibilityMode(compat);
  }
+ if (warm_dir) return warmcache(L);
+ if (stdlib_header)
+ {
+  FILE* D= (output==Output || output==NULL) ? stdout : luaL_fopen(output,strlen(output),"w",sizeof("w")-sizeof(""));
+  if (D==NULL) cannot("open");
+  Pluto::writeStdlibHeader(L,D);
+  if (ferror(D)) cannot("write");
+  if (D!=stdout && fclose(D)) cannot("close");
+  return 0;
+ }
  for (i=0; i<argc; i++)
  {
   const char* filename=IS("-") ? NULL : argv[i];
   if (luaL_loadfile(L,filename)!=LUA_OK) fatal(lua_tostring(L,-1));
+  luaU_loadall(L,toproto(L,-1),1);	/* [Pluto] in case it is an indexed chunk */
  }
  f=combine(L,argc);
  if (listing) luaU_print(f,listing>1);
@@ -199,7 +278,7 @@ static int pmain(lua_State* L)
   FILE* D= (output==NULL) ? stdout : luaL_fopen(output,strlen(output),"wb",sizeof("wb")-sizeof(""));
   if (D==NULL) cannot("open");
   lua_lock(L);
-  luaU_dump(L,f,writer,D,stripping);
+  luaU_dump(L,f,writer,D,stripping,indexed);
   lua_unlock(L);
   if (ferror(D)) cannot("write");
   if (fclose(D)) cannot("close");
@@ -221,7 +300,7 @@ int main (int argc, char **argv) {
  lua_State* L;
  int i=doargs(argc,argv);
  argc-=i; argv+=i;
- if (argc<=0) usage("no input files given");
+ if (argc<=0 && warm_dir==NULL && !stdlib_header) usage("no input files given");
  L=luaL_newstate();
  if (L==NULL) fatal("cannot create state: not enough memory");
  lua_pushcfunction(L,&pmain);
@@ -667,6 +746,9 @@ static void PrintCode(const Proto* f)
     printf(COMMENT "substr/table search (if %d contains %d)", b, a);
     break;
    }
+   case OP_TESTRANGE:
+    printf("%d %d",a,isk);
+    break;
    case OP_TFORCALL:
     printf("%d %d",a,c);
     break;
@@ -836,9 +836,17 @@
 
 // If defined, Pluto will cache the bytecode of text files that parsed without warnings or errors,
 // and if the contents remained unchanged, it'll load the bytecode instead of reparsing the file.
-// The worst-case scenario for this optimization is small files and files that change often,
-// but even then, the overhead should be at most 1ms on modern systems.
+// Unchanged files are recognised by their size & modification time, so a cache hit costs no more than opening the file.
+// The cache lives in $PLUTO_CACHE_DIR, PLUTO_PARSER_CACHE_DIR if defined, or "pluto-cache-<uid>" in the temp directory,
+// which is only used if no other user (besides root) can write to it,
+// and the least recently used entries are evicted once it exceeds PLUTO_PARSER_CACHE_SIZE bytes (default: 64 MiB).
+// 'plutoc --warm-cache <dir>' can be used to populate the cache ahead of time.
+// Entries are keyed by the Pluto version, the compiler and the configuration that affects code generation;
+// builds that change code generation otherwise (e.g. patched sources) should set PLUTO_PARSER_CACHE_BUILD_ID to a unique string.
 //#define PLUTO_PARSER_CACHE
+//#define PLUTO_PARSER_CACHE_DIR "/var/cache/pluto"
+//#define PLUTO_PARSER_CACHE_SIZE (64 * 1024 * 1024)
+//#define PLUTO_PARSER_CACHE_BUILD_ID "my-build-1"
 
 /*
 ** {====================================================================
@@ -987,12 +995,20 @@
 
 #ifdef PLUTO_ETL_ENABLE
 /*
-** This is the maximum amount of nanoseconds the VM is allowed to run.
+** This is the maximum amount of nanoseconds the VM is allowed to run, counted from the creation of the state.
+** It can be changed at runtime via lua_setexecutionlimit. If 0, new states have no limit.
 */
 #ifndef PLUTO_ETL_NANOS
 #define PLUTO_ETL_NANOS			1'000'000 /* 1ms */
 #endif
 
+/*
+** The VM checks the limit at backward jumps, calls & returns, but only reads the clock every this many checks.
+*/
+#ifndef PLUTO_ETL_INTERVAL
+#define PLUTO_ETL_INTERVAL		1024
+#endif
+
 /*
 ** This can be used to execute custom code when the time limit is exceeded and
 ** the VM is about to be terminated.
@@ -1006,12 +1022,19 @@
 ** {====================================================================
 ** Pluto Configuration: Memory Limit
 **
-** For sandbox environments. This changes the memory allocator in luaL_newstate.
+** For sandbox environments. This sets the initial memory limit of states created by luaL_newstate.
+** The limit can also be changed at runtime via lua_setmemorylimit. Scripts can use collectgarbage("limit", bytes),
+** but only to lower it or to raise it back up to the limit set by the host.
 ** =====================================================================}
 */
 
 //#define PLUTO_MEMORY_LIMIT 64'000'000 /* 64 MB (megabytes, not mebibytes!) */
 
+// If defined, luaL_newstate will use a size-class slab allocator for small objects instead of malloc.
+// This speeds up scripts that allocate many small tables & strings, at the cost of keeping up to 1 MiB of empty pages around.
+// Either allocator can also be chosen per state via luaL_newstatex.
+//#define PLUTO_USE_SLAB_ALLOCATOR
+
 /*
 ** {====================================================================
 ** Pluto Configuration: VM Dump
@@ -1119,6 +1142,12 @@
 // If it returns false, a Lua error is raised.
 //#define PLUTO_FFI_CALL_HOOK ContmodOnFfiCall
 
+// The number of FFI callbacks (see ffi.callback) that can exist at the same time, across all states.
+// Every callback is backed by a precompiled thunk, so this also determines the code size of the FFI library.
+#ifndef PLUTO_FFI_MAX_CALLBACKS
+#define PLUTO_FFI_MAX_CALLBACKS 64
+#endif
+
 /*
 ** {====================================================================
 ** Pluto color macros.
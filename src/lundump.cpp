@@ -13,6 +13,9 @@
 #include <limits.h>
 #include <string.h>
 
+#include <atomic>
+#include <new>
+
 #include "lua.h"
 
 #include "ldebug.h"
@@ -30,10 +33,27 @@
 #endif
 
 
+/*
+** [Pluto] The functions of an indexed chunk, which its prototypes keep alive
+** while they still have parts to load from it. It is not tied to the state
+** that loaded it, since states cloned by 'lua_clonestate' share it.
+*/
+struct LazyChunk {
+  std::atomic<size_t> refs;
+  const char *data;
+  size_t size;
+  lua_Release release;  /* frees 'buff'; NULL if 'data' was copied with 'new[]' */
+  void *ud;
+  const char *buff;
+  size_t buffsize;
+};
+
+
 typedef struct {
   lua_State *L;
   ZIO *Z;
   const char *name;
+  LazyChunk *chunk;  /* [Pluto] chunk being loaded from, if it is indexed */
 } LoadState;
 
 
@@ -58,6 +78,20 @@ static void loadBlock (LoadState *S, void *b, size_t size) {
 #define loadVar(S,x)		loadVector(S,&x,1)
 
 
+/*
+** [Pluto] An indexed chunk is read from memory, so skipping a block or
+** telling the offset of the next one doesn't need to read anything.
+*/
+static size_t skipBlock (LoadState *S, size_t size) {
+  size_t offset = S->Z->p - S->chunk->data;
+  if (S->Z->n < size)
+    error(S, "truncated chunk");
+  S->Z->p += size;
+  S->Z->n -= size;
+  return offset;
+}
+
+
 static lu_byte loadByte (LoadState *S) {
   int b = zgetc(S->Z);
   if (b == EOZ)
@@ -272,6 +306,49 @@ static void loadFunction (LoadState *S, Proto *f, TString *psource) {
 }
 
 
+/*
+** [Pluto] Nested functions of an indexed chunk are created as stubs that only
+** know where their body is; see 'luaU_loadbody'.
+*/
+static void loadStubs (LoadState *S, Proto *f) {
+  int i;
+  int n = loadInt(S);
+  f->p = luaM_newvectorchecked(S->L, n, Proto *);
+  f->sizep = n;
+  for (i = 0; i < n; i++)
+    f->p[i] = NULL;
+  for (i = 0; i < n; i++) {
+    size_t size = loadSize(S);
+    Proto *stub = luaF_newproto(S->L);
+    f->p[i] = stub;
+    luaC_objbarrier(S->L, f, stub);
+    stub->source = f->source;  /* unless its body says otherwise */
+    stub->lazy = S->chunk;
+    luaU_chunkref(S->chunk);
+    stub->lazybody = skipBlock(S, size);
+  }
+}
+
+
+static void loadIndexedFunction (LoadState *S, Proto *f) {
+  TString *source = loadStringN(S, f);
+  if (source != NULL)  /* not the same source as its parent? */
+    f->source = source;
+  f->linedefined = loadInt(S);
+  f->lastlinedefined = loadInt(S);
+  f->numparams = loadByte(S);
+  f->is_vararg = loadByte(S);
+  f->maxstacksize = loadByte(S);
+  loadCode(S, f);
+  loadConstants(S, f);
+  loadUpvalues(S, f);
+  loadStubs(S, f);
+  size_t size = loadSize(S);
+  if (size != 0)  /* has debug information? */
+    f->lazydebug = skipBlock(S, size);
+}
+
+
 static void checkliteral (LoadState *S, const char *s, const char *msg) {
   char buff[sizeof(LUA_SIGNATURE) + sizeof(LUAC_DATA)]; /* larger than both */
   size_t len = strlen(s);
@@ -289,7 +366,8 @@ static void fchecksize (LoadState *S, size_t size, const char *tname) {
 
 #define checksize(S,t)	fchecksize(S,sizeof(t),#t)
 
-static void checkHeader (LoadState *S) {
+/* returns whether the chunk is indexed */
+static bool checkHeader (LoadState *S) {
   /* skip 1st char (already read and checked) */
   checkliteral(S, &LUA_SIGNATURE[1], "not a binary chunk");
   auto version = loadByte(S);
@@ -298,7 +376,7 @@ static void checkHeader (LoadState *S) {
     if (version != LUAC_VERSION)
      error(S, "version mismatch");
   }
-  else if (format == 'P') {
+  else if (format == 'P' || format == LUAC_FORMAT_INDEXED) {
     if (version > 0)
       error(S, "version mismatch");
   }
@@ -312,32 +390,243 @@ static void checkHeader (LoadState *S) {
     error(S, "integer format mismatch");
   if (loadNumber(S) != LUAC_NUM)
     error(S, "float format mismatch");
+  return format == LUAC_FORMAT_INDEXED;
+}
+
+
+static const char *chunkname (const char *name) {
+  if (*name == '@' || *name == '=')
+    return name + 1;
+  else if (*name == LUA_SIGNATURE[0])
+    return "binary string";
+  else
+    return name;
+}
+
+
+/*
+** [Pluto] Takes the functions of an indexed chunk from 'mapping' if the
+** whole chunk is there, else copies them, since they must outlive 'Z'.
+*/
+static LazyChunk *newChunk (LoadState *S, size_t size, LoadMapping *mapping) {
+  LazyChunk *c = new (std::nothrow) LazyChunk;
+  if (c == NULL)
+    luaD_throw(S->L, LUA_ERRMEM);
+  c->refs = 1;
+  if (mapping && S->Z->p >= mapping->buff && S->Z->p + S->Z->n == mapping->buff + mapping->size) {
+    if (S->Z->n < size) {
+      delete c;
+      error(S, "truncated chunk");
+    }
+    c->data = S->Z->p;
+    c->release = mapping->release;
+    c->ud = mapping->ud;
+    c->buff = mapping->buff;
+    c->buffsize = mapping->size;
+    mapping->taken = true;
+    S->Z->p += size;
+    S->Z->n -= size;
+  }
+  else {
+    char *data = new (std::nothrow) char[size];
+    if (data == NULL) {
+      delete c;
+      luaD_throw(S->L, LUA_ERRMEM);
+    }
+    if (luaZ_read(S->Z, data, size) != 0) {
+      delete[] data;
+      delete c;
+      error(S, "truncated chunk");
+    }
+    c->data = data;
+    c->release = NULL;
+  }
+  c->size = size;
+  return c;
+}
+
+
+static const char *noreader (lua_State *L, void *ud, size_t *size) {
+  UNUSED(L); UNUSED(ud); UNUSED(size);
+  return NULL;
+}
+
+
+/* [Pluto] prepares to load the part of 'f' at 'offset' of its indexed chunk */
+static void openLazy (LoadState *S, ZIO *Z, lua_State *L, Proto *f, size_t offset) {
+  S->L = L;
+  S->Z = Z;
+  S->name = f->source ? chunkname(getstr(f->source)) : "?";
+  S->chunk = f->lazy;
+  luaZ_init(L, Z, noreader, NULL);
+  Z->p = f->lazy->data + offset;
+  Z->n = f->lazy->size - offset;
+}
+
+
+/* [Pluto] drops the reference to the indexed chunk once nothing is left to load from it */
+static void doneLoading (Proto *f) {
+  if (f->lazybody == 0 && f->lazydebug == 0) {
+    LazyChunk *c = f->lazy;
+    f->lazy = NULL;
+    luaU_chunkunref(c);
+  }
 }
 
 
 /*
 ** Load precompiled chunk.
 */
-LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name) {
+LClosure *luaU_undump(lua_State *L, ZIO *Z, const char *name,
+                      LoadMapping *mapping) {
   LoadState S;
   LClosure *cl;
-  if (*name == '@' || *name == '=')
-    S.name = name + 1;
-  else if (*name == LUA_SIGNATURE[0])
-    S.name = "binary string";
-  else
-    S.name = name;
+  S.name = chunkname(name);
   S.L = L;
   S.Z = Z;
-  checkHeader(&S);
+  S.chunk = NULL;
+  bool indexed = checkHeader(&S);
   cl = luaF_newLclosure(L, loadByte(&S));
   setclLvalue2s(L, L->top.p, cl);
   luaD_inctop(L);
   cl->p = luaF_newproto(L);
   luaC_objbarrier(L, cl, cl->p);
-  loadFunction(&S, cl->p, NULL);
+  if (indexed) {  /* [Pluto] load only the main function, and the rest when needed */
+    size_t size = loadSize(&S);
+    cl->p->lazy = newChunk(&S, size, mapping);  /* owned by the prototype from now on */
+    ZIO z;
+    openLazy(&S, &z, L, cl->p, 0);
+    S.name = chunkname(name);
+    loadIndexedFunction(&S, cl->p);
+    doneLoading(cl->p);
+  }
+  else
+    loadFunction(&S, cl->p, NULL);
   lua_assert(cl->nupvalues == cl->p->sizeupvalues);
   luai_verifycode(L, cl->p);
   return cl;
 }
 
+
+
+/*
+** {======================================================
+** [Pluto] Lazy loading from indexed chunks
+** =======================================================
+*/
+
+void luaU_chunkref (LazyChunk *c) {
+  c->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void luaU_chunkunref (LazyChunk *c) {
+  if (c->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    if (c->release)
+      c->release(c->ud, c->buff, c->buffsize);
+    else
+      delete[] c->data;
+    delete c;
+  }
+}
+
+
+static void f_loadbody (lua_State *L, void *ud) {
+  Proto *f = static_cast<Proto *>(ud);
+  LoadState S;
+  ZIO z;
+  openLazy(&S, &z, L, f, f->lazybody);
+  loadIndexedFunction(&S, f);
+}
+
+
+/* frees what a failed load of a body allocated, so it stays a stub */
+static void discardBody (lua_State *L, Proto *f) {
+  luaM_freearray(L, f->code, f->sizecode);
+  f->code = NULL;
+  f->sizecode = 0;
+  luaM_freearray(L, f->k, f->sizek);
+  f->k = NULL;
+  f->sizek = 0;
+  luaM_freearray(L, f->upvalues, f->sizeupvalues);
+  f->upvalues = NULL;
+  f->sizeupvalues = 0;
+  luaM_freearray(L, f->p, f->sizep);  /* its stubs are collected */
+  f->p = NULL;
+  f->sizep = 0;
+  f->lazydebug = 0;
+}
+
+
+/*
+** Loads the body of a function that was created as a stub; called when a
+** closure is first created for it. Its nested functions become stubs.
+*/
+void luaU_loadbody (lua_State *L, Proto *f) {
+  int status = luaD_rawrunprotected(L, f_loadbody, f);
+  if (l_unlikely(status != LUA_OK)) {
+    discardBody(L, f);
+    if (status == LUA_ERRMEM)
+      luaD_throw(L, LUA_ERRMEM);
+    luaG_errormsg(L);  /* raise the "bad binary format" message as a runtime error */
+  }
+  f->lazybody = 0;
+  doneLoading(f);
+}
+
+
+static void f_loaddebug (lua_State *L, void *ud) {
+  Proto *f = static_cast<Proto *>(ud);
+  LoadState S;
+  ZIO z;
+  openLazy(&S, &z, L, f, f->lazydebug);
+  loadDebug(&S, f);
+}
+
+
+static void discardDebug (lua_State *L, Proto *f) {
+  luaM_freearray(L, f->lineinfo, f->sizelineinfo);
+  f->lineinfo = NULL;
+  f->sizelineinfo = 0;
+  luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
+  f->abslineinfo = NULL;
+  f->sizeabslineinfo = 0;
+  luaM_freearray(L, f->locvars, f->sizelocvars);
+  f->locvars = NULL;
+  f->sizelocvars = 0;
+  for (int i = 0; i < f->sizeupvalues; i++)
+    f->upvalues[i].name = NULL;
+}
+
+
+/*
+** Loads the debug information of a function; called by the debug interface
+** when it first needs it. As it is used while building error messages, a
+** malformed block leaves the function without debug information instead of
+** raising an error.
+*/
+void luaU_loaddebug (lua_State *L, Proto *f) {
+  lua_assert(f->lazybody == 0);
+  int status = luaD_rawrunprotected(L, f_loaddebug, f);
+  if (l_unlikely(status != LUA_OK)) {
+    discardDebug(L, f);
+    if (status == LUA_ERRMEM)
+      luaD_throw(L, LUA_ERRMEM);  /* may succeed later */
+    L->top.p--;  /* remove error message */
+  }
+  f->lazydebug = 0;
+  doneLoading(f);
+}
+
+
+/* Loads everything that is still to be loaded for 'f' and its nested functions, e.g. to dump it. */
+void luaU_loadall (lua_State *L, Proto *f, int debug) {
+  if (f->lazybody)
+    luaU_loadbody(L, f);
+  if (debug && f->lazydebug)
+    luaU_loaddebug(L, f);
+  for (int i = 0; i < f->sizep; i++)
+    luaU_loadall(L, f->p[i], debug);
+}
+
+/* }====================================================== */
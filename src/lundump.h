@@ -24,9 +24,36 @@
 
 #define LUAC_FORMAT	0	/* this is the official format */
 
+/*
+** [Pluto] format of indexed chunks, in which every nested function and the
+** debug information of every function is prefixed with its size, so that
+** they can be loaded when they are first needed instead of with the chunk
+*/
+#define LUAC_FORMAT_INDEXED	'I'
+
+/* [Pluto] memory that 'luaU_undump' may keep instead of copying; see 'lua_loadmapped' */
+struct LoadMapping {
+  const char *buff;
+  size_t size;
+  lua_Release release;
+  void *ud;
+  bool taken;  /* does an indexed chunk own it now? */
+};
+
 /* load one chunk; from lundump.c */
-LUAI_FUNC LClosure* luaU_undump (lua_State* L, ZIO* Z, const char* name);
+LUAI_FUNC LClosure* luaU_undump (lua_State* L, ZIO* Z, const char* name,
+                                 LoadMapping* mapping = NULL);
+
+/* [Pluto] load the parts of a function from an indexed chunk that were not needed yet */
+LUAI_FUNC void luaU_loadbody (lua_State *L, Proto *f);
+LUAI_FUNC void luaU_loaddebug (lua_State *L, Proto *f);
+LUAI_FUNC void luaU_loadall (lua_State *L, Proto *f, int debug);
+LUAI_FUNC void luaU_chunkref (LazyChunk *c);
+LUAI_FUNC void luaU_chunkunref (LazyChunk *c);
+
+#define luaU_checkdebug(L,f) \
+	{ if (l_unlikely((f)->lazydebug != 0)) luaU_loaddebug(L, cast(Proto *, f)); }
 
 /* dump one chunk; from ldump.c */
 LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w,
-                         void* data, int strip);
+                         void* data, int strip, bool indexed = false);
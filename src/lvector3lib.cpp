@@ -1,17 +1,13 @@
-#include <cstring>
-
 #define LUA_LIB
 #include "lualib.h"
+#include "lstdlibcode.hpp"
 
 static const luaL_Reg funcs_vector3[] = {
   {nullptr, nullptr}
 };
 
-LUAMOD_API int luaopen_vector3(lua_State* L) {
-#ifdef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
-    return 0;
-#else
-    const auto code = R"EOC(pluto_use "0.6.0"
+#ifndef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+const Pluto::StdlibChunk Pluto::stdlib_vector3{ "pluto:vector3", R"EOC(pluto_use "0.6.0"
 
 local vector3
  class vector3
@@ -200,8 +196,14 @@ setmetatable(vector3, {
   end
 })
 
-return vector3)EOC";
-    luaL_loadbuffer(L, code, strlen(code), "pluto:vector3");
+return vector3)EOC" };
+#endif
+
+LUAMOD_API int luaopen_vector3(lua_State* L) {
+#ifdef PLUTO_DONT_LOAD_ANY_STANDARD_LIBRARY_CODE_WRITTEN_IN_PLUTO
+    return 0;
+#else
+    Pluto::loadStdlibChunk(L, Pluto::stdlib_vector3);
     lua_call(L, 0, 1);
     return 1;
 #endif
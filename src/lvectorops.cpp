@@ -0,0 +1,216 @@
+#include "lvectorops.hpp"
+
+#include "vendor/Soup/soup/base.hpp"
+
+#define VECTOROPS_X86 (SOUP_X86 && SOUP_BITS == 64)
+
+#if VECTOROPS_X86
+#include "vendor/Soup/soup/CpuInfo.hpp"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+#endif
+
+namespace Pluto {
+  /* Independent accumulators per loop; enough to fill two AVX2 registers of doubles. */
+  static constexpr size_t LANES = 8;
+
+  /* Integer math is done on unsigned types of at least 32 bits, so it wraps instead of overflowing. */
+  template <typename T, bool = std::is_floating_point_v<T>>
+  struct WideOf { using type = T; };
+
+  template <typename T>
+  struct WideOf<T, false> { using type = std::conditional_t<(sizeof(T) < sizeof(uint32_t)), uint32_t, std::make_unsigned_t<T>>; };
+
+  template <typename T>
+  using Wide = typename WideOf<T>::type;
+
+  template <typename T>
+  [[nodiscard]] SOUP_FORCEINLINE VectorOps::Accum<T> widen(T x) noexcept {
+    if constexpr (std::is_floating_point_v<T>)
+      return x;
+    else
+      return static_cast<uint64_t>(static_cast<std::conditional_t<std::is_signed_v<T>, int64_t, uint64_t>>(x));
+  }
+
+  template <typename T>
+  [[nodiscard]] SOUP_FORCEINLINE VectorOps::Accum<T> sumImpl(const T *p, size_t n) noexcept {
+    VectorOps::Accum<T> acc[LANES] = {};
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES)
+      for (size_t l = 0; l != LANES; ++l)
+        acc[l] += widen(p[i + l]);
+    for (; i != n; ++i)
+      acc[0] += widen(p[i]);
+    for (size_t l = 1; l != LANES; ++l)
+      acc[0] += acc[l];
+    return acc[0];
+  }
+
+  template <typename T>
+  [[nodiscard]] SOUP_FORCEINLINE VectorOps::Accum<T> dotImpl(const T *a, const T *b, size_t n) noexcept {
+    VectorOps::Accum<T> acc[LANES] = {};
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES)
+      for (size_t l = 0; l != LANES; ++l)
+        acc[l] += widen(a[i + l]) * widen(b[i + l]);
+    for (; i != n; ++i)
+      acc[0] += widen(a[i]) * widen(b[i]);
+    for (size_t l = 1; l != LANES; ++l)
+      acc[0] += acc[l];
+    return acc[0];
+  }
+
+  template <bool MAX, typename T>
+  [[nodiscard]] SOUP_FORCEINLINE T extremeImpl(const T *p, size_t n) noexcept {
+    T m[LANES];
+    for (size_t l = 0; l != LANES; ++l)
+      m[l] = p[0];
+    size_t i = 0;
+    for (; i + LANES <= n; i += LANES)
+      for (size_t l = 0; l != LANES; ++l)
+        m[l] = (MAX ? p[i + l] > m[l] : p[i + l] < m[l]) ? p[i + l] : m[l];
+    for (; i != n; ++i)
+      m[0] = (MAX ? p[i] > m[0] : p[i] < m[0]) ? p[i] : m[0];
+    for (size_t l = 1; l != LANES; ++l)
+      m[0] = (MAX ? m[l] > m[0] : m[l] < m[0]) ? m[l] : m[0];
+    return m[0];
+  }
+
+  template <typename T>
+  SOUP_FORCEINLINE void scaleImpl(T *p, size_t n, T k) noexcept {
+    for (size_t i = 0; i != n; ++i)
+      p[i] = static_cast<T>(static_cast<Wide<T>>(p[i]) * static_cast<Wide<T>>(k));
+  }
+
+  template <typename T>
+  SOUP_FORCEINLINE void addImpl(T *dst, const T *src, size_t n) noexcept {
+    for (size_t i = 0; i != n; ++i)
+      dst[i] = static_cast<T>(static_cast<Wide<T>>(dst[i]) + static_cast<Wide<T>>(src[i]));
+  }
+
+  template <typename T>
+  SOUP_FORCEINLINE void addScalarImpl(T *p, size_t n, T k) noexcept {
+    for (size_t i = 0; i != n; ++i)
+      p[i] = static_cast<T>(static_cast<Wide<T>>(p[i]) + static_cast<Wide<T>>(k));
+  }
+
+  template <VectorOps::Cmp OP, typename T>
+  [[nodiscard]] SOUP_FORCEINLINE bool compare(T x, T v) noexcept {
+    if constexpr (OP == VectorOps::LT) return x < v;
+    if constexpr (OP == VectorOps::LE) return x <= v;
+    if constexpr (OP == VectorOps::GT) return x > v;
+    if constexpr (OP == VectorOps::GE) return x >= v;
+    if constexpr (OP == VectorOps::EQ) return x == v;
+    return x != v;
+  }
+
+  template <VectorOps::Cmp OP, typename T>
+  [[nodiscard]] SOUP_FORCEINLINE size_t filterOp(const T *p, size_t n, T v, T *out) noexcept {
+    size_t count = 0;
+    if (out == nullptr) {
+      for (size_t i = 0; i != n; ++i)
+        count += compare<OP>(p[i], v);
+    }
+    else {
+      for (size_t i = 0; i != n; ++i) {
+        out[count] = p[i];
+        count += compare<OP>(p[i], v);
+      }
+    }
+    return count;
+  }
+
+  template <typename T>
+  [[nodiscard]] SOUP_FORCEINLINE size_t filterImpl(const T *p, size_t n, VectorOps::Cmp op, T v, T *out) noexcept {
+    switch (op) {
+      case VectorOps::LT: return filterOp<VectorOps::LT>(p, n, v, out);
+      case VectorOps::LE: return filterOp<VectorOps::LE>(p, n, v, out);
+      case VectorOps::GT: return filterOp<VectorOps::GT>(p, n, v, out);
+      case VectorOps::GE: return filterOp<VectorOps::GE>(p, n, v, out);
+      case VectorOps::EQ: return filterOp<VectorOps::EQ>(p, n, v, out);
+      case VectorOps::NE: break;
+    }
+    return filterOp<VectorOps::NE>(p, n, v, out);
+  }
+
+#if VECTOROPS_X86
+  /* The same loops, compiled for AVX2. */
+  template <typename T> TARGET_AVX2 static VectorOps::Accum<T> sumAvx2(const T *p, size_t n) noexcept { return sumImpl(p, n); }
+  template <typename T> TARGET_AVX2 static VectorOps::Accum<T> dotAvx2(const T *a, const T *b, size_t n) noexcept { return dotImpl(a, b, n); }
+  template <bool MAX, typename T> TARGET_AVX2 static T extremeAvx2(const T *p, size_t n) noexcept { return extremeImpl<MAX>(p, n); }
+  template <typename T> TARGET_AVX2 static void scaleAvx2(T *p, size_t n, T k) noexcept { scaleImpl(p, n, k); }
+  template <typename T> TARGET_AVX2 static void addAvx2(T *dst, const T *src, size_t n) noexcept { addImpl(dst, src, n); }
+  template <typename T> TARGET_AVX2 static void addScalarAvx2(T *p, size_t n, T k) noexcept { addScalarImpl(p, n, k); }
+  template <typename T> TARGET_AVX2 static size_t filterAvx2(const T *p, size_t n, VectorOps::Cmp op, T v, T *out) noexcept { return filterImpl(p, n, op, v, out); }
+
+  static const bool use_avx2 = soup::CpuInfo::get().supportsAVX2();
+#define VECTOROPS_DISPATCH(avx2, portable) if (use_avx2) return avx2; return portable;
+#else
+#define VECTOROPS_DISPATCH(avx2, portable) return portable;
+#endif
+
+  const char *VectorOps::backend() noexcept {
+#if VECTOROPS_X86
+    if (use_avx2)
+      return "avx2";
+#endif
+    return "portable";
+  }
+
+  template <typename T> VectorOps::Accum<T> VectorOps::sum(const T *p, size_t n) noexcept {
+    VECTOROPS_DISPATCH(sumAvx2(p, n), sumImpl(p, n))
+  }
+
+  template <typename T> VectorOps::Accum<T> VectorOps::dot(const T *a, const T *b, size_t n) noexcept {
+    VECTOROPS_DISPATCH(dotAvx2(a, b, n), dotImpl(a, b, n))
+  }
+
+  template <typename T> T VectorOps::min(const T *p, size_t n) noexcept {
+    VECTOROPS_DISPATCH(extremeAvx2<false>(p, n), extremeImpl<false>(p, n))
+  }
+
+  template <typename T> T VectorOps::max(const T *p, size_t n) noexcept {
+    VECTOROPS_DISPATCH(extremeAvx2<true>(p, n), extremeImpl<true>(p, n))
+  }
+
+  template <typename T> void VectorOps::scale(T *p, size_t n, T k) noexcept {
+    VECTOROPS_DISPATCH(scaleAvx2(p, n, k), scaleImpl(p, n, k))
+  }
+
+  template <typename T> void VectorOps::add(T *dst, const T *src, size_t n) noexcept {
+    VECTOROPS_DISPATCH(addAvx2(dst, src, n), addImpl(dst, src, n))
+  }
+
+  template <typename T> void VectorOps::addScalar(T *p, size_t n, T k) noexcept {
+    VECTOROPS_DISPATCH(addScalarAvx2(p, n, k), addScalarImpl(p, n, k))
+  }
+
+  template <typename T> size_t VectorOps::filter(const T *p, size_t n, Cmp op, T v, T *out) noexcept {
+    VECTOROPS_DISPATCH(filterAvx2(p, n, op, v, out), filterImpl(p, n, op, v, out))
+  }
+
+#define VECTOROPS_INSTANTIATE(T) \
+  template VectorOps::Accum<T> VectorOps::sum<T>(const T*, size_t) noexcept; \
+  template VectorOps::Accum<T> VectorOps::dot<T>(const T*, const T*, size_t) noexcept; \
+  template T VectorOps::min<T>(const T*, size_t) noexcept; \
+  template T VectorOps::max<T>(const T*, size_t) noexcept; \
+  template void VectorOps::scale<T>(T*, size_t, T) noexcept; \
+  template void VectorOps::add<T>(T*, const T*, size_t) noexcept; \
+  template void VectorOps::addScalar<T>(T*, size_t, T) noexcept; \
+  template size_t VectorOps::filter<T>(const T*, size_t, Cmp, T, T*) noexcept;
+
+  VECTOROPS_INSTANTIATE(int8_t)
+  VECTOROPS_INSTANTIATE(int16_t)
+  VECTOROPS_INSTANTIATE(int32_t)
+  VECTOROPS_INSTANTIATE(int64_t)
+  VECTOROPS_INSTANTIATE(uint8_t)
+  VECTOROPS_INSTANTIATE(uint16_t)
+  VECTOROPS_INSTANTIATE(uint32_t)
+  VECTOROPS_INSTANTIATE(uint64_t)
+  VECTOROPS_INSTANTIATE(float)
+  VECTOROPS_INSTANTIATE(double)
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+/*
+** Bulk kernels over contiguous numeric arrays, backing the typed arrays of
+** the 'ffi' library. The loops keep several independent accumulators, so
+** compilers vectorise them without having to reassociate floating-point
+** math. On x86-64, they're additionally compiled for AVX2, which is used if
+** the CPU supports it.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace Pluto {
+  struct VectorOps {
+    enum Cmp : uint8_t { LT, LE, GT, GE, EQ, NE };
+
+    /* Sums & dot products of integers wrap around; those of floats are accumulated as doubles. */
+    template <typename T>
+    using Accum = std::conditional_t<std::is_floating_point_v<T>, double, uint64_t>;
+
+    /* Names the instruction set the kernels run with. */
+    [[nodiscard]] static const char *backend() noexcept;
+
+    template <typename T> [[nodiscard]] static Accum<T> sum(const T *p, size_t n) noexcept;
+    template <typename T> [[nodiscard]] static Accum<T> dot(const T *a, const T *b, size_t n) noexcept;
+
+    /* 'n' must not be 0. */
+    template <typename T> [[nodiscard]] static T min(const T *p, size_t n) noexcept;
+    template <typename T> [[nodiscard]] static T max(const T *p, size_t n) noexcept;
+
+    /* Integer results wrap around. */
+    template <typename T> static void scale(T *p, size_t n, T k) noexcept;
+    template <typename T> static void add(T *dst, const T *src, size_t n) noexcept;
+    template <typename T> static void addScalar(T *p, size_t n, T k) noexcept;
+
+    /*
+    ** Returns how many elements 'x' satisfy 'x <op> v'. If 'out' isn't null,
+    ** they're also copied there, in order; 'out' must have room for one more
+    ** element than that, since the copy is branchless.
+    */
+    template <typename T> [[nodiscard]] static size_t filter(const T *p, size_t n, Cmp op, T v, T *out) noexcept;
+  };
+}
@@ -28,6 +28,7 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "lundump.h"
 #include "lvm.h"
 
 #ifdef PLUTO_ETL_ENABLE
@@ -1157,7 +1158,7 @@ void luaV_finishOp (lua_State *L) {
 ** Execute a jump instruction. The 'updatetrap' allows signals to stop
 ** tight loops. (Without it, the local copy of 'trap' could never change.)
 */
-#define dojump(ci,i,e)	{ pc += GETARG_sJ(i) + e; updatetrap(ci); }
+#define dojump(ci,i,e)	{ etlbackjump(GETARG_sJ(i) + e); pc += GETARG_sJ(i) + e; updatetrap(ci); }
 
 
 /* for test instructions, execute the jump instruction that follows it */
@@ -1199,6 +1200,20 @@ void luaV_finishOp (lua_State *L) {
 */
 #define halfProtect(exp)  (savestate(L,ci), (exp))
 
+
+/*
+** [Pluto] Execution time limit checkpoints. These are only placed where
+** control can flow backwards (loops, calls & returns), so the time between
+** two of them is bounded by the length of a function's straight-line code.
+*/
+#ifdef PLUTO_ETL_ENABLE
+#define etlcheck()  { if (l_unlikely(--G(L)->etl_fuel < 0)) Protect(L->checkEtlDeadline()); }
+#define etlbackjump(offset)  { if ((offset) < 0) etlcheck(); }
+#else
+#define etlcheck()  ((void)0)
+#define etlbackjump(offset)  ((void)0)
+#endif
+
 /* 'c' is the limit of live values in the stack */
 #define checkGC(L,c)  \
     { luaC_condGC(L, (savepc(L), L->top.p = (c)), \
@@ -1239,6 +1254,35 @@ void luaV_finishOp (lua_State *L) {
 */
 LUAI_FUNC int luaB_next (lua_State *L);
 LUAI_FUNC int luaB_ipairsaux (lua_State *L);
+LUAI_FUNC int luaB_range (lua_State *L);
+
+
+/*
+** [Pluto] A generic for over a userdata that can't be called iterates over
+** what its __pairs metamethod returns, as if it were wrapped in pairs().
+** Returns 0 if there is no such metamethod.
+*/
+static int forpairs (lua_State *L, StkId ra) {
+  Table *mt = uvalue(s2v(ra))->metatable;
+  if (mt == NULL)
+    return 0;
+  const TValue *tm = luaH_getshortstr(mt, luaS_newliteral(L, "__pairs"));
+  if (notm(tm))
+    return 0;
+  ptrdiff_t res = savestack(L, ra);
+  StkId func = L->top.p;
+  setobj2s(L, func, tm);
+  setobj2s(L, func + 1, s2v(ra));
+  L->top.p = func + 2;
+  luaD_call(L, func, 3);
+  ra = restorestack(L, res);
+  func = L->top.p - 3;
+  setobjs2s(L, ra, func);
+  setobjs2s(L, ra + 1, func + 1);
+  setobjs2s(L, ra + 2, func + 2);
+  L->top.p = func;
+  return 1;
+}
 
 
 #ifdef PLUTO_VMDUMP
@@ -1336,8 +1380,6 @@ static const std::vector<OpCode> allowOps = { vmDumpAllow };
 #ifdef PLUTO_FORCE_JUMPTABLE
 #ifdef PLUTO_VMDUMP
 #pragma message("PLUTO_FORCE_JUMPTABLE ignored due to PLUTO_VMDUMP")
-#elif defined(PLUTO_ETL_ENABLE)
-#pragma message("PLUTO_FORCE_JUMPTABLE ignored due to PLUTO_ETL_ENABLE")
 #elif !defined(__GNUC__) && !defined(__clang__)
 #include "ljumptab.h"
 #endif
@@ -1353,7 +1395,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
   int sequentialJumps = 0;
   int sequentialTailCalls = 0;
 #endif
-#if (defined(__GNUC__) || defined(__clang__)) && !defined(PLUTO_VMDUMP) && !defined(PLUTO_ETL_ENABLE)
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(PLUTO_VMDUMP)
 #include "ljumptabgcc.h"
 #endif
  startfunc:
@@ -1365,6 +1407,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
   if (l_unlikely(trap))
     trap = luaG_tracecall(L);
   base = ci->func.p + 1;
+  L->checkEtl();  /* every call & return passes through here */
   /* main loop of interpreter */
   for (;;) {
     Instruction i;  /* instruction being executed */
@@ -2092,6 +2135,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           vmbreak;
         }
 #endif // PLUTO_ILP_ENABLE
+        etlbackjump(offset);
         pc += offset;
         updatetrap(ci);
         vmDumpInit();
@@ -2416,11 +2460,14 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
             idx = intop(+, idx, step);  /* add step to index */
             chgivalue(s2v(ra), idx);  /* update internal index */
             setivalue(s2v(ra + 3), idx);  /* and control variable */
+            etlcheck();
             pc -= GETARG_Bx(i);  /* jump back */
           }
         }
-        else if (floatforloop(ra))  /* float loop */
+        else if (floatforloop(ra)) {  /* float loop */
+          etlcheck();
           pc -= GETARG_Bx(i);  /* jump back */
+        }
         updatetrap(ci);  /* allows a signal to break the loop */
         vmDumpInit();
         vmDumpAddA();
@@ -2458,8 +2505,16 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         if ((!ttisfunction(s2v(ra)))
             && ttisnil(luaT_gettmbyobj(L, s2v(ra), TM_CALL))
         ) {
-          setobjs2s(L, ra + 1, ra);
-          setfvalue(s2v(ra), luaB_next);
+          int haspairs = 0;
+          if (ttisfulluserdata(s2v(ra))) {
+            Protect(haspairs = forpairs(L, ra));
+            updatebase(ci);  /* the call may have moved the stack */
+            ra = RA(i);
+          }
+          if (!haspairs) {
+            setobjs2s(L, ra + 1, ra);
+            setfvalue(s2v(ra), luaB_next);
+          }
         }
         if (ttypetag(s2v(ra)) == LUA_VLCF
               && ttistable(s2v(ra+1))
@@ -2578,6 +2633,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         StkId ra = RA(i);
         if (!ttisnil(s2v(ra + 4))) {  /* continue loop? */
           setobjs2s(L, ra + 2, ra + 4);  /* save control variable */
+          etlcheck();
           pc -= GETARG_Bx(i);  /* jump back */
         }
         vmbreak;
@@ -2618,8 +2674,12 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmbreak;
       }
       vmcase(OP_CLOSURE) {
-        StkId ra = RA(i);
         Proto *p = cl->p->p[GETARG_Bx(i)];
+        if (l_unlikely(p->lazybody != 0)) {  /* [Pluto] not yet loaded from its indexed chunk? */
+          Protect(luaU_loadbody(L, p));
+          updatebase(ci);  /* loading may have moved the stack */
+        }
+        StkId ra = RA(i);
         halfProtect(pushclosure(L, p, cl->upvals, base, ra));
         checkGC(L, ra + 1);
         vmDumpInit();
@@ -2672,19 +2732,30 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmDumpOut ("; " << old << " in " << stringify_tvalue(b) << " (" << stringify_tvalue(s2v(ra)) << ")");
         vmbreak;
       }
+      vmcase(OP_TESTRANGE) {
+        StkId ra = RA(i);
+        int cond = (ttislcf(s2v(ra)) && fvalue(s2v(ra)) == luaB_range);
+        vmDumpInit();
+        vmDumpAddA();
+        vmDumpAdd(GETARG_k(i));
+        vmDumpOut("; " << (cond ? "standard range" : "not the standard range"));
+        docondjump();
+        vmbreak;
+      }
       vmcase(NUM_OPCODES) {
         vmbreak;
       }
     }
-    L->checkEtl();
   }
 }
 
 
 #ifdef PLUTO_ETL_ENABLE
-void lua_State::checkEtl() {
+void lua_State::checkEtlDeadline() {
   lua_State* const L = this;
-  if (l_unlikely(L->l_G->deadline < std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count())) {
+  global_State* const g = L->l_G;
+  g->etl_fuel = PLUTO_ETL_INTERVAL;
+  if (g->deadline != 0 && l_unlikely(g->deadline < std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count())) {
     PLUTO_ETL_TIMESUP
   }
 }
@@ -1,103 +1,715 @@
-#include <cstring> // strcmp
+#include <algorithm> // min, max
+#include <cerrno>
+#include <cstdio> // fread
+#include <cstring> // strcmp, memchr, memcmp, strerror
+#include <string>
+#include <string_view>
+#include <utility> // pair
+#include <vector>
 
 #define LUA_LIB
 #include "lualib.h"
 #include "lstate.h" // luaE_incCstack
+#include "ldo.h" // luaD_throw
+#include "lbufferlib.hpp"
 
+#include "vendor/Soup/soup/string.hpp"
+#include "vendor/Soup/soup/unicode.hpp"
 #include "vendor/Soup/soup/xml.hpp"
 
-static void check_xml (lua_State *L, int i, soup::UniquePtr<soup::XmlNode>& out) {
+/*
+** {======================================================
+** Encoding, straight from the Lua representation
+** =======================================================
+*/
+
+/* 'Out' is std::string or soup::Buffer. */
+template <typename Out>
+static void encodetext (Out& out, const char *s, size_t len) {
+  const char *run = s;
+  const char *const end = s + len;
+  for (; s != end; ++s) {
+    const char *esc;
+    size_t esclen;
+    switch (*s) {
+      case '&': esc = "&amp;"; esclen = 5; break;
+      case '<': esc = "&lt;"; esclen = 4; break;
+      case '>': esc = "&gt;"; esclen = 4; break;
+      default: continue;
+    }
+    out.append(run, s - run);
+    out.append(esc, esclen);
+    run = s + 1;
+  }
+  out.append(run, end - run);
+}
+
+template <typename Out>
+static void encodenode (lua_State *L, int i, bool pretty, Out& out, unsigned depth) {
   const auto type = lua_type(L, i);
   if (type == LUA_TTABLE) {
-    lua_checkstack(L, 4);
+    lua_checkstack(L, 5);
     lua_pushvalue(L, i);
     lua_pushliteral(L, "tag");
     if (lua_rawget(L, -2) == LUA_TSTRING) {
       luaE_incCstack(L);
-      out = soup::make_unique<soup::XmlTag>();
-      auto& tag = static_cast<soup::XmlTag&>(*out);
-      tag.name = pluto_checkstring(L, -1);
-      lua_pop(L, 1);  /* pop result of lua_rawget */
+      size_t namelen;
+      const char *name = lua_tolstring(L, -1, &namelen);  /* stays on the stack until the closing tag is written */
+      out.push_back('<');
+      out.append(name, namelen);
       lua_pushliteral(L, "attributes");
-      if (lua_rawget(L, -2) != LUA_TNONE) {
-        if (lua_type(L, -1) == LUA_TTABLE) {
-          lua_pushnil(L);
-          while (lua_next(L, -2)) {
-            lua_pushvalue(L, -2);
-            tag.attributes.emplace_back(pluto_checkstring(L, -1), pluto_checkstring(L, -2));
-            lua_pop(L, 2);
-          }
+      if (lua_rawget(L, -3) == LUA_TTABLE) {
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+          lua_pushvalue(L, -2);
+          size_t keylen, valuelen;
+          const char *key = luaL_checklstring(L, -1, &keylen);
+          const char *value = luaL_checklstring(L, -2, &valuelen);
+          const char quote = (memchr(value, '"', valuelen) ? '\'' : '"');
+          out.push_back(' ');
+          out.append(key, keylen);
+          out.push_back('=');
+          out.push_back(quote);
+          out.append(value, valuelen);
+          out.push_back(quote);
+          lua_pop(L, 2);
         }
-        lua_pop(L, 1);  /* pop result of lua_rawget */
       }
+      lua_pop(L, 1);  /* pop result of lua_rawget */
+      out.push_back('>');
+      bool haschildren = false;
       lua_pushliteral(L, "children");
-      if (lua_rawget(L, -2) != LUA_TNONE) {
-        if (lua_type(L, -1) == LUA_TTABLE) {
-          lua_pushnil(L);
-          while (lua_next(L, -2)) {
-            check_xml(L, -1, tag.children.emplace_back());
-            lua_pop(L, 1);
+      if (lua_rawget(L, -3) == LUA_TTABLE) {
+        lua_pushnil(L);
+        while (lua_next(L, -2)) {
+          haschildren = true;
+          if (pretty) {
+            out.push_back('\n');
+            for (unsigned n = depth + 1; n != 0; --n)
+              out.append("    ", 4);
           }
+          encodenode(L, -1, pretty, out, depth + 1);
+          lua_pop(L, 1);
         }
-        lua_pop(L, 1);  /* pop result of lua_rawget */
       }
-      lua_pop(L, 1);  /* pop table from lua_pushvalue */
+      lua_pop(L, 1);  /* pop result of lua_rawget */
+      if (pretty && haschildren) {
+        out.push_back('\n');
+        for (unsigned n = depth; n != 0; --n)
+          out.append("    ", 4);
+      }
+      out.append("</", 2);
+      out.append(name, namelen);
+      out.push_back('>');
+      lua_pop(L, 2);  /* pop tag name & table from lua_pushvalue */
       L->nCcalls--;
       return;
     }
   }
   else if (type == LUA_TSTRING) {
-    out = soup::make_unique<soup::XmlText>(pluto_checkstring(L, i));
+    size_t len;
+    const char *s = lua_tolstring(L, i, &len);
+    encodetext(out, s, len);
     return;
   }
   luaL_typeerror(L, i, "XML-castable type");
 }
 
+/* xml.encode(root[, pretty[, buf]]): with a pluto:buffer, appends to it and returns it instead of creating a string. */
 static int xml_encode (lua_State *L) {
-  auto& root = *pluto_newclassinst(L, soup::UniquePtr<soup::XmlNode>);
-  check_xml(L, 1, root);
-  if (lua_istrue(L, 2)) {
-    pluto_pushstring(L, root->encodePretty());
-  }
-  else {
-    pluto_pushstring(L, root->encode());
+  const bool pretty = lua_istrue(L, 2);
+  if (!lua_isnoneornil(L, 3)) {
+    soup::Buffer& buf = checkbuffer(L, 3)->buffer;
+    try {
+      encodenode(L, 1, pretty, buf, 0);
+    }
+    catch (std::bad_alloc&) {
+      luaD_throw(L, LUA_ERRMEM);
+    }
+    lua_settop(L, 3);
+    return 1;
   }
+  auto str = pluto_newclassinst(L, std::string);
+  encodenode(L, 1, pretty, *str, 0);
+  pluto_pushstring(L, *str);
   return 1;
 }
 
-static void pushxmltag (lua_State *L, const soup::XmlTag& tag) {
-  lua_checkstack(L, 5);
-  lua_newtable(L);
-  lua_pushliteral(L, "tag");
-  pluto_pushstring(L, tag.name);
-  lua_settable(L, -3);
-  if (!tag.attributes.empty()) {
-    lua_pushliteral(L, "attributes");
-    lua_newtable(L);
-    for (const auto& attr : tag.attributes) {
-      pluto_pushstring(L, attr.first);
-      pluto_pushstring(L, attr.second);
-      lua_settable(L, -3);
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Incremental parsing
+** =======================================================
+*/
+
+#define XMLPARSER "pluto:xml-parser"
+
+/* How much is read from a file source at a time. */
+#define XML_READ_SIZE (64 * 1024)
+
+/* Elements may not be nested deeper than this. */
+#define XML_MAX_DEPTH 1000
+
+namespace {
+  /*
+  ** Turns input that may arrive in arbitrarily sized chunks into a stream of
+  ** start/text/end events, without ever holding more of it than the token
+  ** that is currently incomplete. Tokens are searched for their end only
+  ** once, so feeding a document byte by byte is still linear.
+  */
+  struct XmlParser {
+    enum Source : uint8_t {
+      PUSHED,  /* parser:feed */
+      BYTES,  /* string, buffer or file mapping, all available up front */
+      FUNCTION,  /* returns the next chunk, or nil at the end */
+      FILE_HANDLE,
+    };
+
+    enum Event : uint8_t {
+      NEED_MORE,  /* only for pushed input that has not been finished */
+      START,  /* 'name' & 'attrs' */
+      TEXT,  /* 'text' */
+      END,  /* 'ended' */
+      DONE,
+    };
+
+    enum Markup : uint8_t {
+      INCOMPLETE,
+      LITERAL,  /* a '<' that does not begin markup */
+      CDATA,
+      COMMENT,
+      DECLARATION,
+      INSTRUCTION,
+      END_TAG,
+      START_TAG,
+    };
+
+    const soup::XmlMode *mode = &soup::xml::MODE_XML;
+    Source source = PUSHED;
+    bool eof = false;
+    bool canbuild = false;  /* the last event was a START, so parser:node can take over */
+
+    /* input; 'data' is 'buf' unless it's BYTES */
+    std::string buf;
+    const char *data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
+
+    /* progress on the current token */
+    size_t scan = 0;  /* how far past 'pos' its end has been searched for */
+    char quote = 0;
+    int brackets = 0;
+    bool intext = false;
+
+    /* the last token; 'name' & 'attrs' point into the input, so they're only valid until it's refilled */
+    std::string text;
+    std::string_view name;
+    std::vector<std::pair<std::string_view, std::string_view>> attrs;
+
+    /* elements that have been started but not ended */
+    std::vector<std::string> open;
+    size_t closing = 0;  /* how many of them are due an END event */
+    std::string ended;
+
+    void compact () {
+      if (pos != 0) {
+        buf.erase(0, pos);
+        pos = 0;
+      }
+      data = buf.data();
+      size = buf.size();
     }
-    lua_settable(L, -3);
-  }
-  if (!tag.children.empty()) {
-    lua_pushliteral(L, "children");
-    lua_newtable(L);
-    lua_Integer i = 1;
-    for (const auto& child : tag.children) {
-      lua_pushinteger(L, i++);
-      if (child->isTag()) {
-        pushxmltag(L, child->asTag());
+
+    /* Gets more input from the source. Returns false if nothing changed, either because it's exhausted or because it's pushed. */
+    bool more (lua_State *L, int self) {
+      if (eof || source == PUSHED)
+        return false;
+      compact();
+      lua_getiuservalue(L, self, 1);
+      if (source == FUNCTION) {
+        lua_call(L, 0, 1);
+        if (lua_isnil(L, -1))
+          eof = true;
+        else {
+          size_t len;
+          const char *chunk = pluto_tobytes(L, -1, &len);
+          if (l_unlikely(chunk == nullptr))
+            luaL_error(L, "XML source returned a %s value instead of a string", luaL_typename(L, -1));
+          buf.append(chunk, len);
+        }
       }
-      else /*if (child->isText())*/ {
-        pluto_pushstring(L, child->asText().contents);
+      else {
+        auto stream = (luaL_Stream *)lua_touserdata(L, -1);
+        if (l_unlikely(stream->closef == nullptr))
+          luaL_error(L, "attempt to use a closed file");
+        const size_t old = buf.size();
+        buf.resize(old + XML_READ_SIZE);
+        const size_t n = fread(buf.data() + old, 1, XML_READ_SIZE, stream->f);
+        buf.resize(old + n);
+        if (n == 0) {
+          if (l_unlikely(ferror(stream->f)))
+            luaL_error(L, "%s", strerror(errno));
+          eof = true;
+        }
       }
-      lua_settable(L, -3);
+      lua_pop(L, 1);
+      data = buf.data();
+      size = buf.size();
+      return true;
     }
-    lua_settable(L, -3);
+
+    [[noreturn]] static void truncated (lua_State *L) {
+      luaL_error(L, "unexpected end of XML input");
+    }
+
+    [[nodiscard]] Markup classify () const noexcept {
+      const size_t avail = size - pos;
+      if (avail < 2)
+        return eof ? LITERAL : INCOMPLETE;
+      switch (data[pos + 1]) {
+        case '!': {
+          size_t n = std::min<size_t>(avail, 9);
+          if (memcmp(data + pos, "<![CDATA[", n) == 0)
+            return n == 9 ? CDATA : (eof ? DECLARATION : INCOMPLETE);
+          n = std::min<size_t>(avail, 4);
+          if (memcmp(data + pos, "<!--", n) == 0)
+            return n == 4 ? COMMENT : (eof ? DECLARATION : INCOMPLETE);
+          return DECLARATION;
+        }
+        case '?':
+          return INSTRUCTION;
+        case '/':
+          return END_TAG;
+      }
+      const auto c = static_cast<unsigned char>(data[pos + 1]);
+      return (soup::string::isLetter(c) || c == '_' || c == ':' || c >= 0x80) ? START_TAG : LITERAL;
+    }
+
+    /* Searches for 'term' from 'from' bytes into the current token, or from where the last search left off. */
+    [[nodiscard]] bool find (std::string_view term, size_t from, size_t& at) noexcept {
+      const size_t start = pos + std::max(from, scan);
+      if (start <= size) {
+        const size_t i = std::string_view(data + start, size - start).find(term);
+        if (i != std::string_view::npos) {
+          at = start + i;
+          return true;
+        }
+      }
+      const size_t avail = size - pos;
+      scan = std::max(from, avail >= term.size() ? avail - term.size() + 1 : 0);
+      return false;
+    }
+
+    /* Like 'find' for the closing '>', but skips those in quoted attribute values and, for declarations, in brackets. */
+    [[nodiscard]] bool findtagend (bool declaration, size_t& at) noexcept {
+      size_t i = pos + std::max<size_t>(scan, 1);
+      for (; i < size; ++i) {
+        const char c = data[i];
+        if (quote != 0) {
+          if (c == quote)
+            quote = 0;
+        }
+        else if ((c == '"' || c == '\'') && data[i - 1] == '=')
+          quote = c;
+        else if (declaration && c == '[')
+          ++brackets;
+        else if (declaration && c == ']' && brackets != 0)
+          --brackets;
+        else if (c == '>' && brackets == 0) {
+          at = i;
+          return true;
+        }
+      }
+      scan = i - pos;
+      return false;
+    }
+
+    void consumed (size_t to) noexcept {
+      pos = to;
+      scan = 0;
+      quote = 0;
+      brackets = 0;
+    }
+
+    /* Appends character data with its entity and character references resolved. Leading whitespace is skipped, as with soup::xml. */
+    void appendtext (const char *s, const char *e) {
+      if (text.empty()) {
+        while (s != e && soup::string::isSpace(*s))
+          ++s;
+      }
+      while (s != e) {
+        auto amp = (const char *)memchr(s, '&', e - s);
+        if (amp == nullptr) {
+          text.append(s, e - s);
+          return;
+        }
+        text.append(s, amp - s);
+        s = appendreference(amp, e);
+      }
+    }
+
+    const char *appendreference (const char *amp, const char *e) {
+      auto semi = (const char *)memchr(amp + 1, ';', std::min<size_t>(e - amp - 1, 10));
+      if (semi != nullptr) {
+        const std::string_view ref(amp + 1, semi - amp - 1);
+        char c = 0;
+        if (ref == "amp") c = '&';
+        else if (ref == "lt") c = '<';
+        else if (ref == "gt") c = '>';
+        else if (ref == "quot") c = '"';
+        else if (ref == "apos") c = '\'';
+        else if (ref.size() > 1 && ref[0] == '#') {
+          const bool hex = (ref[1] == 'x' || ref[1] == 'X');
+          uint32_t cp = 0;
+          bool valid = (ref.size() > (hex ? 2u : 1u));
+          for (size_t i = (hex ? 2 : 1); valid && i != ref.size(); ++i) {
+            const char d = ref[i];
+            if (d >= '0' && d <= '9') cp = cp * (hex ? 16 : 10) + (d - '0');
+            else if (hex && d >= 'a' && d <= 'f') cp = cp * 16 + (d - 'a' + 10);
+            else if (hex && d >= 'A' && d <= 'F') cp = cp * 16 + (d - 'A' + 10);
+            else valid = false;
+            valid = valid && cp <= 0x10FFFF;
+          }
+          if (valid && cp != 0) {
+            text.append(soup::unicode::utf32_to_utf8(cp));
+            return semi + 1;
+          }
+        }
+        if (c != 0) {
+          text.push_back(c);
+          return semi + 1;
+        }
+      }
+      text.push_back('&');
+      return amp + 1;
+    }
+
+    void parsestarttag (size_t gt) {
+      const char *p = data + pos + 1;
+      const char *e = data + gt;
+      const char *n = p;
+      while (p != e && !soup::string::isSpace(*p) && *p != '/')
+        ++p;
+      name = std::string_view(n, p - n);
+      bool selfclosing = false;
+      if (e != p && *(e - 1) == '/') {
+        --e;
+        selfclosing = mode->self_closing_tags.empty();
+      }
+      if (!mode->self_closing_tags.empty() && mode->self_closing_tags.count(std::string(name)))
+        selfclosing = true;
+      attrs.clear();
+      for (;;) {
+        while (p != e && (soup::string::isSpace(*p) || *p == '/'))
+          ++p;
+        if (p == e)
+          break;
+        n = p;
+        while (p != e && !soup::string::isSpace(*p) && *p != '=' && *p != '/')
+          ++p;
+        const std::string_view attr(n, p - n);
+        const char *q = p;
+        while (q != e && soup::string::isSpace(*q))
+          ++q;
+        if (q != e && *q == '=') {
+          p = q + 1;
+          if (p != e && (*p == '"' || *p == '\'')) {
+            const char quote = *p++;
+            const char *v = p;
+            while (p != e && *p != quote)
+              ++p;
+            attrs.emplace_back(attr, std::string_view(v, p - v));
+            if (p != e)
+              ++p;
+            continue;
+          }
+          if (p != e && !soup::string::isSpace(*p) && mode->unquoted_attributes) {
+            const char *v = p;
+            while (p != e && !soup::string::isSpace(*p))
+              ++p;
+            attrs.emplace_back(attr, std::string_view(v, p - v));
+            continue;
+          }
+        }
+        if (mode->empty_attribute_syntax)
+          attrs.emplace_back(attr, std::string_view());
+      }
+      if (selfclosing)
+        closing = 1;
+    }
+
+    /* Reads the next token; the element structure is left to 'next'. */
+    Event token (lua_State *L, int self) {
+      for (;;) {
+        if (intext) {
+          auto lt = (const char *)memchr(data + pos, '<', size - pos);
+          if (lt == nullptr) {
+            size_t upto = size;
+            if (!eof) {  /* a reference may continue in the next chunk */
+              for (size_t i = size; i != pos && size - i < 10; ) {
+                if (data[--i] == ';')
+                  break;
+                if (data[i] == '&') {
+                  upto = i;
+                  break;
+                }
+              }
+            }
+            appendtext(data + pos, data + upto);
+            pos = upto;
+            if (more(L, self))
+              continue;
+            if (!eof)
+              return NEED_MORE;
+            intext = false;
+            if (!text.empty())
+              return TEXT;
+            continue;
+          }
+          appendtext(data + pos, lt);
+          pos = lt - data;
+          switch (classify()) {
+            case INCOMPLETE:
+              if (more(L, self))
+                continue;
+              return NEED_MORE;
+            case LITERAL:
+              text.push_back('<');
+              ++pos;
+              continue;
+            case CDATA: {
+              size_t end;
+              if (!find("]]>", 9, end)) {
+                if (more(L, self))
+                  continue;
+                if (!eof)
+                  return NEED_MORE;
+                truncated(L);
+              }
+              text.append(data + pos + 9, end - pos - 9);
+              consumed(end + 3);
+              continue;
+            }
+            default:
+              intext = false;
+              if (!text.empty())
+                return TEXT;
+              continue;
+          }
+        }
+
+        if (pos == size) {
+          if (more(L, self))
+            continue;
+          return eof ? DONE : NEED_MORE;
+        }
+        if (data[pos] != '<') {
+          intext = true;
+          text.clear();
+          continue;
+        }
+        size_t end;
+        bool found;
+        const Markup markup = classify();
+        switch (markup) {
+          case INCOMPLETE:
+            if (more(L, self))
+              continue;
+            return NEED_MORE;
+          case LITERAL:
+          case CDATA:
+            intext = true;
+            text.clear();
+            continue;
+          case COMMENT:
+            found = find("-->", 4, end);
+            break;
+          case INSTRUCTION:
+            found = find("?>", 2, end);
+            break;
+          case END_TAG:
+            found = find(">", 2, end);
+            break;
+          default:
+            found = findtagend(markup == DECLARATION, end);
+            break;
+        }
+        if (!found) {
+          if (more(L, self))
+            continue;
+          if (!eof)
+            return NEED_MORE;
+          truncated(L);
+        }
+        switch (markup) {
+          case COMMENT:
+            consumed(end + 3);
+            continue;
+          case INSTRUCTION:
+            consumed(end + 2);
+            continue;
+          case DECLARATION:
+            consumed(end + 1);
+            continue;
+          case END_TAG: {
+            const char *n = data + pos + 2;
+            const char *e = data + end;
+            while (n != e && soup::string::isSpace(*n))
+              ++n;
+            while (e != n && soup::string::isSpace(*(e - 1)))
+              --e;
+            name = std::string_view(n, e - n);
+            consumed(end + 1);
+            return END;
+          }
+          default:
+            parsestarttag(end);
+            consumed(end + 1);
+            return START;
+        }
+      }
+    }
+
+    Event popopen () {
+      ended = std::move(open.back());
+      open.pop_back();
+      return END;
+    }
+
+    /* Unclosed elements are ended when their parent is, or when the input is, and stray end tags are ignored. */
+    Event next (lua_State *L, int self) {
+      if (closing != 0) {
+        --closing;
+        return popopen();
+      }
+      for (;;) {
+        switch (token(L, self)) {
+          case START:
+            if (l_unlikely(open.size() == XML_MAX_DEPTH))
+              luaL_error(L, "XML elements are nested too deeply");
+            open.emplace_back(name);
+            return START;
+          case END:
+            for (size_t i = open.size(); i-- != 0; ) {
+              if (open[i] == name) {
+                closing = open.size() - i - 1;
+                return popopen();
+              }
+            }
+            continue;
+          case TEXT:
+            return TEXT;
+          case DONE:
+            if (!open.empty()) {
+              closing = open.size() - 1;
+              return popopen();
+            }
+            return DONE;
+          default:
+            return NEED_MORE;
+        }
+      }
+    }
+  };
+}
+
+static const soup::XmlMode *checkmode (lua_State *L, int i) {
+  if (lua_isnoneornil(L, i))
+    return &soup::xml::MODE_XML;
+  const char *modename = luaL_checkstring(L, i);
+  if (strcmp(modename, "html") == 0)
+    return &soup::xml::MODE_HTML;
+  if (strcmp(modename, "lax") == 0)
+    return &soup::xml::MODE_LAX_XML;
+  if (strcmp(modename, "xml") != 0)
+    luaL_error(L, "unknown parser mode '%s'", modename);
+  return &soup::xml::MODE_XML;
+}
+
+static XmlParser& checkparser (lua_State *L, int i) {
+  auto& p = *(XmlParser *)luaL_checkudata(L, i, XMLPARSER);
+  if (p.source == XmlParser::BYTES) {  /* buffers can move when appended to */
+    lua_getiuservalue(L, i, 1);
+    p.data = pluto_checkbytes(L, -1, &p.size);
+    lua_pop(L, 1);
+    if (l_unlikely(p.pos > p.size))
+      luaL_error(L, "XML source has shrunk while being parsed");
+  }
+  return p;
+}
+
+static int parser_gc (lua_State *L) {
+  std::destroy_at((XmlParser *)luaL_checkudata(L, 1, XMLPARSER));
+  return 0;
+}
+
+/* parser:feed(data) */
+static int parser_feed (lua_State *L) {
+  XmlParser& p = checkparser(L, 1);
+  size_t len;
+  const char *data = pluto_checkbytes(L, 2, &len);
+  if (l_unlikely(p.source != XmlParser::PUSHED))
+    luaL_error(L, "cannot feed a parser that reads from a source");
+  if (l_unlikely(p.eof))
+    luaL_error(L, "cannot feed a finished parser");
+  p.compact();
+  p.buf.append(data, len);
+  p.data = p.buf.data();
+  p.size = p.buf.size();
+  return 0;
+}
+
+/* parser:finish(): there is no more input to be fed */
+static int parser_finish (lua_State *L) {
+  checkparser(L, 1).eof = true;
+  return 0;
+}
+
+/* parser:next(): returns "start", name, attributes or "text", contents or "end", name, or nil once the input is exhausted */
+static int parser_next (lua_State *L) {
+  XmlParser& p = checkparser(L, 1);
+  lua_settop(L, 1);
+  const auto event = p.next(L, 1);
+  p.canbuild = (event == XmlParser::START);
+  switch (event) {
+    case XmlParser::START:
+      lua_pushliteral(L, "start");
+      lua_pushlstring(L, p.name.data(), p.name.size());
+      lua_createtable(L, 0, static_cast<int>(p.attrs.size()));
+      for (const auto& attr : p.attrs) {
+        lua_pushlstring(L, attr.first.data(), attr.first.size());
+        lua_pushlstring(L, attr.second.data(), attr.second.size());
+        lua_rawset(L, -3);
+      }
+      lua_pushvalue(L, -1);
+      lua_setiuservalue(L, 1, 2);  /* for parser:node */
+      return 3;
+    case XmlParser::TEXT:
+      lua_pushliteral(L, "text");
+      lua_pushlstring(L, p.text.data(), p.text.size());
+      return 2;
+    case XmlParser::END:
+      lua_pushliteral(L, "end");
+      lua_pushlstring(L, p.ended.data(), p.ended.size());
+      return 2;
+    default:
+      lua_pushnil(L);
+      return 1;
   }
+}
+
+/* }====================================================== */
+
 
+/*
+** {======================================================
+** Building tables
+** =======================================================
+*/
+
+static void pushnodemetatable (lua_State *L) {
   if (luaL_newmetatable(L, "pluto:xml_full_node")) {
     lua_pushliteral(L, "__index");
     lua_pushcfunction(L, [](lua_State *L) -> int {
@@ -121,36 +733,179 @@ static void pushxmltag (lua_State *L, const soup::XmlTag& tag) {
     });
     lua_settable(L, -3);
   }
+}
+
+/* Appends the value on top of the stack to the children of the node at 'node', whose children table (or nil) is just above it. */
+static void appendchild (lua_State *L, int node, lua_Integer& n) {
+  if (n == 0) {
+    lua_createtable(L, 4, 0);
+    lua_pushvalue(L, -1);
+    lua_replace(L, node + 1);
+    lua_pushliteral(L, "children");
+    lua_insert(L, -2);
+    lua_rawset(L, node);
+  }
+  lua_rawseti(L, node + 1, ++n);
+}
+
+/*
+** Builds the node at 'base' (with a nil above it) from events, until it ends.
+** The stack holds such a pair for every element that's being built, so only
+** the finished tables are ever kept, and there's no recursion.
+*/
+static void buildnode (lua_State *L, XmlParser& p, int self, int mt, int base) {
+  std::vector<lua_Integer> counts{ 0 };
+  for (;;) {
+    const int node = base + 2 * static_cast<int>(counts.size() - 1);
+    switch (p.next(L, self)) {
+      case XmlParser::START:
+        lua_checkstack(L, 5);
+        lua_createtable(L, 0, 3);
+        lua_pushliteral(L, "tag");
+        lua_pushlstring(L, p.name.data(), p.name.size());
+        lua_rawset(L, -3);
+        if (!p.attrs.empty()) {
+          lua_pushliteral(L, "attributes");
+          lua_createtable(L, 0, static_cast<int>(p.attrs.size()));
+          for (const auto& attr : p.attrs) {
+            lua_pushlstring(L, attr.first.data(), attr.first.size());
+            lua_pushlstring(L, attr.second.data(), attr.second.size());
+            lua_rawset(L, -3);
+          }
+          lua_rawset(L, -3);
+        }
+        lua_pushvalue(L, mt);
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        appendchild(L, node, counts.back());
+        lua_pushnil(L);
+        counts.emplace_back(0);
+        break;
+      case XmlParser::TEXT:
+        lua_pushlstring(L, p.text.data(), p.text.size());
+        appendchild(L, node, counts.back());
+        break;
+      case XmlParser::END:
+        counts.pop_back();
+        if (counts.empty()) {
+          lua_settop(L, base);
+          return;
+        }
+        lua_settop(L, node - 1);
+        break;
+      case XmlParser::DONE:  /* only reached by the document node, since open elements are ended first */
+        lua_settop(L, base);
+        return;
+      default:
+        luaL_error(L, "XML input is incomplete; feed the rest of it or finish the parser first");
+    }
+  }
+}
+
+/* parser:node(): after a "start" event, builds that element like xml.decode would, consuming everything up to its end */
+static int parser_node (lua_State *L) {
+  XmlParser& p = checkparser(L, 1);
+  if (l_unlikely(!p.canbuild))
+    luaL_error(L, "parser:node must be called right after a 'start' event");
+  p.canbuild = false;
+  lua_settop(L, 1);
+  pushnodemetatable(L);
+  lua_createtable(L, 0, 3);
+  lua_pushliteral(L, "tag");
+  pluto_pushstring(L, p.open.back());
+  lua_rawset(L, -3);
+  lua_pushliteral(L, "attributes");
+  lua_getiuservalue(L, 1, 2);
+  lua_pushnil(L);
+  if (lua_next(L, -2)) {
+    lua_pop(L, 2);
+    lua_rawset(L, -3);
+  }
+  else
+    lua_pop(L, 2);
+  lua_pushvalue(L, 2);
   lua_setmetatable(L, -2);
+  lua_pushnil(L);
+  buildnode(L, p, 1, 2, 3);
+  return 1;
 }
 
-static int xml_decode (lua_State *L) {
-  const soup::XmlMode *mode = &soup::xml::MODE_XML;
-  if (lua_gettop(L) >= 2) {
-    const char *modename = luaL_checkstring(L, 2);
-    if (strcmp(modename, "html") == 0)
-      mode = &soup::xml::MODE_HTML;
-    else if (strcmp(modename, "lax") == 0)
-      mode = &soup::xml::MODE_LAX_XML;
-    else if (strcmp(modename, "xml") != 0)
-      luaL_error(L, "unknown parser mode '%s'", modename);
+static const luaL_Reg funcs_parser[] = {
+  {"feed", parser_feed},
+  {"finish", parser_finish},
+  {"next", parser_next},
+  {"node", parser_node},
+  {"__call", parser_next},
+  {"__gc", parser_gc},
+  {nullptr, nullptr}
+};
+
+static XmlParser& newparser (lua_State *L, int src, const soup::XmlMode *mode) {
+  auto& p = *new (lua_newuserdatauv(L, sizeof(XmlParser), 2)) XmlParser{};
+  if (luaL_newmetatable(L, XMLPARSER)) {
+    luaL_setfuncs(L, funcs_parser, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
   }
+  lua_setmetatable(L, -2);
+  p.mode = mode;
+  if (lua_isnoneornil(L, src))
+    return p;
   size_t len;
-  const char *data = luaL_checklstring(L, 1, &len);
-  soup::UniquePtr<soup::XmlTag> root;
-  try {
-    root = soup::xml::parseAndDiscardMetadata(data, data + len, *mode);
-  }
-  catch (const std::exception& e) {
-    luaL_error(L, e.what());
+  if (luaL_testudata(L, src, LUA_FILEHANDLE))
+    p.source = XmlParser::FILE_HANDLE;
+  else if (lua_type(L, src) == LUA_TFUNCTION)
+    p.source = XmlParser::FUNCTION;
+  else if ((p.data = pluto_tobytes(L, src, &len)) != nullptr) {
+    p.source = XmlParser::BYTES;
+    p.size = len;
+    p.eof = true;
   }
-  pushxmltag(L, *root);
+  else
+    luaL_typeerror(L, src, "string, buffer, function or file");
+  lua_pushvalue(L, src);
+  lua_setiuservalue(L, -2, 1);
+  return p;
+}
+
+/* xml.parser([source[, mode]]): without a source, input is given to parser:feed */
+static int xml_parser (lua_State *L) {
+  const soup::XmlMode *mode = checkmode(L, 2);
+  lua_settop(L, 2);
+  newparser(L, 1, mode);
   return 1;
 }
 
+/* xml.decode(source[, mode]): the source can be anything xml.parser takes. */
+static int xml_decode (lua_State *L) {
+  const soup::XmlMode *mode = checkmode(L, 2);
+  lua_settop(L, 2);
+  luaL_argexpected(L, !lua_isnoneornil(L, 1), 1, "string, buffer, function or file");
+  XmlParser& p = newparser(L, 1, mode);  /* 3 */
+  pushnodemetatable(L);  /* 4 */
+  lua_createtable(L, 0, 2);  /* 5: the document */
+  lua_pushvalue(L, 4);
+  lua_setmetatable(L, 5);
+  lua_pushnil(L);
+  buildnode(L, p, 3, 4, 5);
+  /* a document with just one element is that element, anything else is wrapped in a "body" */
+  lua_pushliteral(L, "children");
+  if (lua_rawget(L, 5) == LUA_TTABLE && luaL_len(L, -1) == 1 && lua_rawgeti(L, -1, 1) == LUA_TTABLE)
+    return 1;
+  lua_settop(L, 5);
+  lua_pushliteral(L, "tag");
+  lua_pushliteral(L, "body");
+  lua_rawset(L, 5);
+  return 1;
+}
+
+/* }====================================================== */
+
+
 static const luaL_Reg funcs_xml[] = {
   {"encode", xml_encode},
   {"decode", xml_decode},
+  {"parser", xml_parser},
   {nullptr, nullptr}
 };
 
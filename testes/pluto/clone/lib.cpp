@@ -0,0 +1,50 @@
+#include "../../../src/lua.h"
+#include "../../../src/lauxlib.h"
+
+/* clone.run(code [, limit]): runs 'code' in a clone of this state, with 'limit' set as its memory limit by the host, and returns its result as a string */
+static int run (lua_State *L) {
+  const char *code = luaL_checkstring(L, 1);
+  const lua_Integer limit = luaL_optinteger(L, 2, 0);
+  lua_State *C = luaL_clonestate(L);
+  if (C == NULL)
+    return luaL_error(L, "not enough memory");
+  if (limit != 0)
+    lua_setmemorylimit(C, (size_t)limit);
+  const bool ok = (luaL_dostring(C, code) == LUA_OK);
+  if (lua_gettop(C) == 0)
+    lua_pushnil(C);
+  size_t len;
+  const char *s = luaL_tolstring(C, -1, &len);
+  lua_pushlstring(L, s, len);
+  lua_close(C);
+  if (!ok)
+    return lua_error(L);
+  return 1;
+}
+
+static int gc (lua_State *L) {
+  (void)L;
+  return 0;
+}
+
+/* clone.newudata(): a userdata with a __gc but no __clone metamethod */
+static int newudata (lua_State *L) {
+  lua_newuserdatauv(L, 1, 0);
+  if (luaL_newmetatable(L, "clonetest.udata")) {
+    lua_pushcfunction(L, gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static const luaL_Reg funcs[] = {
+  {"run", run},
+  {"newudata", newudata},
+  {NULL, NULL}
+};
+
+LUAMOD_API int luaopen_clone (lua_State *L) {
+  luaL_newlib(L, funcs);
+  return 1;
+}
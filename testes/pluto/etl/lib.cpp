@@ -0,0 +1,32 @@
+#include "../../../src/lua.h"
+#include "../../../src/lauxlib.h"
+#include "../../../src/lualib.h"
+
+/* etl.run(code, nanos): runs 'code' in a new state whose execution time limit is 'nanos' from now, and returns whether it succeeded and its error message, if any */
+static int run (lua_State *L) {
+  const char *code = luaL_checkstring(L, 1);
+  const lua_Integer nanos = luaL_checkinteger(L, 2);
+  lua_State *C = luaL_newstate();
+  if (C == NULL)
+    return luaL_error(L, "not enough memory");
+  luaL_openlibs(C);
+  lua_setexecutionlimit(C, nanos);
+  const bool ok = (luaL_dostring(C, code) == LUA_OK);
+  lua_pushboolean(L, ok);
+  if (ok)
+    lua_pushnil(L);
+  else
+    lua_pushstring(L, lua_tostring(C, -1));
+  lua_close(C);
+  return 2;
+}
+
+static const luaL_Reg funcs[] = {
+  {"run", run},
+  {NULL, NULL}
+};
+
+LUAMOD_API int luaopen_etl (lua_State *L) {
+  luaL_newlib(L, funcs);
+  return 1;
+}
@@ -1,3 +1,4 @@
+#include <cstdarg> // va_list
 #include <cstdint> // uint8_t
 #include <cstring> // memcpy
 #include <stdexcept>
@@ -40,3 +41,120 @@ SOUP_CEXPORT void buffer_test(uint8_t* in, size_t inlen, uint8_t* out, size_t ou
     }
     memcpy(out, in, inlen);
 }
+
+SOUP_CEXPORT double mix(int a, double b, float c, int64_t d)
+{
+    return a + b + c + d;
+}
+
+SOUP_CEXPORT float scale(float x, float y)
+{
+    return x * y;
+}
+
+SOUP_CEXPORT int64_t many_ints(int64_t a, int64_t b, int64_t c, int64_t d, int64_t e, int64_t f, int64_t g, int64_t h, int64_t i, int64_t j)
+{
+    return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h + 9 * i + 10 * j;
+}
+
+SOUP_CEXPORT double many_doubles(double a, int64_t x, double b, double c, double d, double e, double f, double g, double h, double i, int64_t y, double j)
+{
+    return a + 2 * b + 3 * c + 4 * d + 5 * e + 6 * f + 7 * g + 8 * h + 9 * i + 10 * j + 100 * x + 1000 * y;
+}
+
+struct Vec2
+{
+    float x;
+    float y;
+};
+
+SOUP_CEXPORT Vec2 vec2_add(Vec2 a, Vec2 b)
+{
+    return Vec2{ a.x + b.x, a.y + b.y };
+}
+
+struct Mixed
+{
+    int id;
+    double weight;
+};
+
+SOUP_CEXPORT Mixed mixed_scale(Mixed m, double f)
+{
+    return Mixed{ m.id + 1, m.weight * f };
+}
+
+struct Big
+{
+    int64_t a;
+    int64_t b;
+    int64_t c;
+};
+
+SOUP_CEXPORT Big big_make(int64_t a, int64_t b, int64_t c)
+{
+    return Big{ a, b, c };
+}
+
+SOUP_CEXPORT int64_t big_sum(Big big)
+{
+    return big.a + big.b + big.c;
+}
+
+SOUP_CEXPORT double sum_fmt(const char* fmt, ...)
+{
+    double sum = 0;
+    va_list args;
+    va_start(args, fmt);
+    for (; *fmt; ++fmt)
+    {
+        if (*fmt == 'i')
+        {
+            sum += va_arg(args, int64_t);
+        }
+        else if (*fmt == 'd')
+        {
+            sum += va_arg(args, double);
+        }
+    }
+    va_end(args);
+    return sum;
+}
+
+SOUP_CEXPORT int64_t fold(int64_t(*f)(int64_t, int64_t), int64_t n)
+{
+    int64_t acc = 0;
+    for (int64_t i = 1; i <= n; ++i)
+    {
+        acc = f(acc, i);
+    }
+    return acc;
+}
+
+SOUP_CEXPORT double apply_fp(double(*f)(double, float, int), double a, float b, int c)
+{
+    return f(a, b, c);
+}
+
+SOUP_CEXPORT float apply_f32(float(*f)(float))
+{
+    return f(1.5f) * 2;
+}
+
+SOUP_CEXPORT double sum_doubles(const double* values, size_t n)
+{
+    double sum = 0;
+    for (size_t i = 0; i != n; ++i)
+    {
+        sum += values[i];
+    }
+    return sum;
+}
+
+SOUP_CEXPORT void negate_ints(int32_t* values, size_t n)
+{
+    for (size_t i = 0; i != n; ++i)
+    {
+        values[i] = -values[i];
+    }
+}
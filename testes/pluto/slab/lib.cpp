@@ -0,0 +1,55 @@
+#include <cstring>
+
+#include <sys/resource.h>
+
+#include "../../../src/lua.h"
+#include "../../../src/lauxlib.h"
+#include "../../../src/lslaballoc.hpp"
+
+using Pluto::SlabAllocator;
+
+/* slab.shrinkwithoutpages(): shrinks blocks into size classes that have no page while no page can be mapped */
+static int shrinkwithoutpages (lua_State *L) {
+  SlabAllocator *slab = SlabAllocator::create();
+  if (slab == nullptr)
+    return luaL_error(L, "not enough memory");
+  char *large = static_cast<char*>(SlabAllocator::alloc(slab, nullptr, 0, 1000));
+  char *small = static_cast<char*>(SlabAllocator::alloc(slab, nullptr, 0, 200));
+  if (large == nullptr || small == nullptr)
+    return luaL_error(L, "not enough memory");
+  memset(large, 'l', 1000);
+  memset(small, 's', 200);
+
+  /* from now on, mapping a page fails */
+  rlimit old;
+  getrlimit(RLIMIT_AS, &old);
+  rlimit limit = old;
+  limit.rlim_cur = 0;
+  setrlimit(RLIMIT_AS, &limit);
+  char *large2 = static_cast<char*>(SlabAllocator::alloc(slab, large, 1000, 40));  /* malloc'd block to a small size */
+  char *small2 = static_cast<char*>(SlabAllocator::alloc(slab, small, 200, 20));  /* small block to a smaller class */
+  void *grown = SlabAllocator::alloc(slab, nullptr, 0, 20);  /* new blocks may fail */
+  setrlimit(RLIMIT_AS, &old);
+
+  const bool ok = (large2 == large && small2 == small && grown == nullptr
+    && large2[0] == 'l' && large2[39] == 'l' && small2[0] == 's' && small2[19] == 's');
+  /* the shrunk blocks can still be resized & freed by their new sizes */
+  large2 = static_cast<char*>(SlabAllocator::alloc(slab, large2, 40, 30));
+  SlabAllocator::alloc(slab, large2, 30, 0);
+  SlabAllocator::alloc(slab, small2, 20, 0);
+  void *block = SlabAllocator::alloc(slab, nullptr, 0, 20);
+  SlabAllocator::alloc(slab, block, 20, 0);
+  slab->release();
+  lua_pushboolean(L, ok);
+  return 1;
+}
+
+static const luaL_Reg funcs[] = {
+  {"shrinkwithoutpages", shrinkwithoutpages},
+  {NULL, NULL}
+};
+
+LUAMOD_API int luaopen_slab (lua_State *L) {
+  luaL_newlib(L, funcs);
+  return 1;
+}